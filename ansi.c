@@ -0,0 +1,233 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ansi.h"
+
+#include <errno.h>
+#include <ncurses.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+const char ANSI_START[] = "\x1b[?1049h\x1b[?25l\x1b[0m\x1b[2J";	/* Alternate screen, hide cursor, clear. */
+const char ANSI_STOP[] = "\x1b[0m\x1b[?25h\x1b[?1049l";	/* Reset colors, show cursor, main screen. */
+
+/* Writes all of len bytes, retrying on partial writes and interrupts. */
+bool write_all(const char *s, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, s, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		s += n;
+		len -= n;
+	}
+	return true;
+}
+
+void append(struct ansi_term *term, const char *s, size_t len)
+{
+	if (term->len + len > sizeof(term->buf)) {
+		ansi_flush(term); /* Does not happen for a single frame of the UI, but stay correct anyway. */
+		if (len > sizeof(term->buf)) {
+			write_all(s, len);
+			return;
+		}
+	}
+	memcpy(term->buf + term->len, s, len);
+	term->len += len;
+}
+
+/* Appends a non-negative decimal number; cheaper than snprintf. */
+void append_uint(struct ansi_term *term, unsigned int value)
+{
+	char digits[10];
+	int n = sizeof(digits);
+	do {
+		digits[--n] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	append(term, digits + n, sizeof(digits) - n);
+}
+
+bool ansi_start(struct ansi_term *term)
+{
+	if (tcgetattr(STDIN_FILENO, &term->saved_termios) < 0) {
+		perror("Failed to get terminal attributes");
+		return false;
+	}
+	struct termios raw = term->saved_termios;
+	cfmakeraw(&raw);
+	raw.c_cc[VMIN] = 0; /* Reads return immediately, even without input. */
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) < 0) {
+		perror("Failed to set terminal attributes");
+		return false;
+	}
+	term->active = true;
+	term->len = 0;
+	term->input_len = 0;
+	term->row = -1;
+	term->col = -1;
+	term->fg = ANSI_DEFAULT_COLOR;
+	term->bg = ANSI_DEFAULT_COLOR;
+	append(term, ANSI_START, sizeof(ANSI_START) - 1);
+	return ansi_flush(term);
+}
+
+void ansi_stop(struct ansi_term *term)
+{
+	if (!term->active) {
+		return;
+	}
+	term->active = false;
+	term->len = 0;
+	write_all(ANSI_STOP, sizeof(ANSI_STOP) - 1);
+	tcsetattr(STDIN_FILENO, TCSANOW, &term->saved_termios);
+}
+
+void ansi_move(struct ansi_term *term, int row, int col)
+{
+	if (term->row == row && term->col == col) {
+		return;
+	}
+	append(term, "\x1b[", 2);
+	append_uint(term, row + 1);
+	append(term, ";", 1);
+	append_uint(term, col + 1);
+	append(term, "H", 1);
+	term->row = row;
+	term->col = col;
+}
+
+void ansi_set_color(struct ansi_term *term, int fg, int bg)
+{
+	if (term->fg == fg && term->bg == bg) {
+		return;
+	}
+	if (fg == ANSI_DEFAULT_COLOR) {
+		append(term, "\x1b[39", 4);
+	} else {
+		append(term, "\x1b[38;5;", 7);
+		append_uint(term, fg);
+	}
+	if (bg == ANSI_DEFAULT_COLOR) {
+		append(term, ";49m", 4);
+	} else {
+		append(term, ";48;5;", 6);
+		append_uint(term, bg);
+		append(term, "m", 1);
+	}
+	term->fg = fg;
+	term->bg = bg;
+}
+
+void ansi_put(struct ansi_term *term, const char *s, size_t len, int width)
+{
+	append(term, s, len);
+	term->col += width;
+}
+
+void ansi_box(struct ansi_term *term, int row, int col, int height, int width)
+{
+	ansi_set_color(term, ANSI_DEFAULT_COLOR, ANSI_DEFAULT_COLOR);
+	for (int i = 0; i < height; i++) {
+		bool top = i == 0;
+		bool bottom = i == height - 1;
+		ansi_move(term, row + i, col);
+		ansi_put(term, top ? "┌" : bottom ? "└" : "│", strlen("┌"), 1);
+		if (top || bottom) {
+			for (int j = 1; j < width - 1; j++) {
+				ansi_put(term, "─", strlen("─"), 1);
+			}
+		} else {
+			ansi_move(term, row + i, col + width - 1);
+		}
+		ansi_put(term, top ? "┐" : bottom ? "┘" : "│", strlen("┐"), 1);
+	}
+}
+
+bool ansi_flush(struct ansi_term *term)
+{
+	if (term->len == 0) {
+		return true;
+	}
+	bool success = write_all(term->buf, term->len);
+	term->len = 0;
+	return success;
+}
+
+int ansi_getch(struct ansi_term *term)
+{
+	unsigned char *in = term->input;
+	for (;;) {
+		if (term->input_len == 0) {
+			ssize_t n = read(STDIN_FILENO, in, sizeof(term->input));
+			if (n <= 0) {
+				return ERR;
+			}
+			term->input_len = n;
+		}
+
+		int ch = in[0];
+		size_t used = 1;
+		if (ch == '\x1b' && term->input_len >= 3 && (in[1] == '[' || in[1] == 'O')) {
+			/* Escape sequence: skip parameters up to the final byte, which identifies the key. */
+			used = 2;
+			while (used < term->input_len && (in[used] < 0x40 || in[used] > 0x7e)) {
+				used++;
+			}
+			switch (used < term->input_len ? in[used] : 0) {
+			case 'A':
+				ch = KEY_UP;
+				break;
+			case 'B':
+				ch = KEY_DOWN;
+				break;
+			case 'C':
+				ch = KEY_RIGHT;
+				break;
+			case 'D':
+				ch = KEY_LEFT;
+				break;
+			case '~':
+				/* Editing keys have a number as parameter. */
+				ch = in[2] == '5' ? KEY_PPAGE : in[2] == '6' ? KEY_NPAGE : ERR;
+				break;
+			default:
+				ch = ERR; /* Unknown or incomplete, ignore it. */
+				break;
+			}
+			if (used < term->input_len) {
+				used++;
+			}
+		} else if (ch == '\r') {
+			ch = '\n'; /* Like ncurses in nl() mode. */
+		}
+		term->input_len -= used;
+		memmove(in, in + used, term->input_len);
+		if (ch != ERR) {
+			return ch;
+		}
+	}
+}
@@ -0,0 +1,76 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ANSI_H
+#define _ANSI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <termios.h>
+
+#define ANSI_BUFFER_SIZE 0x4000	/* Enough for redrawing the whole UI in one frame. */
+#define ANSI_INPUT_SIZE 0x40
+
+#define ANSI_DEFAULT_COLOR -1
+
+/*
+ * Terminal output that bypasses ncurses: a frame is built as ANSI escape sequences in a preallocated
+ * buffer and written with a single write() call.
+ */
+struct ansi_term {
+	char buf[ANSI_BUFFER_SIZE];	/* Output of the current frame. */
+	size_t len;
+	/* Cursor position and colors as last output, -1 if unknown. */
+	int row;
+	int col;
+	int fg;
+	int bg;
+
+	unsigned char input[ANSI_INPUT_SIZE];	/* Input read but not yet decoded into keys. */
+	size_t input_len;
+
+	struct termios saved_termios;	/* Terminal settings to restore on stop. */
+	bool active;	/* True iff the terminal is set up and needs ansi_stop(). */
+};
+
+/* Switches the terminal to raw mode and the alternate screen, then clears it. */
+bool ansi_start(struct ansi_term *term);
+
+/* Restores the terminal. Only uses async-signal-safe calls, so it can be called from signal handlers. */
+void ansi_stop(struct ansi_term *term);
+
+/* Moves the cursor to a 0-based screen position. */
+void ansi_move(struct ansi_term *term, int row, int col);
+
+/* Sets foreground and background to 256-color palette indices or ANSI_DEFAULT_COLOR. */
+void ansi_set_color(struct ansi_term *term, int fg, int bg);
+
+/* Outputs len bytes of text taking up width columns. */
+void ansi_put(struct ansi_term *term, const char *s, size_t len, int width);
+
+/* Draws a box with its top left corner at the given position, including the border in its size. */
+void ansi_box(struct ansi_term *term, int row, int col, int height, int width);
+
+/* Writes the buffered frame to the terminal. */
+bool ansi_flush(struct ansi_term *term);
+
+/* Returns the next key pressed without blocking, with the same codes as ncurses getch(), or ERR if none. */
+int ansi_getch(struct ansi_term *term);
+
+#endif /* _ANSI_H */
@@ -0,0 +1,370 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "aot.h"
+
+#include "fastfwd.h"
+#include "ops.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const uint64_t AOT_MAX_FUEL = 1 << 16;	/* Maximum cycles per call into translated code. */
+const int AOT_MAX_SCAN = 8;		/* Instructions searched backwards for a constant jump page. */
+
+const char *const VARIANT_NAMES[NUM_VARIANTS] = {
+#define VARIANT_NAME(name, ...) #name,
+	FOR_EACH_INSTRUCTION(VARIANT_NAME)
+	FOR_EACH_WIDE_INSTRUCTION(VARIANT_NAME)
+#undef VARIANT_NAME
+};
+
+program_addr_t aot_next_pc(program_addr_t pc)
+{
+	return (pc + 1) % PROGRAM_MEMORY_SIZE;
+}
+
+/* Returns the register written by an instruction that can start a call or jump, 0 otherwise. */
+uint8_t get_jump_register(const struct decoded_instruction *di)
+{
+	uint8_t reg;
+	switch (di->variant) {
+	case VARIANT_MOV_RX_RY:
+	case VARIANT_MOV_RX_N:
+		reg = di->vmi.nibble2;
+		break;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+		reg = di->vmi.nibble3;
+		break;
+	default:
+		return 0;
+	}
+	return is_jump_address(reg) ? reg : 0;
+}
+
+/* Returns one of AOT_FLOW_*. Sets taken for AOT_FLOW_GOTO and AOT_FLOW_BRANCH. */
+int get_flow(const struct decoded_instruction *di, program_addr_t pc, program_addr_t *taken)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	program_addr_t next = aot_next_pc(pc);
+	uint8_t m;
+	switch (di->variant) {
+	case VARIANT_JR_NN:
+		*taken = next + (int8_t) ((vmi->nibble2 << 4) | vmi->nibble3);
+		return *taken < PROGRAM_MEMORY_SIZE ? AOT_FLOW_GOTO : AOT_FLOW_JUMP;
+	case VARIANT_DSZ_RY:
+		*taken = next + 1;
+		return *taken < PROGRAM_MEMORY_SIZE ? AOT_FLOW_BRANCH : AOT_FLOW_JUMP;
+	case VARIANT_SKIP_F_M:
+		m = vmi->nibble3 & 0x3;
+		*taken = next + (m ? m : 4);
+		return *taken < PROGRAM_MEMORY_SIZE ? AOT_FLOW_BRANCH : AOT_FLOW_JUMP;
+	case VARIANT_RET_R0_N:
+		return AOT_FLOW_JUMP;
+	default:
+		return get_jump_register(di) ? AOT_FLOW_JUMP : AOT_FLOW_NEXT;
+	}
+}
+
+/* Returns true if the instruction may change PCM or PCH. */
+bool writes_jump_page(const struct decoded_instruction *di)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	if (vmi->nibble1 >= 0x1 && vmi->nibble1 <= 0x9) {
+		return vmi->nibble2 == SFR_PCM || vmi->nibble2 == SFR_PCH;
+	}
+	switch (di->variant) {
+	case VARIANT_MOV_IND_R0:
+	case VARIANT_MOV_PTR_R0:
+	case VARIANT_EXR_N:
+		return true;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+	case VARIANT_DSZ_RY:
+	case VARIANT_RRC_RY:
+		return vmi->nibble3 == SFR_PCM || vmi->nibble3 == SFR_PCH;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Guesses the targets of a computed call or jump at pc, which usually follows
+ * a MOV PC,NN setting the page. Returns the page address or -1 if unknown.
+ */
+int find_jump_page(const struct decoded_instruction *decoded, program_addr_t pc)
+{
+	program_addr_t taken;
+	for (int i = 1; i <= AOT_MAX_SCAN && i <= pc; i++) {
+		const struct decoded_instruction *di = &decoded[pc - i];
+		if (di->variant == VARIANT_MOV_PC_NN) {
+			return ((di->vmi.nibble2 << 4) | di->vmi.nibble3) << 4;
+		}
+		if (writes_jump_page(di) || get_flow(di, pc - i, &taken) != AOT_FLOW_NEXT) {
+			break;
+		}
+	}
+	return -1;
+}
+
+void mark_reachable(bool *reachable, program_addr_t *worklist, int *worklist_size, int addr)
+{
+	if (addr >= 0 && addr < PROGRAM_MEMORY_SIZE && !reachable[addr]) {
+		reachable[addr] = true;
+		worklist[(*worklist_size)++] = addr;
+	}
+}
+
+/*
+ * Finds addresses reachable from the reset vector. Targets of computed jumps
+ * are found heuristically; the rest are interpreted at runtime.
+ */
+void find_reachable(const struct decoded_instruction *decoded, bool *reachable)
+{
+	program_addr_t worklist[PROGRAM_MEMORY_SIZE];
+	int worklist_size = 0;
+	mark_reachable(reachable, worklist, &worklist_size, 0);
+	while (worklist_size) {
+		program_addr_t pc = worklist[--worklist_size];
+		const struct decoded_instruction *di = &decoded[pc];
+		program_addr_t taken;
+		int flow = get_flow(di, pc, &taken);
+		if (flow != AOT_FLOW_GOTO && flow != AOT_FLOW_JUMP) {
+			mark_reachable(reachable, worklist, &worklist_size, aot_next_pc(pc));
+		}
+		if (flow == AOT_FLOW_GOTO || flow == AOT_FLOW_BRANCH) {
+			mark_reachable(reachable, worklist, &worklist_size, taken);
+		}
+
+		uint8_t reg = get_jump_register(di);
+		if (!reg) {
+			continue;
+		}
+		if (reg == SFR_JSR) {
+			mark_reachable(reachable, worklist, &worklist_size, aot_next_pc(pc)); /* Return address. */
+		}
+		int page = find_jump_page(decoded, pc);
+		if (page < 0) {
+			continue;
+		}
+		if (di->variant == VARIANT_MOV_RX_N) {
+			mark_reachable(reachable, worklist, &worklist_size, page | di->vmi.nibble3);
+		} else {
+			for (int low = 0; low < 0x10; low++) {
+				mark_reachable(reachable, worklist, &worklist_size, page | low);
+			}
+		}
+	}
+}
+
+/* Returns true if the instruction may write the Clock or Sync registers. */
+bool may_write_timing(const struct decoded_instruction *di)
+{
+	uint8_t nn = (di->vmi.nibble2 << 4) | di->vmi.nibble3;
+	switch (di->variant) {
+	case VARIANT_MOV_IND_R0:
+		return true;
+	case VARIANT_MOV_PTR_R0:
+		return nn == SFR_CLOCK || nn == SFR_SYNC;
+	default:
+		return false;
+	}
+}
+
+/* Writes the translation of the instruction at pc. */
+void write_instruction(FILE *out, const struct decoded_instruction *decoded, program_addr_t pc)
+{
+	const struct decoded_instruction *di = &decoded[pc];
+	const struct vm_instruction *vmi = &di->vmi;
+	const char *name = VARIANT_NAMES[di->variant];
+	char text[64];
+	disassemble_instruction(vmi, get_instruction_descriptor(vmi), text, sizeof(text));
+	/* Fast-forwarding is checked by aot_run() only, so those addresses start a batch. */
+	const char *step = fastfwd_get_kind(decoded, pc) ? "AOT_STEP_FIRST" : "AOT_STEP";
+	fprintf(out, "\t%s(0x%03x); /* %s */\n", step, pc, text);
+	if (may_access_rd_flags(di)) {
+		fprintf(out, "\tAOT_SYNC();\n");
+	}
+
+	program_addr_t next = aot_next_pc(pc);
+	program_addr_t taken;
+	switch (get_flow(di, pc, &taken)) {
+	case AOT_FLOW_NEXT:
+		if (may_write_timing(di)) {
+			fprintf(out, "\tAOT_EXEC_SFR(0x%03x, %s, 0x%x, 0x%x, 0x%x);\n",
+					next, name, vmi->nibble1, vmi->nibble2, vmi->nibble3);
+		} else {
+			fprintf(out, "\tAOT_EXEC(%s, 0x%x, 0x%x, 0x%x);\n", name, vmi->nibble1, vmi->nibble2, vmi->nibble3);
+		}
+		break;
+	case AOT_FLOW_GOTO:
+		fprintf(out, "\tAOT_GOTO(0x%03x);\n", taken);
+		return;
+	case AOT_FLOW_BRANCH:
+		fprintf(out, "\tAOT_BRANCH(0x%03x, 0x%03x, %s, 0x%x, 0x%x, 0x%x);\n",
+				next, taken, name, vmi->nibble1, vmi->nibble2, vmi->nibble3);
+		break;
+	case AOT_FLOW_JUMP:
+		fprintf(out, "\tAOT_JUMP(0x%03x, %s, 0x%x, 0x%x, 0x%x);\n",
+				next, name, vmi->nibble1, vmi->nibble2, vmi->nibble3);
+		return;
+	}
+	if (next != pc + 1) {
+		fprintf(out, "\tAOT_GOTO(0x%03x);\n", next); /* Wrap around to the first instruction. */
+	}
+}
+
+/* Returns the file name part of a path, as a string safe to embed in C source. */
+void get_safe_name(const char *path, char *out, size_t size)
+{
+	const char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	size_t i;
+	for (i = 0; name[i] && i + 1 < size; i++) {
+		char c = name[i];
+		out[i] = (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '*' && c != '/') ? c : '_';
+	}
+	out[i] = '\0';
+}
+
+bool aot_translate(const char *binary_path, const char *out_path)
+{
+	struct program *prg = load_program_file(binary_path);
+	if (!prg) {
+		return false;
+	}
+
+	struct decoded_instruction *decoded = calloc(PROGRAM_MEMORY_SIZE, sizeof(struct decoded_instruction));
+	bool *reachable = calloc(PROGRAM_MEMORY_SIZE, sizeof(bool));
+	FILE *out = fopen(out_path, "w");
+	if (!decoded || !reachable || !out) {
+		fprintf(stderr, "Could not write file %s\n", out_path);
+		free(prg);
+		free(decoded);
+		free(reachable);
+		if (out) {
+			fclose(out);
+		}
+		return false;
+	}
+
+	for (int i = 0; i < PROGRAM_MEMORY_SIZE; i++) {
+		predecode_instruction(prg->instructions[i], &decoded[i]);
+	}
+	find_reachable(decoded, reachable);
+
+	char name[256];
+	get_safe_name(binary_path, name, sizeof(name));
+	fprintf(out, "/* Translated by nibbler --aot from %s. Do not edit. */\n\n", name);
+	fprintf(out, "#include \"aot.h\"\n\n");
+
+	fprintf(out, "static const program_word_t INSTRUCTIONS[PROGRAM_MEMORY_SIZE] = {");
+	for (int i = 0; i < PROGRAM_MEMORY_SIZE; i++) {
+		fprintf(out, "%s0x%03x,", (i % 16) ? " " : "\n\t", prg->instructions[i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static uint64_t run(struct vm_state *vm, uint64_t fuel, struct vm_sync *sync)\n{\n");
+	fprintf(out, "\tstatic const void *const LABELS[PROGRAM_MEMORY_SIZE] = {\n");
+	for (int i = 0; i < PROGRAM_MEMORY_SIZE; i++) {
+		if (reachable[i]) {
+			fprintf(out, "\t\tAOT_LABEL(0x%03x),\n", i);
+		}
+	}
+	fprintf(out, "\t};\n");
+	fprintf(out, "\n\tAOT_ENTRY(LABELS);\n\n");
+	for (int i = 0; i < PROGRAM_MEMORY_SIZE; i++) {
+		if (reachable[i]) {
+			write_instruction(out, decoded, i);
+		}
+	}
+	fprintf(out, "}\n\n");
+
+	fprintf(out, "const struct aot_image AOT_LINKED_IMAGE = {\n");
+	fprintf(out, "\t.name = \"%s\",\n", name);
+	fprintf(out, "\t.length = %u,\n", prg->length);
+	fprintf(out, "\t.instructions = INSTRUCTIONS,\n");
+	fprintf(out, "\t.entry = run,\n");
+	fprintf(out, "};\n");
+
+	bool success = !ferror(out);
+	if (fclose(out) || !success) {
+		fprintf(stderr, "Could not write file %s\n", out_path);
+		success = false;
+	}
+	free(prg);
+	free(decoded);
+	free(reachable);
+	return success;
+}
+
+struct program *aot_load_program(const char *binary_path)
+{
+	if (binary_path) {
+		return load_program_file(binary_path);
+	}
+	if (!&AOT_LINKED_IMAGE) {
+		fprintf(stderr, "No program given.\n");
+		return NULL;
+	}
+
+	struct program *prg = calloc(1, sizeof(struct program));
+	if (!prg) {
+		fprintf(stderr, "Failed to allocate program.\n");
+		return NULL;
+	}
+	prg->length = AOT_LINKED_IMAGE.length;
+	memcpy(prg->instructions, AOT_LINKED_IMAGE.instructions, sizeof(prg->instructions));
+	return prg;
+}
+
+const struct aot_image *aot_find_image(const struct program *prg)
+{
+	if (!&AOT_LINKED_IMAGE) {
+		return NULL;
+	}
+	if (memcmp(prg->instructions, AOT_LINKED_IMAGE.instructions, sizeof(prg->instructions))) {
+		return NULL; /* A different program was loaded. */
+	}
+	return &AOT_LINKED_IMAGE;
+}
+
+uint64_t aot_run(const struct aot_image *image, struct vm_state *vm, uint64_t max_cycles)
+{
+	uint64_t start = vm->cycle_count;
+	while (!vm->fault && vm->cycle_count - start < max_cycles && !fastfwd_halt(vm)) {
+		uint64_t fuel = max_cycles - (vm->cycle_count - start);
+		if (fastfwd_begin_cycle(vm, fuel)) {
+			continue;
+		}
+		if (fuel > AOT_MAX_FUEL) {
+			fuel = AOT_MAX_FUEL;
+		}
+		struct vm_sync sync;
+		vm_init_sync(vm, &sync);
+		uint64_t executed = image->entry(vm, fuel, &sync);
+		if (executed) {
+			vm_apply_sync(&sync, vm, executed - 1);
+		}
+		vm_end_synced_cycles(vm, executed, &sync);
+	}
+	return vm->cycle_count - start;
+}
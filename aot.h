@@ -0,0 +1,174 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ahead-of-time translation of programs to C.
+ *
+ * aot_translate() writes a C file with one label per reachable address, which
+ * is compiled and linked together with the VM sources into a standalone
+ * executable. The macros below are the building blocks of the generated code.
+ */
+
+#ifndef _AOT_H
+#define _AOT_H
+
+#include "exec.h"
+#include "program.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Runs translated code for up to fuel cycles, setting UserSync in RdFlags as
+ * tracked by sync. Returns the number of cycles executed.
+ */
+typedef uint64_t (*aot_entry_fn_t)(struct vm_state *vm, uint64_t fuel, struct vm_sync *sync);
+
+/* A translated program linked into the executable. */
+struct aot_image {
+	const char *name;			/* File name of the translated program. */
+	uint16_t length;			/* As in struct program. */
+	const program_word_t *instructions;	/* PROGRAM_MEMORY_SIZE words. */
+	aot_entry_fn_t entry;
+};
+
+/* Defined by generated code. Weak, so executables without a translated program still link. */
+extern const struct aot_image AOT_LINKED_IMAGE __attribute__((weak));
+
+/* How control leaves an instruction. */
+enum {
+	AOT_FLOW_NEXT,		/* Falls through to the next address. */
+	AOT_FLOW_GOTO,		/* Always continues at a constant address. */
+	AOT_FLOW_BRANCH,	/* Continues at the next address or a constant one. */
+	AOT_FLOW_JUMP,		/* Continues at a computed address. */
+};
+
+/* Returns the register written by an instruction that can start a call or jump, 0 otherwise. */
+uint8_t get_jump_register(const struct decoded_instruction *di);
+
+/* Returns one of AOT_FLOW_*. Sets taken for AOT_FLOW_GOTO and AOT_FLOW_BRANCH. */
+int get_flow(const struct decoded_instruction *di, program_addr_t pc, program_addr_t *taken);
+
+/* Guesses the page of a computed call or jump at pc from the preceding instructions, -1 if unknown. */
+int find_jump_page(const struct decoded_instruction *decoded, program_addr_t pc);
+
+/* Translates the program at binary_path to C source at out_path. */
+bool aot_translate(const char *binary_path, const char *out_path);
+
+/* Loads a program from a file, or the linked translated program if binary_path is NULL. */
+struct program *aot_load_program(const char *binary_path);
+
+/* Returns the linked translated image if it matches the program, NULL otherwise. */
+const struct aot_image *aot_find_image(const struct program *prg);
+
+/* Executes up to max_cycles cycles of translated code, see vm_run(). */
+uint64_t aot_run(const struct aot_image *image, struct vm_state *vm, uint64_t max_cycles);
+
+/* Equivalent of vm_update_in_reg() done at the start of every translated cycle. */
+static ALWAYS_INLINE void aot_update_in_reg(struct vm_state *vm)
+{
+	vm->user_mem[(vm->reg_wr_flags & WR_FLAG_IN_OUT_POS) ? SFR_IN_B : SFR_IN] = 0xf;
+}
+
+/*
+ * Jumps to the translated code for the program counter. Addresses that were
+ * not translated are interpreted one cycle at a time until execution reaches
+ * translated code again. Placed once at the start of the entry function.
+ * Returns early when Clock or Sync change, as required by vm_end_cycles().
+ */
+#define AOT_ENTRY(labels) \
+	uint64_t executed = 0; \
+	const memory_word_t clock = vm->reg_clock; \
+	const memory_word_t reg_sync = vm->reg_sync; \
+	aot_dispatch: \
+	if (vm->fault) { \
+		return executed; \
+	} \
+	if (vm->reg_pc < PROGRAM_MEMORY_SIZE && labels[vm->reg_pc]) { \
+		goto *labels[vm->reg_pc]; \
+	} \
+	if (executed == fuel) { \
+		return executed; \
+	} \
+	executed++; \
+	aot_update_in_reg(vm); \
+	AOT_SYNC(); \
+	exec_decoded(vm_fetch_next(vm), vm); \
+	if (vm->reg_clock != clock || vm->reg_sync != reg_sync) { \
+		return executed; \
+	} \
+	goto aot_dispatch
+
+/* Entry of the dispatch table for a translated address. */
+#define AOT_LABEL(addr) [addr] = &&L_##addr
+
+/* Starts the cycle for the instruction at addr, returning when out of fuel. */
+#define AOT_STEP(addr) \
+	L_##addr: \
+	if (executed == fuel) { \
+		vm->reg_pc = addr; \
+		return executed; \
+	} \
+	executed++; \
+	aot_update_in_reg(vm)
+
+/* Like AOT_STEP(), but returns unless the cycle is the first of the call. */
+#define AOT_STEP_FIRST(addr) \
+	L_##addr: \
+	if (executed) { \
+		vm->reg_pc = addr; \
+		return executed; \
+	} \
+	executed++; \
+	aot_update_in_reg(vm)
+
+/* Sets UserSync before an instruction that may access RdFlags, if it fired since the start of the call. */
+#define AOT_SYNC() vm_apply_sync(sync, vm, executed - 1)
+
+/* Executes an instruction that falls through to the next address. */
+#define AOT_EXEC(name, n1, n2, n3) \
+	exec_##name(&(const struct vm_instruction) {n1, n2, n3}, vm)
+
+/* Executes an instruction that may write SFRs, returning if Clock or Sync changed. */
+#define AOT_EXEC_SFR(next, name, n1, n2, n3) \
+	AOT_EXEC(name, n1, n2, n3); \
+	if (vm->reg_clock != clock || vm->reg_sync != reg_sync) { \
+		vm->reg_pc = next; \
+		return executed; \
+	}
+
+/* Continues at a translated address. */
+#define AOT_GOTO(addr) goto L_##addr
+
+/* Executes a conditional skip, continuing at taken or falling through to next. */
+#define AOT_BRANCH(next, taken, name, n1, n2, n3) \
+	vm->reg_pc = next; \
+	AOT_EXEC(name, n1, n2, n3); \
+	if (vm->reg_pc == taken) { \
+		AOT_GOTO(taken); \
+	}
+
+/* Executes an instruction with a computed target. */
+#define AOT_JUMP(next, name, n1, n2, n3) \
+	vm->reg_pc = next; \
+	AOT_EXEC(name, n1, n2, n3); \
+	goto aot_dispatch
+
+#endif /* _AOT_H */
@@ -0,0 +1,893 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Lockstep execution of many VMs running the same program.
+ *
+ * Memory, flags and stack pointers of all lanes are stored as struct of
+ * arrays, with one 256 bit vector of lanes per memory word. Every cycle, lanes
+ * at the same program counter form a group that executes the instruction once
+ * for all of them with vector operations, masked to the lanes in the group.
+ * Calls, returns, reading Random and UserSync firing at a steady rate are
+ * handled in vectors too. Anything else with per lane side effects (Clock,
+ * Sync and Random writes, faults, fast-forwarding) is executed by the scalar interpreter on
+ * the lane's own vm_state instead, which is brought up to date for that.
+ *
+ * Lanes get a number of cycles they may run in vectors before batch_run()
+ * looks at them again, e.g. to account for cycles or to begin a cycle in
+ * their vm_state. Program counters and these counters use 16 bit elements,
+ * kept in two halves of 16 lanes each.
+ *
+ * The kernels need AVX2 and are only built for x86-64: GCC splits vector
+ * comparisons wider than the target supports into scalar code, which is
+ * slower than running the VMs one by one.
+ */
+
+#include "batch.h"
+
+#include "exec.h"
+#include "fastfwd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+
+/* Vector code, inlined into batch_run(). */
+#define KERNEL static inline __attribute__((always_inline, target("avx2")))
+
+/*
+ * One element per lane. Alignment is explicit since the default for 256 bit
+ * vectors depends on whether the function using them targets AVX.
+ */
+#define LANES(type, count) type __attribute__((vector_size((count) * sizeof(type)), aligned((count) * sizeof(type))))
+
+#define HALF_LANES (BATCH_MAX_LANES / 2)
+
+typedef LANES(uint8_t, BATCH_MAX_LANES) lane_bytes_t;
+typedef LANES(int8_t, BATCH_MAX_LANES) lane_mask_t;
+typedef LANES(uint8_t, HALF_LANES) half_bytes_t;
+typedef LANES(int8_t, HALF_LANES) half_mask_t;
+typedef LANES(uint16_t, HALF_LANES) half_words_t;
+typedef LANES(int16_t, HALF_LANES) half_wmask_t;
+
+/*
+ * Sync periods in cycles from which fast-forwarding polling loops in vm_state
+ * is cheaper than running them in vectors.
+ */
+#define BATCH_FASTFWD_MIN_CYCLES 512
+
+struct vm_batch {
+	lane_bytes_t mem[NUM_PAGES * PAGE_SIZE];	/* User memory indexed by address, then lane. */
+	lane_bytes_t flags;	/* Flags registers. */
+	lane_bytes_t sp;	/* Stack pointers. */
+	half_words_t pc[2];	/* Program counters. */
+	half_words_t left[2];	/* Cycles each lane may still run in vectors. */
+	half_words_t sync_in[2];	/* Cycles until the one in which UserSync fires, for lanes in sync_mask. */
+	half_words_t sync_period[2];	/* Cycles between UserSync firing, for lanes in sync_mask. */
+	lane_mask_t sync_mask;	/* Lanes where UserSync firing is handled in vectors. */
+	lane_mask_t active_mask;	/* Lanes set in active. */
+	uint32_t running;	/* Lanes that did not stop. */
+	uint32_t active;	/* Running lanes with cycles left in batch_run(). */
+	uint32_t attention;	/* Active lanes that ran out of vector cycles. */
+	uint16_t granted[BATCH_MAX_LANES];	/* Value of left when it was last set. */
+	uint64_t pending[BATCH_MAX_LANES];	/* Cycles executed since the lane's vm_state was up to date. */
+	uint64_t budget[BATCH_MAX_LANES];	/* Cycles left in batch_run(). */
+	uint64_t scalar_in[BATCH_MAX_LANES];	/* Cycles until the next one must begin in vm_state. */
+	const struct decoded_instruction *decoded;
+	const uint8_t *fastfwd_kind;
+	struct vm_state *lanes[BATCH_MAX_LANES];
+};
+
+/* Returns one bit per lane that is set in the mask. */
+KERNEL uint32_t lane_bits(lane_mask_t mask)
+{
+	return _mm256_movemask_epi8((__m256i) mask);
+}
+
+/* Selects a where the mask is set and b elsewhere. */
+KERNEL lane_bytes_t blend(lane_mask_t mask, lane_bytes_t a, lane_bytes_t b)
+{
+	return (a & (lane_bytes_t) mask) | (b & ~(lane_bytes_t) mask);
+}
+
+KERNEL half_words_t blend_words(half_wmask_t mask, half_words_t a, half_words_t b)
+{
+	return (a & (half_words_t) mask) | (b & ~(half_words_t) mask);
+}
+
+KERNEL lane_bytes_t broadcast(uint8_t value)
+{
+	return (lane_bytes_t) {} + value;
+}
+
+/* Zero extends one half of the lanes to 16 bits. */
+KERNEL half_words_t widen(lane_bytes_t value, int half)
+{
+	union {
+		lane_bytes_t all;
+		half_bytes_t half[2];
+	} u = {.all = value};
+	return __builtin_convertvector(u.half[half], half_words_t);
+}
+
+KERNEL half_wmask_t widen_mask(lane_mask_t mask, int half)
+{
+	union {
+		lane_mask_t all;
+		half_mask_t half[2];
+	} u = {.all = mask};
+	return __builtin_convertvector(u.half[half], half_wmask_t);
+}
+
+KERNEL lane_mask_t narrow_masks(half_wmask_t lo, half_wmask_t hi)
+{
+	union {
+		lane_mask_t all;
+		half_mask_t half[2];
+	} u;
+	u.half[0] = __builtin_convertvector(lo, half_mask_t);
+	u.half[1] = __builtin_convertvector(hi, half_mask_t);
+	return u.all;
+}
+
+/* Returns the lanes whose program counter is pc. */
+KERNEL lane_mask_t lanes_at(const struct vm_batch *b, program_addr_t pc)
+{
+	return narrow_masks(b->pc[0] == pc, b->pc[1] == pc);
+}
+
+KERNEL void store_row(struct vm_batch *b, memory_addr_t addr, lane_bytes_t value, lane_mask_t mask)
+{
+	b->mem[addr] = blend(mask, value, b->mem[addr]);
+}
+
+KERNEL void update_flag(struct vm_batch *b, uint8_t flag, lane_mask_t set, lane_mask_t mask)
+{
+	lane_bytes_t flags = b->flags;
+	b->flags = blend(mask, blend(set, flags | flag, flags & (uint8_t) ~flag), flags);
+}
+
+/* Interprets nibbles as signed integers, see nibble_to_int8(). */
+KERNEL lane_bytes_t nibbles_to_int8(lane_bytes_t nibbles)
+{
+	return (nibbles ^ 0x8) - 0x8;
+}
+
+/*
+ * Arithmetic shared by ADD, ADC, SUB, SBB and CP, updating flags like the
+ * scalar handlers.
+ */
+KERNEL void arith(struct vm_batch *b, memory_addr_t dst_addr, lane_bytes_t src, bool sub, bool with_carry, bool store, lane_mask_t mask)
+{
+	lane_bytes_t dst = b->mem[dst_addr];
+	lane_bytes_t result, sresult;
+	if (sub) {
+		result = dst - src;
+		sresult = nibbles_to_int8(dst) - nibbles_to_int8(src);
+		if (with_carry) {
+			lane_bytes_t borrow = (b->flags & FLAG_CARRY) ^ FLAG_CARRY;
+			result -= borrow;
+			sresult -= borrow;
+		}
+	} else {
+		result = dst + src;
+		sresult = nibbles_to_int8(dst) + nibbles_to_int8(src);
+		if (with_carry) {
+			lane_bytes_t carry = b->flags & FLAG_CARRY;
+			result += carry;
+			sresult += carry;
+		}
+	}
+	if (store) {
+		store_row(b, dst_addr, result & 0xf, mask);
+	}
+	lane_mask_t carry_out = (result & 0x10) != 0;
+	/* Signed results overflow unless in -8..7. */
+	lane_mask_t overflow = (lane_mask_t) ((sresult + 0x8) & 0xf0) != 0;
+	update_flag(b, FLAG_ZERO, (result & 0xf) == 0, mask);
+	update_flag(b, FLAG_CARRY, sub ? ~carry_out : carry_out, mask);
+	update_flag(b, FLAG_OVERFLOW, overflow, mask);
+	lane_bytes_t rd_flags = b->mem[SFR_RD_FLAGS];
+	store_row(b, SFR_RD_FLAGS, blend(overflow, rd_flags | RD_FLAG_V_FLAG, rd_flags & (uint8_t) ~RD_FLAG_V_FLAG), mask);
+}
+
+/* Updates Zero flag from the low nibble of results. */
+KERNEL void update_zero(struct vm_batch *b, lane_bytes_t result, lane_mask_t mask)
+{
+	update_flag(b, FLAG_ZERO, (result & 0xf) == 0, mask);
+}
+
+/* Vector counterpart of vm_begin_cycle(), for lanes in the mask. */
+KERNEL void begin_cycles(struct vm_batch *b, lane_mask_t mask)
+{
+	half_wmask_t fired[2];
+	for (int h = 0; h < 2; h++) {
+		half_wmask_t wmask = widen_mask(mask, h);
+		b->sync_in[h] += (half_words_t) wmask;
+		fired[h] = wmask & widen_mask(b->sync_mask, h) & (b->sync_in[h] == 0);
+		b->sync_in[h] = blend_words(fired[h], b->sync_period[h], b->sync_in[h]);
+	}
+	store_row(b, SFR_RD_FLAGS, b->mem[SFR_RD_FLAGS] | RD_FLAG_USER_SYNC, narrow_masks(fired[0], fired[1]));
+
+	/* Sets the active In register to its idle value, see vm_update_in_reg(). */
+	lane_mask_t in_b = (b->mem[SFR_WR_FLAGS] & WR_FLAG_IN_OUT_POS) != 0;
+	store_row(b, SFR_IN_B, broadcast(0xf), mask & in_b);
+	store_row(b, SFR_IN, broadcast(0xf), mask & ~in_b);
+}
+
+/* Returns the address of a BIT, BSET, BCLR or BTG operand for lanes with the In/Out position flag clear and set. */
+KERNEL memory_addr_t rg_addr(const struct vm_instruction *instr, bool out, bool pos_b)
+{
+	uint8_t rg = instr->nibble3 >> 2;
+	if (rg < 0x3) {
+		return rg;
+	} else if (pos_b) {
+		return out ? SFR_OUT_B : SFR_IN_B;
+	} else {
+		return out ? SFR_OUT : SFR_IN;
+	}
+}
+
+/* Applies a bit operation to RG operands, which may be a different register for each lane. */
+KERNEL void bit_op(struct vm_batch *b, const struct vm_instruction *instr, int variant, lane_mask_t mask)
+{
+	lane_mask_t pos_b = (b->mem[SFR_WR_FLAGS] & WR_FLAG_IN_OUT_POS) != 0;
+	bool out = variant != VARIANT_BIT_RG_M;
+	memory_addr_t addrs[2] = {rg_addr(instr, out, false), rg_addr(instr, out, true)};
+	lane_mask_t masks[2] = {mask & ~pos_b, mask & pos_b};
+	uint8_t bit = 1 << (instr->nibble3 & 0x3);
+	for (int i = 0; i < 2; i++) {
+		if (addrs[0] == addrs[1]) {
+			masks[i] = mask;
+		}
+		lane_bytes_t value = b->mem[addrs[i]];
+		switch (variant) {
+		case VARIANT_BIT_RG_M:
+			update_zero(b, value & bit, masks[i]);
+			break;
+		case VARIANT_BSET_RG_M:
+			store_row(b, addrs[i], value | bit, masks[i]);
+			break;
+		case VARIANT_BCLR_RG_M:
+			store_row(b, addrs[i], value & (uint8_t) ~bit, masks[i]);
+			break;
+		case VARIANT_BTG_RG_M:
+			store_row(b, addrs[i], value ^ bit, masks[i]);
+			break;
+		}
+		if (addrs[0] == addrs[1]) {
+			break;
+		}
+	}
+}
+
+/* Returns the jump target formed by PCH, PCM and a low nibble register. */
+KERNEL void get_jump_target(const struct vm_batch *b, memory_addr_t low_addr, half_words_t target[2])
+{
+	for (int h = 0; h < 2; h++) {
+		target[h] = (widen(b->mem[SFR_PCH], h) << 8) | (widen(b->mem[SFR_PCM], h) << 4) | widen(b->mem[low_addr], h);
+	}
+}
+
+/*
+ * Returns the lanes that must execute an instruction in their vm_state,
+ * among those at its address.
+ */
+KERNEL lane_mask_t get_scalar_lanes(const struct vm_batch *b, const struct decoded_instruction *di)
+{
+	const lane_mask_t all = ~(lane_mask_t) {};
+	const lane_mask_t none = {};
+	const struct vm_instruction *instr = &di->vmi;
+	memory_addr_t ptr = (instr->nibble2 << 4) | instr->nibble3;
+	switch (di->variant) {
+	case VARIANT_MOV_RX_RY:
+	case VARIANT_MOV_RX_N:
+		/* Calls that overflow the stack fault. */
+		return instr->nibble2 == SFR_JSR ? b->sp == (uint8_t) MAX_STACK_DEPTH : none;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+		return is_jump_address(instr->nibble3) ? all : none;
+	case VARIANT_MOV_PTR_R0:
+		/* Clock and Sync change timing, writing Random reseeds the PRNG. */
+		return ptr == SFR_CLOCK || ptr == SFR_SYNC || ptr == SFR_RANDOM ? all : none;
+	case VARIANT_MOV_IND_R0: {
+		lane_bytes_t lo = b->mem[instr->nibble3];
+		return (b->mem[instr->nibble2] == (SFR_CLOCK >> 4)) & ((lo == (SFR_CLOCK & 0xf)) | (lo == (SFR_SYNC & 0xf)));
+	}
+	case VARIANT_RET_R0_N:
+		/* Returns with an empty stack fault. */
+		return b->sp == 0;
+	default:
+		return none;
+	}
+}
+
+/*
+ * Executes one instruction for the lanes in the mask, which all are at the
+ * given program counter and need no scalar execution. Sets the program
+ * counter each lane continues at.
+ */
+KERNEL void exec_group(struct vm_batch *b, const struct decoded_instruction *di, lane_mask_t mask, program_addr_t pc, half_words_t target[2])
+{
+	const struct vm_instruction *instr = &di->vmi;
+	memory_addr_t rx = instr->nibble2;
+	memory_addr_t ry = instr->nibble3;
+	memory_addr_t ptr = (rx << 4) | ry;
+	uint8_t n = instr->nibble3;
+	program_addr_t next_pc = pc + 1 < PROGRAM_MEMORY_SIZE ? pc + 1 : 0;
+	lane_bytes_t skip = {};
+	lane_bytes_t result;
+	uint32_t bits;
+
+	switch (di->variant) {
+	case VARIANT_ADD_RX_RY:
+		arith(b, rx, b->mem[ry], false, false, true, mask);
+		break;
+	case VARIANT_ADC_RX_RY:
+		arith(b, rx, b->mem[ry], false, true, true, mask);
+		break;
+	case VARIANT_SUB_RX_RY:
+		arith(b, rx, b->mem[ry], true, false, true, mask);
+		break;
+	case VARIANT_SBB_RX_RY:
+		arith(b, rx, b->mem[ry], true, true, true, mask);
+		break;
+	case VARIANT_CP_R0_N:
+		arith(b, 0, broadcast(n), true, false, false, mask);
+		break;
+	case VARIANT_ADD_R0_N:
+		arith(b, 0, broadcast(n), false, false, true, mask);
+		break;
+	case VARIANT_OR_RX_RY:
+		result = b->mem[rx] | b->mem[ry];
+		store_row(b, rx, result, mask);
+		update_zero(b, result, mask);
+		break;
+	case VARIANT_AND_RX_RY:
+		result = b->mem[rx] & b->mem[ry];
+		store_row(b, rx, result, mask);
+		update_zero(b, result, mask);
+		break;
+	case VARIANT_XOR_RX_RY:
+		result = b->mem[rx] ^ b->mem[ry];
+		store_row(b, rx, result, mask);
+		update_zero(b, result, mask);
+		break;
+	case VARIANT_OR_R0_N:
+		result = b->mem[0] | n;
+		store_row(b, 0, result, mask);
+		update_zero(b, result, mask);
+		b->flags |= FLAG_CARRY & (lane_bytes_t) mask;
+		break;
+	case VARIANT_AND_R0_N:
+		result = b->mem[0] & n;
+		store_row(b, 0, result, mask);
+		update_zero(b, result, mask);
+		b->flags &= ~(FLAG_CARRY & (lane_bytes_t) mask);
+		break;
+	case VARIANT_XOR_R0_N:
+		result = b->mem[0] ^ n;
+		store_row(b, 0, result, mask);
+		update_zero(b, result, mask);
+		b->flags ^= FLAG_CARRY & (lane_bytes_t) mask;
+		break;
+	case VARIANT_MOV_RX_RY:
+	case VARIANT_MOV_RX_N:
+		store_row(b, rx, di->variant == VARIANT_MOV_RX_N ? broadcast(n) : b->mem[ry], mask);
+		if (rx == SFR_JSR) {
+			/* Pushes the return address, see maybe_call_or_jump(). */
+			bits = lane_bits(mask);
+			while (bits) {
+				int lane = __builtin_ctz(bits);
+				bits &= bits - 1;
+				memory_addr_t ret_ptr = PAGE_SIZE + b->sp[lane] * 3;
+				b->mem[ret_ptr][lane] = next_pc & 0xf;
+				b->mem[ret_ptr + 1][lane] = (next_pc >> 4) & 0xf;
+				b->mem[ret_ptr + 2][lane] = next_pc >> 8;
+			}
+			b->sp -= (lane_bytes_t) mask;
+		}
+		if (is_jump_address(rx)) {
+			get_jump_target(b, rx, target);
+			return;
+		}
+		break;
+	case VARIANT_MOV_IND_R0:
+		bits = lane_bits(mask);
+		while (bits) {
+			int lane = __builtin_ctz(bits);
+			bits &= bits - 1;
+			memory_addr_t addr = (b->mem[rx][lane] << 4) | b->mem[ry][lane];
+			b->mem[addr][lane] = b->mem[0][lane];
+		}
+		break;
+	case VARIANT_MOV_R0_IND:
+		bits = lane_bits(mask);
+		while (bits) {
+			int lane = __builtin_ctz(bits);
+			bits &= bits - 1;
+			memory_addr_t addr = (b->mem[rx][lane] << 4) | b->mem[ry][lane];
+			b->mem[0][lane] = b->mem[addr][lane];
+		}
+		break;
+	case VARIANT_MOV_PTR_R0:
+		store_row(b, ptr, b->mem[0], mask);
+		break;
+	case VARIANT_MOV_R0_PTR:
+		store_row(b, 0, b->mem[ptr], mask);
+		/* Reading these has side effects, see maybe_handle_sfr_read(). */
+		if (ptr == SFR_RANDOM) {
+			bits = lane_bits(mask);
+			while (bits) {
+				int lane = __builtin_ctz(bits);
+				bits &= bits - 1;
+				b->mem[ptr][lane] = next_rng(&b->lanes[lane]->rng);
+			}
+		} else if (ptr == SFR_RD_FLAGS) {
+			store_row(b, ptr, b->mem[ptr] & (uint8_t) ~RD_FLAG_USER_SYNC, mask);
+		} else if (ptr == SFR_KEY_STATUS) {
+			store_row(b, ptr, b->mem[ptr] & (uint8_t) ~KEY_STATUS_JUST_PRESS, mask);
+		}
+		break;
+	case VARIANT_MOV_PC_NN:
+		store_row(b, SFR_PCM, broadcast(ptr & 0xf), mask);
+		store_row(b, SFR_PCH, broadcast(ptr >> 4), mask);
+		break;
+	case VARIANT_JR_NN:
+		next_pc = pc + 1 + (int8_t) ptr;
+		break;
+	case VARIANT_INC_RY:
+		result = b->mem[ry] + 1;
+		store_row(b, ry, result & 0xf, mask);
+		update_zero(b, result, mask);
+		update_flag(b, FLAG_CARRY, (result & 0x10) != 0, mask);
+		break;
+	case VARIANT_DEC_RY:
+		result = b->mem[ry] - 1;
+		store_row(b, ry, result & 0xf, mask);
+		update_zero(b, result, mask);
+		update_flag(b, FLAG_CARRY, (result & 0x10) == 0, mask);
+		break;
+	case VARIANT_DSZ_RY:
+		result = (b->mem[ry] - 1) & 0xf;
+		store_row(b, ry, result, mask);
+		skip = (lane_bytes_t) (result == 0) & 1;
+		break;
+	case VARIANT_EXR_N:
+		for (int i = 0; i < (n ? n : PAGE_SIZE); i++) {
+			lane_bytes_t main = b->mem[i];
+			lane_bytes_t alt = b->mem[(NUM_PAGES - 2) * PAGE_SIZE + i];
+			b->mem[i] = blend(mask, alt, main);
+			b->mem[(NUM_PAGES - 2) * PAGE_SIZE + i] = blend(mask, main, alt);
+		}
+		break;
+	case VARIANT_BIT_RG_M:
+	case VARIANT_BSET_RG_M:
+	case VARIANT_BCLR_RG_M:
+	case VARIANT_BTG_RG_M:
+		bit_op(b, instr, di->variant, mask);
+		break;
+	case VARIANT_RRC_RY: {
+		lane_bytes_t value = b->mem[ry];
+		lane_bytes_t carry_in = (b->flags & FLAG_CARRY) << 3;
+		update_flag(b, FLAG_CARRY, (value & 0x1) != 0, mask);
+		result = (value >> 1) | carry_in;
+		store_row(b, ry, result, mask);
+		update_zero(b, result, mask);
+		break;
+	}
+	case VARIANT_RET_R0_N:
+		store_row(b, 0, broadcast(n), mask);
+		b->sp += (lane_bytes_t) mask;
+		bits = lane_bits(mask);
+		while (bits) {
+			int lane = __builtin_ctz(bits);
+			bits &= bits - 1;
+			memory_addr_t ret_ptr = PAGE_SIZE + b->sp[lane] * 3;
+			target[lane / HALF_LANES][lane % HALF_LANES] = b->mem[ret_ptr][lane] | (b->mem[ret_ptr + 1][lane] << 4) | (b->mem[ret_ptr + 2][lane] << 8);
+		}
+		return;
+	case VARIANT_SKIP_F_M: {
+		uint8_t m = n & 0x3;
+		lane_bytes_t flag = b->flags & (uint8_t) ((n >> 2) < 2 ? FLAG_CARRY : FLAG_ZERO);
+		lane_mask_t taken = (n >> 2) & 1 ? flag == 0 : flag != 0;
+		skip = (lane_bytes_t) taken & (uint8_t) (m ? m : 4);
+		break;
+	}
+	default:
+		/* Other instructions are always executed by the scalar interpreter. */
+		__builtin_unreachable();
+	}
+	for (int h = 0; h < 2; h++) {
+		target[h] = next_pc + widen(skip, h);
+	}
+}
+
+static inline uint16_t get_half_word(const half_words_t *halves, int lane)
+{
+	return halves[lane / HALF_LANES][lane % HALF_LANES];
+}
+
+static inline void set_half_word(half_words_t *halves, int lane, uint16_t value)
+{
+	halves[lane / HALF_LANES][lane % HALF_LANES] = value;
+}
+
+/* Accounts for the vector cycles a lane ran since it was last granted some. */
+void settle_lane(struct vm_batch *b, int lane)
+{
+	uint16_t cycles = b->granted[lane] - get_half_word(b->left, lane);
+	b->pending[lane] += cycles;
+	b->budget[lane] -= cycles;
+	b->scalar_in[lane] -= cycles;
+	b->granted[lane] = 0;
+	set_half_word(b->left, lane, 0);
+}
+
+/*
+ * Grants vector cycles to a settled lane, up to the next one that must begin
+ * in vm_state. Lanes with no cycles left in batch_run() become inactive.
+ */
+void grant_lane(struct vm_batch *b, int lane)
+{
+	uint32_t bit = 1u << lane;
+	if (!(b->running & bit) || !b->budget[lane]) {
+		b->active &= ~bit;
+		b->active_mask[lane] = 0;
+		return;
+	}
+	uint64_t cycles = b->budget[lane] < b->scalar_in[lane] ? b->budget[lane] : b->scalar_in[lane];
+	cycles = cycles < UINT16_MAX ? cycles : UINT16_MAX;
+	b->granted[lane] = cycles;
+	set_half_word(b->left, lane, cycles);
+	b->active |= bit;
+	b->active_mask[lane] = -1;
+	if (!cycles) {
+		b->attention |= bit;
+	}
+}
+
+/* Brings a settled lane's vm_state up to date with the batch. */
+struct vm_state *load_lane(struct vm_batch *b, int lane)
+{
+	struct vm_state *vm = b->lanes[lane];
+	uint64_t cycles = b->pending[lane];
+	if (cycles) {
+		/*
+		 * Clock stayed the same during these cycles, and UserSync only
+		 * fired every sync_period cycles in lanes that are in sync_mask.
+		 * Memory side effects are in the batch, copied below.
+		 */
+		vm_clock_t dt = vm->dt_virtual_cycle;
+		if (b->sync_mask[lane]) {
+			int64_t period = get_half_word(b->sync_period, lane);
+			int64_t last = cycles - (period - get_half_word(b->sync_in, lane));
+			if (last >= 1) {
+				vm_clock_t t_sync = vm->t_virtual + (last - 1) * dt;
+				vm->dt_last_user_sync_period = last > period ? period * dt : t_sync - vm->t_last_user_sync;
+				vm->t_last_user_sync = t_sync;
+			}
+		}
+		vm->dt_last_cycle_period = cycles > 1 ? dt : vm->t_virtual - vm->t_cycle_start;
+		vm->t_cycle_start = vm->t_virtual;
+		vm_end_cycles(vm, cycles);
+		vm->t_cycle_start = vm->t_virtual - dt;
+		b->pending[lane] = 0;
+	}
+	for (int i = 0; i < NUM_PAGES * PAGE_SIZE; i++) {
+		vm->user_mem[i] = b->mem[i][lane];
+	}
+	vm->reg_pc = get_half_word(b->pc, lane);
+	vm->reg_flags = b->flags[lane];
+	vm->reg_sp = b->sp[lane];
+	return vm;
+}
+
+/* Copies a lane's vm_state into the batch. */
+void store_lane(struct vm_batch *b, int lane)
+{
+	const struct vm_state *vm = b->lanes[lane];
+	for (int i = 0; i < NUM_PAGES * PAGE_SIZE; i++) {
+		b->mem[i][lane] = vm->user_mem[i];
+	}
+	set_half_word(b->pc, lane, vm->reg_pc);
+	b->flags[lane] = vm->reg_flags;
+	b->sp[lane] = vm->reg_sp;
+	if (vm->fault || vm->halted) {
+		b->running &= ~(1u << lane);
+	}
+}
+
+/*
+ * Executes one cycle of a lane with the scalar interpreter, or fast-forwards
+ * several if allowed. A lane at JR -1 halts instead. Returns the number of
+ * cycles executed.
+ */
+uint64_t step_lane(struct vm_batch *b, int lane, bool fastfwd)
+{
+	settle_lane(b, lane);
+	struct vm_state *vm = load_lane(b, lane);
+	/* Unless timing stays the same, it is recomputed when the next cycle begins. */
+	b->scalar_in[lane] = 0;
+	b->sync_mask[lane] = 0;
+	/* Lanes halt even when not fast-forwarding, so that halted VMs count the same cycles. */
+	if (fastfwd_halt(vm)) {
+		store_lane(b, lane);
+		grant_lane(b, lane);
+		return 0;
+	}
+	uint64_t cycles = 0;
+	if (fastfwd) {
+		cycles = fastfwd_begin_cycle(vm, b->budget[lane]);
+	} else {
+		vm_begin_cycle(vm);
+	}
+	if (!cycles) {
+		uint64_t batch_cycles = vm_get_batch_cycles(vm);
+		memory_word_t clock = vm->reg_clock;
+		memory_word_t sync = vm->reg_sync;
+		exec_decoded(vm_fetch_next(vm), vm);
+		vm_end_cycles(vm, 1);
+		cycles = 1;
+		if (vm->reg_clock == clock && vm->reg_sync == sync) {
+			uint64_t sync_cycles = vm_get_sync_cycles(vm);
+			if (sync_cycles <= UINT16_MAX) {
+				/* UserSync fires often, at a steady rate from now on. */
+				b->sync_mask[lane] = -1;
+				set_half_word(b->sync_in, lane, batch_cycles);
+				set_half_word(b->sync_period, lane, sync_cycles);
+				b->scalar_in[lane] = UINT64_MAX;
+			} else {
+				b->scalar_in[lane] = batch_cycles - 1;
+			}
+		}
+	}
+	b->budget[lane] -= cycles;
+	store_lane(b, lane);
+	grant_lane(b, lane);
+	return cycles;
+}
+
+uint64_t step_lanes(struct vm_batch *b, uint32_t bits, bool fastfwd)
+{
+	uint64_t cycles = 0;
+	while (bits) {
+		cycles += step_lane(b, __builtin_ctz(bits), fastfwd);
+		bits &= bits - 1;
+	}
+	return cycles;
+}
+
+/* Returns the lowest program counter among lanes set in bits. */
+program_addr_t get_min_pc(const struct vm_batch *b, uint32_t bits)
+{
+	program_addr_t min = UINT16_MAX;
+	while (bits) {
+		program_addr_t pc = get_half_word(b->pc, __builtin_ctz(bits));
+		min = pc < min ? pc : min;
+		bits &= bits - 1;
+	}
+	return min;
+}
+
+/*
+ * Returns the lanes polling UserSync at a fast-forward candidate that are
+ * better off fast-forwarding than running the loop in vectors.
+ */
+uint32_t get_fastfwd_lanes(const struct vm_batch *b, uint32_t bits)
+{
+	uint32_t fastfwd = 0;
+	while (bits) {
+		int lane = __builtin_ctz(bits);
+		bits &= bits - 1;
+		if (!b->sync_mask[lane] || get_half_word(b->sync_period, lane) >= BATCH_FASTFWD_MIN_CYCLES) {
+			fastfwd |= 1u << lane;
+		}
+	}
+	return fastfwd;
+}
+
+bool batch_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+struct vm_batch *batch_create(struct vm_state *const *lanes, int num_lanes)
+{
+	if (!batch_supported()) {
+		fprintf(stderr, "Batches need a CPU with AVX2.\n");
+		return NULL;
+	}
+	if (num_lanes < 1 || num_lanes > BATCH_MAX_LANES) {
+		fprintf(stderr, "A batch needs between 1 and %d VMs.\n", BATCH_MAX_LANES);
+		return NULL;
+	}
+	for (int i = 0; i < num_lanes; i++) {
+		if (lanes[i]->time_mode != VM_TIME_VIRTUAL) {
+			fprintf(stderr, "Batched VMs must use virtual time.\n");
+			return NULL;
+		}
+		if (memcmp(lanes[i]->prg->instructions, lanes[0]->prg->instructions, sizeof(lanes[0]->prg->instructions))) {
+			fprintf(stderr, "Batched VMs must run the same program.\n");
+			return NULL;
+		}
+	}
+
+	struct vm_batch *b = aligned_alloc(_Alignof(struct vm_batch), sizeof(struct vm_batch));
+	if (!b) {
+		fprintf(stderr, "Failed to allocate VM batch.\n");
+		return NULL;
+	}
+	memset(b, 0, sizeof(struct vm_batch));
+	b->decoded = lanes[0]->decoded;
+	b->fastfwd_kind = lanes[0]->fastfwd_kind;
+	for (int i = 0; i < num_lanes; i++) {
+		b->lanes[i] = lanes[i];
+		b->running |= 1u << i;
+		store_lane(b, i);
+	}
+	return b;
+}
+
+void batch_destroy(struct vm_batch *batch)
+{
+	free(batch);
+}
+
+__attribute__((target("avx2")))
+uint64_t batch_run(struct vm_batch *b, uint64_t max_cycles)
+{
+	uint64_t cycles = 0;
+	uint32_t bits = b->running;
+	while (bits) {
+		int lane = __builtin_ctz(bits);
+		bits &= bits - 1;
+		settle_lane(b, lane);
+		b->budget[lane] = max_cycles;
+		grant_lane(b, lane);
+	}
+
+	while (b->active) {
+		while (b->attention) {
+			int lane = __builtin_ctz(b->attention);
+			b->attention &= b->attention - 1;
+			settle_lane(b, lane);
+			if ((b->running & (1u << lane)) && b->budget[lane] && !b->scalar_in[lane]) {
+				cycles += step_lane(b, lane, false);
+			} else {
+				grant_lane(b, lane);
+			}
+		}
+		if (!b->active) {
+			break;
+		}
+
+		/*
+		 * Lanes usually share the program counter. Otherwise, running those
+		 * furthest behind in the program first lets them reconverge.
+		 */
+		program_addr_t pc = get_half_word(b->pc, __builtin_ctz(b->active));
+		lane_mask_t group = b->active_mask & lanes_at(b, pc);
+		if (lane_bits(group) != b->active) {
+			pc = get_min_pc(b, b->active);
+			group = b->active_mask & lanes_at(b, pc);
+		}
+		if (pc >= PROGRAM_MEMORY_SIZE) {
+			/* Out of range addresses fault like the interpreter. */
+			cycles += step_lanes(b, lane_bits(group), false);
+			continue;
+		}
+		uint32_t scalar = 0;
+		if (b->fastfwd_kind[pc] == FASTFWD_SYNC_POLL) {
+			scalar = get_fastfwd_lanes(b, lane_bits(group));
+			cycles += step_lanes(b, scalar, true);
+		} else if (b->fastfwd_kind[pc] == FASTFWD_HALT) {
+			/* Halted lanes stop running, like faulted ones. */
+			scalar = lane_bits(group);
+			cycles += step_lanes(b, scalar, true);
+		}
+		const struct decoded_instruction *di = &b->decoded[pc];
+		uint32_t faulting = lane_bits(group & get_scalar_lanes(b, di)) & ~scalar;
+		cycles += step_lanes(b, faulting, false);
+		scalar |= faulting;
+		if (scalar) {
+			for (int lane = 0; lane < BATCH_MAX_LANES; lane++) {
+				if (scalar & (1u << lane)) {
+					group[lane] = 0;
+				}
+			}
+			if (!lane_bits(group)) {
+				continue;
+			}
+		}
+
+		begin_cycles(b, group);
+		half_words_t target[2] = {b->pc[0], b->pc[1]};
+		exec_group(b, di, group, pc, target);
+		half_wmask_t done[2];
+		for (int h = 0; h < 2; h++) {
+			half_wmask_t wmask = widen_mask(group, h);
+			b->pc[h] = blend_words(wmask, target[h], b->pc[h]);
+			b->left[h] += (half_words_t) wmask;
+			done[h] = wmask & (b->left[h] == 0);
+		}
+		b->attention |= lane_bits(narrow_masks(done[0], done[1]));
+		cycles += __builtin_popcount(lane_bits(group));
+	}
+	return cycles;
+}
+
+void batch_sync(struct vm_batch *b)
+{
+	uint32_t bits = b->running;
+	while (bits) {
+		int lane = __builtin_ctz(bits);
+		bits &= bits - 1;
+		settle_lane(b, lane);
+		load_lane(b, lane);
+		grant_lane(b, lane);
+	}
+}
+
+void batch_stop_lane(struct vm_batch *b, int lane)
+{
+	/* Lanes that faulted or halted were left up to date. */
+	if (b->running & (1u << lane)) {
+		settle_lane(b, lane);
+		load_lane(b, lane);
+		b->running &= ~(1u << lane);
+		grant_lane(b, lane);
+	}
+}
+
+#else /* __x86_64__ */
+
+bool batch_supported(void)
+{
+	return false;
+}
+
+struct vm_batch *batch_create(struct vm_state *const *lanes, int num_lanes)
+{
+	fprintf(stderr, "Batches are only supported on x86-64.\n");
+	return NULL;
+}
+
+void batch_destroy(struct vm_batch *batch)
+{
+}
+
+uint64_t batch_run(struct vm_batch *batch, uint64_t max_cycles)
+{
+	return 0;
+}
+
+void batch_sync(struct vm_batch *batch)
+{
+}
+
+void batch_stop_lane(struct vm_batch *batch, int lane)
+{
+}
+
+#endif /* __x86_64__ */
@@ -0,0 +1,60 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Maximum number of VMs in a batch, one per byte of a 256 bit vector. */
+#define BATCH_MAX_LANES 32
+
+struct vm_batch;
+
+/* Returns whether batches can run on this CPU. */
+bool batch_supported(void);
+
+/*
+ * Creates a batch that executes the given VMs in lockstep, one lane per VM.
+ * All VMs must run the same program in VM_TIME_VIRTUAL mode. The VMs are
+ * still owned by the caller. Returns NULL on error.
+ */
+struct vm_batch *batch_create(struct vm_state *const *lanes, int num_lanes);
+
+void batch_destroy(struct vm_batch *batch);
+
+/*
+ * Executes up to max_cycles cycles on every running lane. Lanes that fault
+ * stop running. Returns the number of cycles executed, summed over lanes.
+ *
+ * While running, lane state is kept in the batch; call batch_sync() before
+ * inspecting the VMs.
+ */
+uint64_t batch_run(struct vm_batch *batch, uint64_t max_cycles);
+
+/* Brings the VMs of all running lanes up to date with the batch. */
+void batch_sync(struct vm_batch *batch);
+
+/* Stops executing a lane, e.g. after it reached a stop condition. */
+void batch_stop_lane(struct vm_batch *batch, int lane);
+
+#endif /* _BATCH_H */
@@ -0,0 +1,541 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark suite, built and run with "make bench".
+ *
+ * Measures the interpreter in nanoseconds per cycle on synthetic programs
+ * that repeat a single instruction variant, on synthetic workloads mixing
+ * ALU, indirect memory, call/return and SFR instructions, and on the programs
+ * given on the command line. Programs run headless in virtual time with a
+ * fixed seed, and the fastest of several runs is reported as CSV or JSON.
+ * Results can be compared against a CSV file saved from an earlier run. With
+ * -j, benchmarks run compiled to native code, after checking that they end
+ * in the same state as when interpreted.
+ */
+
+#include "exec.h"
+#include "headless.h"
+#include "program.h"
+#include "vm.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_BENCHMARKS 256
+#define MAX_NAME_LEN 64
+#define JIT_CHECK_CYCLES 1000000	/* Cycles each benchmark runs for when comparing the JIT with the interpreter. */
+
+enum {
+	FORMAT_CSV = 0,
+	FORMAT_JSON,
+};
+
+/*
+ * Instruction repeated through program memory to measure each variant. They
+ * avoid jumps, SFRs and fast-forwarded loops, and program memory wraps around
+ * to the start. RET cannot run on its own and is measured together with the
+ * calls of fill_call_program().
+ */
+const program_word_t VARIANT_WORDS[NUM_VARIANTS] = {
+	[VARIANT_ADD_RX_RY] = 0x112,	/* ADD R1,R2 */
+	[VARIANT_ADC_RX_RY] = 0x212,	/* ADC R1,R2 */
+	[VARIANT_SUB_RX_RY] = 0x312,	/* SUB R1,R2 */
+	[VARIANT_SBB_RX_RY] = 0x412,	/* SBB R1,R2 */
+	[VARIANT_OR_RX_RY] = 0x512,	/* OR R1,R2 */
+	[VARIANT_AND_RX_RY] = 0x612,	/* AND R1,R2 */
+	[VARIANT_XOR_RX_RY] = 0x712,	/* XOR R1,R2 */
+	[VARIANT_MOV_RX_RY] = 0x812,	/* MOV R1,R2 */
+	[VARIANT_MOV_RX_N] = 0x915,	/* MOV R1,5 */
+	[VARIANT_MOV_IND_R0] = 0xa34,	/* MOV [R3:R4],R0 */
+	[VARIANT_MOV_R0_IND] = 0xb34,	/* MOV R0,[R3:R4] */
+	[VARIANT_MOV_PTR_R0] = 0xc20,	/* MOV [0x20],R0 */
+	[VARIANT_MOV_R0_PTR] = 0xd20,	/* MOV R0,[0x20] */
+	[VARIANT_MOV_PC_NN] = 0xe00,	/* MOV PC,0x00 */
+	[VARIANT_JR_NN] = 0xf00,	/* JR 0 */
+	[VARIANT_CP_R0_N] = 0x005,	/* CP R0,5 */
+	[VARIANT_ADD_R0_N] = 0x015,	/* ADD R0,5 */
+	[VARIANT_INC_RY] = 0x021,	/* INC R1 */
+	[VARIANT_DEC_RY] = 0x031,	/* DEC R1 */
+	[VARIANT_DSZ_RY] = 0x041,	/* DSZ R1 */
+	[VARIANT_OR_R0_N] = 0x055,	/* OR R0,5 */
+	[VARIANT_AND_R0_N] = 0x065,	/* AND R0,5 */
+	[VARIANT_XOR_R0_N] = 0x075,	/* XOR R0,5 */
+	[VARIANT_EXR_N] = 0x084,	/* EXR 4 */
+	[VARIANT_BIT_RG_M] = 0x091,	/* BIT R0,1 */
+	[VARIANT_BSET_RG_M] = 0x0a1,	/* BSET R0,1 */
+	[VARIANT_BCLR_RG_M] = 0x0b1,	/* BCLR R0,1 */
+	[VARIANT_BTG_RG_M] = 0x0c1,	/* BTG R0,1 */
+	[VARIANT_RRC_RY] = 0x0d1,	/* RRC R1 */
+	[VARIANT_SKIP_F_M] = 0x0f1,	/* SKIP C,1 with Carry clear */
+};
+
+/* Synthetic workloads: a prologue run once per pass through program memory, then a body repeated to fill it. */
+struct workload {
+	const char *name;
+	program_word_t prologue[4];
+	int prologue_len;
+	program_word_t body[16];
+	int body_len;
+};
+
+const struct workload WORKLOADS[] = {
+	{
+		.name = "workload/alu",
+		.body = {
+			0x112,	/* ADD R1,R2 */
+			0x223,	/* ADC R2,R3 */
+			0x334,	/* SUB R3,R4 */
+			0x745,	/* XOR R4,R5 */
+			0x656,	/* AND R5,R6 */
+			0x567,	/* OR R6,R7 */
+			0x021,	/* INC R1 */
+			0x0d2,	/* RRC R2 */
+			0x015,	/* ADD R0,5 */
+			0x005,	/* CP R0,5 */
+		},
+		.body_len = 10,
+	},
+	{
+		.name = "workload/indirect",
+		.prologue = {
+			0x932,	/* MOV R3,2 */
+			0x953,	/* MOV R5,3 */
+		},
+		.prologue_len = 2,
+		.body = {
+			0xb34,	/* MOV R0,[R3:R4] */
+			0x024,	/* INC R4 */
+			0xa56,	/* MOV [R5:R6],R0 */
+			0x036,	/* DEC R6 */
+		},
+		.body_len = 4,
+	},
+	{
+		.name = "workload/sfr",
+		.body = {
+			0xdf4,	/* MOV R0,[RdFlags] */
+			0xdff,	/* MOV R0,[Random] */
+			0xcf0,	/* MOV [Page],R0 */
+		},
+		.body_len = 3,
+	},
+};
+
+/* Name of the workload that calls a subroutine made of a single RET. */
+const char *CALL_WORKLOAD_NAME = "workload/calls";
+
+struct benchmark {
+	char name[MAX_NAME_LEN];
+	struct program *prg;
+	uint64_t cycles;	/* Cycles executed by the fastest run. */
+	vm_clock_t elapsed;	/* Wall time of the fastest run. */
+	bool has_baseline;
+	double baseline_ns;	/* Nanoseconds per cycle in the baseline. */
+};
+
+struct bench_options {
+	uint64_t cycles;
+	int repeats;
+	int format;
+	const char *output_path;
+	const char *baseline_path;
+	double threshold;	/* Regression in percent that fails the comparison; 0 to only report. */
+	bool jit;		/* Compile the programs to native code. */
+};
+
+struct bench {
+	struct benchmark benchmarks[MAX_BENCHMARKS];
+	int num_benchmarks;
+};
+
+struct benchmark *add_benchmark(struct bench *bench, const char *name)
+{
+	if (bench->num_benchmarks == MAX_BENCHMARKS) {
+		fprintf(stderr, "Too many benchmarks.\n");
+		return NULL;
+	}
+	struct benchmark *benchmark = &bench->benchmarks[bench->num_benchmarks];
+	benchmark->prg = calloc(1, sizeof(struct program));
+	if (!benchmark->prg) {
+		fprintf(stderr, "Failed to allocate program.\n");
+		return NULL;
+	}
+	benchmark->prg->length = PROGRAM_MEMORY_SIZE;
+	snprintf(benchmark->name, sizeof(benchmark->name), "%s", name);
+	bench->num_benchmarks++;
+	return benchmark;
+}
+
+/* Calls a RET at the end of program memory from everywhere else. */
+void fill_call_program(struct program *prg)
+{
+	program_word_t *words = prg->instructions;
+	words[0] = 0xeff;	/* MOV PC,0xff, the page of the subroutine. */
+	for (int pc = 1; pc < PROGRAM_MEMORY_SIZE - 3; pc++) {
+		words[pc] = 0x9cf;	/* MOV JSR,0xf */
+	}
+	words[PROGRAM_MEMORY_SIZE - 3] = 0xe00;	/* MOV PC,0x00 */
+	words[PROGRAM_MEMORY_SIZE - 2] = 0x9d0;	/* MOV PCL,0x0 */
+	words[PROGRAM_MEMORY_SIZE - 1] = 0x0e0;	/* RET R0,0 */
+}
+
+bool add_synthetic_benchmarks(struct bench *bench)
+{
+	struct benchmark *benchmark;
+	char name[MAX_NAME_LEN];
+	for (int variant = 0; variant < NUM_VARIANTS; variant++) {
+		snprintf(name, sizeof(name), "op/%s", VARIANT_NAMES[variant]);
+		if (!(benchmark = add_benchmark(bench, name))) {
+			return false;
+		}
+		if (variant == VARIANT_RET_R0_N) {
+			fill_call_program(benchmark->prg);
+			continue;
+		}
+		/* Skips must not go past the end, as only the increment of the program counter wraps around. */
+		for (int pc = 0; pc < PROGRAM_MEMORY_SIZE; pc++) {
+			benchmark->prg->instructions[pc] = pc < PROGRAM_MEMORY_SIZE - 2 ? VARIANT_WORDS[variant] : 0xf00; /* JR 0 */
+		}
+	}
+
+	for (size_t i = 0; i < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]); i++) {
+		const struct workload *workload = &WORKLOADS[i];
+		if (!(benchmark = add_benchmark(bench, workload->name))) {
+			return false;
+		}
+		program_word_t *words = benchmark->prg->instructions;
+		memcpy(words, workload->prologue, workload->prologue_len * sizeof(program_word_t));
+		for (int pc = workload->prologue_len; pc < PROGRAM_MEMORY_SIZE; pc++) {
+			words[pc] = workload->body[(pc - workload->prologue_len) % workload->body_len];
+		}
+	}
+
+	if (!(benchmark = add_benchmark(bench, CALL_WORKLOAD_NAME))) {
+		return false;
+	}
+	fill_call_program(benchmark->prg);
+	return true;
+}
+
+bool add_program_benchmark(struct bench *bench, const char *path)
+{
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	char name[MAX_NAME_LEN];
+	snprintf(name, sizeof(name), "example/%.*s", (int) strcspn(base, "."), base);
+	struct program *prg = load_program_file(path);
+	if (!prg) {
+		return false;
+	}
+	struct benchmark *benchmark = add_benchmark(bench, name);
+	if (!benchmark) {
+		free(prg);
+		return false;
+	}
+	free(benchmark->prg);
+	benchmark->prg = prg;
+	return true;
+}
+
+/* Runs a benchmark for JIT_CHECK_CYCLES, interpreted or compiled, into vm. Returns false if out of memory. */
+bool run_check(const struct benchmark *benchmark, bool jit, struct vm_state *vm)
+{
+	struct headless_options run = {.max_cycles = JIT_CHECK_CYCLES, .jit = jit, .has_seed = true, .seed = 1};
+	struct program *prg = malloc(sizeof(struct program));
+	if (!prg) {
+		fprintf(stderr, "Failed to allocate program.\n");
+		return false;
+	}
+	memcpy(prg, benchmark->prg, sizeof(struct program));
+	vm_init(vm, prg); /* vm takes ownership of prg. */
+	headless_setup_vm(&run, vm);
+	vm_clock_t elapsed;
+	headless_execute(&run, vm, &elapsed);
+	return true;
+}
+
+/* Runs every benchmark interpreted and compiled, comparing memory and registers. Returns false on a mismatch. */
+bool check_jit(const struct bench *bench)
+{
+	struct vm_state *interpreted = calloc(1, sizeof(struct vm_state));
+	struct vm_state *compiled = calloc(1, sizeof(struct vm_state));
+	if (!interpreted || !compiled) {
+		free(interpreted);
+		free(compiled);
+		fprintf(stderr, "Failed to allocate VM state.\n");
+		return false;
+	}
+	bool success = true;
+	for (int i = 0; success && i < bench->num_benchmarks; i++) {
+		const struct benchmark *benchmark = &bench->benchmarks[i];
+		if (!run_check(benchmark, false, interpreted)) {
+			success = false;
+			break;
+		}
+		if (!run_check(benchmark, true, compiled)) {
+			vm_destroy(interpreted);
+			success = false;
+			break;
+		}
+		if (memcmp(interpreted->user_mem, compiled->user_mem, sizeof(interpreted->user_mem)) ||
+				interpreted->reg_pc != compiled->reg_pc || interpreted->reg_sp != compiled->reg_sp ||
+				interpreted->reg_flags != compiled->reg_flags || interpreted->fault != compiled->fault ||
+				interpreted->cycle_count != compiled->cycle_count) {
+			fprintf(stderr, "JIT check failed: %s ends at PC %03x after %llu cycles, interpreted at PC %03x after %llu cycles.\n",
+				benchmark->name, compiled->reg_pc, (unsigned long long) compiled->cycle_count,
+				interpreted->reg_pc, (unsigned long long) interpreted->cycle_count);
+			success = false;
+		}
+		vm_destroy(interpreted);
+		vm_destroy(compiled);
+	}
+	free(interpreted);
+	free(compiled);
+	return success;
+}
+
+/* Runs a benchmark repeatedly, keeping the fastest run. Runs end early if the program halts or faults. */
+bool run_benchmark(const struct bench_options *opts, struct benchmark *benchmark)
+{
+	struct headless_options run = {.max_cycles = opts->cycles, .jit = opts->jit, .has_seed = true, .seed = 1};
+	for (int i = 0; i < opts->repeats; i++) {
+		struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+		struct program *prg = malloc(sizeof(struct program));
+		if (!vm || !prg) {
+			free(vm);
+			free(prg);
+			fprintf(stderr, "Failed to allocate VM state.\n");
+			return false;
+		}
+		memcpy(prg, benchmark->prg, sizeof(struct program));
+		vm_init(vm, prg); /* vm takes ownership of prg. */
+		headless_setup_vm(&run, vm);
+		vm_clock_t elapsed;
+		int stop = headless_execute(&run, vm, &elapsed);
+		if (stop == STOP_FAULT && !i) {
+			fprintf(stderr, "Benchmark %s faulted after %llu cycles: %s\n", benchmark->name,
+				(unsigned long long) vm->cycle_count, vm_fault_message(vm->fault));
+		}
+		if (!i || elapsed < benchmark->elapsed) {
+			benchmark->cycles = vm->cycle_count;
+			benchmark->elapsed = elapsed;
+		}
+		vm_destroy(vm);
+		free(vm);
+	}
+	return true;
+}
+
+double get_ns_per_cycle(const struct benchmark *benchmark)
+{
+	return benchmark->cycles ? (double) benchmark->elapsed / benchmark->cycles : 0;
+}
+
+/* Returns how much slower the benchmark got than the baseline, in percent. */
+double get_change(const struct benchmark *benchmark)
+{
+	return benchmark->baseline_ns > 0 ? 100 * (get_ns_per_cycle(benchmark) / benchmark->baseline_ns - 1) : 0;
+}
+
+/* Reads ns_per_cycle for each benchmark from a CSV file written by an earlier run. */
+bool load_baseline(struct bench *bench, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		char name[MAX_NAME_LEN];
+		double ns;
+		if (sscanf(line, "%63[^,],%*[^,],%*[^,],%lf", name, &ns) != 2) {
+			continue; /* The header. */
+		}
+		for (int i = 0; i < bench->num_benchmarks; i++) {
+			struct benchmark *benchmark = &bench->benchmarks[i];
+			if (!strcmp(benchmark->name, name)) {
+				benchmark->has_baseline = true;
+				benchmark->baseline_ns = ns;
+			}
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+void write_csv(const struct bench *bench, bool compare, FILE *out)
+{
+	fprintf(out, "benchmark,cycles,seconds,ns_per_cycle,mips%s\n",
+		compare ? ",baseline_ns_per_cycle,change_percent" : "");
+	for (int i = 0; i < bench->num_benchmarks; i++) {
+		const struct benchmark *benchmark = &bench->benchmarks[i];
+		double ns = get_ns_per_cycle(benchmark);
+		fprintf(out, "%s,%llu,%.6f,%.3f,%.3f", benchmark->name, (unsigned long long) benchmark->cycles,
+			benchmark->elapsed / 1e9, ns, ns > 0 ? 1e3 / ns : 0);
+		if (compare && benchmark->has_baseline) {
+			fprintf(out, ",%.3f,%+.1f", benchmark->baseline_ns, get_change(benchmark));
+		} else if (compare) {
+			fprintf(out, ",,");
+		}
+		fprintf(out, "\n");
+	}
+}
+
+void write_json(const struct bench *bench, bool compare, FILE *out)
+{
+	fprintf(out, "{\n  \"benchmarks\": [\n");
+	for (int i = 0; i < bench->num_benchmarks; i++) {
+		const struct benchmark *benchmark = &bench->benchmarks[i];
+		double ns = get_ns_per_cycle(benchmark);
+		fprintf(out, "    {\"name\": \"%s\", \"cycles\": %llu, \"seconds\": %.6f, \"ns_per_cycle\": %.3f, \"mips\": %.3f",
+			benchmark->name, (unsigned long long) benchmark->cycles, benchmark->elapsed / 1e9,
+			ns, ns > 0 ? 1e3 / ns : 0);
+		if (compare && benchmark->has_baseline) {
+			fprintf(out, ", \"baseline_ns_per_cycle\": %.3f, \"change_percent\": %.1f",
+				benchmark->baseline_ns, get_change(benchmark));
+		}
+		fprintf(out, "}%s\n", i + 1 < bench->num_benchmarks ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+/* Lists benchmarks that got slower than the threshold. Returns false if there are any. */
+bool check_regressions(const struct bench *bench, double threshold)
+{
+	bool success = true;
+	for (int i = 0; i < bench->num_benchmarks; i++) {
+		const struct benchmark *benchmark = &bench->benchmarks[i];
+		if (benchmark->has_baseline && get_change(benchmark) > threshold) {
+			fprintf(stderr, "Regression: %s is %.1f%% slower than the baseline.\n",
+				benchmark->name, get_change(benchmark));
+			success = false;
+		}
+	}
+	return success;
+}
+
+void output_usage(const char *executable_name)
+{
+	fprintf(stderr, "Usage: %s [-n cycles] [-r repeats] [-f csv|json] [-o file] [-c baseline.csv [-x percent]] [-j] [file.hex]...\n",
+		executable_name);
+	fprintf(stderr, "  -n: cycles per benchmark, default is 10000000\n");
+	fprintf(stderr, "  -r: runs per benchmark, of which the fastest is reported, default is 3\n");
+	fprintf(stderr, "  -f: output format, default is csv\n");
+	fprintf(stderr, "  -o: write results to a file instead of stdout, e.g. to save a baseline\n");
+	fprintf(stderr, "  -c: compare with results saved as CSV, positive changes are slowdowns\n");
+	fprintf(stderr, "  -x: fail if a benchmark is more than this many percent slower than the baseline\n");
+	fprintf(stderr, "  -j: compile the programs to native code where supported\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_options opts = {.cycles = 10000000, .repeats = 3};
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:f:o:c:x:j")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.cycles = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.repeats = atoi(optarg);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "csv")) {
+				opts.format = FORMAT_CSV;
+			} else if (!strcmp(optarg, "json")) {
+				opts.format = FORMAT_JSON;
+			} else {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			opts.output_path = optarg;
+			break;
+		case 'c':
+			opts.baseline_path = optarg;
+			break;
+		case 'x':
+			opts.threshold = strtod(optarg, NULL);
+			break;
+		case 'j':
+			opts.jit = true;
+			break;
+		default:
+			output_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!opts.cycles || opts.repeats < 1 || (opts.threshold && !opts.baseline_path)) {
+		output_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct bench *bench = calloc(1, sizeof(struct bench));
+	if (!bench) {
+		fprintf(stderr, "Failed to allocate benchmarks.\n");
+		exit(EXIT_FAILURE);
+	}
+	bool success = add_synthetic_benchmarks(bench);
+	for (int i = optind; success && i < argc; i++) {
+		success = add_program_benchmark(bench, argv[i]);
+	}
+	if (success && opts.jit) {
+		success = check_jit(bench);
+	}
+	for (int i = 0; success && i < bench->num_benchmarks; i++) {
+		success = run_benchmark(&opts, &bench->benchmarks[i]);
+	}
+	if (success && opts.baseline_path) {
+		success = load_baseline(bench, opts.baseline_path);
+	}
+
+	if (success) {
+		FILE *out = opts.output_path ? fopen(opts.output_path, "w") : stdout;
+		if (!out) {
+			perror(opts.output_path);
+			success = false;
+		} else {
+			bool compare = opts.baseline_path != NULL;
+			if (opts.format == FORMAT_JSON) {
+				write_json(bench, compare, out);
+			} else {
+				write_csv(bench, compare, out);
+			}
+			if (out != stdout && fclose(out)) {
+				fprintf(stderr, "Could not write results to %s\n", opts.output_path);
+				success = false;
+			}
+		}
+	}
+	if (success && opts.threshold) {
+		success = check_regressions(bench, opts.threshold);
+	}
+
+	for (int i = 0; i < bench->num_benchmarks; i++) {
+		free(bench->benchmarks[i].prg);
+	}
+	free(bench);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
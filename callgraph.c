@@ -0,0 +1,230 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "callgraph.h"
+
+#include <stdlib.h>
+
+/* Subroutines that can be active at once; more than the VM stack holds. */
+#define MAX_FRAMES 8
+
+/* Index of the root of the call tree, which stands for code not called by a tracked JSR. */
+#define ROOT_NODE 0
+
+/* Node index for calls that did not fit in the tree. */
+#define NO_NODE UINT32_MAX
+
+struct call_stats {
+	uint64_t calls;
+	uint64_t inclusive;	/* Cycles from the call up to and including the RET. */
+	uint64_t exclusive;	/* Inclusive cycles minus those of the subroutines called. */
+};
+
+struct call_node {
+	uint32_t parent;
+	uint32_t first_child;	/* NO_NODE if none. */
+	uint32_t next_sibling;	/* NO_NODE if none; siblings are in order of their first call. */
+	program_addr_t addr;
+	struct call_stats stats;
+};
+
+/* An active subroutine. */
+struct call_frame {
+	program_addr_t addr;
+	uint32_t node;
+	uint64_t entry_cycle;	/* The first cycle of the subroutine. */
+	uint64_t callee_cycles;	/* Inclusive cycles of the subroutines it called so far. */
+};
+
+struct call_graph {
+	uint64_t start_cycle;
+	uint64_t top_cycles;	/* Inclusive cycles of subroutines called from the root. */
+	struct call_stats subroutines[PROGRAM_MEMORY_SIZE];	/* Indexed by entry point. */
+	struct call_node nodes[CALL_GRAPH_MAX_NODES];
+	uint32_t num_nodes;
+	struct call_frame frames[MAX_FRAMES];
+	int depth;
+};
+
+struct call_graph *call_graph_create(const struct vm_state *vm)
+{
+	struct call_graph *graph = calloc(1, sizeof(struct call_graph));
+	if (!graph) {
+		fprintf(stderr, "Failed to allocate call graph.\n");
+		return NULL;
+	}
+	graph->start_cycle = vm->cycle_count;
+	graph->nodes[ROOT_NODE].first_child = NO_NODE;
+	graph->nodes[ROOT_NODE].next_sibling = NO_NODE;
+	graph->num_nodes = 1;
+	return graph;
+}
+
+void call_graph_destroy(struct call_graph *graph)
+{
+	free(graph);
+}
+
+/* Returns the child of a node for calls to addr, adding it if needed. */
+uint32_t get_child_node(struct call_graph *graph, uint32_t parent, program_addr_t addr)
+{
+	if (parent == NO_NODE) {
+		return NO_NODE;
+	}
+	uint32_t *link = &graph->nodes[parent].first_child;
+	while (*link != NO_NODE) {
+		if (graph->nodes[*link].addr == addr) {
+			return *link;
+		}
+		link = &graph->nodes[*link].next_sibling;
+	}
+	if (graph->num_nodes == CALL_GRAPH_MAX_NODES) {
+		return NO_NODE;
+	}
+	uint32_t index = graph->num_nodes++;
+	struct call_node *node = &graph->nodes[index];
+	node->parent = parent;
+	node->first_child = NO_NODE;
+	node->next_sibling = NO_NODE;
+	node->addr = addr;
+	*link = index;
+	return index;
+}
+
+void call_graph_call(struct call_graph *graph, const struct vm_state *vm)
+{
+	if (graph->depth == MAX_FRAMES) {
+		return; /* Should not happen, as the VM faults first. */
+	}
+	uint32_t parent = graph->depth ? graph->frames[graph->depth - 1].node : ROOT_NODE;
+	struct call_frame *frame = &graph->frames[graph->depth++];
+	frame->addr = vm->reg_pc;
+	frame->node = get_child_node(graph, parent, frame->addr);
+	frame->entry_cycle = vm->cycle_count + 1;
+	frame->callee_cycles = 0;
+
+	graph->subroutines[frame->addr].calls++;
+	if (frame->node != NO_NODE) {
+		graph->nodes[frame->node].stats.calls++;
+	}
+}
+
+/* Pops the innermost frame, with end_cycle being the first cycle after it. */
+void close_frame(struct call_graph *graph, uint64_t end_cycle)
+{
+	const struct call_frame *frame = &graph->frames[--graph->depth];
+	uint64_t inclusive = end_cycle - frame->entry_cycle;
+	uint64_t exclusive = inclusive - frame->callee_cycles;
+
+	struct call_stats *stats = &graph->subroutines[frame->addr];
+	stats->exclusive += exclusive;
+	/* Cycles of recursive calls are already part of the outermost one. */
+	bool recursive = false;
+	for (int i = 0; i < graph->depth; i++) {
+		recursive |= graph->frames[i].addr == frame->addr;
+	}
+	if (!recursive) {
+		stats->inclusive += inclusive;
+	}
+	if (frame->node != NO_NODE) {
+		graph->nodes[frame->node].stats.inclusive += inclusive;
+		graph->nodes[frame->node].stats.exclusive += exclusive;
+	}
+
+	if (graph->depth) {
+		graph->frames[graph->depth - 1].callee_cycles += inclusive;
+	} else {
+		graph->top_cycles += inclusive;
+	}
+}
+
+void call_graph_return(struct call_graph *graph, const struct vm_state *vm)
+{
+	/* Returns from calls made before the graph was attached, e.g. when resuming a snapshot, are ignored. */
+	if (graph->depth) {
+		close_frame(graph, vm->cycle_count + 1);
+	}
+}
+
+struct subroutine_row {
+	program_addr_t addr;
+	const struct call_stats *stats;
+};
+
+int compare_subroutine_rows(const void *a, const void *b)
+{
+	const struct subroutine_row *row_a = a;
+	const struct subroutine_row *row_b = b;
+	if (row_a->stats->inclusive != row_b->stats->inclusive) {
+		return row_a->stats->inclusive < row_b->stats->inclusive ? 1 : -1;
+	}
+	return row_a->addr - row_b->addr;
+}
+
+void print_stats(const struct call_stats *stats, FILE *out)
+{
+	fprintf(out, "%12llu  %12llu  %12llu  ", (unsigned long long) stats->calls,
+		(unsigned long long) stats->inclusive, (unsigned long long) stats->exclusive);
+}
+
+/* Prints a node and its descendants, indented by depth. */
+void print_tree(const struct call_graph *graph, uint32_t index, int depth, FILE *out)
+{
+	const struct call_node *node = &graph->nodes[index];
+	print_stats(&node->stats, out);
+	if (index == ROOT_NODE) {
+		fprintf(out, "root\n");
+	} else {
+		fprintf(out, "%*ssub_%03hx\n", 2 * depth, "", node->addr);
+	}
+	for (uint32_t child = node->first_child; child != NO_NODE; child = graph->nodes[child].next_sibling) {
+		print_tree(graph, child, depth + 1, out);
+	}
+}
+
+void call_graph_report(struct call_graph *graph, const struct vm_state *vm, FILE *out)
+{
+	while (graph->depth) {
+		close_frame(graph, vm->cycle_count);
+	}
+	struct call_stats *root = &graph->nodes[ROOT_NODE].stats;
+	root->calls = 1;
+	root->inclusive = vm->cycle_count - graph->start_cycle;
+	root->exclusive = root->inclusive - graph->top_cycles;
+
+	struct subroutine_row rows[PROGRAM_MEMORY_SIZE];
+	int num_rows = 0;
+	for (int addr = 0; addr < PROGRAM_MEMORY_SIZE; addr++) {
+		if (graph->subroutines[addr].calls) {
+			rows[num_rows++] = (struct subroutine_row) {.addr = addr, .stats = &graph->subroutines[addr]};
+		}
+	}
+	qsort(rows, num_rows, sizeof(rows[0]), compare_subroutine_rows);
+
+	fprintf(out, "Subroutines:\n");
+	fprintf(out, "       Calls     Inclusive     Exclusive  ADDR\n");
+	for (int i = 0; i < num_rows; i++) {
+		print_stats(rows[i].stats, out);
+		fprintf(out, "%03hx\n", rows[i].addr);
+	}
+
+	fprintf(out, "\nCall tree:\n");
+	fprintf(out, "       Calls     Inclusive     Exclusive  SUBROUTINE\n");
+	print_tree(graph, ROOT_NODE, 0, out);
+}
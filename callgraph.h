@@ -0,0 +1,62 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Subroutine profiler.
+ *
+ * Follows calls made by writing JSR and returns made by RET, as they happen,
+ * to count calls and the cycles spent in every subroutine, both in total
+ * (inclusive) and outside the subroutines it called in turn (exclusive), and
+ * to build the tree of call paths. The hooks are always compiled in; when no
+ * call graph is attached to the VM they cost a pointer test on JSR and RET.
+ */
+
+#ifndef _CALLGRAPH_H
+#define _CALLGRAPH_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of nodes in the call tree; calls beyond it are only counted per subroutine. */
+#define CALL_GRAPH_MAX_NODES 0x1000
+
+struct call_graph;
+
+/* Allocates a call graph that counts cycles from the current cycle of the VM. Returns NULL on error. */
+struct call_graph *call_graph_create(const struct vm_state *vm);
+
+void call_graph_destroy(struct call_graph *graph);
+
+/* Records a call to the subroutine at the program counter, made by the current cycle. */
+void call_graph_call(struct call_graph *graph, const struct vm_state *vm);
+
+/* Records a return from the innermost subroutine, made by the current cycle. */
+void call_graph_return(struct call_graph *graph, const struct vm_state *vm);
+
+/*
+ * Prints calls, inclusive and exclusive cycles per subroutine, followed by
+ * the call tree. Subroutines that have not returned yet are closed first,
+ * counting them up to the last cycle executed.
+ */
+void call_graph_report(struct call_graph *graph, const struct vm_state *vm, FILE *out);
+
+#endif /* _CALLGRAPH_H */
@@ -19,6 +19,7 @@
 
 #include "clock.h"
 
+#include <errno.h>
 #include <time.h>
 
 const unsigned long long NSEC_PER_SEC = 1000000000;
@@ -51,3 +52,24 @@ long vm_clock_as_usec(vm_clock_t clk)
 {
 	return clk / 1000;
 }
+
+void get_timespec(const struct timespec *ref, vm_clock_t t, struct timespec *out)
+{
+	out->tv_sec = ref->tv_sec + t / (vm_clock_t) NSEC_PER_SEC;
+	out->tv_nsec = ref->tv_nsec + t % (vm_clock_t) NSEC_PER_SEC;
+	if (out->tv_nsec >= NSEC_PER_SEC) {
+		out->tv_sec++;
+		out->tv_nsec -= NSEC_PER_SEC;
+	} else if (out->tv_nsec < 0) {
+		out->tv_sec--;
+		out->tv_nsec += NSEC_PER_SEC;
+	}
+}
+
+void sleep_until(const struct timespec *ref, vm_clock_t t)
+{
+	struct timespec deadline;
+	get_timespec(ref, t, &deadline);
+	/* Unlike relative sleeps, oversleeping does not delay the following deadlines. */
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
+}
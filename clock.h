@@ -34,5 +34,11 @@ vm_clock_t get_vm_clock(const struct timespec *ref);
 /* Returns time elapsed as microseconds. */
 long vm_clock_as_usec(vm_clock_t clk);
 
+/* Converts a clock value measured from the given reference back to a time. */
+void get_timespec(const struct timespec *ref, vm_clock_t t, struct timespec *out);
+
+/* Sleeps until a clock value measured from the given reference, returning at once if it has passed. */
+void sleep_until(const struct timespec *ref, vm_clock_t t);
+
 
 #endif /* _CLOCK_H */
@@ -0,0 +1,644 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Specialized instruction handlers.
+ *
+ * Every instruction variant is listed exactly once in the tables below. The
+ * tables generate both the instruction descriptors used for disassembly and
+ * one handler per variant, in which operand kinds and flags are compile time
+ * constants so the generic operation bodies reduce to straight line code.
+ */
+
+#ifndef _EXEC_H
+#define _EXEC_H
+
+#include "callgraph.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* Kinds of instruction operands. */
+enum {
+	OPERAND_NONE = 0,
+	OPERAND_RX,	/* Register selected by the second nibble. */
+	OPERAND_RY,	/* Register selected by the third nibble. */
+	OPERAND_RGI,	/* R0-R2 or the active In register. */
+	OPERAND_RGO,	/* R0-R2 or the active Out register. */
+	OPERAND_R0,	/* Register R0. */
+	OPERAND_PC,	/* Registers PCM and PCH. */
+	OPERAND_PTR,	/* Memory at the address given by second and third nibbles. */
+	OPERAND_IND,	/* Memory at the address given by registers RX and RY. */
+	OPERAND_N,	/* 4 bit literal. */
+	OPERAND_NN,	/* 8 bit literal. */
+	OPERAND_M,	/* 2 bit literal. */
+	OPERAND_FLG,	/* Condition flag selector. */
+	NUM_OPERANDS,
+};
+
+enum {
+	OP_FLAG_DST_BYTE = 0x1,
+	OP_FLAG_CAN_JUMP = 0x2,
+	OP_FLAG_CAN_RD_SFR = 0x4,
+	OP_FLAG_CAN_WR_SFR = 0x8,
+	OP_FLAG_UPDATE_CARRY = 0x10,
+};
+
+/*
+ * Single nibble opcodes (indexed by first nibble; zero indicates a wide opcode).
+ * Columns: variant, opcode, operation, operation function, dst, cnd, src, flags.
+ */
+#define FOR_EACH_INSTRUCTION(X) \
+	X(ADD_RX_RY,   0x1, ADD,  add,  RX,   NONE, RY,   0) \
+	X(ADC_RX_RY,   0x2, ADC,  adc,  RX,   NONE, RY,   0) \
+	X(SUB_RX_RY,   0x3, SUB,  sub,  RX,   NONE, RY,   0) \
+	X(SBB_RX_RY,   0x4, SBB,  sbb,  RX,   NONE, RY,   0) \
+	X(OR_RX_RY,    0x5, OR,   or,   RX,   NONE, RY,   0) \
+	X(AND_RX_RY,   0x6, AND,  and,  RX,   NONE, RY,   0) \
+	X(XOR_RX_RY,   0x7, XOR,  xor,  RX,   NONE, RY,   0) \
+	X(MOV_RX_RY,   0x8, MOV,  mov,  RX,   NONE, RY,   OP_FLAG_CAN_JUMP) \
+	X(MOV_RX_N,    0x9, MOV,  mov,  RX,   NONE, N,    OP_FLAG_CAN_JUMP) \
+	X(MOV_IND_R0,  0xa, MOV,  mov,  IND,  NONE, R0,   0) \
+	X(MOV_R0_IND,  0xb, MOV,  mov,  R0,   NONE, IND,  0) \
+	X(MOV_PTR_R0,  0xc, MOV,  mov,  PTR,  NONE, R0,   OP_FLAG_CAN_WR_SFR) \
+	X(MOV_R0_PTR,  0xd, MOV,  mov,  R0,   NONE, PTR,  OP_FLAG_CAN_RD_SFR) \
+	X(MOV_PC_NN,   0xe, MOV,  mov,  PC,   NONE, NN,   OP_FLAG_DST_BYTE) \
+	X(JR_NN,       0xf, JR,   jr,   NONE, NONE, NN,   0)
+
+/* Double nibble opcodes (indexed by second nibble; first nibble is zero). */
+#define FOR_EACH_WIDE_INSTRUCTION(X) \
+	X(CP_R0_N,     0x0, CP,   cp,   R0,   NONE, N,    0) \
+	X(ADD_R0_N,    0x1, ADD,  add,  R0,   NONE, N,    0) \
+	X(INC_RY,      0x2, INC,  inc,  RY,   NONE, NONE, OP_FLAG_CAN_JUMP) \
+	X(DEC_RY,      0x3, DEC,  dec,  RY,   NONE, NONE, OP_FLAG_CAN_JUMP) \
+	X(DSZ_RY,      0x4, DSZ,  dsz,  RY,   NONE, NONE, 0) \
+	X(OR_R0_N,     0x5, OR,   or,   R0,   NONE, N,    OP_FLAG_UPDATE_CARRY) \
+	X(AND_R0_N,    0x6, AND,  and,  R0,   NONE, N,    OP_FLAG_UPDATE_CARRY) \
+	X(XOR_R0_N,    0x7, XOR,  xor,  R0,   NONE, N,    OP_FLAG_UPDATE_CARRY) \
+	X(EXR_N,       0x8, EXR,  exr,  NONE, NONE, N,    0) \
+	X(BIT_RG_M,    0x9, BIT,  bit,  RGI,  NONE, M,    0) \
+	X(BSET_RG_M,   0xa, BSET, bset, RGO,  NONE, M,    0) \
+	X(BCLR_RG_M,   0xb, BCLR, bclr, RGO,  NONE, M,    0) \
+	X(BTG_RG_M,    0xc, BTG,  btg,  RGO,  NONE, M,    0) \
+	X(RRC_RY,      0xd, RRC,  rrc,  RY,   NONE, NONE, 0) \
+	X(RET_R0_N,    0xe, RET,  ret,  R0,   NONE, N,    0) \
+	X(SKIP_F_M,    0xf, SKIP, skip, NONE, FLG,  M,    0)
+
+/* Instruction variants, one per table entry above. */
+enum {
+#define INSTRUCTION_VARIANT(name, ...) VARIANT_##name,
+	FOR_EACH_INSTRUCTION(INSTRUCTION_VARIANT)
+	FOR_EACH_WIDE_INSTRUCTION(INSTRUCTION_VARIANT)
+#undef INSTRUCTION_VARIANT
+	NUM_VARIANTS,
+};
+
+/* Out of line helpers for rare paths, implemented in ops.c. */
+void maybe_call_or_jump(memory_addr_t dst_addr, struct vm_state *vm);
+bool maybe_handle_sfr_read(memory_addr_t addr, struct vm_state *vm);
+bool maybe_handle_sfr_write(memory_addr_t addr, struct vm_state *vm);
+
+/* Number of return addresses that fit on the stack, defined in ops.c. */
+extern const int MAX_STACK_DEPTH;
+
+/* Names of instruction variants, e.g. "ADD_RX_RY", defined in aot.c. */
+extern const char *const VARIANT_NAMES[NUM_VARIANTS];
+
+static ALWAYS_INLINE memory_addr_t operand_addr(int kind, const struct vm_instruction *instr, const struct vm_state *vm)
+{
+	uint8_t rg;
+	switch (kind) {
+	case OPERAND_RX:
+		return instr->nibble2;
+	case OPERAND_RY:
+		return instr->nibble3;
+	case OPERAND_RGI:
+	case OPERAND_RGO:
+		rg = instr->nibble3 >> 2;
+		if (rg < 0x3) {
+			return rg;
+		} else if (vm->reg_wr_flags & WR_FLAG_IN_OUT_POS) {
+			return kind == OPERAND_RGI ? SFR_IN_B : SFR_OUT_B;
+		} else {
+			return kind == OPERAND_RGI ? SFR_IN : SFR_OUT;
+		}
+	case OPERAND_R0:
+		return 0;
+	case OPERAND_PC:
+		return SFR_PCM;
+	case OPERAND_PTR:
+		return (instr->nibble2 << 4) | instr->nibble3;
+	case OPERAND_IND:
+		return (vm->main_regs_page[instr->nibble2] << 4) | vm->main_regs_page[instr->nibble3];
+	default:
+		__builtin_unreachable();
+	}
+}
+
+static ALWAYS_INLINE uint8_t operand_val(int kind, const struct vm_instruction *instr, const struct vm_state *vm)
+{
+	switch (kind) {
+	case OPERAND_RY:
+		return vm->main_regs_page[instr->nibble3];
+	case OPERAND_R0:
+		return vm->reg_r0;
+	case OPERAND_PTR:
+	case OPERAND_IND:
+		return vm->user_mem[operand_addr(kind, instr, vm)];
+	case OPERAND_N:
+		return instr->nibble3;
+	case OPERAND_NN:
+		return (instr->nibble2 << 4) | instr->nibble3;
+	case OPERAND_M:
+		return instr->nibble3 & 0x3;
+	case OPERAND_FLG:
+		return instr->nibble3 >> 2;
+	default:
+		__builtin_unreachable();
+	}
+}
+
+/*
+ * Updates Zero flag.
+ */
+static ALWAYS_INLINE void update_zero_flag(uint8_t result, struct vm_state *vm)
+{
+	if (!(result & 0xf)) {
+		vm->reg_flags |= FLAG_ZERO;
+	} else {
+		vm->reg_flags &= ~FLAG_ZERO;
+	}
+}
+
+/*
+ * Updates the Carry flag for addition ops (ADD, ADC, INC).
+ */
+static ALWAYS_INLINE void update_carry_flag(uint8_t result, struct vm_state *vm)
+{
+	if (result & 0x10) {
+		vm->reg_flags |= FLAG_CARRY;
+	} else {
+		vm->reg_flags &= ~FLAG_CARRY;
+	}
+}
+
+/*
+ * Updates the Carry flag for subtraction ops (SUB, SBB, CP, DEC).
+ * The Carry flag is called Borrow (inverse of Carry).
+ */
+static ALWAYS_INLINE void update_borrow_flag(uint8_t result, struct vm_state *vm)
+{
+	if (!(result & 0x10)) {
+		vm->reg_flags |= FLAG_CARRY;
+	} else {
+		vm->reg_flags &= ~FLAG_CARRY;
+	}
+}
+
+/*
+ * Updates the Overflow flag for basic arithmetic ops (ADD, ADC, SUB, SBB, CP).
+ * The operands and result are interpreted as signed values.
+ */
+static ALWAYS_INLINE void update_overflow_flag(int8_t sresult, struct vm_state *vm)
+{
+	if (sresult < -8 || sresult > 7) {
+		vm->reg_flags |= FLAG_OVERFLOW;
+		vm->reg_rd_flags |= RD_FLAG_V_FLAG;
+	} else {
+		vm->reg_flags &= ~FLAG_OVERFLOW;
+		vm->reg_rd_flags &= ~RD_FLAG_V_FLAG;
+	}
+}
+
+/*
+ * Interprets a nibble as a signed integer and casts to an int8.
+ */
+static ALWAYS_INLINE int8_t nibble_to_int8(uint8_t nibble)
+{
+	uint8_t sign_bit = nibble & 0x8;
+	/* Extend sign bit to full byte. */
+	uint8_t ret = nibble | ~(sign_bit - 1);
+	return (int8_t) ret;
+}
+
+/* Returns true if writing to the given address initiates a call or jump. */
+static ALWAYS_INLINE bool is_jump_address(memory_addr_t addr)
+{
+	return addr == SFR_JSR || addr == SFR_PCL;
+}
+
+/*
+ * Operation bodies. All take the same arguments so handlers can be generated
+ * from the tables; dst, cnd, src and flg are compile time constants.
+ */
+#define OPERATION_ARGS const struct vm_instruction *instr, int dst, int cnd, int src, uint8_t flg, struct vm_state *vm
+
+/*
+ * ADD operation (addition).
+ */
+static ALWAYS_INLINE void op_add(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t dst_val = vm->user_mem[dst_addr];
+	uint8_t src_val = operand_val(src, instr, vm);
+	uint8_t result = dst_val + src_val;
+	int8_t sresult = nibble_to_int8(dst_val) + nibble_to_int8(src_val);
+	vm->user_mem[dst_addr] = result & 0xf;
+	update_zero_flag(result, vm);
+	update_carry_flag(result, vm);
+	update_overflow_flag(sresult, vm);
+}
+
+/*
+ * ADC operation (addition with carry).
+ */
+static ALWAYS_INLINE void op_adc(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t dst_val = vm->user_mem[dst_addr];
+	uint8_t src_val = operand_val(src, instr, vm);
+	uint8_t result = dst_val + src_val;
+	int8_t sresult = nibble_to_int8(dst_val) + nibble_to_int8(src_val);
+	if (vm->reg_flags & FLAG_CARRY) {
+		result++;
+		sresult++;
+	}
+	vm->user_mem[dst_addr] = result & 0xf;
+	update_zero_flag(result, vm);
+	update_carry_flag(result, vm);
+	update_overflow_flag(sresult, vm);
+}
+
+/*
+ * SUB operation (subtraction).
+ */
+static ALWAYS_INLINE void op_sub(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t dst_val = vm->user_mem[dst_addr];
+	uint8_t src_val = operand_val(src, instr, vm);
+	uint8_t result = dst_val - src_val;
+	int8_t sresult = nibble_to_int8(dst_val) - nibble_to_int8(src_val);
+	vm->user_mem[dst_addr] = result & 0xf;
+	update_zero_flag(result, vm);
+	update_borrow_flag(result, vm);
+	update_overflow_flag(sresult, vm);
+}
+
+/*
+ * SBB operation (subtraction with borrow).
+ */
+static ALWAYS_INLINE void op_sbb(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t dst_val = vm->user_mem[dst_addr];
+	uint8_t src_val = operand_val(src, instr, vm);
+	uint8_t result = dst_val - src_val;
+	int8_t sresult = nibble_to_int8(dst_val) - nibble_to_int8(src_val);
+	if (!(vm->reg_flags & FLAG_CARRY)) {
+		result--;
+		sresult--;
+	}
+	vm->user_mem[dst_addr] = result & 0xf;
+	update_zero_flag(result, vm);
+	update_borrow_flag(result, vm);
+	update_overflow_flag(sresult, vm);
+}
+
+/*
+ * OR operation (bitwise OR).
+ * When src is a literal, sets the Carry flag.
+ */
+static ALWAYS_INLINE void op_or(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	result |= operand_val(src, instr, vm);
+	vm->user_mem[dst_addr] = result;
+	update_zero_flag(result, vm);
+	if (flg & OP_FLAG_UPDATE_CARRY) {
+		vm->reg_flags |= FLAG_CARRY;
+	}
+}
+
+/*
+ * AND operation (bitwise AND).
+ * When src is a literal, clears the Carry flag.
+ */
+static ALWAYS_INLINE void op_and(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	result &= operand_val(src, instr, vm);
+	vm->user_mem[dst_addr] = result;
+	update_zero_flag(result, vm);
+	if (flg & OP_FLAG_UPDATE_CARRY) {
+		vm->reg_flags &= ~FLAG_CARRY;
+	}
+}
+
+/*
+ * XOR operation (bitwise exclusive OR).
+ * When src is a literal, toggles the Carry flag.
+ */
+static ALWAYS_INLINE void op_xor(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	result ^= operand_val(src, instr, vm);
+	vm->user_mem[dst_addr] = result;
+	update_zero_flag(result, vm);
+	if (flg & OP_FLAG_UPDATE_CARRY) {
+		vm->reg_flags ^= FLAG_CARRY;
+	}
+}
+
+/*
+ * MOV operation (move).
+ * May initiate a call or jump if registers JSR or PCL are the destination.
+ */
+static ALWAYS_INLINE void op_mov(OPERATION_ARGS)
+{
+	if ((flg & OP_FLAG_CAN_RD_SFR) && maybe_handle_sfr_read(operand_addr(src, instr, vm), vm)) {
+		return;
+	}
+	if ((flg & OP_FLAG_CAN_WR_SFR) && maybe_handle_sfr_write(operand_addr(dst, instr, vm), vm)) {
+		return;
+	}
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t src_val = operand_val(src, instr, vm);
+	if (flg & OP_FLAG_DST_BYTE) {
+		vm->user_mem[dst_addr] = src_val & 0xf;
+		vm->user_mem[dst_addr + 1] = src_val >> 4;
+	} else {
+		vm->user_mem[dst_addr] = src_val;
+	}
+	if ((flg & OP_FLAG_CAN_JUMP) && is_jump_address(dst_addr)) {
+		maybe_call_or_jump(dst_addr, vm);
+	}
+}
+
+/*
+ * JR operation (jump relative).
+ */
+static ALWAYS_INLINE void op_jr(OPERATION_ARGS)
+{
+	vm->reg_pc += (int8_t) operand_val(src, instr, vm);
+}
+
+/*
+ * CP operation (compare).
+ * This is identical in behavior with the SUB operation, except that the result
+ * is not stored (only the flags are updated).
+ */
+static ALWAYS_INLINE void op_cp(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t dst_val = vm->user_mem[dst_addr];
+	uint8_t src_val = operand_val(src, instr, vm);
+	uint8_t result = dst_val - src_val;
+	int8_t sresult = nibble_to_int8(dst_val) - nibble_to_int8(src_val);
+	update_zero_flag(result, vm);
+	update_borrow_flag(result, vm);
+	update_overflow_flag(sresult, vm);
+}
+
+/*
+ * INC operation (increment).
+ * May initiate a call or jump if registers JSR or PCL are the destination.
+ */
+static ALWAYS_INLINE void op_inc(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	result++;
+	vm->user_mem[dst_addr] = result & 0xf;
+	update_zero_flag(result, vm);
+	update_carry_flag(result, vm);
+	if (is_jump_address(dst_addr)) {
+		if (vm->reg_flags & FLAG_CARRY) {
+			/* Carry over to pcm and pch. */
+			vm->reg_pcm++;
+			if (vm->reg_pcm & 0x10) {
+				vm->reg_pcm &= 0xf;
+				vm->reg_pch = (vm->reg_pch + 1) & 0xf;
+			}
+		}
+		maybe_call_or_jump(dst_addr, vm);
+	}
+}
+
+/*
+ * DEC operation (decrement).
+ * May initiate a call or jump if registers JSR or PCL are the destination.
+ */
+static ALWAYS_INLINE void op_dec(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	result--;
+	vm->user_mem[dst_addr] = result & 0xf;
+	update_zero_flag(result, vm);
+	update_borrow_flag(result, vm);
+	if (is_jump_address(dst_addr)) {
+		if (!(vm->reg_flags & FLAG_CARRY)) {
+			/* Carry over to pcm and pch. */
+			vm->reg_pcm--;
+			if (vm->reg_pcm & 0x10) {
+				vm->reg_pcm &= 0xf;
+				vm->reg_pch = (vm->reg_pch - 1) & 0xf;
+			}
+		}
+		maybe_call_or_jump(dst_addr, vm);
+	}
+}
+
+/*
+ * DSZ operation (decrement and skip next instruction if zero).
+ */
+static ALWAYS_INLINE void op_dsz(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	result--;
+	result &= 0xf;
+	vm->user_mem[dst_addr] = result;
+	if (!result) {
+		vm->reg_pc++;
+	}
+}
+
+/*
+ * EXR operation (exchange registers).
+ */
+static ALWAYS_INLINE void op_exr(OPERATION_ARGS)
+{
+	uint8_t n = operand_val(src, instr, vm);
+	if (!n) {
+		n = 0x10;
+	}
+	memory_word_t buf[PAGE_SIZE];
+	size_t size = n * sizeof(memory_word_t);
+	memcpy(buf, vm->main_regs_page, size);
+	memcpy(vm->main_regs_page, vm->alt_regs_page, size);
+	memcpy(vm->alt_regs_page, buf, size);
+}
+
+/*
+ * BIT operation (test bit).
+ */
+static ALWAYS_INLINE void op_bit(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t m = operand_val(src, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr] & (1 << m);
+	update_zero_flag(result, vm);
+}
+
+/*
+ * BSET operation (set bit).
+ */
+static ALWAYS_INLINE void op_bset(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t m = operand_val(src, instr, vm);
+	vm->user_mem[dst_addr] |= 1 << m;
+}
+
+/*
+ * BCLR operation (clear bit).
+ */
+static ALWAYS_INLINE void op_bclr(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t m = operand_val(src, instr, vm);
+	vm->user_mem[dst_addr] &= ~(1 << m);
+}
+
+/*
+ * BTG operation (toggle bit).
+ */
+static ALWAYS_INLINE void op_btg(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t m = operand_val(src, instr, vm);
+	vm->user_mem[dst_addr] ^= 1 << m;
+}
+
+/*
+ * RRC operation (rotate right through carry).
+ */
+static ALWAYS_INLINE void op_rrc(OPERATION_ARGS)
+{
+	memory_addr_t dst_addr = operand_addr(dst, instr, vm);
+	uint8_t result = vm->user_mem[dst_addr];
+	bool carry = vm->reg_flags & FLAG_CARRY;
+	if (result & 0x1) {
+		vm->reg_flags |= FLAG_CARRY;
+	} else {
+		vm->reg_flags &= ~FLAG_CARRY;
+	}
+	result >>= 1;
+	if (carry) {
+		result |= 0x8;
+	}
+	vm->user_mem[dst_addr] = result;
+	update_zero_flag(result, vm);
+}
+
+/*
+ * RET operation (return from subroutine).
+ */
+static ALWAYS_INLINE void op_ret(OPERATION_ARGS)
+{
+	if (!vm->reg_sp) {
+		vm->fault = VM_FAULT_STACK_UNDERFLOW;
+		return;
+	}
+	uint8_t n = operand_val(src, instr, vm);
+	vm->reg_r0 = n;
+	vm->reg_sp--;
+	memory_word_t ret_ptr = vm->reg_sp * 3;
+	vm->reg_pc = vm->stack[ret_ptr] | (vm->stack[ret_ptr + 1] << 4) | (vm->stack[ret_ptr + 2] << 8);
+	if (__builtin_expect(vm->call_graph != NULL, 0)) {
+		call_graph_return(vm->call_graph, vm);
+	}
+}
+
+/*
+ * SKIP operation (skip next instructions conditionally).
+ */
+static ALWAYS_INLINE void op_skip(OPERATION_ARGS)
+{
+	uint8_t cnd_flg = operand_val(cnd, instr, vm);
+	uint8_t m = operand_val(src, instr, vm);
+	if (!m) {
+		m = 4;
+	}
+	bool result = false;
+	switch (cnd_flg) {
+	case 0:
+		result = vm->reg_flags & FLAG_CARRY;
+		break;
+	case 1:
+		result = !(vm->reg_flags & FLAG_CARRY);
+		break;
+	case 2:
+		result = vm->reg_flags & FLAG_ZERO;
+		break;
+	case 3:
+		result = !(vm->reg_flags & FLAG_ZERO);
+		break;
+	}
+	if (result) {
+		vm->reg_pc += m;
+	}
+}
+
+/* One specialized handler per instruction variant, e.g. exec_ADD_RX_RY(). */
+#define INSTRUCTION_HANDLER(name, opcode, operation, fn, dst_kind, cnd_kind, src_kind, flags) \
+	static inline void exec_##name(const struct vm_instruction *instr, struct vm_state *vm) \
+	{ \
+		op_##fn(instr, OPERAND_##dst_kind, OPERAND_##cnd_kind, OPERAND_##src_kind, flags, vm); \
+	}
+FOR_EACH_INSTRUCTION(INSTRUCTION_HANDLER)
+FOR_EACH_WIDE_INSTRUCTION(INSTRUCTION_HANDLER)
+#undef INSTRUCTION_HANDLER
+
+/* Executes a pre-decoded instruction with a dense switch over its variant. */
+static ALWAYS_INLINE void exec_decoded(const struct decoded_instruction *di, struct vm_state *vm)
+{
+	switch (di->variant) {
+#define INSTRUCTION_CASE(name, ...) \
+	case VARIANT_##name: \
+		exec_##name(&di->vmi, vm); \
+		break;
+	FOR_EACH_INSTRUCTION(INSTRUCTION_CASE)
+	FOR_EACH_WIDE_INSTRUCTION(INSTRUCTION_CASE)
+#undef INSTRUCTION_CASE
+	default:
+		__builtin_unreachable();
+	}
+}
+
+#endif /* _EXEC_H */
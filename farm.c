@@ -0,0 +1,390 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs independent VM instances across worker threads.
+ *
+ * Instances are split evenly between workers up front. Each worker executes
+ * instances from the front of its own range; a worker that runs out steals
+ * the back half of the largest remaining range of another worker, so uneven
+ * run times (e.g. some instances faulting early) still keep all cores busy.
+ * In batch mode, workers take up to BATCH_MAX_LANES consecutive instances of
+ * the same program at a time and execute them in lockstep.
+ */
+
+#include "farm.h"
+
+#include "batch.h"
+#include "program.h"
+#include "vm.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Outcome of one instance. */
+struct farm_result {
+	int stop;		/* One of STOP_*. */
+	uint64_t cycles;
+	program_addr_t pc;
+	uint64_t mem_hash;	/* FNV-1a of all user memory at exit. */
+	bool failed;		/* Could not be started. */
+};
+
+/* Range of instance indices owned by a worker. */
+struct farm_queue {
+	pthread_mutex_t lock;
+	unsigned next;
+	unsigned end;
+};
+
+struct farm {
+	const struct farm_options *opts;
+	struct program **programs;
+	struct farm_result *results;
+	unsigned num_instances;
+	int num_threads;
+	struct farm_queue *queues;
+	bool batch;		/* Batching was requested and is supported. */
+};
+
+struct farm_worker {
+	struct farm *farm;
+	int id;
+	pthread_t thread;
+};
+
+uint64_t hash_memory(const struct vm_state *vm)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < sizeof(vm->user_mem); i++) {
+		hash = (hash ^ vm->user_mem[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+uint32_t get_instance_seed(const struct farm *farm, unsigned instance)
+{
+	return farm->opts->run.seed + instance % farm->opts->instances_per_program;
+}
+
+/* Creates a VM set up for an instance. Returns NULL on error. */
+struct vm_state *create_instance(struct farm *farm, unsigned instance)
+{
+	const struct program *prg = farm->programs[instance / farm->opts->instances_per_program];
+	struct program *copy = malloc(sizeof(struct program));
+	struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+	if (!copy || !vm) {
+		free(copy);
+		free(vm);
+		farm->results[instance].failed = true;
+		return NULL;
+	}
+	memcpy(copy, prg, sizeof(struct program));
+	vm_init(vm, copy); /* vm takes ownership of copy. */
+
+	struct headless_options run = farm->opts->run;
+	run.has_seed = true;
+	run.seed = get_instance_seed(farm, instance);
+	run.jit = run.jit && !farm->batch;
+	headless_setup_vm(&run, vm);
+	return vm;
+}
+
+void record_result(struct farm *farm, unsigned instance, const struct vm_state *vm, int stop)
+{
+	struct farm_result *result = &farm->results[instance];
+	result->stop = stop;
+	result->cycles = vm->cycle_count;
+	result->pc = vm->reg_pc;
+	result->mem_hash = hash_memory(vm);
+}
+
+void destroy_instance(struct vm_state *vm)
+{
+	if (vm) {
+		vm_destroy(vm);
+		free(vm);
+	}
+}
+
+void run_instance(struct farm *farm, unsigned instance)
+{
+	struct vm_state *vm = create_instance(farm, instance);
+	if (!vm) {
+		return;
+	}
+	vm_clock_t elapsed;
+	int stop = headless_execute(&farm->opts->run, vm, &elapsed);
+	record_result(farm, instance, vm, stop);
+	destroy_instance(vm);
+}
+
+/* Runs consecutive instances of the same program in lockstep, like headless_execute(). */
+void run_batch(struct farm *farm, unsigned first, unsigned count)
+{
+	struct vm_state *vms[BATCH_MAX_LANES] = {};
+	int stops[BATCH_MAX_LANES] = {};
+	bool created = true;
+	for (unsigned i = 0; i < count; i++) {
+		vms[i] = create_instance(farm, first + i);
+		created = created && vms[i];
+	}
+	struct vm_batch *batch = created ? batch_create(vms, count) : NULL;
+	if (!batch) {
+		for (unsigned i = 0; i < count; i++) {
+			farm->results[first + i].failed = true;
+		}
+		goto out;
+	}
+
+	struct timespec t_start;
+	get_time(&t_start);
+	vm_clock_t elapsed = 0;
+	for (;;) {
+		/* Lanes run the same number of cycles, so they share slices. */
+		uint64_t slice = 0;
+		for (unsigned i = 0; i < count; i++) {
+			if (stops[i]) {
+				continue;
+			}
+			stops[i] = check_stop(&farm->opts->run, vms[i], elapsed);
+			if (stops[i]) {
+				batch_stop_lane(batch, i);
+				record_result(farm, first + i, vms[i], stops[i]);
+			} else {
+				slice = get_slice_cycles(&farm->opts->run, vms[i]);
+			}
+		}
+		if (!slice) {
+			break;
+		}
+		batch_run(batch, slice);
+		batch_sync(batch);
+		elapsed = get_vm_clock(&t_start);
+	}
+
+out:
+	batch_destroy(batch);
+	for (unsigned i = 0; i < count; i++) {
+		destroy_instance(vms[i]);
+	}
+}
+
+/*
+ * Takes the next instances of the same program from a worker's own range, at
+ * most one unless batching. Returns false if empty.
+ */
+bool pop_instances(struct farm *farm, struct farm_queue *queue, unsigned *first, unsigned *count)
+{
+	unsigned per_program = farm->opts->instances_per_program;
+	pthread_mutex_lock(&queue->lock);
+	bool found = queue->next < queue->end;
+	if (found) {
+		*first = queue->next;
+		*count = farm->batch ? BATCH_MAX_LANES : 1;
+		if (*count > queue->end - *first) {
+			*count = queue->end - *first;
+		}
+		if (*count > per_program - *first % per_program) {
+			*count = per_program - *first % per_program;
+		}
+		queue->next += *count;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return found;
+}
+
+void run_instances(struct farm *farm, unsigned first, unsigned count)
+{
+	if (farm->batch) {
+		run_batch(farm, first, count);
+	} else {
+		run_instance(farm, first);
+	}
+}
+
+/* Moves the back half of the fullest other range into the worker's own. Returns false if none is left. */
+bool steal_instances(struct farm *farm, int id)
+{
+	for (;;) {
+		int victim = -1;
+		unsigned most = 0;
+		for (int i = 0; i < farm->num_threads; i++) {
+			struct farm_queue *queue = &farm->queues[i];
+			unsigned left = queue->end - queue->next; /* Racy estimate, checked under lock below. */
+			if (i != id && queue->next < queue->end && left > most) {
+				victim = i;
+				most = left;
+			}
+		}
+		if (victim < 0) {
+			return false;
+		}
+
+		struct farm_queue *from = &farm->queues[victim];
+		pthread_mutex_lock(&from->lock);
+		unsigned begin = 0, end = 0;
+		if (from->next < from->end) {
+			end = from->end;
+			begin = end - (end - from->next + 1) / 2;
+			from->end = begin;
+		}
+		pthread_mutex_unlock(&from->lock);
+		if (begin == end) {
+			continue; /* Emptied by its owner meanwhile; look again. */
+		}
+
+		struct farm_queue *own = &farm->queues[id];
+		pthread_mutex_lock(&own->lock);
+		own->next = begin;
+		own->end = end;
+		pthread_mutex_unlock(&own->lock);
+		return true;
+	}
+}
+
+void *farm_worker_main(void *arg)
+{
+	struct farm_worker *worker = arg;
+	struct farm *farm = worker->farm;
+	unsigned first, count;
+	do {
+		while (pop_instances(farm, &farm->queues[worker->id], &first, &count)) {
+			run_instances(farm, first, count);
+		}
+	} while (steal_instances(farm, worker->id));
+	return NULL;
+}
+
+void print_results(const struct farm *farm, char *const *binary_paths)
+{
+	printf("program,seed,exit_reason,cycles,final_pc,memory_hash\n");
+	for (unsigned i = 0; i < farm->num_instances; i++) {
+		const struct farm_result *result = &farm->results[i];
+		printf("%s,%u,%s,%llu,%03hx,%016llx\n",
+				binary_paths[i / farm->opts->instances_per_program],
+				get_instance_seed(farm, i),
+				result->failed ? "error" : headless_stop_reason(result->stop),
+				(unsigned long long) result->cycles,
+				result->pc,
+				(unsigned long long) result->mem_hash);
+	}
+}
+
+bool farm_run(const struct farm_options *opts, char *const *binary_paths, int num_programs)
+{
+	if (opts->batch && opts->run.paced) {
+		fprintf(stderr, "Batched instances cannot be paced.\n");
+		return false;
+	}
+	if ((uint64_t) num_programs * opts->instances_per_program > FARM_MAX_INSTANCES) {
+		fprintf(stderr, "Too many instances, at most %u can run.\n", FARM_MAX_INSTANCES);
+		return false;
+	}
+
+	struct farm farm = {.opts = opts, .batch = opts->batch};
+	if (farm.batch && !batch_supported()) {
+		fprintf(stderr, "Batches are not supported on this CPU, running instances one by one.\n");
+		farm.batch = false;
+	}
+	farm.num_instances = num_programs * opts->instances_per_program;
+	farm.num_threads = opts->num_threads > 0 ? opts->num_threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (farm.num_threads < 1) {
+		farm.num_threads = 1;
+	}
+
+	bool success = false;
+	struct farm_worker *workers = calloc(farm.num_threads, sizeof(struct farm_worker));
+	farm.programs = calloc(num_programs, sizeof(struct program *));
+	farm.results = calloc(farm.num_instances, sizeof(struct farm_result));
+	farm.queues = calloc(farm.num_threads, sizeof(struct farm_queue));
+	if (!workers || !farm.programs || !farm.results || !farm.queues) {
+		fprintf(stderr, "Failed to allocate farm state.\n");
+		goto out;
+	}
+	for (int i = 0; i < num_programs; i++) {
+		farm.programs[i] = load_program_file(binary_paths[i]);
+		if (!farm.programs[i]) {
+			goto out;
+		}
+	}
+
+	for (int i = 0; i < farm.num_threads; i++) {
+		pthread_mutex_init(&farm.queues[i].lock, NULL);
+		farm.queues[i].next = (uint64_t) farm.num_instances * i / farm.num_threads;
+		farm.queues[i].end = (uint64_t) farm.num_instances * (i + 1) / farm.num_threads;
+	}
+
+	struct timespec t_start;
+	get_time(&t_start);
+	int started = 0;
+	for (; started < farm.num_threads; started++) {
+		workers[started].farm = &farm;
+		workers[started].id = started;
+		if (pthread_create(&workers[started].thread, NULL, farm_worker_main, &workers[started])) {
+			fprintf(stderr, "Failed to start worker thread.\n");
+			break;
+		}
+	}
+	if (!started) {
+		farm_worker_main(&(struct farm_worker) {.farm = &farm, .id = 0});
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	/* With fewer threads than planned, ranges of missing workers are left over. */
+	for (int i = 0; i < farm.num_threads; i++) {
+		unsigned first, count;
+		while (pop_instances(&farm, &farm.queues[i], &first, &count)) {
+			run_instances(&farm, first, count);
+		}
+		pthread_mutex_destroy(&farm.queues[i].lock);
+	}
+	vm_clock_t elapsed = get_vm_clock(&t_start);
+
+	print_results(&farm, binary_paths);
+
+	uint64_t total_cycles = 0;
+	success = true;
+	for (unsigned i = 0; i < farm.num_instances; i++) {
+		total_cycles += farm.results[i].cycles;
+		success = success && !farm.results[i].failed;
+	}
+	double seconds = elapsed / 1e9;
+	fprintf(stderr, "Instances:            %u\n", farm.num_instances);
+	fprintf(stderr, "Threads:              %d\n", farm.num_threads);
+	fprintf(stderr, "Instructions retired: %llu\n", (unsigned long long) total_cycles);
+	fprintf(stderr, "Wall time (s):        %.6f\n", seconds);
+	fprintf(stderr, "MIPS:                 %.3f\n", seconds > 0 ? total_cycles / seconds / 1e6 : 0);
+
+out:
+	if (farm.programs) {
+		for (int i = 0; i < num_programs; i++) {
+			free(farm.programs[i]);
+		}
+	}
+	free(farm.programs);
+	free(farm.results);
+	free(farm.queues);
+	free(workers);
+	return success;
+}
@@ -0,0 +1,45 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FARM_H
+#define _FARM_H
+
+#include "headless.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Limits on worker threads and on instances across all programs. */
+#define FARM_MAX_THREADS 1024
+#define FARM_MAX_INSTANCES (1u << 24)
+
+struct farm_options {
+	struct headless_options run;	/* Options for every instance; seed is the first seed. */
+	int num_threads;		/* Worker threads; 0 for one per online CPU. */
+	unsigned instances_per_program;	/* Instances of each program, with consecutive seeds. */
+	bool batch;			/* Run instances of a program in lockstep batches, see batch.h. */
+};
+
+/*
+ * Runs many headless VM instances on a pool of worker threads and prints one
+ * CSV line of results per instance, in instance order.
+ */
+bool farm_run(const struct farm_options *opts, char *const *binary_paths, int num_programs);
+
+#endif /* _FARM_H */
@@ -0,0 +1,382 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "fastfwd.h"
+
+#include "aot.h"
+#include "exec.h"
+
+#include <string.h>
+
+const program_word_t INSN_JR_BACK_1 = 0xfff;	/* JR -1 */
+const program_word_t INSN_JR_BACK_2 = 0xffe;	/* JR -2 */
+const program_word_t INSN_JR_BACK_3 = 0xffd;	/* JR -3 */
+const program_word_t INSN_SKIP_Z_1 = 0x0f9;	/* SKIP Z,1 */
+
+/* Instructions reachable from a poll beyond which its footprint is not worked out. */
+#define FASTFWD_MAX_LOOP_LEN 64
+
+/* Cycles taken by an iteration of counted loops that does not exit, indexed by kind. */
+const uint64_t LOOP_PERIODS[] = {
+	[FASTFWD_DSZ_LOOP] = 2,
+	[FASTFWD_DEC_LOOP] = 3,
+};
+
+/* Returns the program word at pc + offset, or an invalid word beyond program memory. */
+uint16_t get_word(const struct decoded_instruction *decoded, program_addr_t pc, int offset)
+{
+	if (pc + offset >= PROGRAM_MEMORY_SIZE) {
+		return UINT16_MAX;
+	}
+	const struct vm_instruction *vmi = &decoded[pc + offset].vmi;
+	return (vmi->nibble1 << 8) | (vmi->nibble2 << 4) | vmi->nibble3;
+}
+
+uint8_t fastfwd_get_kind(const struct decoded_instruction *decoded, program_addr_t pc)
+{
+	const struct decoded_instruction *di = &decoded[pc];
+	uint8_t y = di->vmi.nibble3;
+	switch (di->variant) {
+	case VARIANT_MOV_R0_PTR:
+		if (((di->vmi.nibble2 << 4) | y) == SFR_RD_FLAGS) {
+			return FASTFWD_SYNC_POLL;
+		}
+		break;
+	case VARIANT_DSZ_RY:
+		/* The In register is reset every cycle, so it cannot count. */
+		if (y != SFR_IN && get_word(decoded, pc, 1) == INSN_JR_BACK_2) {
+			return FASTFWD_DSZ_LOOP;
+		}
+		break;
+	case VARIANT_DEC_RY:
+		/* Decrementing JSR or PCL also jumps. */
+		if (y != SFR_IN && !is_jump_address(y) &&
+				get_word(decoded, pc, 1) == INSN_SKIP_Z_1 &&
+				get_word(decoded, pc, 2) == INSN_JR_BACK_3) {
+			return FASTFWD_DEC_LOOP;
+		}
+		break;
+	case VARIANT_JR_NN:
+		if (get_word(decoded, pc, 0) == INSN_JR_BACK_1) {
+			return FASTFWD_HALT;
+		}
+		break;
+	}
+	return FASTFWD_NONE;
+}
+
+void fastfwd_init(struct vm_state *vm)
+{
+	for (int pc = 0; pc < PROGRAM_MEMORY_SIZE; pc++) {
+		vm->fastfwd_kind[pc] = fastfwd_get_kind(vm->decoded, pc);
+	}
+	vm->poll_snapshot.valid = false;
+	vm->poll_snapshot.has_footprint = false;
+}
+
+/* Adds addr to the footprint unless its bit in seen is set. SFRs are always kept, so they are left out. */
+static inline void add_addr(struct poll_snapshot *snapshot, uint64_t *seen, memory_addr_t addr)
+{
+	uint64_t bit = 1ull << (addr % 64);
+	if (addr < SFR_FIRST && !(seen[addr / 64] & bit)) {
+		seen[addr / 64] |= bit;
+		snapshot->addrs[snapshot->num_addrs++] = addr;
+	}
+}
+
+/* Adds the memory an instruction reads or writes to the footprint. Returns false if it depends on the VM state. */
+bool add_instruction(struct poll_snapshot *snapshot, uint64_t *seen, const struct decoded_instruction *di)
+{
+	uint8_t x = di->vmi.nibble2;
+	uint8_t y = di->vmi.nibble3;
+	uint8_t rg = y >> 2;
+	switch (di->variant) {
+	case VARIANT_ADD_RX_RY:
+	case VARIANT_ADC_RX_RY:
+	case VARIANT_SUB_RX_RY:
+	case VARIANT_SBB_RX_RY:
+	case VARIANT_OR_RX_RY:
+	case VARIANT_AND_RX_RY:
+	case VARIANT_XOR_RX_RY:
+	case VARIANT_MOV_RX_RY:
+		add_addr(snapshot, seen, x);
+		add_addr(snapshot, seen, y);
+		break;
+	case VARIANT_MOV_RX_N:
+		add_addr(snapshot, seen, x);
+		break;
+	case VARIANT_MOV_PTR_R0:
+	case VARIANT_MOV_R0_PTR:
+		add_addr(snapshot, seen, 0);
+		add_addr(snapshot, seen, (x << 4) | y);
+		break;
+	case VARIANT_MOV_PC_NN:
+		add_addr(snapshot, seen, SFR_PCM);
+		add_addr(snapshot, seen, SFR_PCH);
+		break;
+	case VARIANT_CP_R0_N:
+	case VARIANT_ADD_R0_N:
+	case VARIANT_OR_R0_N:
+	case VARIANT_AND_R0_N:
+	case VARIANT_XOR_R0_N:
+		add_addr(snapshot, seen, 0);
+		break;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+	case VARIANT_DSZ_RY:
+	case VARIANT_RRC_RY:
+		add_addr(snapshot, seen, y);
+		break;
+	case VARIANT_EXR_N:
+		for (int i = 0; i < (y ? y : PAGE_SIZE); i++) {
+			add_addr(snapshot, seen, i);
+			add_addr(snapshot, seen, (NUM_PAGES - 2) * PAGE_SIZE + i);
+		}
+		break;
+	case VARIANT_BIT_RG_M:
+	case VARIANT_BSET_RG_M:
+	case VARIANT_BCLR_RG_M:
+	case VARIANT_BTG_RG_M:
+		if (rg < 0x3) {
+			add_addr(snapshot, seen, rg);
+		} else {
+			/* In or Out, at either position; the other position is in the SFR page. */
+			add_addr(snapshot, seen, SFR_IN);
+			add_addr(snapshot, seen, SFR_OUT);
+		}
+		break;
+	case VARIANT_JR_NN:
+	case VARIANT_SKIP_F_M:
+		break;
+	default:
+		/* Indirect accesses and returns. */
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Works out the memory an iteration of the given number of cycles starting at
+ * the poll at pc can read or write: that of every instruction reachable from
+ * it in fewer cycles. If a call, return, computed jump or indirect access is
+ * among them, or too many instructions are, the footprint is all of memory.
+ */
+void find_footprint(struct poll_snapshot *snapshot, const struct decoded_instruction *decoded,
+		program_addr_t pc, uint64_t period)
+{
+	uint64_t seen[NUM_PAGES * PAGE_SIZE / 64] = {};
+	program_addr_t queue[FASTFWD_MAX_LOOP_LEN];	/* Every reachable address, in the order found. */
+	uint8_t depth[FASTFWD_MAX_LOOP_LEN];	/* Cycles from the poll to each queued address. */
+	int head = 0;
+	int tail = 0;
+	snapshot->has_footprint = true;
+	snapshot->footprint_pc = pc;
+	snapshot->footprint_period = period;
+	snapshot->num_addrs = 0;
+	/* Beginning a cycle resets In, besides SFRs. */
+	add_addr(snapshot, seen, SFR_IN);
+
+	queue[tail] = pc;
+	depth[tail++] = 0;
+	while (head < tail) {
+		pc = queue[head];
+		uint8_t next_depth = depth[head++] + 1;
+		const struct decoded_instruction *di = &decoded[pc];
+		program_addr_t taken;
+		int flow = get_flow(di, pc, &taken);
+		if (flow == AOT_FLOW_JUMP || !add_instruction(snapshot, seen, di)) {
+			snapshot->num_addrs = 0;
+			return;
+		}
+		if (next_depth == period) {
+			continue; /* The iteration is over by the time successors run. */
+		}
+		program_addr_t successors[2];
+		int num_successors = 0;
+		if (flow != AOT_FLOW_GOTO) {
+			successors[num_successors++] = (pc + 1) % PROGRAM_MEMORY_SIZE; /* As in vm_fetch_next(). */
+		}
+		if (flow == AOT_FLOW_GOTO || flow == AOT_FLOW_BRANCH) {
+			successors[num_successors++] = taken;
+		}
+		for (int i = 0; i < num_successors; i++) {
+			int found = 0;
+			while (found < tail && queue[found] != successors[i]) {
+				found++;
+			}
+			if (found < tail) {
+				continue;
+			}
+			if (tail == FASTFWD_MAX_LOOP_LEN) {
+				snapshot->num_addrs = 0;
+				return;
+			}
+			queue[tail] = successors[i];
+			depth[tail++] = next_depth;
+		}
+	}
+}
+
+/* Returns true if the VM is in the same state as when the snapshot was taken, as far as the iteration can tell. */
+static inline bool matches_snapshot(const struct vm_state *vm, const struct poll_snapshot *snapshot, uint64_t period)
+{
+	if (!snapshot->valid ||
+			snapshot->pc != vm->reg_pc ||
+			snapshot->t_last_user_sync != vm->t_last_user_sync ||
+			snapshot->reg_sp != vm->reg_sp ||
+			snapshot->reg_flags != vm->reg_flags ||
+			snapshot->rng.seed != vm->rng.seed) {
+		return false;
+	}
+	if (!snapshot->partial) {
+		return !memcmp(snapshot->user_mem, vm->user_mem, sizeof(vm->user_mem));
+	}
+	if (snapshot->footprint_period != period) {
+		return false; /* The iteration took another path, which may touch other memory. */
+	}
+	/* Beginning a cycle reads and writes SFRs, e.g. to fire UserSync. */
+	if (memcmp(&snapshot->user_mem[SFR_FIRST], vm->special_regs_page, PAGE_SIZE)) {
+		return false;
+	}
+	for (int i = 0; i < snapshot->num_addrs; i++) {
+		uint8_t addr = snapshot->addrs[i];
+		if (snapshot->user_mem[addr] != vm->user_mem[addr]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Skips iterations of a loop polling UserSync. If the VM state is the same as
+ * at the previous poll and UserSync did not fire since, the program went
+ * around a loop that depends on nothing but time, and will keep doing so
+ * until UserSync fires. Whole iterations are skipped up to that point. Once
+ * the length of an iteration is known, only the registers and the memory an
+ * iteration that long can touch are compared, as it cannot depend on anything
+ * else or change it.
+ */
+uint64_t skip_wait_loop(struct vm_state *vm, uint64_t max_cycles)
+{
+	struct poll_snapshot *snapshot = &vm->poll_snapshot;
+	uint64_t skipped = 0;
+	uint64_t period = vm->cycle_count - snapshot->cycle_count;
+	/* Iterations may call subroutines, which the call graph has to see. */
+	bool matched = period && !vm->call_graph && matches_snapshot(vm, snapshot, period);
+	if (matched) {
+		uint64_t limit = vm_get_batch_cycles(vm);
+		if (limit > max_cycles) {
+			limit = max_cycles;
+		}
+		skipped = limit / period * period;
+		if (skipped) {
+			vm_end_cycles(vm, skipped);
+			vm->cycles_fast_forwarded += skipped;
+		}
+	}
+
+	/*
+	 * Iterations of a loop usually take the same time, so after one that long,
+	 * only what the next one can touch is kept. Otherwise, e.g. when the loop
+	 * was entered again, all memory is. The footprint is worked out for the
+	 * first iteration at a poll and again once another length is seen to
+	 * repeat, not every time the length changes.
+	 */
+	bool same_poll = snapshot->valid && snapshot->pc == vm->reg_pc;
+	bool known_poll = snapshot->has_footprint && snapshot->footprint_pc == vm->reg_pc;
+	if (same_poll && period && period <= FASTFWD_MAX_LOOP_LEN &&
+			(!known_poll || (matched && snapshot->footprint_period != period))) {
+		find_footprint(snapshot, vm->decoded, vm->reg_pc, period);
+	}
+	snapshot->valid = true;
+	snapshot->pc = vm->reg_pc;
+	snapshot->cycle_count = vm->cycle_count;
+	snapshot->t_last_user_sync = vm->t_last_user_sync;
+	snapshot->reg_sp = vm->reg_sp;
+	snapshot->reg_flags = vm->reg_flags;
+	snapshot->rng = vm->rng;
+	snapshot->partial = same_poll && snapshot->has_footprint && snapshot->footprint_pc == vm->reg_pc &&
+			snapshot->footprint_period == period && snapshot->num_addrs;
+	if (!snapshot->partial) {
+		memcpy(snapshot->user_mem, vm->user_mem, sizeof(vm->user_mem));
+	} else {
+		memcpy(&snapshot->user_mem[SFR_FIRST], vm->special_regs_page, PAGE_SIZE);
+		for (int i = 0; i < snapshot->num_addrs; i++) {
+			snapshot->user_mem[snapshot->addrs[i]] = vm->user_mem[snapshot->addrs[i]];
+		}
+	}
+	return skipped;
+}
+
+/*
+ * Skips iterations of a counted delay loop starting at the program counter,
+ * up to the one where the counter reaches zero, which executes normally. The
+ * last skipped decrement is executed to leave the same flags as stepping.
+ */
+uint64_t skip_counted_loop(struct vm_state *vm, uint64_t max_cycles, uint64_t period)
+{
+	const struct decoded_instruction *di = &vm->decoded[vm->reg_pc];
+	uint8_t reg = di->vmi.nibble3;
+	uint8_t count = vm->main_regs_page[reg];
+	uint64_t iterations = (count ? count : 0x10) - 1;
+	uint64_t limit = vm_get_batch_cycles(vm);
+	if (limit > max_cycles) {
+		limit = max_cycles;
+	}
+	if (iterations > limit / period) {
+		iterations = limit / period;
+	}
+	if (!iterations) {
+		return 0;
+	}
+
+	vm->main_regs_page[reg] = (count - (iterations - 1)) & 0xf;
+	exec_decoded(di, vm); /* Leaves a non-zero counter, so the program counter does not change. */
+	uint64_t skipped = iterations * period;
+	vm_end_cycles(vm, skipped);
+	vm->cycles_fast_forwarded += skipped;
+	return skipped;
+}
+
+uint64_t fastfwd_cycles(struct vm_state *vm, uint64_t max_cycles)
+{
+	/*
+	 * Beginning the cycle resets In. Skipped wait loop iterations end like the
+	 * last one did, which left In as it is now, so it is put back.
+	 */
+	memory_word_t in = vm->reg_in;
+	memory_word_t in_b = vm->reg_in_b;
+	vm_begin_cycle(vm);
+	uint8_t kind = vm->fastfwd_kind[vm->reg_pc];
+	uint64_t skipped;
+	switch (kind) {
+	case FASTFWD_SYNC_POLL:
+		skipped = skip_wait_loop(vm, max_cycles);
+		if (skipped) {
+			vm->reg_in = in;
+			vm->reg_in_b = in_b;
+		}
+		return skipped;
+	case FASTFWD_DSZ_LOOP:
+	case FASTFWD_DEC_LOOP:
+		return skip_counted_loop(vm, max_cycles, LOOP_PERIODS[kind]);
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,89 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fast-forwarding over cycles whose outcome is known without executing them.
+ *
+ * Only used in VM_TIME_VIRTUAL mode, where skipped cycles can be accounted for
+ * exactly. Execution engines call fastfwd_halt(), then begin each cycle with
+ * fastfwd_begin_cycle() instead of vm_begin_cycle().
+ */
+
+#ifndef _FASTFWD_H
+#define _FASTFWD_H
+
+#include "program.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Kinds of instructions where fast-forwarding may start. */
+enum {
+	FASTFWD_NONE = 0,
+	FASTFWD_SYNC_POLL,	/* Reads RdFlags, usually in a loop waiting for UserSync. */
+	FASTFWD_DSZ_LOOP,	/* DSZ RY; JR -2 */
+	FASTFWD_DEC_LOOP,	/* DEC RY; SKIP Z,1; JR -3 */
+	FASTFWD_HALT,		/* JR -1, which loops forever. */
+};
+
+/* Returns the fast-forward kind of the instruction at pc, one of FASTFWD_*. */
+uint8_t fastfwd_get_kind(const struct decoded_instruction *decoded, program_addr_t pc);
+
+/* Classifies all addresses of the loaded program. */
+void fastfwd_init(struct vm_state *vm);
+
+/*
+ * Begins a cycle like vm_begin_cycle() and skips as many cycles as possible
+ * from it, up to max_cycles. Skipped cycles are accounted for with
+ * vm_end_cycles(). Returns the number of cycles skipped, 0 if the cycle must
+ * be executed. Only called when fastfwd_candidate() is true.
+ */
+uint64_t fastfwd_cycles(struct vm_state *vm, uint64_t max_cycles);
+
+static inline bool fastfwd_candidate(const struct vm_state *vm)
+{
+	return vm->time_mode == VM_TIME_VIRTUAL && vm->reg_pc < PROGRAM_MEMORY_SIZE &&
+			vm->fastfwd_kind[vm->reg_pc] != FASTFWD_NONE;
+}
+
+/* Begins a cycle, fast-forwarding from it if possible, see fastfwd_cycles(). */
+static inline uint64_t fastfwd_begin_cycle(struct vm_state *vm, uint64_t max_cycles)
+{
+	if (!fastfwd_candidate(vm)) {
+		vm_begin_cycle(vm);
+		return 0;
+	}
+	return fastfwd_cycles(vm, max_cycles);
+}
+
+/*
+ * Sets vm_state.halted and returns true if the program reached JR -1, which
+ * it never leaves. Checked before vm_begin_cycle(), so the halted VM is left
+ * as it was after its last counted cycle, without the cycles it would spin for.
+ */
+static inline bool fastfwd_halt(struct vm_state *vm)
+{
+	if (fastfwd_candidate(vm) && vm->fastfwd_kind[vm->reg_pc] == FASTFWD_HALT) {
+		vm->halted = true;
+	}
+	return vm->halted;
+}
+
+#endif /* _FASTFWD_H */
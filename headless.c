@@ -0,0 +1,240 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "headless.h"
+
+#include "aot.h"
+#include "callgraph.h"
+#include "clock.h"
+#include "jit.h"
+#include "profile.h"
+#include "program.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+const uint64_t HEADLESS_SLICE_CYCLES = 0x10000;	/* Cycles to run between checking stop conditions. */
+
+/* Encoding of JR -1, which jumps to itself and ends most programs. */
+const program_word_t HALT_INSTRUCTION = 0xfff;
+
+const char *STOP_REASONS[] = {
+	"none",
+	"cycle limit",
+	"time limit",
+	"halted",
+	"fault",
+};
+
+int check_stop(const struct headless_options *opts, const struct vm_state *vm, vm_clock_t elapsed)
+{
+	if (vm->fault) {
+		return STOP_FAULT;
+	}
+	if (opts->max_cycles && vm->cycle_count >= opts->max_cycles) {
+		return STOP_CYCLE_LIMIT;
+	}
+	if (opts->max_seconds > 0 && elapsed >= opts->max_seconds * 1e9) {
+		return STOP_TIME_LIMIT;
+	}
+	if (vm->prg->instructions[vm->reg_pc] == HALT_INSTRUCTION) {
+		return STOP_HALTED;
+	}
+	return STOP_NONE;
+}
+
+uint64_t get_slice_cycles(const struct headless_options *opts, const struct vm_state *vm)
+{
+	uint64_t slice = opts->paced ? 1 : HEADLESS_SLICE_CYCLES;
+	if (opts->max_cycles && opts->max_cycles - vm->cycle_count < slice) {
+		slice = opts->max_cycles - vm->cycle_count;
+	}
+	return slice;
+}
+
+void print_report(const struct vm_state *vm, int stop, vm_clock_t elapsed, uint64_t start_cycles)
+{
+	double seconds = elapsed / 1e9;
+	double mips = seconds > 0 ? (vm->cycle_count - start_cycles) / seconds / 1e6 : 0;
+	printf("Exit reason:          %s\n", headless_stop_reason(stop));
+	if (stop == STOP_FAULT) {
+		printf("Fault:                %s\n", vm_fault_message(vm->fault));
+	}
+	printf("Instructions retired: %llu\n", (unsigned long long) vm->cycle_count);
+	printf("Wall time (s):        %.6f\n", seconds);
+	if (vm->time_mode == VM_TIME_VIRTUAL) {
+		printf("Virtual time (s):     %.6f\n", vm->t_virtual / 1e9);
+		printf("Cycles skipped:       %llu\n", (unsigned long long) vm->cycles_fast_forwarded);
+	} else {
+		printf("Clock rate (Hz):      %.1f of %.1f\n", mips * 1e6, vm_get_clock_frequency(vm));
+	}
+	printf("MIPS:                 %.3f\n", mips);
+	printf("Final PC:             %03hx\n", vm->reg_pc);
+}
+
+const char *headless_stop_reason(int stop)
+{
+	return STOP_REASONS[stop];
+}
+
+void headless_setup_vm(const struct headless_options *opts, struct vm_state *vm)
+{
+	/* Only paced runs need the host clock; otherwise time is counted in cycles. */
+	vm->time_mode = opts->paced ? VM_TIME_WALL : VM_TIME_VIRTUAL;
+	if (opts->has_seed) {
+		vm->reg_random = set_rng_state(&vm->rng, opts->seed);
+	}
+	if (opts->jit) {
+		vm_enable_jit(vm);
+	}
+}
+
+/* Like headless_execute(), recording cycles to the trace or the profile unless they are NULL. */
+int execute_recorded(const struct headless_options *opts, struct vm_state *vm, struct trace_writer *trace,
+		struct profile *profile, vm_clock_t *elapsed)
+{
+	struct timespec t_start;
+	get_time(&t_start);
+	*elapsed = 0;
+	int stop;
+	while (!(stop = check_stop(opts, vm, *elapsed))) {
+		if (opts->paced) {
+			vm_clock_t t_next_cycle = vm_get_next_cycle_time(vm);
+			if (t_next_cycle > get_vm_clock(&vm->t_start)) {
+				sleep_until(&vm->t_start, t_next_cycle);
+			}
+		}
+		if (trace) {
+			trace_run(trace, vm, get_slice_cycles(opts, vm));
+		} else if (profile) {
+			profile_run(profile, vm, get_slice_cycles(opts, vm));
+		} else {
+			vm_run(vm, get_slice_cycles(opts, vm));
+		}
+		*elapsed = get_vm_clock(&t_start);
+	}
+	return stop;
+}
+
+int headless_execute(const struct headless_options *opts, struct vm_state *vm, vm_clock_t *elapsed)
+{
+	return execute_recorded(opts, vm, NULL, NULL, elapsed);
+}
+
+bool headless_run(const struct headless_options *opts, const char *binary_path)
+{
+	struct program *prg = aot_load_program(binary_path);
+	if (!prg) {
+		return false;
+	}
+
+	struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+	if (!vm) {
+		free(prg);
+		fprintf(stderr, "Failed to allocate VM state.\n");
+		return false;
+	}
+	vm_init(vm, prg); /* vm takes ownership of prg. */
+	prg = NULL;
+	headless_setup_vm(opts, vm);
+	if (opts->jit && !vm->jit) {
+		fprintf(stderr, "JIT is not supported on this platform, interpreting instead.\n");
+	}
+	if (opts->resume_path && !vm_load_snapshot(vm, opts->resume_path)) {
+		vm_destroy(vm);
+		free(vm);
+		return false;
+	}
+
+	struct trace_writer *trace = NULL;
+	if (opts->trace_path && !(trace = trace_create(opts->trace_path, opts->compress_trace))) {
+		vm_destroy(vm);
+		free(vm);
+		return false;
+	}
+
+	struct profile *profile = NULL;
+	if ((opts->profile || opts->folded_path) && !(profile = profile_create())) {
+		if (trace) {
+			trace_close(trace);
+		}
+		vm_destroy(vm);
+		free(vm);
+		return false;
+	}
+
+	if (opts->call_graph) {
+		if (!(vm->call_graph = call_graph_create(vm))) {
+			profile_destroy(profile);
+			if (trace) {
+				trace_close(trace);
+			}
+			vm_destroy(vm);
+			free(vm);
+			return false;
+		}
+		/*
+		 * Translated and compiled programs only update the cycle count between
+		 * batches, which calls are timed with, and do not report calls.
+		 */
+		if (vm->aot || vm->jit) {
+			fprintf(stderr, "The call graph needs the interpreter, interpreting instead.\n");
+		}
+		vm->aot = NULL;
+		jit_destroy(vm->jit);
+		vm->jit = NULL;
+	}
+
+	/* Resumed VMs count cycles from the snapshot; throughput is for this run only. */
+	uint64_t start_cycles = vm->cycle_count;
+	vm_clock_t elapsed;
+	int stop = execute_recorded(opts, vm, trace, profile, &elapsed);
+	print_report(vm, stop, elapsed, start_cycles);
+	bool success = !vm->fault;
+	if (profile) {
+		if (opts->profile) {
+			printf("\n");
+			profile_report(profile, vm->prg, stdout);
+		}
+		if (opts->folded_path) {
+			success = profile_write_folded(profile, opts->folded_path) && success;
+		}
+		profile_destroy(profile);
+	}
+	if (vm->call_graph) {
+		printf("\n");
+		call_graph_report(vm->call_graph, vm, stdout);
+		call_graph_destroy(vm->call_graph);
+		vm->call_graph = NULL;
+	}
+	if (trace) {
+		success = trace_close(trace) && success;
+	}
+	if (opts->save_path) {
+		success = vm_save_snapshot(vm, opts->save_path) && success;
+	}
+
+	vm_destroy(vm);
+	free(vm);
+
+	return success;
+}
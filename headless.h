@@ -0,0 +1,75 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HEADLESS_H
+#define _HEADLESS_H
+
+#include "clock.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Reasons for headless execution to end. */
+enum {
+	STOP_NONE = 0,
+	STOP_CYCLE_LIMIT,
+	STOP_TIME_LIMIT,
+	STOP_HALTED,
+	STOP_FAULT,
+};
+
+struct headless_options {
+	uint64_t max_cycles;	/* Stop after this many cycles; 0 for no limit. */
+	double max_seconds;	/* Stop after this much wall time; 0 for no limit. */
+	bool paced;		/* Honor the Clock register instead of running flat out. */
+	bool jit;		/* Compile the program to native code where supported. */
+	bool has_seed;		/* Use seed for the PRNG instead of a random one. */
+	uint32_t seed;
+	const char *resume_path;	/* Restore the VM from this snapshot before running; NULL for none. */
+	const char *save_path;	/* Save a snapshot of the VM here when done; NULL for none. */
+	const char *trace_path;	/* Record every cycle to this trace file, see trace.h; NULL for none. */
+	bool compress_trace;	/* Compress the trace with zlib. */
+	bool profile;		/* Print where cycles were spent when done, see profile.h. */
+	const char *folded_path;	/* Write cycles per call path here in folded stack format; NULL for none. */
+	bool call_graph;	/* Print calls and cycles per subroutine when done, see callgraph.h. */
+};
+
+/* Runs a program without a terminal UI and prints throughput stats. */
+bool headless_run(const struct headless_options *opts, const char *binary_path);
+
+/* Applies the options to an initialized VM before headless_execute(). */
+void headless_setup_vm(const struct headless_options *opts, struct vm_state *vm);
+
+/*
+ * Runs the VM until a stop condition is met and returns it, one of STOP_*.
+ * Wall time spent is returned in elapsed.
+ */
+int headless_execute(const struct headless_options *opts, struct vm_state *vm, vm_clock_t *elapsed);
+
+/* Returns a non-zero stop reason, one of STOP_*, if execution should end. */
+int check_stop(const struct headless_options *opts, const struct vm_state *vm, vm_clock_t elapsed);
+
+/* Returns how many cycles may run before stop conditions are checked again. */
+uint64_t get_slice_cycles(const struct headless_options *opts, const struct vm_state *vm);
+
+/* Returns a description of a stop reason. */
+const char *headless_stop_reason(int stop);
+
+#endif /* _HEADLESS_H */
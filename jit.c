@@ -0,0 +1,1364 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Basic block compiler from Voja's 4-bit instruction set to x86-64.
+ *
+ * A block starts at any PC and extends over instructions that have a native
+ * translation. It ends at JR, SKIP and DSZ (compiled as native branches to
+ * their successors), at calls, returns and writes to PCL (compiled as jumps
+ * through a table of block entries indexed by PC), or right before an
+ * instruction that is left to the interpreter: writes to Clock, Sync, WrFlags
+ * and Random. Compiled blocks are chained directly to their
+ * successors once those are compiled.
+ *
+ * Native code is entered through a stub with the VM in rdi and a cycle budget
+ * ("fuel") in rsi. Each block subtracts its length from the fuel on entry and
+ * returns when the budget would be exceeded, so timing bookkeeping can be done
+ * in bulk by the caller. The remaining fuel is returned in rax. The block
+ * table is kept in r12 and the offset of the active In register in r9. Blocks
+ * can also be entered at any of their instructions, taking fuel for the rest
+ * of the block. A block is compiled once the dispatcher reached its PC
+ * JIT_HOT_VISITS times, and the blocks it continues to along with it. Calls
+ * and returns share code that keeps native return addresses on the x86 stack,
+ * see emit_return_stub().
+ *
+ * jit_run() calls vm_begin_cycle() only at addresses that may be
+ * fast-forwarded and after writes to Clock or Sync; in between it runs native
+ * code and interprets what was not compiled. Blocks at those addresses start
+ * with a check, see emit_fastfwd_check(): counted loops are skipped inline,
+ * and native code returns to the dispatcher only when it may skip a wait for
+ * UserSync or halt, so that blocks chain through them. UserSync firing in between is
+ * only visible through RdFlags, so native code sets it before accessing
+ * RdFlags once UserSync is due, and the dispatcher accounts for the times it
+ * fired when native code returns.
+ *
+ * Flags are computed inline from those of x86 operations on nibbles shifted
+ * to the high half of a byte, where x86 Carry, Zero and Overflow match the
+ * 4-bit ones.
+ *
+ * The code buffer is never writable and executable at the same time: it is
+ * made writable to compile blocks and executable again before running them.
+ */
+
+#include "jit.h"
+
+#include "exec.h"
+#include "fastfwd.h"
+#include "ops.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_MAX_BLOCK_LEN 64	/* Maximum number of instructions in a block. */
+#define JIT_MAX_EXITS (3 * JIT_MAX_BLOCK_LEN + 3)	/* Exits of a block: fast-forward check, entry, RdFlags and side exits per instruction, and two branch targets. */
+
+const size_t JIT_BUFFER_SIZE = 4 << 20;	/* Size of the executable code buffer. */
+const size_t JIT_MAX_BLOCK_SIZE = 64 * 1024;	/* Upper bound of the native code size of a block. */
+const uint64_t JIT_MAX_FUEL = INT64_MAX;	/* Fuel is kept in a signed register. */
+const int JIT_MAX_COMPILE_AHEAD = 256;	/* Maximum successors compiled together with a block. */
+const int JIT_HOT_VISITS = 4;		/* Times the dispatcher interprets a PC before compiling it. */
+const uint8_t JIT_POLL_MISSES = 4;		/* Polls in a row fast-forwarding fails at before backing off. */
+const uint8_t JIT_MAX_POLL_BACKOFF = 7;		/* Up to 2^7 polls run natively between those the dispatcher sees. */
+
+/*
+ * Runs native code from block with up to fuel cycles, returning the fuel left.
+ * UserSync fires once no more than *sync_fuel is left, and then every
+ * sync_period cycles, each time lowering *sync_fuel by sync_period.
+ */
+typedef int64_t (__attribute__((sysv_abi)) *jit_entry_fn_t)(struct vm_state *vm, int64_t fuel, const uint8_t *block,
+	int64_t *sync_fuel, int64_t sync_period);
+
+/* Translation state of a program address. */
+enum {
+	JIT_ADDR_UNVISITED = 0,
+	JIT_ADDR_COMPILED,
+	JIT_ADDR_INTERPRETED,
+};
+
+/* How an instruction is translated. */
+enum {
+	JIT_INSN_NONE,		/* Not compiled; executed by the interpreter. */
+	JIT_INSN_PLAIN,		/* Falls through to the next instruction. */
+	JIT_INSN_SIDE_EXIT,	/* May return to the dispatcher after executing. */
+	JIT_INSN_BRANCH,	/* Ends the block with native jumps to its successors. */
+	JIT_INSN_JUMP,		/* Ends the block with a jump to a computed address. */
+};
+
+/* Arithmetic operations, which update Carry, Zero and Overflow. */
+enum {
+	ARITH_ADD,
+	ARITH_ADC,
+	ARITH_SUB,
+	ARITH_SBB,
+	ARITH_CP,
+};
+
+/* Opcodes of x86 logic operations on r/m8, r8; the forms on al use the opcode plus 2 and 4. */
+enum {
+	LOGIC_OR = 0x08,
+	LOGIC_AND = 0x20,
+	LOGIC_XOR = 0x30,
+};
+
+/* Condition codes of x86 setcc and jcc. */
+enum {
+	CC_O = 0x0,
+	CC_C = 0x2,
+	CC_NC = 0x3,
+	CC_Z = 0x4,
+	CC_L = 0xc,
+	CC_LE = 0xe,
+	CC_G = 0xf,
+};
+
+/* A jump to a block that was not compiled yet, to be patched later. */
+struct jit_patch {
+	uint32_t site;		/* Offset of the rel32 operand in the code buffer. */
+	program_addr_t target;	/* PC of the target block. */
+};
+
+/* A jump leaving native code, emitted after the block it belongs to. */
+struct jit_exit {
+	uint32_t site;		/* Offset of the rel32 operand in the code buffer. */
+	uint8_t refund;		/* Cycles taken on block entry that did not run. */
+	program_addr_t pc;	/* Where execution continues. */
+};
+
+struct jit {
+	uint8_t *buf;		/* Code buffer. */
+	bool writable;		/* The code buffer is mapped read-write instead of read-execute. */
+	size_t used;		/* Bytes used in the code buffer. */
+	size_t enter_stub;	/* Offset of the code entering a block, see jit_entry_fn_t. */
+	size_t exit_stub;	/* Offset of the code returning to the dispatcher. */
+	size_t dispatch_stub;	/* Offset of the code jumping to the address in eax. */
+	size_t call_stub;	/* Offset of the code shared by calls, see emit_call_stub(). */
+	size_t return_stub;	/* Offset of the code shared by returns, see emit_return_stub(). */
+
+	uint8_t addr_state[PROGRAM_MEMORY_SIZE];	/* One of JIT_ADDR_*. */
+	uint8_t visits[PROGRAM_MEMORY_SIZE];		/* Times the dispatcher reached each unvisited PC. */
+	uint32_t entry[PROGRAM_MEMORY_SIZE];		/* Offset of the code entering a block at each PC. */
+	uint32_t dispatch_entry[PROGRAM_MEMORY_SIZE];	/* Same past the fast-forward check, for the dispatcher. */
+	uint8_t block_len[PROGRAM_MEMORY_SIZE];		/* Number of instructions from the PC to the end of the block. */
+	/* Code computed jumps continue at for each PC: the block, or the exit stub if not compiled. */
+	const uint8_t *targets[PROGRAM_MEMORY_SIZE];
+	/* Read by native code relative to targets, see emit_fastfwd_check(). */
+	uint8_t poll_countdown[PROGRAM_MEMORY_SIZE];	/* Polls left at each PC before returning to the dispatcher. */
+	uint8_t poll_misses[PROGRAM_MEMORY_SIZE];	/* Polls in a row not fast-forwarded, see back_off_poll(). */
+	bool fastfwd;		/* The dispatcher fast-forwards, see fastfwd_candidate(). */
+
+	struct jit_patch *patches;
+	size_t num_patches;
+	size_t max_patches;
+
+	/* Successors of compiled blocks, compiled ahead while the code buffer is writable. */
+	program_addr_t ahead[PROGRAM_MEMORY_SIZE];
+	int num_ahead;
+
+	struct jit_exit exits[JIT_MAX_EXITS];	/* Of the block being compiled. */
+	int num_exits;
+
+	const struct decoded_instruction *decoded;
+	const uint8_t *fastfwd_kind;	/* Addresses the dispatcher checks for fast-forwarding, see fastfwd.h. */
+};
+
+/* Offsets of VM state fields relative to the VM pointer in rdi. */
+#define VM_OFFSET(field) ((int32_t) offsetof(struct vm_state, field))
+#define MEM_OFFSET(addr) (VM_OFFSET(user_mem) + (int32_t) (addr))
+
+/* Offsets of JIT fields relative to the block table in r12. */
+#define JIT_OFFSET(field) ((int32_t) (offsetof(struct jit, field) - offsetof(struct jit, targets)))
+
+/* x86-64 register numbers. */
+enum {
+	RAX = 0,
+	RCX = 1,
+	RDX = 2,
+};
+
+/* ModRM byte for [rdi + disp32] with the given register field. */
+#define MODRM_RDI_DISP32(reg) (0x80 | ((reg) << 3) | 0x7)
+
+void emit8(struct jit *jit, uint8_t b)
+{
+	jit->buf[jit->used++] = b;
+}
+
+void emit32(struct jit *jit, uint32_t v)
+{
+	memcpy(&jit->buf[jit->used], &v, sizeof(v));
+	jit->used += sizeof(v);
+}
+
+void emit64(struct jit *jit, uint64_t v)
+{
+	memcpy(&jit->buf[jit->used], &v, sizeof(v));
+	jit->used += sizeof(v);
+}
+
+void emit_bytes(struct jit *jit, const uint8_t *bytes, size_t size)
+{
+	memcpy(&jit->buf[jit->used], bytes, size);
+	jit->used += size;
+}
+
+#define EMIT(jit, ...) do { \
+		const uint8_t bytes[] = {__VA_ARGS__}; \
+		emit_bytes(jit, bytes, sizeof(bytes)); \
+	} while (0)
+
+/* Emits an opcode with a [rdi + disp32] operand. */
+void emit_rdi_op(struct jit *jit, const uint8_t *opcode, size_t size, int reg, int32_t disp)
+{
+	emit_bytes(jit, opcode, size);
+	emit8(jit, MODRM_RDI_DISP32(reg));
+	emit32(jit, disp);
+}
+
+/* Emits a one byte opcode with a [rdi + r9 + disp32] operand, used for the In and Out registers. */
+void emit_rdi_r9_op(struct jit *jit, uint8_t opcode, int reg, int32_t disp)
+{
+	EMIT(jit, 0x42, opcode, 0x84 | (reg << 3), 0x0f);
+	emit32(jit, disp);
+}
+
+/* movzx reg32, byte [rdi + disp] */
+void emit_load(struct jit *jit, int reg, int32_t disp)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0x0f, 0xb6}, 2, reg, disp);
+}
+
+/* mov byte [rdi + disp], reg8 (al, cl or dl) */
+void emit_store(struct jit *jit, int reg, int32_t disp)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0x88}, 1, reg, disp);
+}
+
+/* mov byte [rdi + disp], imm8 */
+void emit_store_imm(struct jit *jit, int32_t disp, uint8_t imm)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0xc6}, 1, 0, disp);
+	emit8(jit, imm);
+}
+
+/* or/and/xor/cmp byte [rdi + disp], imm8, selected by the ModRM extension. */
+void emit_group1_imm(struct jit *jit, int ext, int32_t disp, uint8_t imm)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0x80}, 1, ext, disp);
+	emit8(jit, imm);
+}
+
+/* setcc reg8 (al, cl or dl) */
+void emit_setcc(struct jit *jit, int cc, int reg)
+{
+	EMIT(jit, 0x0f, 0x90 | cc, 0xc0 | reg);
+}
+
+/* Replaces the flags in mask with those computed in dl, clobbering eax. */
+void emit_update_flags(struct jit *jit, uint8_t mask)
+{
+	emit_load(jit, RAX, VM_OFFSET(reg_flags));
+	EMIT(jit, 0x83, 0xe0, (uint8_t) ~mask);		/* and eax, imm8 */
+	EMIT(jit, 0x09, 0xd0);				/* or eax, edx */
+	emit_store(jit, RAX, VM_OFFSET(reg_flags));
+}
+
+/* Emits a rel32 jump or conditional jump and returns the offset of its operand. */
+size_t emit_jump(struct jit *jit, const uint8_t *opcode, size_t size)
+{
+	emit_bytes(jit, opcode, size);
+	size_t site = jit->used;
+	emit32(jit, 0);
+	return site;
+}
+
+void patch_jump(struct jit *jit, size_t site, size_t target)
+{
+	int32_t rel = (int32_t) (target - (site + sizeof(int32_t)));
+	memcpy(&jit->buf[site], &rel, sizeof(rel));
+}
+
+/* Emits a rel8 conditional jump over code emitted later and returns the offset of its operand. */
+size_t emit_short_jump(struct jit *jit, int cc)
+{
+	EMIT(jit, 0x70 | cc, 0);
+	return jit->used - 1;
+}
+
+void patch_short_jump(struct jit *jit, size_t site)
+{
+	jit->buf[site] = (uint8_t) (jit->used - (site + 1));
+}
+
+/* Records a jump that leaves native code, refunding unused fuel. */
+void add_exit(struct jit *jit, size_t site, int refund, program_addr_t pc)
+{
+	jit->exits[jit->num_exits++] = (struct jit_exit) {.site = site, .refund = refund, .pc = pc};
+}
+
+/* Emits the equivalent of vm->reg_random = next_rng(&vm->rng). */
+void emit_next_rng(struct jit *jit)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0x8b}, 1, RAX, VM_OFFSET(rng.seed));	/* mov eax, [seed] */
+	EMIT(jit, 0x69, 0xc0);					/* imul eax, eax, imm32 */
+	emit32(jit, (int32_t) RNG_A);
+	EMIT(jit, 0x05);					/* add eax, imm32 */
+	emit32(jit, (int32_t) RNG_C);
+	emit_rdi_op(jit, (const uint8_t[]) {0x89}, 1, RAX, VM_OFFSET(rng.seed));	/* mov [seed], eax */
+	/* seed_to_nibble() */
+	EMIT(jit, 0x89, 0xc1);					/* mov ecx, eax */
+	EMIT(jit, 0xc1, 0xe9, 0x10);				/* shr ecx, 16 */
+	EMIT(jit, 0x0f, 0xb7, 0xc0);				/* movzx eax, ax */
+	EMIT(jit, 0x31, 0xc8);					/* xor eax, ecx */
+	EMIT(jit, 0x89, 0xc1);					/* mov ecx, eax */
+	EMIT(jit, 0xc1, 0xe9, 0x08);				/* shr ecx, 8 */
+	EMIT(jit, 0x0f, 0xb6, 0xc0);				/* movzx eax, al */
+	EMIT(jit, 0x01, 0xc8);					/* add eax, ecx */
+	EMIT(jit, 0x0f, 0xb6, 0xc0);				/* movzx eax, al */
+	EMIT(jit, 0x89, 0xc1);					/* mov ecx, eax */
+	EMIT(jit, 0xc1, 0xe9, 0x04);				/* shr ecx, 4 */
+	EMIT(jit, 0x83, 0xe0, 0x0f);				/* and eax, 0xf */
+	EMIT(jit, 0x31, 0xc8);					/* xor eax, ecx */
+	emit_store(jit, RAX, MEM_OFFSET(SFR_RANDOM));
+}
+
+/* Loads eax with the address [RX:RY] of an indirect memory operand. */
+void emit_indirect_addr(struct jit *jit, const struct vm_instruction *vmi)
+{
+	emit_load(jit, RAX, MEM_OFFSET(vmi->nibble2));
+	EMIT(jit, 0xc1, 0xe0, 0x04);		/* shl eax, 4 */
+	emit_rdi_op(jit, (const uint8_t[]) {0x0a}, 1, RAX, MEM_OFFSET(vmi->nibble3));	/* or al, [y] */
+}
+
+/*
+ * Emits ADD, ADC, SUB, SBB or CP. src is used for register sources, otherwise
+ * imm is the literal operand. The Carry flag enters through the low nibble:
+ * 8 + 8 carries into the high one, and 0 - 1 borrows from it, which then has
+ * to be left out of the Zero flag.
+ */
+void emit_arith(struct jit *jit, int op, memory_addr_t dst, bool src_is_reg, memory_addr_t src, uint8_t imm)
+{
+	bool add = op == ARITH_ADD || op == ARITH_ADC;
+	emit_load(jit, RAX, MEM_OFFSET(dst));
+	EMIT(jit, 0xc1, 0xe0, 0x04);			/* shl eax, 4 */
+	if (src_is_reg) {
+		emit_load(jit, RCX, MEM_OFFSET(src));
+		EMIT(jit, 0xc1, 0xe1, 0x04);		/* shl ecx, 4 */
+	} else {
+		EMIT(jit, 0xb9);			/* mov ecx, imm32 */
+		emit32(jit, imm << 4);
+	}
+	if (op == ARITH_ADC || op == ARITH_SBB) {
+		emit_load(jit, RDX, VM_OFFSET(reg_flags));
+		EMIT(jit, 0x83, 0xe2, FLAG_CARRY);	/* and edx, FLAG_CARRY */
+		if (op == ARITH_ADC) {
+			EMIT(jit, 0xc1, 0xe2, 0x03);	/* shl edx, 3 */
+			EMIT(jit, 0x09, 0xd0);		/* or eax, edx */
+			EMIT(jit, 0x83, 0xc9, 0x08);	/* or ecx, 8 */
+		} else {
+			EMIT(jit, 0x83, 0xf2, FLAG_CARRY);	/* xor edx, FLAG_CARRY */
+			EMIT(jit, 0x09, 0xd1);		/* or ecx, edx */
+		}
+	}
+	EMIT(jit, add ? 0x00 : 0x28, 0xc8);		/* add/sub al, cl */
+	emit_setcc(jit, add ? CC_C : CC_NC, RDX);	/* The Carry flag of subtractions is the inverse of a borrow. */
+	emit_setcc(jit, CC_O, RCX);
+	if (op == ARITH_ADC || op == ARITH_SBB) {
+		EMIT(jit, 0xa8, 0xf0);			/* test al, 0xf0 */
+	}
+	EMIT(jit, 0x41, 0x0f, 0x94, 0xc0);		/* setz r8b */
+	if (op != ARITH_CP) {
+		EMIT(jit, 0xc1, 0xe8, 0x04);		/* shr eax, 4 */
+		emit_store(jit, RAX, MEM_OFFSET(dst));
+	}
+	EMIT(jit, 0x42, 0x8d, 0x14, 0x42);		/* lea edx, [rdx + r8 * 2] */
+	EMIT(jit, 0x8d, 0x14, 0x8a);			/* lea edx, [rdx + rcx * 4] */
+	emit_update_flags(jit, FLAG_CARRY | FLAG_ZERO | FLAG_OVERFLOW);
+	/* The Overflow flag is mirrored in the RdFlags register. */
+	emit_group1_imm(jit, 4, MEM_OFFSET(SFR_RD_FLAGS), (uint8_t) ~RD_FLAG_V_FLAG);	/* and */
+	EMIT(jit, 0x01, 0xc9);				/* add ecx, ecx */
+	emit_rdi_op(jit, (const uint8_t[]) {0x08}, 1, RCX, MEM_OFFSET(SFR_RD_FLAGS));	/* or [rd_flags], cl */
+}
+
+/* Emits OR, AND or XOR, one of LOGIC_*, leaving the Zero flag in bit 1 of dl. */
+void emit_logic(struct jit *jit, uint8_t opcode, memory_addr_t dst, bool src_is_reg, memory_addr_t src, uint8_t imm)
+{
+	emit_load(jit, RAX, MEM_OFFSET(dst));
+	if (src_is_reg) {
+		emit_rdi_op(jit, (const uint8_t[]) {opcode + 2}, 1, RAX, MEM_OFFSET(src));	/* op al, [src] */
+	} else {
+		EMIT(jit, opcode + 4, imm);		/* op al, imm8 */
+	}
+	emit_store(jit, RAX, MEM_OFFSET(dst));
+	emit_setcc(jit, CC_Z, RDX);
+	EMIT(jit, 0x01, 0xd2);				/* add edx, edx */
+}
+
+/* Emits INC or DEC, which update Carry and Zero. */
+void emit_inc_dec(struct jit *jit, memory_addr_t dst, bool inc)
+{
+	emit_load(jit, RAX, MEM_OFFSET(dst));
+	EMIT(jit, 0xc1, 0xe0, 0x04);			/* shl eax, 4 */
+	EMIT(jit, inc ? 0x04 : 0x2c, 0x10);		/* add/sub al, 0x10 */
+	emit_setcc(jit, inc ? CC_C : CC_NC, RDX);
+	emit_setcc(jit, CC_Z, RCX);
+	EMIT(jit, 0xc1, 0xe8, 0x04);			/* shr eax, 4 */
+	emit_store(jit, RAX, MEM_OFFSET(dst));
+	EMIT(jit, 0x8d, 0x14, 0x4a);			/* lea edx, [rdx + rcx * 2] */
+	emit_update_flags(jit, FLAG_CARRY | FLAG_ZERO);
+}
+
+/* Emits the carry or borrow of INC or DEC on a jump register into PCM and PCH, see op_inc(). */
+void emit_page_carry(struct jit *jit, bool inc)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0xf6}, 1, 0, VM_OFFSET(reg_flags));	/* test byte [flags], imm8 */
+	emit8(jit, FLAG_CARRY);
+	size_t site = emit_short_jump(jit, inc ? CC_Z : CC_Z + 1);	/* Borrow is Carry clear. */
+	emit_load(jit, RAX, MEM_OFFSET(SFR_PCH));
+	EMIT(jit, 0xc1, 0xe0, 0x04);			/* shl eax, 4 */
+	emit_rdi_op(jit, (const uint8_t[]) {0x0a}, 1, RAX, MEM_OFFSET(SFR_PCM));	/* or al, [pcm] */
+	EMIT(jit, 0x83, inc ? 0xc0 : 0xe8, 0x01);	/* add/sub eax, 1 */
+	EMIT(jit, 0x89, 0xc1);				/* mov ecx, eax */
+	EMIT(jit, 0x83, 0xe1, 0x0f);			/* and ecx, 0xf */
+	emit_store(jit, RCX, MEM_OFFSET(SFR_PCM));
+	EMIT(jit, 0xc1, 0xe8, 0x04);			/* shr eax, 4 */
+	EMIT(jit, 0x83, 0xe0, 0x0f);			/* and eax, 0xf */
+	emit_store(jit, RAX, MEM_OFFSET(SFR_PCH));
+	patch_short_jump(jit, site);
+}
+
+/* Emits a jump to the PC in eax through the block table. */
+void emit_dispatch(struct jit *jit)
+{
+	EMIT(jit, 0x25);				/* and eax, imm32 */
+	emit32(jit, PROGRAM_MEMORY_SIZE - 1);
+	emit_rdi_op(jit, (const uint8_t[]) {0x66, 0x89}, 2, RAX, VM_OFFSET(reg_pc));	/* mov word [pc], ax */
+	EMIT(jit, 0x41, 0xff, 0x24, 0xc4);		/* jmp qword [r12 + rax * 8] */
+}
+
+/* Returns true if writing the register would initiate a call or jump. */
+bool is_jump_register(uint8_t reg)
+{
+	return reg == SFR_JSR || reg == SFR_PCL;
+}
+
+/* Returns the address of the instruction following pc, as in vm_fetch_next(). */
+program_addr_t next_pc(program_addr_t pc)
+{
+	return (pc + 1) % PROGRAM_MEMORY_SIZE;
+}
+
+/*
+ * Returns true if the instruction may write the active In register, which has
+ * to be reset before the next one runs, as in vm_update_in_reg().
+ */
+bool may_write_in(const struct decoded_instruction *di)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	uint8_t nn = (vmi->nibble2 << 4) | vmi->nibble3;
+	switch (di->variant) {
+	case VARIANT_ADD_RX_RY:
+	case VARIANT_ADC_RX_RY:
+	case VARIANT_SUB_RX_RY:
+	case VARIANT_SBB_RX_RY:
+	case VARIANT_OR_RX_RY:
+	case VARIANT_AND_RX_RY:
+	case VARIANT_XOR_RX_RY:
+	case VARIANT_MOV_RX_RY:
+	case VARIANT_MOV_RX_N:
+		return vmi->nibble2 == SFR_IN;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+	case VARIANT_DSZ_RY:
+	case VARIANT_RRC_RY:
+		return vmi->nibble3 == SFR_IN;
+	case VARIANT_MOV_IND_R0:
+		return true;
+	case VARIANT_MOV_PTR_R0:
+		return nn == SFR_IN || nn == SFR_IN_B;
+	case VARIANT_EXR_N:
+		return !vmi->nibble3 || vmi->nibble3 > SFR_IN;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Classifies how the instruction at pc is translated. For branches, taken is
+ * set to the PC when the branch is taken (otherwise execution continues at
+ * next_pc(pc)). Branches whose targets fall outside program memory are left
+ * to the interpreter.
+ */
+int classify_instruction(const struct decoded_instruction *di, program_addr_t pc, program_addr_t *taken)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	uint16_t next = next_pc(pc);
+	uint8_t nn = (vmi->nibble2 << 4) | vmi->nibble3;
+	uint8_t m;
+	switch (di->variant) {
+	case VARIANT_ADD_RX_RY:
+	case VARIANT_ADC_RX_RY:
+	case VARIANT_SUB_RX_RY:
+	case VARIANT_SBB_RX_RY:
+	case VARIANT_OR_RX_RY:
+	case VARIANT_AND_RX_RY:
+	case VARIANT_XOR_RX_RY:
+	case VARIANT_MOV_R0_IND:
+	case VARIANT_MOV_PC_NN:
+	case VARIANT_CP_R0_N:
+	case VARIANT_ADD_R0_N:
+	case VARIANT_OR_R0_N:
+	case VARIANT_AND_R0_N:
+	case VARIANT_XOR_R0_N:
+	case VARIANT_EXR_N:
+	case VARIANT_BIT_RG_M:
+	case VARIANT_BSET_RG_M:
+	case VARIANT_BCLR_RG_M:
+	case VARIANT_BTG_RG_M:
+	case VARIANT_RRC_RY:
+		return JIT_INSN_PLAIN;
+	case VARIANT_MOV_RX_RY:
+	case VARIANT_MOV_RX_N:
+		return is_jump_register(vmi->nibble2) ? JIT_INSN_JUMP : JIT_INSN_PLAIN;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+		return is_jump_register(vmi->nibble3) ? JIT_INSN_JUMP : JIT_INSN_PLAIN;
+	case VARIANT_RET_R0_N:
+		return JIT_INSN_JUMP;
+	case VARIANT_MOV_IND_R0:
+		return JIT_INSN_SIDE_EXIT;
+	case VARIANT_MOV_PTR_R0:
+		/* Clock and Sync change timing, WrFlags the In/Out position, and Random reseeds. */
+		return nn == SFR_CLOCK || nn == SFR_SYNC || nn == SFR_WR_FLAGS || nn == SFR_RANDOM ?
+			JIT_INSN_NONE : JIT_INSN_PLAIN;
+	case VARIANT_MOV_R0_PTR:
+		return JIT_INSN_PLAIN;
+	case VARIANT_JR_NN:
+		*taken = next + (int8_t) nn;
+		break;
+	case VARIANT_DSZ_RY:
+		*taken = next + 1;
+		break;
+	case VARIANT_SKIP_F_M:
+		m = vmi->nibble3 & 0x3;
+		*taken = next + (m ? m : 4);
+		break;
+	default:
+		return JIT_INSN_NONE;
+	}
+	return *taken < PROGRAM_MEMORY_SIZE ? JIT_INSN_BRANCH : JIT_INSN_NONE;
+}
+
+/* Queues the block at pc to be compiled ahead of running it. */
+void compile_ahead(struct jit *jit, program_addr_t pc)
+{
+	if (jit->addr_state[pc] == JIT_ADDR_UNVISITED && jit->num_ahead < PROGRAM_MEMORY_SIZE) {
+		jit->ahead[jit->num_ahead++] = pc;
+	}
+}
+
+/* Emits a jump to the block at pc, to be patched if it is not compiled yet. */
+void emit_goto(struct jit *jit, program_addr_t pc)
+{
+	size_t site = emit_jump(jit, (const uint8_t[]) {0xe9}, 1);		/* jmp rel32 */
+	if (jit->addr_state[pc] == JIT_ADDR_COMPILED) {
+		patch_jump(jit, site, jit->entry[pc]);
+		return;
+	}
+	add_exit(jit, site, 0, pc);
+	compile_ahead(jit, pc);
+	if (jit->num_patches == jit->max_patches) {
+		size_t max_patches = jit->max_patches ? 2 * jit->max_patches : 256;
+		struct jit_patch *patches = realloc(jit->patches, max_patches * sizeof(struct jit_patch));
+		if (!patches) {
+			return; /* The jump will keep going through the dispatcher. */
+		}
+		jit->patches = patches;
+		jit->max_patches = max_patches;
+	}
+	jit->patches[jit->num_patches++] = (struct jit_patch) {.site = site, .target = pc};
+}
+
+/* Emits the translation of a non-branch instruction. Returns the side exit jump site, if any. */
+size_t emit_instruction(struct jit *jit, const struct decoded_instruction *di)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	uint8_t x = vmi->nibble2;
+	uint8_t y = vmi->nibble3;
+	uint8_t nn = (x << 4) | y;
+	uint8_t rg = y >> 2;
+	uint8_t m = y & 0x3;
+	int ext;
+	size_t site = 0;
+	switch (di->variant) {
+	case VARIANT_ADD_RX_RY:
+		emit_arith(jit, ARITH_ADD, x, true, y, 0);
+		break;
+	case VARIANT_ADC_RX_RY:
+		emit_arith(jit, ARITH_ADC, x, true, y, 0);
+		break;
+	case VARIANT_SUB_RX_RY:
+		emit_arith(jit, ARITH_SUB, x, true, y, 0);
+		break;
+	case VARIANT_SBB_RX_RY:
+		emit_arith(jit, ARITH_SBB, x, true, y, 0);
+		break;
+	case VARIANT_OR_RX_RY:
+		emit_logic(jit, LOGIC_OR, x, true, y, 0);
+		emit_update_flags(jit, FLAG_ZERO);
+		break;
+	case VARIANT_AND_RX_RY:
+		emit_logic(jit, LOGIC_AND, x, true, y, 0);
+		emit_update_flags(jit, FLAG_ZERO);
+		break;
+	case VARIANT_XOR_RX_RY:
+		emit_logic(jit, LOGIC_XOR, x, true, y, 0);
+		emit_update_flags(jit, FLAG_ZERO);
+		break;
+	case VARIANT_MOV_RX_RY:
+		emit_load(jit, RAX, MEM_OFFSET(y));
+		emit_store(jit, RAX, MEM_OFFSET(x));
+		break;
+	case VARIANT_MOV_RX_N:
+		emit_store_imm(jit, MEM_OFFSET(x), y);
+		break;
+	case VARIANT_MOV_IND_R0:
+		emit_indirect_addr(jit, vmi);
+		emit_load(jit, RCX, MEM_OFFSET(0));
+		EMIT(jit, 0x88, 0x8c, 0x07);		/* mov byte [rdi + rax + disp32], cl */
+		emit32(jit, MEM_OFFSET(0));
+		/* Writes to Clock, Sync or WrFlags change timing or the In/Out position; leave native code. */
+		EMIT(jit, 0x8d, 0x88);			/* lea ecx, [rax + disp32] */
+		emit32(jit, -SFR_CLOCK);
+		EMIT(jit, 0x83, 0xf9, SFR_WR_FLAGS - SFR_CLOCK);	/* cmp ecx, imm8 */
+		site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x86}, 2);	/* jbe rel32 */
+		break;
+	case VARIANT_MOV_R0_IND:
+		emit_indirect_addr(jit, vmi);
+		EMIT(jit, 0x0f, 0xb6, 0x84, 0x07);	/* movzx eax, byte [rdi + rax + disp32] */
+		emit32(jit, MEM_OFFSET(0));
+		emit_store(jit, RAX, MEM_OFFSET(0));
+		break;
+	case VARIANT_MOV_PTR_R0:
+		emit_load(jit, RAX, MEM_OFFSET(0));
+		emit_store(jit, RAX, MEM_OFFSET(nn));
+		break;
+	case VARIANT_MOV_R0_PTR:
+		emit_load(jit, RAX, MEM_OFFSET(nn));
+		emit_store(jit, RAX, MEM_OFFSET(0));
+		/* Reads with side effects, see maybe_handle_sfr_read(). */
+		if (nn == SFR_RD_FLAGS) {
+			EMIT(jit, 0x83, 0xe0, RD_FLAG_USER_SYNC);	/* and eax, RD_FLAG_USER_SYNC */
+			emit_rdi_op(jit, (const uint8_t[]) {0x48, 0x01}, 2, RAX, VM_OFFSET(user_sync_reads));	/* add [reads], rax */
+			emit_group1_imm(jit, 4, MEM_OFFSET(nn), (uint8_t) ~RD_FLAG_USER_SYNC);	/* and */
+		} else if (nn == SFR_RANDOM) {
+			emit_next_rng(jit);
+		} else if (nn == SFR_KEY_STATUS) {
+			emit_group1_imm(jit, 4, MEM_OFFSET(nn), (uint8_t) ~KEY_STATUS_JUST_PRESS);	/* and */
+		}
+		break;
+	case VARIANT_MOV_PC_NN:
+		emit_store_imm(jit, MEM_OFFSET(SFR_PCM), nn & 0xf);
+		emit_store_imm(jit, MEM_OFFSET(SFR_PCH), nn >> 4);
+		break;
+	case VARIANT_CP_R0_N:
+		emit_arith(jit, ARITH_CP, 0, false, 0, y);
+		break;
+	case VARIANT_ADD_R0_N:
+		emit_arith(jit, ARITH_ADD, 0, false, 0, y);
+		break;
+	case VARIANT_INC_RY:
+		emit_inc_dec(jit, y, true);
+		break;
+	case VARIANT_DEC_RY:
+		emit_inc_dec(jit, y, false);
+		break;
+	case VARIANT_OR_R0_N:
+		emit_logic(jit, LOGIC_OR, 0, false, 0, y);
+		EMIT(jit, 0x80, 0xca, FLAG_CARRY);	/* or dl, FLAG_CARRY */
+		emit_update_flags(jit, FLAG_CARRY | FLAG_ZERO);
+		break;
+	case VARIANT_AND_R0_N:
+		emit_logic(jit, LOGIC_AND, 0, false, 0, y);
+		emit_update_flags(jit, FLAG_CARRY | FLAG_ZERO);
+		break;
+	case VARIANT_XOR_R0_N:
+		emit_logic(jit, LOGIC_XOR, 0, false, 0, y);
+		emit_update_flags(jit, FLAG_ZERO);
+		emit_group1_imm(jit, 6, VM_OFFSET(reg_flags), FLAG_CARRY);	/* xor */
+		break;
+	case VARIANT_EXR_N:
+		for (int i = 0; i < (y ? y : PAGE_SIZE); i++) {
+			memory_addr_t alt = (NUM_PAGES - 2) * PAGE_SIZE + i;
+			emit_load(jit, RAX, MEM_OFFSET(i));
+			emit_load(jit, RCX, MEM_OFFSET(alt));
+			emit_store(jit, RCX, MEM_OFFSET(i));
+			emit_store(jit, RAX, MEM_OFFSET(alt));
+		}
+		break;
+	case VARIANT_BIT_RG_M:
+		/* The active In register is at r9 from SFR_IN. */
+		if (rg < 0x3) {
+			emit_rdi_op(jit, (const uint8_t[]) {0xf6}, 1, 0, MEM_OFFSET(rg));	/* test byte [rg], imm8 */
+		} else {
+			emit_rdi_r9_op(jit, 0xf6, 0, MEM_OFFSET(SFR_IN));
+		}
+		emit8(jit, 1 << m);
+		emit_setcc(jit, CC_Z, RDX);
+		EMIT(jit, 0x01, 0xd2);			/* add edx, edx */
+		emit_update_flags(jit, FLAG_ZERO);
+		break;
+	case VARIANT_BSET_RG_M:
+	case VARIANT_BCLR_RG_M:
+	case VARIANT_BTG_RG_M:
+		/* or, and or xor with the bit; the active Out register is at r9 from SFR_OUT. */
+		ext = di->variant == VARIANT_BSET_RG_M ? 1 : di->variant == VARIANT_BCLR_RG_M ? 4 : 6;
+		if (rg < 0x3) {
+			emit_rdi_op(jit, (const uint8_t[]) {0x80}, 1, ext, MEM_OFFSET(rg));
+		} else {
+			emit_rdi_r9_op(jit, 0x80, ext, MEM_OFFSET(SFR_OUT));
+		}
+		emit8(jit, di->variant == VARIANT_BCLR_RG_M ? ~(1 << m) : 1 << m);
+		break;
+	case VARIANT_RRC_RY:
+		emit_load(jit, RAX, MEM_OFFSET(y));
+		emit_load(jit, RCX, VM_OFFSET(reg_flags));
+		EMIT(jit, 0x83, 0xe1, FLAG_CARRY);	/* and ecx, FLAG_CARRY */
+		EMIT(jit, 0xc1, 0xe1, 0x04);		/* shl ecx, 4 */
+		EMIT(jit, 0x09, 0xc8);			/* or eax, ecx */
+		EMIT(jit, 0xd1, 0xe8);			/* shr eax, 1 */
+		emit_setcc(jit, CC_C, RDX);
+		emit_store(jit, RAX, MEM_OFFSET(y));
+		EMIT(jit, 0x84, 0xc0);			/* test al, al */
+		emit_setcc(jit, CC_Z, RCX);
+		EMIT(jit, 0x8d, 0x14, 0x4a);		/* lea edx, [rdx + rcx * 2] */
+		emit_update_flags(jit, FLAG_CARRY | FLAG_ZERO);
+		break;
+	}
+	return site;
+}
+
+/* Emits a jump to the address in PCH, PCM and reg, see maybe_call_or_jump(). */
+void emit_jump_through(struct jit *jit, uint8_t reg)
+{
+	emit_load(jit, RAX, MEM_OFFSET(SFR_PCH));
+	EMIT(jit, 0xc1, 0xe0, 0x08);			/* shl eax, 8 */
+	emit_load(jit, RCX, MEM_OFFSET(SFR_PCM));
+	EMIT(jit, 0xc1, 0xe1, 0x04);			/* shl ecx, 4 */
+	EMIT(jit, 0x09, 0xc8);				/* or eax, ecx */
+	emit_rdi_op(jit, (const uint8_t[]) {0x0a}, 1, RAX, MEM_OFFSET(reg));	/* or al, [reg] */
+	emit_dispatch(jit);
+}
+
+/*
+ * Emits a call, a jump through PCL or a return, which continue at a computed
+ * address through the block table. Returns the site of a jump taken before
+ * executing the instruction, for the interpreter to report stack faults.
+ */
+size_t emit_computed_jump(struct jit *jit, const struct decoded_instruction *di, program_addr_t pc)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	uint8_t x = vmi->nibble2;
+	uint8_t y = vmi->nibble3;
+	size_t site = 0;
+	if (di->variant == VARIANT_RET_R0_N) {
+		emit_group1_imm(jit, 7, VM_OFFSET(reg_sp), 0);	/* cmp byte [sp], 0 */
+		site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2);	/* je rel32 */
+		emit_store_imm(jit, MEM_OFFSET(0), y);
+		patch_jump(jit, emit_jump(jit, (const uint8_t[]) {0xe9}, 1), jit->return_stub);	/* jmp rel32 */
+		return site;
+	}
+
+	uint8_t reg = di->variant == VARIANT_INC_RY || di->variant == VARIANT_DEC_RY ? y : x;
+	if (reg == SFR_JSR) {
+		emit_group1_imm(jit, 7, VM_OFFSET(reg_sp), MAX_STACK_DEPTH);	/* cmp byte [sp], imm8 */
+		site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2);	/* je rel32 */
+	}
+	switch (di->variant) {
+	case VARIANT_MOV_RX_RY:
+		emit_load(jit, RAX, MEM_OFFSET(y));
+		emit_store(jit, RAX, MEM_OFFSET(x));
+		break;
+	case VARIANT_MOV_RX_N:
+		emit_store_imm(jit, MEM_OFFSET(x), y);
+		break;
+	case VARIANT_INC_RY:
+		emit_inc_dec(jit, y, true);
+		emit_page_carry(jit, true);
+		break;
+	case VARIANT_DEC_RY:
+		emit_inc_dec(jit, y, false);
+		emit_page_carry(jit, false);
+		break;
+	}
+	if (reg == SFR_JSR) {
+		program_addr_t ret = next_pc(pc);
+		compile_ahead(jit, ret);
+		EMIT(jit, 0xba);			/* mov edx, imm32 */
+		emit32(jit, (ret & 0xf) | (ret & 0xf0) << 4 | (ret & 0xf00) << 8);
+		patch_jump(jit, emit_jump(jit, (const uint8_t[]) {0xe8}, 1), jit->call_stub);	/* call rel32 */
+		/* Returns here with the popped return address in eax, see emit_return_stub(). */
+		EMIT(jit, 0x3d);			/* cmp eax, imm32 */
+		emit32(jit, ret);
+		patch_jump(jit, emit_jump(jit, (const uint8_t[]) {0x0f, 0x85}, 2), jit->dispatch_stub);	/* jne rel32 */
+		emit_goto(jit, ret);
+	} else {
+		emit_jump_through(jit, reg);
+	}
+	return site;
+}
+
+/* Emits the code shared by calls, which pushes the return address in edx, a nibble per byte, and jumps through JSR. */
+void emit_call_stub(struct jit *jit)
+{
+	emit_load(jit, RAX, VM_OFFSET(reg_sp));
+	EMIT(jit, 0x8d, 0x04, 0x40);			/* lea eax, [rax + rax * 2] */
+	for (int i = 0; i < 3; i++) {
+		if (i) {
+			EMIT(jit, 0xc1, 0xea, 0x08);	/* shr edx, 8 */
+		}
+		EMIT(jit, 0x88, 0x94, 0x07);		/* mov byte [rdi + rax + disp32], dl */
+		emit32(jit, MEM_OFFSET(PAGE_SIZE + i));
+	}
+	emit_rdi_op(jit, (const uint8_t[]) {0xfe}, 1, 0, VM_OFFSET(reg_sp));	/* inc byte [sp] */
+	emit_jump_through(jit, SFR_JSR);
+}
+
+/*
+ * Emits the code shared by returns, which pops the return address and jumps
+ * to it. Calls from native code push the x86 return address on the native
+ * stack, which is then returned to so that the CPU predicts the jump; the
+ * call site checks the address matches, as the program can change its stack.
+ * The native stack is not deeper than the VM one, as pushes and pops of the
+ * former come with those of the latter, and it is dropped on exit.
+ */
+void emit_return_stub(struct jit *jit)
+{
+	emit_rdi_op(jit, (const uint8_t[]) {0xfe}, 1, 1, VM_OFFSET(reg_sp));	/* dec byte [sp] */
+	emit_load(jit, RCX, VM_OFFSET(reg_sp));
+	EMIT(jit, 0x8d, 0x0c, 0x49);			/* lea ecx, [rcx + rcx * 2] */
+	EMIT(jit, 0x0f, 0xb6, 0x84, 0x0f);		/* movzx eax, byte [rdi + rcx + disp32] */
+	emit32(jit, MEM_OFFSET(PAGE_SIZE + 2));
+	EMIT(jit, 0xc1, 0xe0, 0x08);			/* shl eax, 8 */
+	EMIT(jit, 0x0f, 0xb6, 0x94, 0x0f);		/* movzx edx, byte [rdi + rcx + disp32] */
+	emit32(jit, MEM_OFFSET(PAGE_SIZE + 1));
+	EMIT(jit, 0xc1, 0xe2, 0x04);			/* shl edx, 4 */
+	EMIT(jit, 0x09, 0xd0);				/* or eax, edx */
+	EMIT(jit, 0x0a, 0x84, 0x0f);			/* or al, [rdi + rcx + disp32] */
+	emit32(jit, MEM_OFFSET(PAGE_SIZE));
+	EMIT(jit, 0x48, 0x39, 0xec);			/* cmp rsp, rbp */
+	patch_jump(jit, emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2), jit->dispatch_stub);	/* je rel32 */
+	EMIT(jit, 0xc3);				/* ret */
+}
+
+/* Emits a branch instruction and the jumps to its successors. */
+void emit_branch(struct jit *jit, const struct decoded_instruction *di, program_addr_t next, program_addr_t taken)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	size_t site;
+	switch (di->variant) {
+	case VARIANT_JR_NN:
+		emit_goto(jit, taken);
+		return;
+	case VARIANT_DSZ_RY:
+		emit_load(jit, RAX, MEM_OFFSET(vmi->nibble3));
+		EMIT(jit, 0xff, 0xc8);			/* dec eax */
+		EMIT(jit, 0x83, 0xe0, 0x0f);		/* and eax, 0xf */
+		emit_store(jit, RAX, MEM_OFFSET(vmi->nibble3));
+		site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2);	/* jz rel32 */
+		break;
+	case VARIANT_SKIP_F_M:
+		/* Conditions are C, NC, Z and NZ. */
+		emit_rdi_op(jit, (const uint8_t[]) {0xf6}, 1, 0, VM_OFFSET(reg_flags));	/* test byte [flags], imm8 */
+		emit8(jit, (vmi->nibble3 >> 3) ? FLAG_ZERO : FLAG_CARRY);
+		if ((vmi->nibble3 >> 2) & 0x1) {
+			site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2);	/* jz rel32 */
+		} else {
+			site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x85}, 2);	/* jnz rel32 */
+		}
+		break;
+	default:
+		return;
+	}
+	emit_goto(jit, next);
+	patch_jump(jit, site, jit->used);
+	emit_goto(jit, taken);
+}
+
+/* Emits code returning to the dispatcher at pc after refunding unused fuel. */
+void emit_exit(struct jit *jit, int refund, program_addr_t pc)
+{
+	if (refund) {
+		EMIT(jit, 0x48, 0x83, 0xc6, refund);	/* add rsi, imm8 */
+	}
+	emit_rdi_op(jit, (const uint8_t[]) {0x66, 0xc7}, 2, 0, VM_OFFSET(reg_pc));	/* mov word [pc], imm16 */
+	EMIT(jit, pc & 0xff, pc >> 8);
+	size_t site = emit_jump(jit, (const uint8_t[]) {0xe9}, 1);		/* jmp rel32 */
+	patch_jump(jit, site, jit->exit_stub);
+}
+
+/* Emits the check taking fuel for len instructions on entering a block at pc. */
+void emit_take_fuel(struct jit *jit, int len, program_addr_t pc)
+{
+	EMIT(jit, 0x48, 0x83, 0xee, len);		/* sub rsi, imm8 */
+	add_exit(jit, emit_jump(jit, (const uint8_t[]) {0x0f, 0x8c}, 2), len, pc);	/* jl rel32 */
+}
+
+/*
+ * Emits the check at the start of a block at an address the dispatcher may
+ * fast-forward from, which blocks chain into. Counted loops are skipped
+ * inline up to their last iteration, like skip_counted_loop(), if there is
+ * fuel for it. A UserSync poll returns to the dispatcher once it has been
+ * reached poll_countdown times without UserSync pending, as skip_wait_loop()
+ * only skips loops that see no UserSync, and JR -1 returns
+ * for it to halt. The checks only run when the dispatcher fast-forwards.
+ */
+void emit_fastfwd_check(struct jit *jit, program_addr_t pc)
+{
+	uint8_t kind = jit->fastfwd_kind[pc];
+	if (kind == FASTFWD_NONE) {
+		return;
+	}
+	EMIT(jit, 0x41, 0x80, 0xbc, 0x24);		/* cmp byte [r12 + disp32], imm8 */
+	emit32(jit, JIT_OFFSET(fastfwd));
+	emit8(jit, 0);
+	size_t site = emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2);	/* je rel32 */
+	uint8_t y = jit->decoded[pc].vmi.nibble3;
+	switch (kind) {
+	case FASTFWD_SYNC_POLL: {
+		EMIT(jit, 0x4c, 0x39, 0xd6);		/* cmp rsi, r10 */
+		size_t due = emit_short_jump(jit, CC_LE);
+		emit_rdi_op(jit, (const uint8_t[]) {0xf6}, 1, 0, MEM_OFFSET(SFR_RD_FLAGS));	/* test byte [rd_flags], imm8 */
+		emit8(jit, RD_FLAG_USER_SYNC);
+		size_t pending = emit_short_jump(jit, CC_Z + 1);
+		EMIT(jit, 0x41, 0xfe, 0x8c, 0x24);	/* dec byte [r12 + disp32] */
+		emit32(jit, JIT_OFFSET(poll_countdown[pc]));
+		add_exit(jit, emit_jump(jit, (const uint8_t[]) {0x0f, 0x84}, 2), 0, pc);	/* jz rel32 */
+		patch_short_jump(jit, due);
+		patch_short_jump(jit, pending);
+		break;
+	}
+	case FASTFWD_DSZ_LOOP:
+	case FASTFWD_DEC_LOOP:
+		/* Iterations before the last one: (RY - 1) & 0xf, counting 0 as 16. */
+		emit_load(jit, RAX, MEM_OFFSET(y));
+		EMIT(jit, 0xff, 0xc8);			/* dec eax */
+		EMIT(jit, 0x83, 0xe0, 0x0f);		/* and eax, 0xf */
+		size_t last = emit_short_jump(jit, CC_Z);
+		if (kind == FASTFWD_DSZ_LOOP) {
+			EMIT(jit, 0x8d, 0x0c, 0x00);	/* lea ecx, [rax + rax] */
+		} else {
+			EMIT(jit, 0x8d, 0x0c, 0x40);	/* lea ecx, [rax + rax * 2] */
+		}
+		EMIT(jit, 0x48, 0x39, 0xce);		/* cmp rsi, rcx */
+		size_t short_fuel = emit_short_jump(jit, CC_L);
+		EMIT(jit, 0x48, 0x29, 0xce);		/* sub rsi, rcx */
+		emit_rdi_op(jit, (const uint8_t[]) {0x48, 0x01}, 2, RCX, VM_OFFSET(cycles_fast_forwarded));	/* add [skipped], rcx */
+		emit_store_imm(jit, MEM_OFFSET(y), 1);
+		if (kind == FASTFWD_DEC_LOOP) {
+			/* Flags of the last skipped decrement, from 2 to 1. */
+			emit_group1_imm(jit, 4, VM_OFFSET(reg_flags), (uint8_t) ~FLAG_ZERO);	/* and */
+			emit_group1_imm(jit, 1, VM_OFFSET(reg_flags), FLAG_CARRY);		/* or */
+		}
+		patch_short_jump(jit, short_fuel);
+		patch_short_jump(jit, last);
+		break;
+	case FASTFWD_HALT:
+		add_exit(jit, emit_jump(jit, (const uint8_t[]) {0xe9}, 1), 0, pc);	/* jmp rel32 */
+		break;
+	}
+	patch_jump(jit, site, jit->used);
+}
+
+/*
+ * Emits the equivalent of vm_update_user_sync() before an instruction that
+ * may access RdFlags, setting UserSync if it fired since it was last set. The
+ * instruction is the one taking the last cycles of the block, sync_fuel is in
+ * r10 and sync_period in r11.
+ */
+void emit_sync_check(struct jit *jit, int cycles)
+{
+	EMIT(jit, 0x48, 0x8d, 0x46, cycles);		/* lea rax, [rsi + imm8] */
+	EMIT(jit, 0x4c, 0x39, 0xd0);			/* cmp rax, r10 */
+	size_t site = emit_short_jump(jit, CC_G);
+	emit_group1_imm(jit, 1, MEM_OFFSET(SFR_RD_FLAGS), RD_FLAG_USER_SYNC);	/* or */
+	size_t loop = jit->used;
+	EMIT(jit, 0x4d, 0x29, 0xda);			/* sub r10, r11 */
+	EMIT(jit, 0x4c, 0x39, 0xd0);			/* cmp rax, r10 */
+	EMIT(jit, 0x70 | CC_LE, (uint8_t) (loop - (jit->used + 2)));	/* jle loop */
+	patch_short_jump(jit, site);
+}
+
+/* Emits the equivalent of vm_update_in_reg(). */
+void emit_reset_in(struct jit *jit)
+{
+	emit_rdi_r9_op(jit, 0xc6, 0, MEM_OFFSET(SFR_IN));	/* mov byte [rdi + r9 + disp32], imm8 */
+	emit8(jit, 0xf);
+}
+
+/* Maps the code buffer read-write to emit code, or read-execute to run it. Returns false on error. */
+bool set_writable(struct jit *jit, bool writable)
+{
+	if (jit->writable == writable) {
+		return true;
+	}
+	if (mprotect(jit->buf, JIT_BUFFER_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC)) {
+		perror("mprotect");
+		return false;
+	}
+	jit->writable = writable;
+	return true;
+}
+
+/* Discards all compiled code and emits the entry and exit stubs. The code buffer must be writable. */
+void jit_flush(struct jit *jit)
+{
+	memset(jit->addr_state, JIT_ADDR_UNVISITED, sizeof(jit->addr_state));
+	memset(jit->visits, 0, sizeof(jit->visits));
+	jit->num_patches = 0;
+	jit->used = 0;
+	memset(jit->poll_countdown, 1, sizeof(jit->poll_countdown));
+	memset(jit->poll_misses, 0, sizeof(jit->poll_misses));
+
+	jit->enter_stub = jit->used;
+	EMIT(jit, 0x41, 0x54);				/* push r12 */
+	EMIT(jit, 0x49, 0xbc);				/* mov r12, imm64 */
+	emit64(jit, (uint64_t) (uintptr_t) jit->targets);
+	/* Offset of the active In register, constant while in native code: r9 = (wr_flags & 2) * 0x78. */
+	emit_rdi_op(jit, (const uint8_t[]) {0x44, 0x0f, 0xb6}, 3, 1, MEM_OFFSET(SFR_WR_FLAGS));	/* movzx r9d, byte [wr_flags] */
+	EMIT(jit, 0x41, 0x83, 0xe1, WR_FLAG_IN_OUT_POS);	/* and r9d, imm8 */
+	EMIT(jit, 0x45, 0x6b, 0xc9, (SFR_IN_B - SFR_IN) / WR_FLAG_IN_OUT_POS);	/* imul r9d, r9d, imm8 */
+	EMIT(jit, 0x55);				/* push rbp */
+	EMIT(jit, 0x51);				/* push rcx */
+	EMIT(jit, 0x48, 0x89, 0xe5);			/* mov rbp, rsp */
+	EMIT(jit, 0x4c, 0x8b, 0x11);			/* mov r10, [rcx] */
+	EMIT(jit, 0x4d, 0x89, 0xc3);			/* mov r11, r8 */
+	EMIT(jit, 0xff, 0xe2);				/* jmp rdx */
+
+	jit->exit_stub = jit->used;
+	EMIT(jit, 0x48, 0x89, 0xec);			/* mov rsp, rbp */
+	EMIT(jit, 0x59);				/* pop rcx */
+	EMIT(jit, 0x4c, 0x89, 0x11);			/* mov [rcx], r10 */
+	EMIT(jit, 0x48, 0x89, 0xf0);			/* mov rax, rsi */
+	EMIT(jit, 0x5d);				/* pop rbp */
+	EMIT(jit, 0x41, 0x5c);				/* pop r12 */
+	EMIT(jit, 0xc3);				/* ret */
+
+	jit->dispatch_stub = jit->used;
+	emit_dispatch(jit);
+
+	jit->call_stub = jit->used;
+	emit_call_stub(jit);
+	jit->return_stub = jit->used;
+	emit_return_stub(jit);
+
+	for (int pc = 0; pc < PROGRAM_MEMORY_SIZE; pc++) {
+		jit->targets[pc] = &jit->buf[jit->exit_stub];
+	}
+}
+
+/* Compiles the block starting at pc. */
+void compile_block(struct jit *jit, program_addr_t start)
+{
+	const struct decoded_instruction *insns[JIT_MAX_BLOCK_LEN];
+	int kinds[JIT_MAX_BLOCK_LEN];
+	program_addr_t taken = 0;
+	program_addr_t pc = start;
+	int len = 0;
+	while (len < JIT_MAX_BLOCK_LEN) {
+		if (len && jit->fastfwd_kind[pc] != FASTFWD_NONE) {
+			break; /* Starts a block with a fast-forward check. */
+		}
+		const struct decoded_instruction *di = &jit->decoded[pc];
+		int kind = classify_instruction(di, pc, &taken);
+		if (kind == JIT_INSN_NONE) {
+			break;
+		}
+		insns[len] = di;
+		kinds[len] = kind;
+		len++;
+		if (kind == JIT_INSN_BRANCH || kind == JIT_INSN_JUMP) {
+			break;
+		}
+		pc = next_pc(pc);
+	}
+	if (!len || !set_writable(jit, true)) {
+		jit->addr_state[start] = JIT_ADDR_INTERPRETED;
+		return;
+	}
+
+	if (jit->used + JIT_MAX_BLOCK_SIZE > JIT_BUFFER_SIZE) {
+		jit_flush(jit);
+	}
+
+	size_t entries[JIT_MAX_BLOCK_LEN];
+	size_t checked;
+	size_t bodies[JIT_MAX_BLOCK_LEN];
+	jit->num_exits = 0;
+
+	/* Take fuel for the whole block, or go back to the dispatcher. */
+	entries[0] = jit->used;
+	emit_fastfwd_check(jit, start);
+	checked = jit->used;
+	emit_take_fuel(jit, len, start);
+
+	pc = start;
+	for (int i = 0; i < len; i++) {
+		if (!i || may_write_in(insns[i - 1])) {
+			/* In is reset at the start of every cycle, but only changes when written. */
+			emit_reset_in(jit);
+		}
+
+		bodies[i] = jit->used;
+		if (may_access_rd_flags(insns[i])) {
+			emit_sync_check(jit, len - i);
+		}
+		size_t site;
+		if (kinds[i] == JIT_INSN_BRANCH) {
+			emit_branch(jit, insns[i], next_pc(pc), taken);
+		} else if (kinds[i] == JIT_INSN_JUMP) {
+			if ((site = emit_computed_jump(jit, insns[i], pc))) {
+				add_exit(jit, site, len - i, pc);
+			}
+		} else if ((site = emit_instruction(jit, insns[i]))) {
+			add_exit(jit, site, len - i - 1, next_pc(pc));
+		}
+		pc = next_pc(pc);
+	}
+	if (kinds[len - 1] != JIT_INSN_BRANCH && kinds[len - 1] != JIT_INSN_JUMP) {
+		emit_goto(jit, pc);
+	}
+
+	/*
+	 * The block can also be entered at the following instructions, taking
+	 * fuel for the rest of it. Otherwise runs that end in the middle of a
+	 * block would start new blocks at every address.
+	 */
+	for (int i = 1; i < len; i++) {
+		entries[i] = jit->used;
+		emit_take_fuel(jit, len - i, (start + i) % PROGRAM_MEMORY_SIZE);
+		emit_reset_in(jit);
+		patch_jump(jit, emit_jump(jit, (const uint8_t[]) {0xe9}, 1), bodies[i]);	/* jmp rel32 */
+	}
+
+	for (int i = 0; i < jit->num_exits; i++) {
+		patch_jump(jit, jit->exits[i].site, jit->used);
+		emit_exit(jit, jit->exits[i].refund, jit->exits[i].pc);
+	}
+
+	for (int i = 0; i < len; i++) {
+		pc = (start + i) % PROGRAM_MEMORY_SIZE;
+		if (i && jit->addr_state[pc] == JIT_ADDR_COMPILED) {
+			continue; /* Keep the entry of an earlier block. */
+		}
+		jit->addr_state[pc] = JIT_ADDR_COMPILED;
+		jit->entry[pc] = entries[i];
+		jit->dispatch_entry[pc] = i ? entries[i] : checked;
+		jit->block_len[pc] = len - i;
+		jit->targets[pc] = &jit->buf[entries[i]];
+	}
+
+	/* Chain blocks that were waiting for this one. */
+	size_t kept = 0;
+	for (size_t i = 0; i < jit->num_patches; i++) {
+		program_addr_t target = jit->patches[i].target;
+		if (jit->addr_state[target] == JIT_ADDR_COMPILED) {
+			patch_jump(jit, jit->patches[i].site, jit->entry[target]);
+		} else {
+			jit->patches[kept++] = jit->patches[i];
+		}
+	}
+	jit->num_patches = kept;
+}
+
+/*
+ * Compiles the block starting at pc and the blocks it continues to, so that
+ * the code buffer does not have to be made writable for each of them.
+ */
+void jit_compile(struct jit *jit, program_addr_t pc)
+{
+	jit->num_ahead = 0;
+	compile_block(jit, pc);
+	for (int i = 0; i < JIT_MAX_COMPILE_AHEAD && jit->num_ahead; i++) {
+		pc = jit->ahead[--jit->num_ahead];
+		if (jit->addr_state[pc] == JIT_ADDR_UNVISITED) {
+			compile_block(jit, pc);
+		}
+	}
+}
+
+struct jit *jit_create(const struct vm_state *vm)
+{
+	struct jit *jit = calloc(1, sizeof(struct jit));
+	if (!jit) {
+		return NULL;
+	}
+	jit->buf = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->buf == MAP_FAILED) {
+		free(jit);
+		return NULL;
+	}
+	jit->writable = true;
+	jit->decoded = vm->decoded;
+	jit->fastfwd_kind = vm->fastfwd_kind;
+	jit_flush(jit);
+	return jit;
+}
+
+void jit_destroy(struct jit *jit)
+{
+	if (!jit) {
+		return;
+	}
+	munmap(jit->buf, JIT_BUFFER_SIZE);
+	free(jit->patches);
+	free(jit);
+}
+
+/*
+ * Runs up to fuel cycles from one begun by the caller, natively where
+ * compiled and interpreting the rest. Returns early at addresses the
+ * dispatcher has to check for fast-forwarding and after writes to Clock or
+ * Sync, see vm_end_cycles(). Returns the number of cycles run.
+ */
+uint64_t run_compiled(struct jit *jit, struct vm_state *vm, uint64_t fuel, struct vm_sync *sync)
+{
+	const memory_word_t clock = vm->reg_clock;
+	const memory_word_t reg_sync = vm->reg_sync;
+	jit_entry_fn_t enter = (jit_entry_fn_t) (void *) &jit->buf[jit->enter_stub];
+	uint64_t executed = 0;
+	while (executed < fuel && !vm->fault) {
+		vm_apply_sync(sync, vm, executed);
+		program_addr_t pc = vm->reg_pc;
+		bool valid_pc = pc < PROGRAM_MEMORY_SIZE;
+		if (executed && valid_pc && jit->fastfwd_kind[pc] != FASTFWD_NONE) {
+			break; /* For the caller to fast-forward. */
+		}
+		if (valid_pc && jit->addr_state[pc] == JIT_ADDR_UNVISITED && ++jit->visits[pc] >= JIT_HOT_VISITS) {
+			jit_compile(jit, pc);
+		}
+
+		uint64_t left = fuel - executed;
+		uint64_t ran = 0;
+		if (valid_pc && jit->addr_state[pc] == JIT_ADDR_COMPILED && left >= jit->block_len[pc] &&
+				set_writable(jit, false)) {
+			uint64_t to_sync = sync->next - executed;
+			int64_t sync_fuel = to_sync <= left ? (int64_t) (left - to_sync) : INT64_MIN;
+			int64_t native_sync_fuel = sync_fuel;
+			ran = left - enter(vm, left, &jit->buf[jit->dispatch_entry[pc]], &native_sync_fuel, sync->period);
+			executed += ran;
+			if (native_sync_fuel != sync_fuel) {
+				vm_advance_sync(sync, (uint64_t) (sync_fuel - native_sync_fuel) / sync->period);
+			}
+		}
+		if (!ran) {
+			/*
+			 * Not compiled, not enough cycles left for the block, or a call or
+			 * return that faults; the interpreter also reports invalid PCs.
+			 */
+			vm_update_in_reg(vm);
+			exec_decoded(vm_fetch_next(vm), vm);
+			executed++;
+		}
+		if (vm->reg_clock != clock || vm->reg_sync != reg_sync) {
+			break;
+		}
+	}
+	if (executed) {
+		vm_apply_sync(sync, vm, executed - 1);
+	}
+	return executed;
+}
+
+/*
+ * Sets how many times the UserSync poll at pc runs natively before returning
+ * to the dispatcher again. Polls in wait loops return every time, so that
+ * the dispatcher sees iterations of the same length and skips the wait after
+ * a few. Polls that keep failing to skip, e.g. in code busy between frames,
+ * return half as often each time, so that they cost the dispatcher little.
+ */
+void back_off_poll(struct jit *jit, program_addr_t pc, bool skipped)
+{
+	if (jit->fastfwd_kind[pc] != FASTFWD_SYNC_POLL) {
+		return;
+	}
+	uint8_t misses = jit->poll_misses[pc];
+	if (skipped) {
+		misses = 0;
+	} else if (misses < JIT_POLL_MISSES + JIT_MAX_POLL_BACKOFF) {
+		misses++;
+	}
+	jit->poll_misses[pc] = misses;
+	jit->poll_countdown[pc] = misses > JIT_POLL_MISSES ? 1 << (misses - JIT_POLL_MISSES) : 1;
+}
+
+uint64_t jit_run(struct jit *jit, struct vm_state *vm, uint64_t max_cycles)
+{
+	uint64_t start = vm->cycle_count;
+	program_addr_t skipped_at = PROGRAM_MEMORY_SIZE;
+	while (!vm->fault && vm->cycle_count - start < max_cycles && !fastfwd_halt(vm)) {
+		uint64_t fuel = max_cycles - (vm->cycle_count - start);
+		if (!fastfwd_candidate(vm)) {
+			vm_begin_cycle(vm);
+		} else {
+			program_addr_t pc = vm->reg_pc;
+			bool skipped = fastfwd_cycles(vm, fuel);
+			/* The retry right after a skip only takes a new snapshot. */
+			if (pc != skipped_at) {
+				back_off_poll(jit, pc, skipped);
+			}
+			skipped_at = skipped ? pc : PROGRAM_MEMORY_SIZE;
+			if (skipped) {
+				continue;
+			}
+		}
+		if (fuel > JIT_MAX_FUEL) {
+			fuel = JIT_MAX_FUEL;
+		}
+		jit->fastfwd = vm->time_mode == VM_TIME_VIRTUAL;
+		struct vm_sync sync;
+		vm_init_sync(vm, &sync);
+		vm_end_synced_cycles(vm, run_compiled(jit, vm, fuel, &sync), &sync);
+	}
+	return vm->cycle_count - start;
+}
+
+#else /* __x86_64__ && __unix__ */
+
+struct jit *jit_create(const struct vm_state *vm)
+{
+	return NULL;
+}
+
+void jit_destroy(struct jit *jit)
+{
+}
+
+uint64_t jit_run(struct jit *jit, struct vm_state *vm, uint64_t max_cycles)
+{
+	return 0;
+}
+
+#endif /* __x86_64__ && __unix__ */
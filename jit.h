@@ -0,0 +1,44 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "vm.h"
+
+#include <stdint.h>
+
+struct jit;
+
+/*
+ * Creates a basic block compiler to native code for the program loaded in the
+ * VM. Returns NULL if native code generation is not supported on this host.
+ */
+struct jit *jit_create(const struct vm_state *vm);
+
+void jit_destroy(struct jit *jit);
+
+/*
+ * Executes up to max_cycles cycles, running compiled blocks where possible and
+ * falling back to the interpreter for everything else. Returns the number of
+ * cycles executed.
+ */
+uint64_t jit_run(struct jit *jit, struct vm_state *vm, uint64_t max_cycles);
+
+#endif /* _JIT_H */
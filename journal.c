@@ -0,0 +1,235 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+
+#include "exec.h"
+#include "pov.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+bool journal_init(struct journal *journal, size_t capacity)
+{
+	journal->entries = calloc(capacity, sizeof(struct journal_entry));
+	if (!journal->entries) {
+		fprintf(stderr, "Failed to allocate undo journal.\n");
+		return false;
+	}
+	journal->capacity = capacity;
+	journal_clear(journal);
+	return true;
+}
+
+void journal_destroy(struct journal *journal)
+{
+	free(journal->entries);
+	journal->entries = NULL;
+	journal->capacity = 0;
+	journal_clear(journal);
+}
+
+void journal_clear(struct journal *journal)
+{
+	journal->head = 0;
+	journal->count = 0;
+}
+
+static inline void record_write(struct journal_entry *entry, memory_addr_t addr, const struct vm_state *vm)
+{
+	struct journal_write *write = &entry->writes[entry->num_writes++];
+	write->addr = addr;
+	write->value = vm->user_mem[addr];
+}
+
+/* Records the return address a call to JSR would push, see maybe_call_or_jump(). */
+static inline void record_call(struct journal_entry *entry, memory_addr_t dst_addr, const struct vm_state *vm)
+{
+	if (dst_addr == SFR_JSR && vm->reg_sp < MAX_STACK_DEPTH) {
+		for (int i = 0; i < 3; i++) {
+			record_write(entry, PAGE_SIZE + vm->reg_sp * 3 + i, vm);
+		}
+	}
+}
+
+/* Records memory the instruction may write, given the state after vm_begin_cycle(). */
+void record_instruction(struct journal_entry *entry, const struct decoded_instruction *di, const struct vm_state *vm)
+{
+	const struct vm_instruction *instr = &di->vmi;
+	memory_addr_t rx = instr->nibble2;
+	memory_addr_t ry = instr->nibble3;
+	memory_addr_t ptr = (rx << 4) | ry;
+	memory_addr_t ind = (vm->user_mem[rx] << 4) | vm->user_mem[ry];
+	switch (di->variant) {
+	case VARIANT_ADD_RX_RY:
+	case VARIANT_ADC_RX_RY:
+	case VARIANT_SUB_RX_RY:
+	case VARIANT_SBB_RX_RY:
+	case VARIANT_OR_RX_RY:
+	case VARIANT_AND_RX_RY:
+	case VARIANT_XOR_RX_RY:
+	case VARIANT_MOV_RX_RY:
+	case VARIANT_MOV_RX_N:
+		record_write(entry, rx, vm);
+		record_call(entry, rx, vm);
+		break;
+	case VARIANT_ADD_R0_N:
+	case VARIANT_OR_R0_N:
+	case VARIANT_AND_R0_N:
+	case VARIANT_XOR_R0_N:
+	case VARIANT_RET_R0_N:
+		record_write(entry, 0, vm);
+		break;
+	case VARIANT_INC_RY:
+	case VARIANT_DEC_RY:
+		record_write(entry, ry, vm);
+		if (is_jump_address(ry)) {
+			/* The carry or borrow propagates to PCM and PCH, see op_inc(). */
+			record_write(entry, SFR_PCM, vm);
+			record_write(entry, SFR_PCH, vm);
+		}
+		record_call(entry, ry, vm);
+		break;
+	case VARIANT_DSZ_RY:
+	case VARIANT_RRC_RY:
+		record_write(entry, ry, vm);
+		record_call(entry, ry, vm);
+		break;
+	case VARIANT_MOV_IND_R0:
+		record_write(entry, ind, vm);
+		break;
+	case VARIANT_MOV_R0_IND:
+		/* Reading some SFRs changes them too. */
+		record_write(entry, 0, vm);
+		record_write(entry, ind, vm);
+		break;
+	case VARIANT_MOV_PTR_R0:
+		record_write(entry, ptr, vm);
+		break;
+	case VARIANT_MOV_R0_PTR:
+		record_write(entry, 0, vm);
+		record_write(entry, ptr, vm);
+		break;
+	case VARIANT_MOV_PC_NN:
+		record_write(entry, SFR_PCM, vm);
+		record_write(entry, SFR_PCH, vm);
+		break;
+	case VARIANT_BSET_RG_M:
+	case VARIANT_BCLR_RG_M:
+	case VARIANT_BTG_RG_M:
+		record_write(entry, operand_addr(OPERAND_RGO, instr, vm), vm);
+		break;
+	case VARIANT_EXR_N:
+		entry->exr_count = instr->nibble3 ? instr->nibble3 : PAGE_SIZE;
+		break;
+	default:
+		/* CP, JR, BIT and SKIP only change registers. */
+		break;
+	}
+}
+
+/* Marks the rows of memory a cycle may have changed. */
+static inline void mark_dirty(const struct journal_entry *entry, struct vm_state *vm)
+{
+	for (int i = 0; i < entry->num_writes; i++) {
+		vm_mark_dirty(vm, entry->writes[i].addr);
+	}
+	memory_addr_t alt_regs = vm->alt_regs_page - vm->user_mem;
+	for (int i = 0; i < entry->exr_count; i++) {
+		vm_mark_dirty(vm, i);
+		vm_mark_dirty(vm, alt_regs + i);
+	}
+}
+
+/* Accounts the old values of the memory a cycle wrote for the LED matrix. */
+static inline void account_pov(const struct journal_entry *entry, struct vm_state *vm)
+{
+	for (int i = 0; i < entry->num_writes; i++) {
+		pov_write(vm, entry->writes[i].addr, entry->writes[i].value);
+	}
+	/* EXR swapped the registers, so the old values are in the other page now. */
+	memory_addr_t alt_regs = vm->alt_regs_page - vm->user_mem;
+	for (int i = 0; i < entry->exr_count; i++) {
+		pov_write(vm, i, vm->alt_regs_page[i]);
+		pov_write(vm, alt_regs + i, vm->main_regs_page[i]);
+	}
+}
+
+void journal_step(struct journal *journal, struct vm_state *vm)
+{
+	struct journal_entry *entry = &journal->entries[journal->head];
+	entry->t_last_user_sync = vm->t_last_user_sync;
+	entry->dt_last_user_sync_period = vm->dt_last_user_sync_period;
+	entry->rng_seed = vm->rng.seed;
+	entry->pc = vm->reg_pc;
+	entry->sp = vm->reg_sp;
+	entry->flags = vm->reg_flags;
+	entry->fault = vm->fault;
+	entry->exr_count = 0;
+	entry->num_writes = 0;
+	/* Beginning a cycle may fire UserSync and resets the active In register. */
+	record_write(entry, SFR_RD_FLAGS, vm);
+	record_write(entry, vm->reg_wr_flags & WR_FLAG_IN_OUT_POS ? SFR_IN_B : SFR_IN, vm);
+
+	vm_begin_cycle(vm);
+	const struct decoded_instruction *di = vm_fetch_next(vm);
+	record_instruction(entry, di, vm);
+	exec_decoded(di, vm);
+	vm_end_cycles(vm, 1);
+	mark_dirty(entry, vm);
+	account_pov(entry, vm);
+
+	if (++journal->head == journal->capacity) {
+		journal->head = 0;
+	}
+	if (journal->count < journal->capacity) {
+		journal->count++;
+	}
+}
+
+bool journal_undo(struct journal *journal, struct vm_state *vm)
+{
+	if (!journal->count) {
+		return false;
+	}
+	journal->head = (journal->head ? journal->head : journal->capacity) - 1;
+	journal->count--;
+
+	const struct journal_entry *entry = &journal->entries[journal->head];
+	for (int i = 0; i < entry->exr_count; i++) {
+		memory_word_t main = vm->main_regs_page[i];
+		vm->main_regs_page[i] = vm->alt_regs_page[i];
+		vm->alt_regs_page[i] = main;
+	}
+	/* Nibbles written twice were recorded twice; the first record has the oldest value. */
+	for (int i = entry->num_writes - 1; i >= 0; i--) {
+		vm->user_mem[entry->writes[i].addr] = entry->writes[i].value;
+	}
+	vm->t_last_user_sync = entry->t_last_user_sync;
+	vm->dt_last_user_sync_period = entry->dt_last_user_sync_period;
+	vm->rng.seed = entry->rng_seed;
+	vm->reg_pc = entry->pc;
+	vm->reg_sp = entry->sp;
+	vm->reg_flags = entry->flags;
+	vm->fault = entry->fault;
+	vm->cycle_count--;
+	mark_dirty(entry, vm);
+	pov_reset(vm); /* Time went backwards. */
+	return true;
+}
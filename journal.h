@@ -0,0 +1,86 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Undo journal for stepping backwards in the debugger.
+ *
+ * Every cycle executed with journal_step() records the registers and the
+ * memory nibbles it is about to overwrite in a fixed size ring buffer, so the
+ * most recent cycles can be undone one by one. When the buffer is full, the
+ * oldest entries are dropped. Writes are determined from the instruction
+ * before it runs, so recording costs a handful of stores per cycle. The same
+ * writes mark the rows they touch in vm_state.dirty_rows, for the display.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Memory writes a cycle can make, e.g. INC JSR writes JSR, PCM and PCH and pushes three nibbles besides In and RdFlags. */
+#define JOURNAL_MAX_WRITES 8
+
+struct journal_write {
+	uint8_t addr;
+	memory_word_t value;
+};
+
+/* State overwritten by one cycle. */
+struct journal_entry {
+	vm_clock_t t_last_user_sync;
+	vm_clock_t dt_last_user_sync_period;
+	uint32_t rng_seed;
+	program_addr_t pc;
+	uint8_t sp;
+	uint8_t flags;
+	uint8_t fault;
+	uint8_t exr_count;	/* Registers swapped by EXR, undone by swapping them again; 0 for other instructions. */
+	uint8_t num_writes;
+	struct journal_write writes[JOURNAL_MAX_WRITES];	/* Old values, in the order they were recorded. */
+};
+
+struct journal {
+	struct journal_entry *entries;	/* Ring buffer. */
+	size_t capacity;
+	size_t head;	/* Index of the next entry to record. */
+	size_t count;	/* Number of entries that can be undone. */
+};
+
+/* Allocates a journal holding up to capacity cycles. Returns false on error. */
+bool journal_init(struct journal *journal, size_t capacity);
+
+void journal_destroy(struct journal *journal);
+
+/* Forgets all recorded cycles, e.g. after the VM state was changed otherwise. */
+void journal_clear(struct journal *journal);
+
+/*
+ * Executes one cycle with the interpreter and records what it overwrites.
+ * Equivalent to vm_run(vm, 1) without fast-forwarding.
+ */
+void journal_step(struct journal *journal, struct vm_state *vm);
+
+/* Undoes the most recently recorded cycle. Returns false if there is none. */
+bool journal_undo(struct journal *journal, struct vm_state *vm);
+
+#endif /* _JOURNAL_H */
@@ -0,0 +1,92 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "listing.h"
+
+#include "aot.h"
+#include "ops.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const int LISTING_DISASSEMBLY_SIZE = 20;	/* Width of the instruction column. */
+
+/* Returns the static target of a jump or call at pc, -1 if none. Sets the label kind of the target. */
+int find_target(const struct decoded_instruction *decoded, program_addr_t pc, char *kind)
+{
+	const struct decoded_instruction *di = &decoded[pc];
+	program_addr_t taken;
+	if (get_flow(di, pc, &taken) == AOT_FLOW_GOTO) {
+		*kind = 'L';
+		return taken;
+	}
+	uint8_t reg = get_jump_register(di);
+	if (!reg || di->variant != VARIANT_MOV_RX_N) {
+		return -1;
+	}
+	int page = find_jump_page(decoded, pc);
+	if (page < 0) {
+		return -1;
+	}
+	*kind = reg == SFR_JSR ? 'S' : 'L';
+	return page | di->vmi.nibble3;
+}
+
+void listing_init(struct listing *listing, const struct decoded_instruction *decoded)
+{
+	memset(listing, 0, sizeof(struct listing));
+	listing->decoded = decoded;
+	for (int pc = 0; pc < PROGRAM_MEMORY_SIZE; pc++) {
+		char kind;
+		int target = find_target(decoded, pc, &kind);
+		listing->targets[pc] = target;
+		if (target >= 0 && listing->labels[target] != 'S') {
+			listing->labels[target] = kind; /* Subroutine labels win over jumps inside them. */
+		}
+	}
+}
+
+const char *listing_get_line(struct listing *listing, program_addr_t addr)
+{
+	char *line = listing->lines[addr];
+	if (listing->built[addr]) {
+		return line;
+	}
+
+	const struct vm_instruction *vmi = &listing->decoded[addr].vmi;
+	const struct instruction_descriptor *descr = get_instruction_descriptor(vmi);
+	char disassembly[LISTING_DISASSEMBLY_SIZE];
+	disassemble_instruction(vmi, descr, disassembly, sizeof(disassembly));
+
+	char label[8] = "";
+	if (listing->labels[addr]) {
+		snprintf(label, sizeof(label), "%c%03hx", listing->labels[addr], addr);
+	}
+	char target[16] = "";
+	int16_t taken = listing->targets[addr];
+	if (taken >= 0) {
+		snprintf(target, sizeof(target), "-> %c%03hx", listing->labels[taken], taken);
+	}
+	char text[2 * LISTING_WIDTH];
+	snprintf(text, sizeof(text), "%-5s %03hx:  %hhx%hhx%hhx  %-*s%-7s",
+		label, addr, vmi->nibble1, vmi->nibble2, vmi->nibble3, LISTING_DISASSEMBLY_SIZE, disassembly, target);
+	memcpy(line, text, LISTING_WIDTH);
+	listing->built[addr] = true;
+	return line;
+}
@@ -0,0 +1,56 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Disassembly listing of a program for the UI.
+ *
+ * Program memory never changes while running, so each line is disassembled
+ * once, the first time it is shown, and reused from then on. Addresses that
+ * are the known target of a jump or call get labels: 'S' for subroutines
+ * entered through JSR, 'L' for everything else.
+ */
+
+#ifndef _LISTING_H
+#define _LISTING_H
+
+#include "program.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LISTING_WIDTH 44	/* Characters in a line, which is not NUL terminated. */
+#define LISTING_PC_MARKER 5	/* Offset of the blank marking the current instruction. */
+#define LISTING_BREAKPOINT_MARKER 9	/* Offset of the ':' marking a breakpoint. */
+
+struct listing {
+	const struct decoded_instruction *decoded;	/* Program memory decoded by the VM, not owned. */
+	int16_t targets[PROGRAM_MEMORY_SIZE];	/* Known jump or call target of each instruction, -1 if none. */
+	char labels[PROGRAM_MEMORY_SIZE];	/* Label kind of each address, 0 if none. */
+	bool built[PROGRAM_MEMORY_SIZE];	/* True iff the line of an address was disassembled. */
+	char lines[PROGRAM_MEMORY_SIZE][LISTING_WIDTH];
+};
+
+/* Finds jump targets in the decoded program. Lines are disassembled later, on demand. */
+void listing_init(struct listing *listing, const struct decoded_instruction *decoded);
+
+/* Returns the line of LISTING_WIDTH characters for an address, disassembling it on first use. */
+const char *listing_get_line(struct listing *listing, program_addr_t addr);
+
+#endif /* _LISTING_H */
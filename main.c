@@ -18,25 +18,129 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "aot.h"
+#include "farm.h"
+#include "headless.h"
+#include "trace.h"
 #include "ui.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+/* Options without a short form. */
+enum {
+	OPT_TRACE = 0x100,
+	OPT_COMPRESS_TRACE,
+	OPT_DUMP_TRACE,
+	OPT_FROM,
+	OPT_PROFILE,
+	OPT_FOLDED,
+	OPT_CALL_GRAPH,
+};
+
+const struct option LONG_OPTIONS[] = {
+	{"ansi",       no_argument,       NULL, 'A'},
+	{"vsync",      no_argument,       NULL, 'V'},
+	{"headless",   no_argument,       NULL, 'H'},
+	{"cycles",     required_argument, NULL, 'n'},
+	{"time-limit", required_argument, NULL, 't'},
+	{"paced",      no_argument,       NULL, 'P'},
+	{"jit",        no_argument,       NULL, 'j'},
+	{"aot",        required_argument, NULL, 'a'},
+	{"seed",       required_argument, NULL, 's'},
+	{"farm",       no_argument,       NULL, 'F'},
+	{"threads",    required_argument, NULL, 'T'},
+	{"instances",  required_argument, NULL, 'N'},
+	{"batch",      no_argument,       NULL, 'B'},
+	{"resume",     required_argument, NULL, 'R'},
+	{"save",       required_argument, NULL, 'S'},
+	{"trace",      required_argument, NULL, OPT_TRACE},
+	{"compress-trace", no_argument,   NULL, OPT_COMPRESS_TRACE},
+	{"dump-trace", required_argument, NULL, OPT_DUMP_TRACE},
+	{"from",       required_argument, NULL, OPT_FROM},
+	{"profile",    no_argument,       NULL, OPT_PROFILE},
+	{"folded",     required_argument, NULL, OPT_FOLDED},
+	{"call-graph", no_argument,       NULL, OPT_CALL_GRAPH},
+	{},
+};
+
 void output_usage(const char* executable_name)
 {
 	fprintf(stderr, "Nibbler - VM for Voja's 4-bit processor. Eats nibbles for breakfast.\n");
-	fprintf(stderr, "Usage: %s [-p] [-r] <file.hex>\n", executable_name);
+	fprintf(stderr, "Usage: %s [-p] [-r] [-A] [-V] [-R snapshot] [-S snapshot] <file.hex>\n", executable_name);
+	fprintf(stderr, "       %s -H [-n cycles] [-t seconds] [-P] [-j] [-R snapshot] [-S snapshot] [--trace file [--compress-trace]] [--profile] [--folded file] [--call-graph] <file.hex>\n", executable_name);
+	fprintf(stderr, "       %s -F [-T threads] [-N instances] [-B] [-s seed] [-n cycles] [-t seconds] [-j] <file.hex>...\n", executable_name);
+	fprintf(stderr, "       %s --aot <out.c> <file.hex>\n", executable_name);
+	fprintf(stderr, "       %s --dump-trace <file> [--from cycle] [-n cycles]\n", executable_name);
 	fprintf(stderr, "  -p: pause at the start of the program before executing any instructions\n");
 	fprintf(stderr, "  -r: use red for page display to simulate LED color, default is gray\n");
+	fprintf(stderr, "  -A, --ansi: draw with ANSI escape sequences instead of ncurses, needs a 256-color UTF-8 terminal\n");
+	fprintf(stderr, "  -V, --vsync: draw the display when the program consumes UserSync, showing only complete frames\n");
+	fprintf(stderr, "  -H, --headless: run without a terminal UI and report throughput\n");
+	fprintf(stderr, "  -n, --cycles: stop headless execution after this many cycles\n");
+	fprintf(stderr, "  -t, --time-limit: stop headless execution after this many seconds\n");
+	fprintf(stderr, "  -P, --paced: honor the Clock register in headless mode, default is flat out\n");
+	fprintf(stderr, "  -j, --jit: compile the program to native code in headless mode\n");
+	fprintf(stderr, "  -s, --seed: seed the random number generator, default is random (0 in farm mode)\n");
+	fprintf(stderr, "  -F, --farm: run many headless instances in parallel and print results as CSV\n");
+	fprintf(stderr, "  -T, --threads: number of farm worker threads, default is one per CPU\n");
+	fprintf(stderr, "  -N, --instances: number of farm instances per program, seeded consecutively\n");
+	fprintf(stderr, "  -B, --batch: run farm instances of a program in lockstep with vector instructions\n");
+	fprintf(stderr, "  -R, --resume: restore the VM from a snapshot file before running\n");
+	fprintf(stderr, "  -S, --save: save a snapshot of the VM to a file on exit\n");
+	fprintf(stderr, "  --trace: record every executed cycle to a file in headless mode, see README.md\n");
+	fprintf(stderr, "  --compress-trace: compress the trace with zlib\n");
+	fprintf(stderr, "  --dump-trace: print the cycles recorded in a trace, optionally starting at a cycle\n");
+	fprintf(stderr, "  --profile: print the hottest addresses, loops and instructions in headless mode\n");
+	fprintf(stderr, "  --folded: write cycles per call path to a file for flame graph tools in headless mode\n");
+	fprintf(stderr, "  --call-graph: print calls and cycles per subroutine and the call tree in headless mode\n");
+	fprintf(stderr, "  --aot: translate the program to C source, see README.md for building it\n");
+}
+
+/* Parses a whole number up to max. Returns false if the text is not one, e.g. if it is negative. */
+bool parse_number(const char *text, uint64_t max, uint64_t *value)
+{
+	char *end;
+	while (isspace((unsigned char) *text)) {
+		text++;
+	}
+	errno = 0;
+	*value = strtoull(text, &end, 0);
+	return isdigit((unsigned char) *text) && !*end && !errno && *value <= max;
+}
+
+/* Parses a whole number of cycles. Returns false if the text is not one. */
+bool parse_cycles(const char *text, uint64_t *cycles)
+{
+	return parse_number(text, UINT64_MAX, cycles);
+}
+
+/* Parses a number of seconds. Returns false if the text is not a finite, non-negative number. */
+bool parse_seconds(const char *text, double *seconds)
+{
+	char *end;
+	*seconds = strtod(text, &end);
+	return end != text && !*end && isfinite(*seconds) && *seconds >= 0;
 }
 
 int main(int argc, char *argv[])
 {
 	int opt;
 	int ui_options = 0;
-	while ((opt = getopt(argc, argv, "pr")) != -1) {
+	bool headless = false;
+	bool farm = false;
+	uint64_t number;
+	const char *aot_path = NULL;
+	const char *dump_trace_path = NULL;
+	uint64_t dump_from = 0;
+	struct headless_options headless_opts = {};
+	struct farm_options farm_opts = {.instances_per_program = 1};
+	while ((opt = getopt_long(argc, argv, "prAVHn:t:Pja:s:FT:N:BR:S:", LONG_OPTIONS, NULL)) != -1) {
 		switch (opt) {
 		case 'p':
 			ui_options |= START_PAUSED;
@@ -44,17 +148,143 @@ int main(int argc, char *argv[])
 		case 'r':
 			ui_options |= RED_MODE;
 			break;
+		case 'A':
+			ui_options |= ANSI_MODE;
+			break;
+		case 'V':
+			ui_options |= SYNC_FRAMES;
+			break;
+		case 'H':
+			headless = true;
+			break;
+		case 'n':
+			if (!parse_cycles(optarg, &headless_opts.max_cycles)) {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			if (!parse_seconds(optarg, &headless_opts.max_seconds)) {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'P':
+			headless_opts.paced = true;
+			break;
+		case 'j':
+			headless_opts.jit = true;
+			break;
+		case 'a':
+			aot_path = optarg;
+			break;
+		case 's':
+			if (!parse_number(optarg, UINT32_MAX, &number)) {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			headless_opts.has_seed = true;
+			headless_opts.seed = number;
+			break;
+		case 'F':
+			farm = true;
+			break;
+		case 'T':
+			if (!parse_number(optarg, FARM_MAX_THREADS, &number)) {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			farm_opts.num_threads = number;
+			break;
+		case 'N':
+			if (!parse_number(optarg, FARM_MAX_INSTANCES, &number) || !number) {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			farm_opts.instances_per_program = number;
+			break;
+		case 'B':
+			farm_opts.batch = true;
+			break;
+		case 'R':
+			headless_opts.resume_path = optarg;
+			break;
+		case 'S':
+			headless_opts.save_path = optarg;
+			break;
+		case OPT_TRACE:
+			headless_opts.trace_path = optarg;
+			break;
+		case OPT_COMPRESS_TRACE:
+			headless_opts.compress_trace = true;
+			break;
+		case OPT_DUMP_TRACE:
+			dump_trace_path = optarg;
+			break;
+		case OPT_FROM:
+			if (!parse_cycles(optarg, &dump_from)) {
+				output_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_PROFILE:
+			headless_opts.profile = true;
+			break;
+		case OPT_FOLDED:
+			headless_opts.folded_path = optarg;
+			break;
+		case OPT_CALL_GRAPH:
+			headless_opts.call_graph = true;
+			break;
 		default:
 			output_usage(argv[0]);
 			exit(EXIT_FAILURE);
 		}
 	}
 
-	if (optind >= argc) {
+	if (dump_trace_path) {
+		return trace_dump(dump_trace_path, dump_from, headless_opts.max_cycles) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/* Executables with a translated program linked in run it when no file is given. */
+	const char *binary_path = NULL;
+	if (optind < argc) {
+		binary_path = argv[optind];
+	} else if (aot_path || !&AOT_LINKED_IMAGE) {
+		output_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (aot_path) {
+		return aot_translate(binary_path, aot_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (farm) {
+		if (!binary_path || !farm_opts.instances_per_program || headless_opts.resume_path || headless_opts.save_path ||
+				headless_opts.trace_path || headless_opts.profile || headless_opts.folded_path ||
+				headless_opts.call_graph) {
+			output_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		farm_opts.run = headless_opts;
+		return farm_run(&farm_opts, &argv[optind], argc - optind) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (headless) {
+		if (headless_opts.trace_path && (headless_opts.profile || headless_opts.folded_path)) {
+			output_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		return headless_run(&headless_opts, binary_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	/* Options that only apply headless would be silently ignored by the UI. */
+	if (headless_opts.max_cycles || headless_opts.max_seconds || headless_opts.paced || headless_opts.jit ||
+			headless_opts.has_seed || headless_opts.trace_path || headless_opts.compress_trace ||
+			headless_opts.profile || headless_opts.folded_path || headless_opts.call_graph) {
 		output_usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	const char *binary_path = argv[optind];
 
 	struct ui *ui = calloc(1, sizeof(struct ui));
 	if (!ui) {
@@ -62,6 +292,8 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 	ui_init(ui, ui_options);
+	ui->resume_path = headless_opts.resume_path;
+	ui->save_path = headless_opts.save_path;
 	bool success = ui_run(ui, binary_path);
 	ui_destroy(ui);
 	free(ui);
@@ -19,7 +19,6 @@
 
 #include "ops.h"
 
-#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -99,168 +98,21 @@ void get_info_condition_flag(const struct vm_instruction *instr, char *out)
 	snprintf(out, INFO_SIZE, "%#02x", instr->nibble3 >> 2);
 }
 
-memory_addr_t get_reg_addr(const memory_word_t *reg, const struct vm_state *vm) {
-	return (memory_addr_t) (reg - &vm->user_mem[0]);
-}
-
-memory_addr_t get_addr_rx(const struct vm_instruction *instr, const struct vm_state *vm) {
-	return get_reg_addr(&vm->main_regs_page[instr->nibble2], vm);
-}
-
-memory_addr_t get_addr_ry(const struct vm_instruction *instr, const struct vm_state *vm) {
-	return get_reg_addr(&vm->main_regs_page[instr->nibble3], vm);
-}
-
-memory_addr_t get_addr_rg_in(const struct vm_instruction *instr, const struct vm_state *vm) {
-	uint8_t rg = instr->nibble3 >> 2;
-	if (rg < 0x3) {
-		return get_reg_addr(&vm->main_regs_page[rg], vm);
-	} else if (vm->reg_wr_flags & WR_FLAG_IN_OUT_POS) {
-		return get_reg_addr(&vm->reg_in_b, vm);
-	} else {
-		return get_reg_addr(&vm->reg_in, vm);
-	}
-}
-
-memory_addr_t get_addr_rg_out(const struct vm_instruction *instr, const struct vm_state *vm) {
-	uint8_t rg = instr->nibble3 >> 2;
-	if (rg < 0x3) {
-		return get_reg_addr(&vm->main_regs_page[rg], vm);
-	} else if (vm->reg_wr_flags & WR_FLAG_IN_OUT_POS) {
-		return get_reg_addr(&vm->reg_out_b, vm);
-	} else {
-		return get_reg_addr(&vm->reg_out, vm);
-	}
-}
-
-memory_addr_t get_addr_r0(const struct vm_instruction *instr, const struct vm_state *vm) {
-	return get_reg_addr(&vm->reg_r0, vm);
-}
-
-memory_addr_t get_addr_pc(const struct vm_instruction *instr, const struct vm_state *vm) {
-	return get_reg_addr(&vm->reg_pcm, vm);
-}
-
-memory_addr_t get_addr_pointer(const struct vm_instruction *instr, const struct vm_state *vm) {
-	return (instr->nibble2 << 4) | instr->nibble3;
-}
-
-memory_addr_t get_addr_indirect(const struct vm_instruction *instr, const struct vm_state *vm) {
-	return (vm->main_regs_page[instr->nibble2] << 4) | vm->main_regs_page[instr->nibble3];
-}
-
-const struct operand_dst DST_RX  = {.mnemnonic = "RX",   .get_addr = get_addr_rx,       .get_info = get_info_rx};
-const struct operand_dst DST_RY  = {.mnemnonic = "RY",   .get_addr = get_addr_ry,       .get_info = get_info_ry};
-const struct operand_dst DST_RGI = {.mnemnonic = "RG",   .get_addr = get_addr_rg_in,    .get_info = get_info_rg};
-const struct operand_dst DST_RGO = {.mnemnonic = "RG",   .get_addr = get_addr_rg_out,   .get_info = get_info_rg};
-const struct operand_dst DST_R0  = {.mnemnonic = "R0",   .get_addr = get_addr_r0,       .get_info = get_info_r0};
-const struct operand_dst DST_PC  = {.mnemnonic = "PC",   .get_addr = get_addr_pc,       .get_info = get_info_pc};
-const struct operand_dst DST_PTR = {.mnemnonic = "[NN]", .get_addr = get_addr_pointer,  .get_info = get_info_pointer};
-const struct operand_dst DST_IND = {.mnemnonic = "[XY]", .get_addr = get_addr_indirect, .get_info = get_info_indirect};
-
-uint8_t get_condition_flag(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	return instr->nibble3 >> 2;
-}
-
-const struct operand_cnd CND_FLG = {.mnemnonic = "F",    .get_val = get_condition_flag, .get_info = get_info_condition_flag};
-
-uint8_t get_val_ry(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	return vm->main_regs_page[instr->nibble3];
-}
-
-uint8_t get_val_r0(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	return vm->reg_r0;
-}
-
-uint8_t get_val_pointer(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	memory_addr_t addr = (instr->nibble2 << 4) | instr->nibble3;
-	return vm->user_mem[addr];
-}
-
-uint8_t get_val_indirect(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	memory_addr_t addr = (vm->main_regs_page[instr->nibble2] << 4) | vm->main_regs_page[instr->nibble3];
-	return vm->user_mem[addr];
-}
-
-uint8_t get_val_literal(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	return instr->nibble3;
-}
-
-uint8_t get_val_byte_literal(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	return (instr->nibble2 << 4) | instr->nibble3;
-}
-
-uint8_t get_val_crumb_literal(const struct vm_instruction *instr, const struct vm_state *vm)
-{
-	return instr->nibble3 & 0x3;
-}
-
-const struct operand_src SRC_RY  = {.mnemnonic = "RY",   .get_val = get_val_ry,            .get_info = get_info_ry};
-const struct operand_src SRC_R0  = {.mnemnonic = "R0",   .get_val = get_val_r0,            .get_info = get_info_r0};
-const struct operand_src SRC_PTR = {.mnemnonic = "[NN]", .get_val = get_val_pointer,       .get_info = get_info_pointer};
-const struct operand_src SRC_IND = {.mnemnonic = "[XY]", .get_val = get_val_indirect,      .get_info = get_info_indirect};
-const struct operand_src SRC_N   = {.mnemnonic = "N",    .get_val = get_val_literal,       .get_info = get_info_literal};
-const struct operand_src SRC_NN  = {.mnemnonic = "NN",   .get_val = get_val_byte_literal,  .get_info = get_info_byte_literal};
-const struct operand_src SRC_M   = {.mnemnonic = "M",    .get_val = get_val_crumb_literal, .get_info = get_info_crumb_literal};
-
-/*
- * Updates Zero flag.
- */
-void update_zero_flag(uint8_t result, struct vm_state *vm)
-{
-	if (!(result & 0xf)) {
-		vm->reg_flags |= FLAG_ZERO;
-	} else {
-		vm->reg_flags &= ~FLAG_ZERO;
-	}
-}
-
-/*
- * Updates the Carry flag for addition ops (ADD, ADC, INC).
- */
-void update_carry_flag(uint8_t result, struct vm_state *vm)
-{
-	if (result & 0x10) {
-		vm->reg_flags |= FLAG_CARRY;
-	} else {
-		vm->reg_flags &= ~FLAG_CARRY;
-	}
-}
-
-/*
- * Updates the Carry flag for subtraction ops (SUB, SBB, CP, DEC).
- * The Carry flag is called Borrow (inverse of Carry).
- */
-void update_borrow_flag(uint8_t result, struct vm_state *vm)
-{
-	if (!(result & 0x10)) {
-		vm->reg_flags |= FLAG_CARRY;
-	} else {
-		vm->reg_flags &= ~FLAG_CARRY;
-	}
-}
-
-/*
- * Updates the Overflow flag for basic arithmetic ops (ADD, ADC, SUB, SBB, CP).
- * The operands and result are interpreted as signed values.
- */
-void update_overflow_flag(int8_t sresult, struct vm_state *vm)
-{
-	if (sresult < -8 || sresult > 7) {
-		vm->reg_flags |= FLAG_OVERFLOW;
-		vm->reg_rd_flags |= RD_FLAG_V_FLAG;
-	} else {
-		vm->reg_flags &= ~FLAG_OVERFLOW;
-		vm->reg_rd_flags &= ~RD_FLAG_V_FLAG;
-	}
-}
+/* Operand kinds indexed by OPERAND_*, used for disassembly. */
+const struct operand OPERANDS[NUM_OPERANDS] = {
+	[OPERAND_RX]  = {.mnemnonic = "RX",   .get_info = get_info_rx},
+	[OPERAND_RY]  = {.mnemnonic = "RY",   .get_info = get_info_ry},
+	[OPERAND_RGI] = {.mnemnonic = "RG",   .get_info = get_info_rg},
+	[OPERAND_RGO] = {.mnemnonic = "RG",   .get_info = get_info_rg},
+	[OPERAND_R0]  = {.mnemnonic = "R0",   .get_info = get_info_r0},
+	[OPERAND_PC]  = {.mnemnonic = "PC",   .get_info = get_info_pc},
+	[OPERAND_PTR] = {.mnemnonic = "[NN]", .get_info = get_info_pointer},
+	[OPERAND_IND] = {.mnemnonic = "[XY]", .get_info = get_info_indirect},
+	[OPERAND_N]   = {.mnemnonic = "N",    .get_info = get_info_literal},
+	[OPERAND_NN]  = {.mnemnonic = "NN",   .get_info = get_info_byte_literal},
+	[OPERAND_M]   = {.mnemnonic = "M",    .get_info = get_info_crumb_literal},
+	[OPERAND_FLG] = {.mnemnonic = "F",    .get_info = get_info_condition_flag},
+};
 
 /*
  * Initiates a call or jump if the destination address is JSR or PCL register.
@@ -269,15 +121,17 @@ void maybe_call_or_jump(memory_addr_t dst_addr, struct vm_state *vm)
 {
 	if (dst_addr == SFR_JSR) {
 		if (vm->reg_sp == MAX_STACK_DEPTH) {
-			kill(0, SIGUSR1); /* Trigger UI cleanup. */
-			fprintf(stderr, "Stack overflow.\n");
-			exit(EXIT_FAILURE);
+			vm->fault = VM_FAULT_STACK_OVERFLOW;
+			return;
 		}
 		vm->stack[vm->reg_sp * 3] = vm->reg_pc & 0xf;
 		vm->stack[vm->reg_sp * 3 + 1] = (vm->reg_pc >> 4) & 0xf;
 		vm->stack[vm->reg_sp * 3 + 2] = vm->reg_pc >> 8;
 		vm->reg_sp++;
 		vm->reg_pc = (vm->reg_pch << 8) | (vm->reg_pcm << 4) | vm->reg_jsr;
+		if (vm->call_graph) {
+			call_graph_call(vm->call_graph, vm);
+		}
 		return;
 	}
 
@@ -296,9 +150,8 @@ bool is_sfr_address(memory_addr_t addr, const struct vm_state *vm)
  * Overrides memory read behavior for Special Function Registers.
  * Returns true if handled.
  */
-bool maybe_handle_sfr_read(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
+bool maybe_handle_sfr_read(memory_addr_t addr, struct vm_state *vm)
 {
-	memory_addr_t addr = get_addr_pointer(instr, vm);
 	if (!is_sfr_address(addr, vm)) {
 		return false;
 	}
@@ -307,6 +160,9 @@ bool maybe_handle_sfr_read(const struct vm_instruction *instr, const struct inst
 	switch (addr) {
 	case SFR_RD_FLAGS:
 		vm->reg_r0 = vm->reg_rd_flags;
+		if (vm->reg_rd_flags & RD_FLAG_USER_SYNC) {
+			vm->user_sync_reads++;
+		}
 		vm->reg_rd_flags &= ~RD_FLAG_USER_SYNC;
 		break;
 	case SFR_KEY_STATUS:
@@ -329,9 +185,8 @@ bool maybe_handle_sfr_read(const struct vm_instruction *instr, const struct inst
  * Overrides memory write behavior for Special Function Registers.
  * Returns true if handled.
  */
-bool maybe_handle_sfr_write(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
+bool maybe_handle_sfr_write(memory_addr_t addr, struct vm_state *vm)
 {
-	memory_addr_t addr = get_addr_pointer(instr, vm);
 	if (!is_sfr_address(addr, vm)) {
 		return false;
 	}
@@ -349,439 +204,44 @@ bool maybe_handle_sfr_write(const struct vm_instruction *instr, const struct ins
 	return true;
 }
 
-/*
- * Interprets a nibble as a signed integer and casts to an int8.
- */
-int8_t nibble_to_int8(uint8_t nibble)
-{
-	uint8_t sign_bit = nibble & 0x8;
-	/* Extend sign bit to full byte. */
-	uint8_t ret = nibble | ~(sign_bit - 1);
-	return (int8_t) ret;
-}
-
-/*
- * ADD operation (addition).
- */
-void op_add(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t dst = vm->user_mem[dst_addr];
-	uint8_t src = descr->src->get_val(instr, vm);
-	uint8_t result = dst + src;
-	int8_t sresult = nibble_to_int8(dst) + nibble_to_int8(src);
-	vm->user_mem[dst_addr] = result & 0xf;
-	update_zero_flag(result, vm);
-	update_carry_flag(result, vm);
-	update_overflow_flag(sresult, vm);
-}
-
-/*
- * ADC operation (addition with carry).
- */
-void op_adc(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t dst = vm->user_mem[dst_addr];
-	uint8_t src = descr->src->get_val(instr, vm);
-	uint8_t result = dst + src;
-	int8_t sresult = nibble_to_int8(dst) + nibble_to_int8(src);
-	if (vm->reg_flags & FLAG_CARRY) {
-		result++;
-		sresult++;
-	}
-	vm->user_mem[dst_addr] = result & 0xf;
-	update_zero_flag(result, vm);
-	update_carry_flag(result, vm);
-	update_overflow_flag(sresult, vm);
-}
-
-/*
- * SUB operation (subtraction).
- */
-void op_sub(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t dst = vm->user_mem[dst_addr];
-	uint8_t src = descr->src->get_val(instr, vm);
-	uint8_t result = dst - src;
-	int8_t sresult = nibble_to_int8(dst) - nibble_to_int8(src);
-	vm->user_mem[dst_addr] = result & 0xf;
-	update_zero_flag(result, vm);
-	update_borrow_flag(result, vm);
-	update_overflow_flag(sresult, vm);
-}
-
-/*
- * SBB operation (subtraction with borrow).
- */
-void op_sbb(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t dst = vm->user_mem[dst_addr];
-	uint8_t src = descr->src->get_val(instr, vm);
-	uint8_t result = dst - src;
-	int8_t sresult = nibble_to_int8(dst) - nibble_to_int8(src);
-	if (!(vm->reg_flags & FLAG_CARRY)) {
-		result--;
-		sresult--;
-	}
-	vm->user_mem[dst_addr] = result & 0xf;
-	update_zero_flag(result, vm);
-	update_borrow_flag(result, vm);
-	update_overflow_flag(sresult, vm);
-}
-
-/*
- * OR operation (bitwise OR).
- * When src is a literal, sets the Carry flag.
- */
-void op_or(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	result |= descr->src->get_val(instr, vm);
-	vm->user_mem[dst_addr] = result;
-	update_zero_flag(result, vm);
-	if (descr->flg & OP_FLAG_UPDATE_CARRY) {
-		vm->reg_flags |= FLAG_CARRY;
-	}
-}
-
-/*
- * AND operation (bitwise AND).
- * When src is a literal, clears the Carry flag.
- */
-void op_and(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	result &= descr->src->get_val(instr, vm);
-	vm->user_mem[dst_addr] = result;
-	update_zero_flag(result, vm);
-	if (descr->flg & OP_FLAG_UPDATE_CARRY) {
-		vm->reg_flags &= ~FLAG_CARRY;
-	}
-}
-
-/*
- * XOR operation (bitwise exclusive OR).
- * When src is a literal, toggles the Carry flag.
- */
-void op_xor(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	result ^= descr->src->get_val(instr, vm);
-	vm->user_mem[dst_addr] = result;
-	update_zero_flag(result, vm);
-	if (descr->flg & OP_FLAG_UPDATE_CARRY) {
-		vm->reg_flags ^= FLAG_CARRY;
-	}
-}
-
-/*
- * MOV operation (move).
- * May initiate a call or jump if registers JSR or PCL are the destination.
- */
-void op_mov(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	if ((descr->flg & OP_FLAG_CAN_RD_SFR) && maybe_handle_sfr_read(instr, descr, vm)) {
-		return;
-	}
-	if ((descr->flg & OP_FLAG_CAN_WR_SFR) && maybe_handle_sfr_write(instr, descr, vm)) {
-		return;
-	}
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t src = descr->src->get_val(instr, vm);
-	if (descr->flg & OP_FLAG_DST_BYTE) {
-		vm->user_mem[dst_addr] = src & 0xf;
-		vm->user_mem[dst_addr + 1] = src >> 4;
-	} else {
-		vm->user_mem[dst_addr] = src;
-	}
-	if (descr->flg & OP_FLAG_CAN_JUMP) {
-		maybe_call_or_jump(dst_addr, vm);
-	}
-}
-
-/*
- * JR operation (jump relative).
- */
-void op_jr(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	vm->reg_pc += (int8_t) descr->src->get_val(instr, vm);
-}
-
-/*
- * CP operation (compare).
- * This is identical in behavior with the SUB operation, except that the result
- * is not stored (only the flags are updated).
- */
-void op_cp(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t dst = vm->user_mem[dst_addr];
-	uint8_t src = descr->src->get_val(instr, vm);
-	uint8_t result = dst - src;
-	int8_t sresult = nibble_to_int8(dst) - nibble_to_int8(src);
-	update_zero_flag(result, vm);
-	update_borrow_flag(result, vm);
-	update_overflow_flag(sresult, vm);
-}
-
-/*
- * INC operation (increment).
- * May initiate a call or jump if registers JSR or PCL are the destination.
- */
-void op_inc(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	result++;
-	vm->user_mem[dst_addr] = result & 0xf;
-	update_zero_flag(result, vm);
-	update_carry_flag(result, vm);
-	if ((vm->reg_flags & FLAG_CARRY) &&
-			(dst_addr == get_reg_addr(&vm->reg_jsr, vm) ||
-			dst_addr == get_reg_addr(&vm->reg_pcl, vm))) {
-		/* Carry over to pcm and pch. */
-		vm->reg_pcm++;
-		if (vm->reg_pcm & 0x10) {
-			vm->reg_pcm &= 0xf;
-			vm->reg_pch = (vm->reg_pch + 1) & 0xf;
-		}
-	}
-	maybe_call_or_jump(dst_addr, vm);
-}
-
-/*
- * DEC operation (decrement).
- * May initiate a call or jump if registers JSR or PCL are the destination.
- */
-void op_dec(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	result--;
-	vm->user_mem[dst_addr] = result & 0xf;
-	update_zero_flag(result, vm);
-	update_borrow_flag(result, vm);
-	if (!(vm->reg_flags & FLAG_CARRY) &&
-			(dst_addr == get_reg_addr(&vm->reg_jsr, vm) ||
-			dst_addr == get_reg_addr(&vm->reg_pcl, vm))) {
-		/* Carry over to pcm and pch. */
-		vm->reg_pcm--;
-		if (vm->reg_pcm & 0x10) {
-			vm->reg_pcm &= 0xf;
-			vm->reg_pch = (vm->reg_pch - 1) & 0xf;
-		}
-	}
-	maybe_call_or_jump(dst_addr, vm);
-}
-
-/*
- * DSZ operation (decrement and skip next instruction if zero).
- */
-void op_dsz(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	result--;
-	result &= 0xf;
-	vm->user_mem[dst_addr] = result;
-	if (!result) {
-		vm->reg_pc++;
-	}
-}
-
-/*
- * EXR operation (exchange registers).
- */
-void op_exr(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	uint8_t n = descr->src->get_val(instr, vm);
-	if (!n) {
-		n = 0x10;
-	}
-	memory_word_t buf[n];
-	size_t size = n * sizeof(memory_word_t);
-	memcpy(buf, vm->main_regs_page, size);
-	memcpy(vm->main_regs_page, vm->alt_regs_page, size);
-	memcpy(vm->alt_regs_page, buf, size);
-}
-
-/*
- * BIT operation (test bit).
- */
-void op_bit(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t m = descr->src->get_val(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr] & (1 << m);
-	update_zero_flag(result, vm);
-}
-
-/*
- * BSET operation (set bit).
- */
-void op_bset(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t m = descr->src->get_val(instr, vm);
-	vm->user_mem[dst_addr] |= 1 << m;
-}
-
-/*
- * BCLR operation (clear bit).
- */
-void op_bclr(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t m = descr->src->get_val(instr, vm);
-	vm->user_mem[dst_addr] &= ~(1 << m);
-}
-
-/*
- * BTG operation (toggle bit).
- */
-void op_btg(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t m = descr->src->get_val(instr, vm);
-	vm->user_mem[dst_addr] ^= 1 << m;
-}
-
-/*
- * RRC operation (rotate right through carry).
- */
-void op_rrc(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	memory_addr_t dst_addr = descr->dst->get_addr(instr, vm);
-	uint8_t result = vm->user_mem[dst_addr];
-	bool carry = vm->reg_flags & FLAG_CARRY;
-	if (result & 0x1) {
-		vm->reg_flags |= FLAG_CARRY;
-	} else {
-		vm->reg_flags &= ~FLAG_CARRY;
-	}
-	result >>= 1;
-	if (carry) {
-		result |= 0x8;
-	}
-	vm->user_mem[dst_addr] = result;
-	update_zero_flag(result, vm);
-}
-
-/*
- * RET operation (return from subroutine).
- */
-void op_ret(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	if (!vm->reg_sp) {
-		kill(0, SIGUSR1); /* Trigger UI cleanup. */
-		fprintf(stderr, "Stack underflow.\n");
-		exit(EXIT_FAILURE);
-	}
-	uint8_t n = descr->src->get_val(instr, vm);
-	vm->reg_r0 = n;
-	vm->reg_sp--;
-	memory_word_t ret_ptr = vm->reg_sp * 3;
-	vm->reg_pc = vm->stack[ret_ptr] | (vm->stack[ret_ptr + 1] << 4) | (vm->stack[ret_ptr + 2] << 8);
-}
-
-/*
- * SKIP operation (skip next instructions conditionally).
- */
-void op_skip(const struct vm_instruction *instr, const struct instruction_descriptor *descr, struct vm_state *vm)
-{
-	uint8_t cnd_flg = descr->cnd->get_val(instr, vm);
-	uint8_t m = descr->src->get_val(instr, vm);
-	if (!m) {
-		m = 4;
-	}
-	bool result = false;
-	switch (cnd_flg) {
-	case 0:
-		result = vm->reg_flags & FLAG_CARRY;
-		break;
-	case 1:
-		result = !(vm->reg_flags & FLAG_CARRY);
-		break;
-	case 2:
-		result = vm->reg_flags & FLAG_ZERO;
-		break;
-	case 3:
-		result = !(vm->reg_flags & FLAG_ZERO);
-		break;
-	}
-	if (result) {
-		vm->reg_pc += m;
-	}
-}
-
-const struct operation OP_ADD  = {.mnemnonic = "ADD",  .op_fn = op_add};
-const struct operation OP_ADC  = {.mnemnonic = "ADC",  .op_fn = op_adc};
-const struct operation OP_SUB  = {.mnemnonic = "SUB",  .op_fn = op_sub};
-const struct operation OP_SBB  = {.mnemnonic = "SBB",  .op_fn = op_sbb};
-const struct operation OP_OR   = {.mnemnonic = "OR",   .op_fn = op_or};
-const struct operation OP_AND  = {.mnemnonic = "AND",  .op_fn = op_and};
-const struct operation OP_XOR  = {.mnemnonic = "XOR",  .op_fn = op_xor};
-const struct operation OP_MOV  = {.mnemnonic = "MOV",  .op_fn = op_mov};
-const struct operation OP_JR   = {.mnemnonic = "JR",   .op_fn = op_jr};
-const struct operation OP_CP   = {.mnemnonic = "CP",   .op_fn = op_cp};
-const struct operation OP_INC  = {.mnemnonic = "INC",  .op_fn = op_inc};
-const struct operation OP_DEC  = {.mnemnonic = "DEC",  .op_fn = op_dec};
-const struct operation OP_DSZ  = {.mnemnonic = "DSZ",  .op_fn = op_dsz};
-const struct operation OP_EXR  = {.mnemnonic = "EXR",  .op_fn = op_exr};
-const struct operation OP_BIT  = {.mnemnonic = "BIT",  .op_fn = op_bit};
-const struct operation OP_BSET = {.mnemnonic = "BSET", .op_fn = op_bset};
-const struct operation OP_BCLR = {.mnemnonic = "BCLR", .op_fn = op_bclr};
-const struct operation OP_BTG  = {.mnemnonic = "BTG",  .op_fn = op_btg};
-const struct operation OP_RRC  = {.mnemnonic = "RRC",  .op_fn = op_rrc};
-const struct operation OP_RET  = {.mnemnonic = "RET",  .op_fn = op_ret};
-const struct operation OP_SKIP = {.mnemnonic = "SKIP", .op_fn = op_skip};
-
-/* Single nibble opcodes. */
+const struct operation OP_ADD  = {.mnemnonic = "ADD"};
+const struct operation OP_ADC  = {.mnemnonic = "ADC"};
+const struct operation OP_SUB  = {.mnemnonic = "SUB"};
+const struct operation OP_SBB  = {.mnemnonic = "SBB"};
+const struct operation OP_OR   = {.mnemnonic = "OR"};
+const struct operation OP_AND  = {.mnemnonic = "AND"};
+const struct operation OP_XOR  = {.mnemnonic = "XOR"};
+const struct operation OP_MOV  = {.mnemnonic = "MOV"};
+const struct operation OP_JR   = {.mnemnonic = "JR"};
+const struct operation OP_CP   = {.mnemnonic = "CP"};
+const struct operation OP_INC  = {.mnemnonic = "INC"};
+const struct operation OP_DEC  = {.mnemnonic = "DEC"};
+const struct operation OP_DSZ  = {.mnemnonic = "DSZ"};
+const struct operation OP_EXR  = {.mnemnonic = "EXR"};
+const struct operation OP_BIT  = {.mnemnonic = "BIT"};
+const struct operation OP_BSET = {.mnemnonic = "BSET"};
+const struct operation OP_BCLR = {.mnemnonic = "BCLR"};
+const struct operation OP_BTG  = {.mnemnonic = "BTG"};
+const struct operation OP_RRC  = {.mnemnonic = "RRC"};
+const struct operation OP_RET  = {.mnemnonic = "RET"};
+const struct operation OP_SKIP = {.mnemnonic = "SKIP"};
+
+#define INSTRUCTION_DESCRIPTOR(name, opcode, operation, fn, dst_kind, cnd_kind, src_kind, flags) \
+	[opcode] = {.op = &OP_##operation, .dst = OPERAND_##dst_kind, .cnd = OPERAND_##cnd_kind, \
+		.src = OPERAND_##src_kind, .flg = flags, .variant = VARIANT_##name},
+
+/* Single nibble opcodes; the first entry is not an instruction as it indicates a wide opcode. */
 const struct instruction_descriptor INSTRUCTIONS[] = {
-	{},  /* Not an instruction as it indicates a wide opcode. */
-	{.op = &OP_ADD,  .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_ADC,  .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_SUB,  .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_SBB,  .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_OR,   .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_AND,  .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_XOR,  .dst = &DST_RX,  .src = &SRC_RY},
-	{.op = &OP_MOV,  .dst = &DST_RX,  .src = &SRC_RY,  .flg = OP_FLAG_CAN_JUMP},
-	{.op = &OP_MOV,  .dst = &DST_RX,  .src = &SRC_N,   .flg = OP_FLAG_CAN_JUMP},
-	{.op = &OP_MOV,  .dst = &DST_IND, .src = &SRC_R0},
-	{.op = &OP_MOV,  .dst = &DST_R0,  .src = &SRC_IND},
-	{.op = &OP_MOV,  .dst = &DST_PTR, .src = &SRC_R0,  .flg = OP_FLAG_CAN_WR_SFR},
-	{.op = &OP_MOV,  .dst = &DST_R0,  .src = &SRC_PTR, .flg = OP_FLAG_CAN_RD_SFR},
-	{.op = &OP_MOV,  .dst = &DST_PC,  .src = &SRC_NN,  .flg = OP_FLAG_DST_BYTE},
-	{.op = &OP_JR,                    .src = &SRC_NN},
+	FOR_EACH_INSTRUCTION(INSTRUCTION_DESCRIPTOR)
 };
 
 /* Double nibble opcodes (indexed by second nibble; first nibble is zero). */
 const struct instruction_descriptor INSTRUCTIONS_WIDE[] = {
-	{.op = &OP_CP,   .dst = &DST_R0,  .src = &SRC_N},
-	{.op = &OP_ADD,  .dst = &DST_R0,  .src = &SRC_N},
-	{.op = &OP_INC,  .dst = &DST_RY,                   .flg = OP_FLAG_CAN_JUMP},
-	{.op = &OP_DEC,  .dst = &DST_RY,                   .flg = OP_FLAG_CAN_JUMP},
-	{.op = &OP_DSZ,  .dst = &DST_RY},
-	{.op = &OP_OR,   .dst = &DST_R0,  .src = &SRC_N,   .flg = OP_FLAG_UPDATE_CARRY},
-	{.op = &OP_AND,  .dst = &DST_R0,  .src = &SRC_N,   .flg = OP_FLAG_UPDATE_CARRY},
-	{.op = &OP_XOR,  .dst = &DST_R0,  .src = &SRC_N,   .flg = OP_FLAG_UPDATE_CARRY},
-	{.op = &OP_EXR,                   .src = &SRC_N},
-	{.op = &OP_BIT,  .dst = &DST_RGI, .src = &SRC_M},
-	{.op = &OP_BSET, .dst = &DST_RGO, .src = &SRC_M},
-	{.op = &OP_BCLR, .dst = &DST_RGO, .src = &SRC_M},
-	{.op = &OP_BTG,  .dst = &DST_RGO, .src = &SRC_M},
-	{.op = &OP_RRC,  .dst = &DST_RY},
-	{.op = &OP_RET,  .dst = &DST_R0,  .src = &SRC_N},
-	{.op = &OP_SKIP, .cnd = &CND_FLG, .src = &SRC_M},
+	FOR_EACH_WIDE_INSTRUCTION(INSTRUCTION_DESCRIPTOR)
 };
 
+#undef INSTRUCTION_DESCRIPTOR
+
 void decode_instruction(program_word_t pi, struct vm_instruction *vmi)
 {
 	vmi->nibble1 = (pi >> 8) & 0xf;
@@ -798,6 +258,28 @@ const struct instruction_descriptor *get_instruction_descriptor(const struct vm_
 	}
 }
 
+void predecode_instruction(program_word_t pi, struct decoded_instruction *di)
+{
+	decode_instruction(pi, &di->vmi);
+	di->variant = get_instruction_descriptor(&di->vmi)->variant;
+}
+
+bool may_access_rd_flags(const struct decoded_instruction *di)
+{
+	const struct vm_instruction *vmi = &di->vmi;
+	uint8_t nn = (vmi->nibble2 << 4) | vmi->nibble3;
+	switch (di->variant) {
+	case VARIANT_MOV_IND_R0:
+	case VARIANT_MOV_R0_IND:
+		return true;
+	case VARIANT_MOV_PTR_R0:
+	case VARIANT_MOV_R0_PTR:
+		return nn == SFR_RD_FLAGS;
+	default:
+		return false;
+	}
+}
+
 void disassemble_instruction(const struct vm_instruction *vmi, const struct instruction_descriptor *descr, char *out, size_t size)
 {
 	int count;
@@ -806,15 +288,15 @@ void disassemble_instruction(const struct vm_instruction *vmi, const struct inst
 	size -= count;
 	int i = 0;
 	char info[INFO_SIZE];
-	if (descr->dst != NULL) {
-		descr->dst->get_info(vmi, info);
+	if (descr->dst != OPERAND_NONE) {
+		OPERANDS[descr->dst].get_info(vmi, info);
 		count = snprintf(out, size, "%s", info);
 		out += count;
 		size -= count;
 		i++;
 	}
-	if (descr->cnd!= NULL) {
-		descr->cnd->get_info(vmi, info);
+	if (descr->cnd != OPERAND_NONE) {
+		OPERANDS[descr->cnd].get_info(vmi, info);
 		if (i && size > 1) {
 			*out++ = ',';
 			*out = '\0';
@@ -825,8 +307,8 @@ void disassemble_instruction(const struct vm_instruction *vmi, const struct inst
 		size -= count;
 		i++;
 	}
-	if (descr->src != NULL) {
-		descr->src->get_info(vmi, info);
+	if (descr->src != OPERAND_NONE) {
+		OPERANDS[descr->src].get_info(vmi, info);
 		if (i && size > 1) {
 			*out++ = ',';
 			*out = '\0';
@@ -0,0 +1,94 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pov.h"
+
+#include <string.h>
+
+/* Returns the page shown in a slot of the matrix, left to right. */
+static inline memory_word_t get_slot_page(const struct pov_state *pov, int slot)
+{
+	return slot ? pov->page : (pov->page + 1) % NUM_PAGES;
+}
+
+/* Adds the cycles since the row was last accounted to its lit pixels. */
+static inline void account_row(struct pov_state *pov, int slot, int row, memory_word_t value, uint64_t now)
+{
+	uint32_t dt = now - pov->row_start[slot][row];
+	for (int k = 0; k < 4; k++) {
+		if (value & (1 << k)) {
+			pov->on_cycles[slot][row][k] += dt;
+		}
+	}
+	pov->row_start[slot][row] = now;
+}
+
+void account_all(struct vm_state *vm)
+{
+	struct pov_state *pov = &vm->pov;
+	for (int slot = 0; slot < POV_PAGES; slot++) {
+		const memory_word_t *page = vm->pages[get_slot_page(pov, slot)];
+		for (int row = 0; row < PAGE_SIZE; row++) {
+			account_row(pov, slot, row, page[row], vm->cycle_count);
+		}
+	}
+}
+
+void pov_reset(struct vm_state *vm)
+{
+	struct pov_state *pov = &vm->pov;
+	pov->page = vm->reg_page;
+	pov->frame_start = vm->cycle_count;
+	for (int slot = 0; slot < POV_PAGES; slot++) {
+		for (int row = 0; row < PAGE_SIZE; row++) {
+			pov->row_start[slot][row] = vm->cycle_count;
+		}
+	}
+	memset(pov->on_cycles, 0, sizeof(pov->on_cycles));
+}
+
+void pov_write(struct vm_state *vm, memory_addr_t addr, memory_word_t old_value)
+{
+	struct pov_state *pov = &vm->pov;
+	if (addr == SFR_PAGE) {
+		/* The pages are accounted for the matrix positions, so the old ones end here. */
+		if (vm->reg_page != pov->page) {
+			account_all(vm);
+			pov->page = vm->reg_page;
+		}
+		return;
+	}
+	memory_word_t page = addr / PAGE_SIZE;
+	for (int slot = 0; slot < POV_PAGES; slot++) {
+		if (page == get_slot_page(pov, slot)) {
+			account_row(pov, slot, addr % PAGE_SIZE, old_value, vm->cycle_count);
+		}
+	}
+}
+
+uint64_t pov_take(struct vm_state *vm, uint32_t on_cycles[POV_PAGES][PAGE_SIZE][4])
+{
+	struct pov_state *pov = &vm->pov;
+	account_all(vm);
+	memcpy(on_cycles, pov->on_cycles, sizeof(pov->on_cycles));
+	memset(pov->on_cycles, 0, sizeof(pov->on_cycles));
+	uint64_t cycles = vm->cycle_count - pov->frame_start;
+	pov->frame_start = vm->cycle_count;
+	return cycles;
+}
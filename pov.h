@@ -0,0 +1,52 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistence of vision model of the LED matrix.
+ *
+ * Programs can multiplex or dim pixels by rewriting the displayed pages faster
+ * than the UI redraws, so sampling page memory once per frame shows flicker or
+ * wrong brightness. Instead, the cycles each displayed pixel was lit are
+ * accumulated, for the UI to show the average over a frame. Pixels are only
+ * accounted when their row is written, the Page register changes or the
+ * accumulated time is taken, never per cycle. Like vm_state.dirty_rows, it is
+ * only maintained by journal_step() and journal_undo(), and by code changing
+ * memory outside of cycles, so other engines do not pay for it.
+ */
+
+#ifndef _POV_H
+#define _POV_H
+
+#include "vm.h"
+
+#include <stdint.h>
+
+/* Restarts accumulation from the current memory, e.g. after the VM state was changed otherwise. */
+void pov_reset(struct vm_state *vm);
+
+/* Accounts for the old value of a nibble that was just overwritten, at the current cycle count. */
+void pov_write(struct vm_state *vm, memory_addr_t addr, memory_word_t old_value);
+
+/*
+ * Moves the cycles each pixel was lit since the last call to on_cycles, left
+ * page first, and restarts accumulation. Returns the number of cycles covered.
+ */
+uint64_t pov_take(struct vm_state *vm, uint32_t on_cycles[POV_PAGES][PAGE_SIZE][4]);
+
+#endif /* _POV_H */
@@ -0,0 +1,279 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+
+#include "exec.h"
+#include "ops.h"
+
+#include <stdlib.h>
+
+/* Rows printed per table of the report. */
+const int PROFILE_REPORT_ROWS = 20;
+
+/* Bits of the hash table index mapping (parent, subroutine) to a context. */
+#define CONTEXT_HASH_BITS 13
+
+/* A call path, identified by the subroutine entered and the path it was called from. */
+struct profile_context {
+	uint32_t parent;	/* Index of the caller's context; the root is its own parent. */
+	program_addr_t addr;	/* Entry point of the subroutine. */
+	uint64_t cycles;	/* Cycles spent in the subroutine itself, not in the ones it called. */
+};
+
+struct profile {
+	uint64_t cycles;
+	uint64_t pc_cycles[PROGRAM_MEMORY_SIZE];
+	uint64_t variant_cycles[NUM_VARIANTS];
+	struct profile_context contexts[PROFILE_MAX_CONTEXTS];	/* The first one is the root. */
+	uint16_t context_table[1 << CONTEXT_HASH_BITS];	/* Open addressing table of context indices; 0 is free. */
+	uint32_t num_contexts;
+	uint32_t context;	/* Index of the current context. */
+	uint32_t untracked_depth;	/* Calls made once the contexts ran out, counted towards the current one. */
+};
+
+/* A table row in the report, sorted by cycles. */
+struct report_row {
+	uint64_t cycles;
+	uint64_t count;
+	program_addr_t first;
+	program_addr_t last;
+};
+
+struct profile *profile_create(void)
+{
+	struct profile *profile = calloc(1, sizeof(struct profile));
+	if (!profile) {
+		fprintf(stderr, "Failed to allocate profile.\n");
+		return NULL;
+	}
+	profile->num_contexts = 1;
+	return profile;
+}
+
+void profile_destroy(struct profile *profile)
+{
+	free(profile);
+}
+
+/* Switches to the context of a subroutine called from the current one. */
+void enter_subroutine(struct profile *profile, program_addr_t addr)
+{
+	if (profile->untracked_depth) {
+		profile->untracked_depth++;
+		return;
+	}
+	uint32_t parent = profile->context;
+	uint32_t hash = ((parent * PROGRAM_MEMORY_SIZE + addr) * 2654435761u) >> (32 - CONTEXT_HASH_BITS);
+	uint32_t mask = (1 << CONTEXT_HASH_BITS) - 1;
+	for (;; hash = (hash + 1) & mask) {
+		uint16_t index = profile->context_table[hash];
+		if (!index) {
+			break;
+		}
+		const struct profile_context *context = &profile->contexts[index];
+		if (context->parent == parent && context->addr == addr) {
+			profile->context = index;
+			return;
+		}
+	}
+	if (profile->num_contexts == PROFILE_MAX_CONTEXTS) {
+		profile->untracked_depth++;
+		return;
+	}
+	uint32_t index = profile->num_contexts++;
+	profile->contexts[index].parent = parent;
+	profile->contexts[index].addr = addr;
+	profile->context_table[hash] = index;
+	profile->context = index;
+}
+
+/* Switches back to the caller's context. Returns from calls made before profiling began, e.g. when resuming a snapshot, stay at the root. */
+void leave_subroutine(struct profile *profile)
+{
+	if (profile->untracked_depth) {
+		profile->untracked_depth--;
+	} else {
+		profile->context = profile->contexts[profile->context].parent;
+	}
+}
+
+uint64_t profile_run(struct profile *profile, struct vm_state *vm, uint64_t max_cycles)
+{
+	uint64_t start = vm->cycle_count;
+	while (!vm->fault && vm->cycle_count - start < max_cycles) {
+		vm_begin_cycle(vm);
+		program_addr_t pc = vm->reg_pc;
+		uint8_t sp = vm->reg_sp;
+		const struct decoded_instruction *di = vm_fetch_next(vm);
+		exec_decoded(di, vm);
+		vm_end_cycles(vm, 1);
+
+		profile->pc_cycles[pc]++;
+		profile->variant_cycles[di->variant]++;
+		profile->contexts[profile->context].cycles++;
+		if (vm->reg_sp > sp) {
+			enter_subroutine(profile, vm->reg_pc);
+		} else if (vm->reg_sp < sp) {
+			leave_subroutine(profile);
+		}
+	}
+	uint64_t cycles = vm->cycle_count - start;
+	profile->cycles += cycles;
+	return cycles;
+}
+
+int compare_rows(const void *a, const void *b)
+{
+	const struct report_row *row_a = a;
+	const struct report_row *row_b = b;
+	if (row_a->cycles != row_b->cycles) {
+		return row_a->cycles < row_b->cycles ? 1 : -1;
+	}
+	return row_a->first - row_b->first;
+}
+
+double get_percentage(const struct profile *profile, uint64_t cycles)
+{
+	return profile->cycles ? 100.0 * cycles / profile->cycles : 0;
+}
+
+void report_addresses(const struct profile *profile, const struct program *prg, FILE *out)
+{
+	struct report_row rows[PROGRAM_MEMORY_SIZE];
+	int num_rows = 0;
+	for (int pc = 0; pc < PROGRAM_MEMORY_SIZE; pc++) {
+		if (profile->pc_cycles[pc]) {
+			rows[num_rows++] = (struct report_row) {.cycles = profile->pc_cycles[pc], .first = pc};
+		}
+	}
+	qsort(rows, num_rows, sizeof(rows[0]), compare_rows);
+
+	fprintf(out, "Hot addresses:\n");
+	fprintf(out, "      Cycles       %%  ADDR  INSTRUCTION\n");
+	for (int i = 0; i < num_rows && i < PROFILE_REPORT_ROWS; i++) {
+		struct vm_instruction vmi;
+		decode_instruction(prg->instructions[rows[i].first], &vmi);
+		char text[64];
+		disassemble_instruction(&vmi, get_instruction_descriptor(&vmi), text, sizeof(text));
+		fprintf(out, "%12llu %6.2f%%  %03hx   %s\n", (unsigned long long) rows[i].cycles,
+			get_percentage(profile, rows[i].cycles), rows[i].first, text);
+	}
+}
+
+/* Loops are the addresses from the target of a backward JR up to the JR itself, which runs once per iteration. */
+void report_loops(const struct profile *profile, const struct program *prg, FILE *out)
+{
+	struct report_row rows[PROGRAM_MEMORY_SIZE];
+	int num_rows = 0;
+	for (int pc = 0; pc < PROGRAM_MEMORY_SIZE; pc++) {
+		if (!profile->pc_cycles[pc]) {
+			continue;
+		}
+		struct vm_instruction vmi;
+		decode_instruction(prg->instructions[pc], &vmi);
+		if (get_instruction_descriptor(&vmi)->variant != VARIANT_JR_NN) {
+			continue;
+		}
+		int target = pc + 1 + (int8_t) ((vmi.nibble2 << 4) | vmi.nibble3);
+		if (target > pc || target < 0) {
+			continue;
+		}
+		uint64_t cycles = 0;
+		for (int i = target; i <= pc; i++) {
+			cycles += profile->pc_cycles[i];
+		}
+		rows[num_rows++] = (struct report_row) {
+			.cycles = cycles,
+			.count = profile->pc_cycles[pc],
+			.first = target,
+			.last = pc,
+		};
+	}
+	qsort(rows, num_rows, sizeof(rows[0]), compare_rows);
+
+	fprintf(out, "Hot loops:\n");
+	fprintf(out, "      Cycles       %%    Iterations  ADDR\n");
+	for (int i = 0; i < num_rows && i < PROFILE_REPORT_ROWS; i++) {
+		fprintf(out, "%12llu %6.2f%%  %12llu  %03hx-%03hx\n", (unsigned long long) rows[i].cycles,
+			get_percentage(profile, rows[i].cycles), (unsigned long long) rows[i].count,
+			rows[i].first, rows[i].last);
+	}
+}
+
+void report_variants(const struct profile *profile, FILE *out)
+{
+	struct report_row rows[NUM_VARIANTS];
+	int num_rows = 0;
+	for (int variant = 0; variant < NUM_VARIANTS; variant++) {
+		if (profile->variant_cycles[variant]) {
+			rows[num_rows++] = (struct report_row) {.cycles = profile->variant_cycles[variant], .first = variant};
+		}
+	}
+	qsort(rows, num_rows, sizeof(rows[0]), compare_rows);
+
+	fprintf(out, "Instructions:\n");
+	fprintf(out, "      Cycles       %%  VARIANT\n");
+	for (int i = 0; i < num_rows; i++) {
+		fprintf(out, "%12llu %6.2f%%  %s\n", (unsigned long long) rows[i].cycles,
+			get_percentage(profile, rows[i].cycles), VARIANT_NAMES[rows[i].first]);
+	}
+}
+
+void profile_report(const struct profile *profile, const struct program *prg, FILE *out)
+{
+	report_addresses(profile, prg, out);
+	fprintf(out, "\n");
+	report_loops(profile, prg, out);
+	fprintf(out, "\n");
+	report_variants(profile, out);
+}
+
+/* Prints the frames of a call path, outermost first. */
+void write_frames(const struct profile *profile, uint32_t index, FILE *out)
+{
+	const struct profile_context *context = &profile->contexts[index];
+	if (!index) {
+		fprintf(out, "root");
+		return;
+	}
+	write_frames(profile, context->parent, out);
+	fprintf(out, ";sub_%03hx", context->addr);
+}
+
+bool profile_write_folded(const struct profile *profile, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	for (uint32_t i = 0; i < profile->num_contexts; i++) {
+		if (profile->contexts[i].cycles) {
+			write_frames(profile, i, f);
+			fprintf(f, " %llu\n", (unsigned long long) profile->contexts[i].cycles);
+		}
+	}
+	bool success = !ferror(f);
+	success = !fclose(f) && success;
+	if (!success) {
+		fprintf(stderr, "Could not write folded stacks to %s\n", path);
+	}
+	return success;
+}
@@ -0,0 +1,69 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Execution profiler.
+ *
+ * Counts the cycles spent at every program address and in every instruction
+ * variant, along with the subroutines on the call stack at the time, so the
+ * report can point at hot instructions, hot loops and hot call paths. The
+ * call stack is followed by watching the stack pointer: a cycle that pushes a
+ * return address enters a subroutine at the new program counter, and one that
+ * pops it returns to the caller.
+ */
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of distinct call paths that are told apart; deeper calls count towards their caller. */
+#define PROFILE_MAX_CONTEXTS 0x1000
+
+struct profile;
+
+/* Allocates an empty profile. Returns NULL on error. */
+struct profile *profile_create(void);
+
+void profile_destroy(struct profile *profile);
+
+/*
+ * Executes up to max_cycles cycles with the interpreter, counting each,
+ * stopping early if the VM faults. Returns the number of cycles executed.
+ * Like vm_run() without fast-forwarding or native code.
+ */
+uint64_t profile_run(struct profile *profile, struct vm_state *vm, uint64_t max_cycles);
+
+/*
+ * Prints the hottest addresses with their disassembly, the hottest loops
+ * closed by backward JR instructions and the cycles per instruction variant.
+ */
+void profile_report(const struct profile *profile, const struct program *prg, FILE *out);
+
+/*
+ * Writes cycles per call path in the folded stack format read by flame graph
+ * tools, one "root;sub_012;sub_345 cycles" line per path. Returns false on error.
+ */
+bool profile_write_folded(const struct profile *profile, const char *path);
+
+#endif /* _PROFILE_H */
@@ -115,3 +115,15 @@ void *read_file(const char *path, size_t *size)
 
 	return buf;
 }
+
+struct program *load_program_file(const char *path)
+{
+	size_t size;
+	void *buf = read_file(path, &size);
+	if (!buf) {
+		return NULL;
+	}
+	struct program *prg = load_program(buf, size);
+	free(buf);
+	return prg;
+}
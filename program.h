@@ -45,4 +45,7 @@ struct program *load_program(const void *buffer, size_t size);
 
 void *read_file(const char *path, size_t *size);
 
+/* Reads and loads a program from a file. Returns NULL on error. */
+struct program *load_program_file(const char *path);
+
 #endif /* _PROGRAM_H */
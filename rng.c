@@ -74,6 +74,12 @@ uint8_t set_rng_seed(struct rng_state *rng, uint8_t seed)
 	return seed_to_nibble(rng->seed);
 }
 
+uint8_t set_rng_state(struct rng_state *rng, uint32_t seed)
+{
+	rng->seed = seed;
+	return seed_to_nibble(rng->seed);
+}
+
 /*
  * Returns the next 4 bit pseudorandom number based on an internal 32 bit state.
  * This is a 32 bit congruential pseudorandom number generator with some
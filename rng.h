@@ -28,12 +28,19 @@ struct rng_state {
 	uint32_t seed;
 };
 
+/* Linear congruential generator parameters: seed = RNG_A * seed + RNG_C. */
+extern const uint32_t RNG_A;
+extern const uint32_t RNG_C;
+
 /* Initializes the PRNG state and returns the first number in the sequence. */
 uint8_t init_rng(struct rng_state *rng);
 
 /* Resets the PRNG seed and returns the first number in the sequence. */
 uint8_t set_rng_seed(struct rng_state *rng, uint8_t seed);
 
+/* Sets all 32 bits of the PRNG state and returns the first number in the sequence. */
+uint8_t set_rng_state(struct rng_state *rng, uint32_t seed);
+
 /* Gets the next number in the sequence from the PRNG. */
 uint8_t next_rng(struct rng_state *rng);
 
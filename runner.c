@@ -0,0 +1,447 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "runner.h"
+
+#include "pov.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/* Flags the middle view as published since the UI last took it. */
+#define RUNNER_VIEW_NEW 0x4
+
+const int KEY_UP_DELAY_USEC = 200000;	/* Delay after which a key press will generate a corresponding key release. */
+const int PUBLISH_PERIOD_USEC = 1000;	/* Minimum period between views published while running. */
+const int RUNNER_SLICE_USEC = 500;	/* Maximum time to execute cycles before checking for events again. */
+const int CLOCK_RATE_WINDOW_USEC = 1000000;	/* Period over which the achieved clock rate is measured. */
+const vm_clock_t NO_DEADLINE = LLONG_MAX;
+
+/* Wakes up whoever polls an eventfd. */
+void signal_fd(int fd)
+{
+	uint64_t one = 1;
+	/* Can only fail when the counter is about to overflow, which leaves it signaled anyway. */
+	ssize_t written = write(fd, &one, sizeof(one));
+	(void) written;
+}
+
+/* Resets a signaled eventfd or expired timerfd. */
+void drain_fd(int fd)
+{
+	uint64_t count;
+	ssize_t n = read(fd, &count, sizeof(count)); /* Fails with EAGAIN if not signaled. */
+	(void) n;
+}
+
+/*
+ * Adds the changes of the last published view to a view, or removes them
+ * again if sign is -1. Counters wrap around, so removing them is exact.
+ */
+void carry_over_changes(const struct runner *runner, struct vm_view *view, int sign)
+{
+	view->pov_cycles += sign * runner->published_pov_cycles;
+	for (int i = 0; i < POV_PAGES; i++) {
+		for (int j = 0; j < PAGE_SIZE; j++) {
+			for (int k = 0; k < 4; k++) {
+				view->on_cycles[i][j][k] += sign * runner->published_on_cycles[i][j][k];
+			}
+		}
+	}
+}
+
+void publish_view(struct runner *runner)
+{
+	struct vm_state *vm = runner->vm;
+	struct vm_view *view = &runner->views[runner->back];
+	memcpy(view->user_mem, vm->user_mem, sizeof(view->user_mem));
+	view->pov_cycles = pov_take(vm, view->on_cycles);
+	memcpy(view->frame_mem, runner->frame_mem, sizeof(view->frame_mem));
+	view->frame_count = runner->frame_count;
+	view->reg_pc = vm->reg_pc;
+	view->reg_sp = vm->reg_sp;
+	view->reg_flags = vm->reg_flags;
+	view->fault = vm->fault;
+	view->paused = runner->paused;
+	view->cycle_count = vm->cycle_count;
+	view->undo_count = runner->journal.count;
+	view->dt_last_cycle = vm->dt_last_cycle;
+	view->dt_last_cycle_period = vm->dt_last_cycle_period;
+	view->dt_last_user_sync_period = vm->dt_last_user_sync_period;
+	view->clock_rate = runner->clock_rate;
+	view->requested_clock_rate = vm_get_clock_frequency(vm);
+
+	/*
+	 * Carry over the changes of the previous view unless the UI took it, in
+	 * which case it saw them. Only the UI clears RUNNER_VIEW_NEW, so if it
+	 * takes the previous view before the swap, the swap fails once and the
+	 * changes are removed again.
+	 */
+	unsigned middle = atomic_load(&runner->middle);
+	bool carry_over = middle & RUNNER_VIEW_NEW;
+	for (;;) {
+		for (int i = 0; i < NUM_PAGES; i++) {
+			view->dirty_rows[i] = vm->dirty_rows[i] | (carry_over ? runner->published_rows[i] : 0);
+		}
+		if (carry_over) {
+			carry_over_changes(runner, view, 1);
+		}
+		if (atomic_compare_exchange_strong(&runner->middle, &middle, runner->back | RUNNER_VIEW_NEW)) {
+			break;
+		}
+		if (carry_over) {
+			carry_over_changes(runner, view, -1);
+		}
+		carry_over = false;
+	}
+	runner->back = middle & ~RUNNER_VIEW_NEW;
+
+	memcpy(runner->published_rows, view->dirty_rows, sizeof(runner->published_rows));
+	memset(vm->dirty_rows, 0, sizeof(vm->dirty_rows));
+	memcpy(runner->published_on_cycles, view->on_cycles, sizeof(view->on_cycles));
+	runner->published_pov_cycles = view->pov_cycles;
+	signal_fd(runner->view_fd);
+}
+
+const struct vm_view *runner_get_view(struct runner *runner)
+{
+	/* Drain first, so that a view published after the check below signals the fd again. */
+	drain_fd(runner->view_fd);
+	if (!(atomic_load(&runner->middle) & RUNNER_VIEW_NEW)) {
+		return NULL;
+	}
+	runner->front = atomic_exchange(&runner->middle, runner->front) & ~RUNNER_VIEW_NEW;
+	return &runner->views[runner->front];
+}
+
+int runner_get_view_fd(const struct runner *runner)
+{
+	return runner->view_fd;
+}
+
+bool runner_post(struct runner *runner, uint8_t type, uint16_t arg)
+{
+	unsigned head = atomic_load_explicit(&runner->event_head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&runner->event_tail, memory_order_acquire) == RUNNER_QUEUE_SIZE) {
+		return false;
+	}
+	runner->events[head % RUNNER_QUEUE_SIZE] = (struct runner_event) {.type = type, .arg = arg};
+	atomic_store_explicit(&runner->event_head, head + 1, memory_order_release);
+	signal_fd(runner->event_fd);
+	return true;
+}
+
+/* Takes the next event posted by the UI. Returns false if there is none. */
+bool take_event(struct runner *runner, struct runner_event *event)
+{
+	unsigned tail = atomic_load_explicit(&runner->event_tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&runner->event_head, memory_order_acquire)) {
+		return false;
+	}
+	*event = runner->events[tail % RUNNER_QUEUE_SIZE];
+	atomic_store_explicit(&runner->event_tail, tail + 1, memory_order_release);
+	return true;
+}
+
+/* Undoes cycles until reaching a breakpoint or the oldest recorded cycle. */
+void run_backwards(struct runner *runner)
+{
+	while (journal_undo(&runner->journal, runner->vm) && !runner->breakpoints[runner->vm->reg_pc]) {}
+}
+
+void resume(struct runner *runner)
+{
+	if (runner->paused) {
+		/* Time spent paused is not caught up with, so restart the timeline of cycles. */
+		runner->vm->t_next_cycle = get_vm_clock(&runner->vm->t_start);
+		runner->paused = false;
+	}
+}
+
+void handle_event(struct runner *runner, const struct runner_event *event)
+{
+	struct vm_state *vm = runner->vm;
+	memory_word_t old;
+	switch (event->type) {
+	case RUNNER_EVENT_RUN:
+		runner->single_step = false;
+		resume(runner);
+		break;
+	case RUNNER_EVENT_STEP:
+		runner->single_step = true;
+		resume(runner);
+		break;
+	case RUNNER_EVENT_UNDO:
+		journal_undo(&runner->journal, vm);
+		runner->paused = true;
+		break;
+	case RUNNER_EVENT_RUN_BACKWARDS:
+		run_backwards(runner);
+		runner->paused = true;
+		break;
+	case RUNNER_EVENT_SET_BREAKPOINT:
+	case RUNNER_EVENT_CLEAR_BREAKPOINT:
+		if (event->arg < PROGRAM_MEMORY_SIZE) {
+			runner->breakpoints[event->arg] = event->type == RUNNER_EVENT_SET_BREAKPOINT;
+		}
+		break;
+	case RUNNER_EVENT_PAGE:
+		old = vm->reg_page;
+		vm->reg_page = (vm->reg_page + event->arg) & 0xf;
+		vm_mark_dirty(vm, SFR_PAGE);
+		pov_write(vm, SFR_PAGE, old);
+		break;
+	case RUNNER_EVENT_KEY:
+		old = vm->reg_key_status;
+		vm->reg_key_status = KEY_STATUS_JUST_PRESS | KEY_STATUS_LAST_PRESS | KEY_STATUS_ANY_PRESS;
+		vm_mark_dirty(vm, SFR_KEY_STATUS);
+		pov_write(vm, SFR_KEY_STATUS, old);
+		old = vm->reg_key_reg;
+		vm->reg_key_reg = event->arg;
+		vm_mark_dirty(vm, SFR_KEY_REG);
+		pov_write(vm, SFR_KEY_REG, old);
+		runner->t_last_key_press = get_vm_clock(&vm->t_start);
+		break;
+	}
+}
+
+/* Returns true if the VM state changed. */
+bool handle_events(struct runner *runner)
+{
+	struct runner_event event;
+	bool changed = false;
+	while (take_event(runner, &event)) {
+		handle_event(runner, &event);
+		changed = true;
+	}
+
+	struct vm_state *vm = runner->vm;
+	if (vm->reg_key_status & KEY_STATUS_LAST_PRESS) {
+		/*
+		 * There's no easy/portable way to get key release events, so assume keys are released
+		 * after a preset amount of time.
+		 */
+		long elapsed_usec = vm_clock_as_usec(get_vm_clock(&vm->t_start) - runner->t_last_key_press);
+		if (elapsed_usec >= KEY_UP_DELAY_USEC) {
+			/* Generate an artificial key release event, assume all keys have been released. */
+			memory_word_t old = vm->reg_key_status;
+			vm->reg_key_status &= ~(KEY_STATUS_LAST_PRESS | KEY_STATUS_ANY_PRESS);
+			vm_mark_dirty(vm, SFR_KEY_STATUS);
+			pov_write(vm, SFR_KEY_STATUS, old);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+/*
+ * Executes all cycles that are due, until slice_end, recording them so that
+ * they can be undone. Stops early when pausing or on a fault.
+ */
+void run_for(struct runner *runner, vm_clock_t slice_end, bool *dirty)
+{
+	struct vm_state *vm = runner->vm;
+	vm_clock_t now = get_vm_clock(&vm->t_start);
+	while (now < slice_end && vm_get_next_cycle_time(vm) <= now) {
+		journal_step(&runner->journal, vm);
+		*dirty = true;
+		if (vm->user_sync_reads != runner->frame_sync_reads) {
+			/* The program finished drawing before it waited for the UserSync it just consumed. */
+			memcpy(runner->frame_mem, vm->user_mem, sizeof(runner->frame_mem));
+			runner->frame_count++;
+			runner->frame_sync_reads = vm->user_sync_reads;
+		}
+		if (vm->fault) {
+			break;
+		}
+		if (runner->single_step || runner->breakpoints[vm->reg_pc]) {
+			runner->paused = true; /* Single step mode pauses after each instruction. */
+			break;
+		}
+		now = vm->t_cycle_end;
+	}
+}
+
+/* Measures the clock rate achieved while running with the same Clock setting. */
+void measure_clock_rate(struct runner *runner, vm_clock_t now)
+{
+	const struct vm_state *vm = runner->vm;
+	if (runner->paused) {
+		runner->rate_window_open = false;
+		return;
+	}
+	if (runner->rate_window_open && vm->reg_clock == runner->rate_clock) {
+		vm_clock_t dt = now - runner->t_rate_start;
+		if (vm_clock_as_usec(dt) < CLOCK_RATE_WINDOW_USEC) {
+			return;
+		}
+		runner->clock_rate = (vm->cycle_count - runner->rate_start_cycles) * 1e9 / dt;
+	}
+	runner->rate_window_open = true;
+	runner->rate_clock = vm->reg_clock;
+	runner->rate_start_cycles = vm->cycle_count;
+	runner->t_rate_start = now;
+}
+
+/* Returns the VM time when the runner has work to do next unless the UI posts an event, or NO_DEADLINE. */
+vm_clock_t get_next_deadline(const struct runner *runner, bool dirty, vm_clock_t t_last_publish)
+{
+	const struct vm_state *vm = runner->vm;
+	vm_clock_t t = NO_DEADLINE;
+	if (!runner->paused) {
+		t = vm_get_next_cycle_time(vm);
+	}
+	if (dirty) {
+		vm_clock_t t_publish = runner->paused ? 0 : t_last_publish + PUBLISH_PERIOD_USEC * 1000LL;
+		t = t_publish < t ? t_publish : t;
+	}
+	if (vm->reg_key_status & KEY_STATUS_LAST_PRESS) {
+		vm_clock_t t_release = runner->t_last_key_press + KEY_UP_DELAY_USEC * 1000LL;
+		t = t_release < t ? t_release : t;
+	}
+	return t;
+}
+
+/* Sleeps until the VM time t, or until the UI posts an event. */
+void wait_for_event(struct runner *runner, vm_clock_t t)
+{
+	struct itimerspec timer = {};
+	if (t != NO_DEADLINE) {
+		get_timespec(&runner->vm->t_start, t, &timer.it_value);
+	}
+	timerfd_settime(runner->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL); /* Disarmed without a deadline. */
+
+	struct pollfd fds[] = {
+		{.fd = runner->event_fd, .events = POLLIN},
+		{.fd = runner->timer_fd, .events = POLLIN},
+	};
+	if (poll(fds, 2, -1) > 0) {
+		/* Events are taken from the queue, so the fds only need resetting. */
+		if (fds[0].revents & POLLIN) {
+			drain_fd(runner->event_fd);
+		}
+		if (fds[1].revents & POLLIN) {
+			drain_fd(runner->timer_fd);
+		}
+	}
+}
+
+void *runner_main(void *arg)
+{
+	struct runner *runner = arg;
+	struct vm_state *vm = runner->vm;
+	bool dirty = false;
+	vm_clock_t t_last_publish = 0;
+
+	while (!atomic_load_explicit(&runner->stop, memory_order_relaxed)) {
+		dirty |= handle_events(runner);
+
+		/* Publish at a bounded rate while running, so copying views does not slow down execution. */
+		vm_clock_t now = get_vm_clock(&vm->t_start);
+		measure_clock_rate(runner, now);
+		if (dirty && (runner->paused || vm_clock_as_usec(now - t_last_publish) >= PUBLISH_PERIOD_USEC)) {
+			publish_view(runner);
+			t_last_publish = now;
+			dirty = false;
+		}
+
+		if (!runner->paused) {
+			run_for(runner, now + RUNNER_SLICE_USEC * 1000LL, &dirty);
+			if (vm->fault) {
+				break;
+			}
+		}
+
+		/*
+		 * Sleep unless there is more to do right away, e.g. when falling behind. Short
+		 * sleeps between fast cycles skip the fds, as the timer slack of a plain sleep
+		 * lets several cycles run per wakeup.
+		 */
+		vm_clock_t t_next = get_next_deadline(runner, dirty, t_last_publish);
+		vm_clock_t wait = t_next - get_vm_clock(&vm->t_start);
+		if (wait > RUNNER_SLICE_USEC * 1000LL) {
+			wait_for_event(runner, t_next);
+		} else if (wait > 0) {
+			sleep_until(&vm->t_start, t_next);
+		}
+	}
+
+	publish_view(runner); /* Show the final state, e.g. the fault. */
+	return NULL;
+}
+
+void close_fds(struct runner *runner)
+{
+	int *fds[] = {&runner->event_fd, &runner->view_fd, &runner->timer_fd};
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] >= 0) {
+			close(*fds[i]);
+		}
+		*fds[i] = -1;
+	}
+}
+
+bool runner_start(struct runner *runner, struct vm_state *vm, bool paused, size_t journal_capacity)
+{
+	memset(runner, 0, sizeof(struct runner));
+	runner->vm = vm;
+	runner->paused = paused;
+	runner->frame_sync_reads = vm->user_sync_reads;
+	vm->t_next_cycle = get_vm_clock(&vm->t_start);
+	runner->front = 0;
+	atomic_init(&runner->middle, 1);
+	runner->back = 2;
+	atomic_init(&runner->event_head, 0);
+	atomic_init(&runner->event_tail, 0);
+	atomic_init(&runner->stop, false);
+	runner->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	runner->view_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	runner->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (runner->event_fd < 0 || runner->view_fd < 0 || runner->timer_fd < 0) {
+		perror("Failed to create VM thread wakeup fds");
+		close_fds(runner);
+		return false;
+	}
+	if (!journal_init(&runner->journal, journal_capacity)) {
+		close_fds(runner);
+		return false;
+	}
+	publish_view(runner);
+	if (pthread_create(&runner->thread, NULL, runner_main, runner)) {
+		fprintf(stderr, "Failed to start VM thread.\n");
+		journal_destroy(&runner->journal);
+		close_fds(runner);
+		return false;
+	}
+	return true;
+}
+
+void runner_stop(struct runner *runner)
+{
+	atomic_store(&runner->stop, true);
+	signal_fd(runner->event_fd);
+	pthread_join(runner->thread, NULL);
+	journal_destroy(&runner->journal);
+	close_fds(runner);
+}
@@ -0,0 +1,159 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the VM of the terminal UI on its own thread.
+ *
+ * The UI thread never touches the VM. It posts events such as key presses to
+ * the runner through a lock-free single producer, single consumer queue, and
+ * reads back views of the VM state that the runner publishes through a
+ * lock-free triple buffer. Neither side waits for the other, so terminal
+ * latency does not slow down emulation and vice versa.
+ *
+ * Each side is woken up through an eventfd when the other posts an event or
+ * publishes a view. Between cycles the runner sleeps on a timerfd armed for
+ * its next deadline, so that a paused or slowly clocked VM costs no CPU.
+ */
+
+#ifndef _RUNNER_H
+#define _RUNNER_H
+
+#include "clock.h"
+#include "journal.h"
+#include "vm.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Events the UI can post, one of RUNNER_EVENT_*. */
+enum {
+	RUNNER_EVENT_RUN = 0,	/* Resumes execution. */
+	RUNNER_EVENT_STEP,	/* Executes one cycle, then pauses. */
+	RUNNER_EVENT_UNDO,	/* Undoes the last cycle and pauses. */
+	RUNNER_EVENT_RUN_BACKWARDS,	/* Undoes cycles up to a breakpoint and pauses. */
+	RUNNER_EVENT_SET_BREAKPOINT,	/* Sets the breakpoint at arg. */
+	RUNNER_EVENT_CLEAR_BREAKPOINT,	/* Clears the breakpoint at arg. */
+	RUNNER_EVENT_PAGE,	/* Adds arg to the Page register. */
+	RUNNER_EVENT_KEY,	/* Presses the key with index arg. */
+};
+
+struct runner_event {
+	uint8_t type;
+	uint16_t arg;
+};
+
+/* Must be a power of two. */
+#define RUNNER_QUEUE_SIZE 64
+
+/* The part of the VM state shown by the UI. */
+struct vm_view {
+	union {
+		memory_word_t pages[NUM_PAGES][PAGE_SIZE];
+		memory_word_t user_mem[NUM_PAGES * PAGE_SIZE];
+	};
+	program_addr_t reg_pc;
+	uint8_t reg_sp;
+	uint8_t reg_flags;
+	uint8_t fault;
+	bool paused;
+	uint64_t cycle_count;
+	size_t undo_count;	/* Cycles that can be undone. */
+	vm_clock_t dt_last_cycle;
+	vm_clock_t dt_last_cycle_period;
+	vm_clock_t dt_last_user_sync_period;
+	double clock_rate;	/* Achieved clock rate in Hz, 0 until measured. */
+	double requested_clock_rate;	/* Clock rate in Hz set by the Clock register. */
+	uint16_t dirty_rows[NUM_PAGES];	/* Rows changed since the last view the UI took, see vm_state.dirty_rows. */
+	/* Cycles each pixel of the LED matrix was lit and cycles executed since the last view the UI took, see pov.h. */
+	uint32_t on_cycles[POV_PAGES][PAGE_SIZE][4];
+	uint64_t pov_cycles;
+	/* User memory when the program last consumed UserSync, i.e. its last complete frame. */
+	memory_word_t frame_mem[NUM_PAGES * PAGE_SIZE];
+	uint64_t frame_count;	/* Frames completed since the runner started. */
+};
+
+struct runner {
+	struct vm_state *vm;	/* Only accessed by the runner thread while it runs. */
+	struct journal journal;	/* Recent cycles, for stepping backwards. */
+	bool breakpoints[PROGRAM_MEMORY_SIZE];	/* Addresses where execution pauses. */
+	bool paused;
+	bool single_step;
+	atomic_bool stop;	/* Set by runner_stop(). */
+	vm_clock_t t_last_key_press;	/* Timestamp of the last key press. */
+
+	/* Achieved clock rate, measured over windows of running with the same Clock setting. */
+	double clock_rate;
+	bool rate_window_open;
+	memory_word_t rate_clock;
+	uint64_t rate_start_cycles;
+	vm_clock_t t_rate_start;
+
+	/* Ring buffer of events from the UI; head is written by the UI, tail by the runner. */
+	struct runner_event events[RUNNER_QUEUE_SIZE];
+	atomic_uint event_head;
+	atomic_uint event_tail;
+
+	/*
+	 * Triple buffer of views. The runner fills views[back], then swaps it with
+	 * the middle one, flagging it as new. The UI swaps the middle one with
+	 * views[front] when it is new, and reads views[front].
+	 */
+	struct vm_view views[3];
+	atomic_uint middle;	/* Index of the middle view, or'ed with RUNNER_VIEW_NEW. */
+	unsigned back;
+	unsigned front;
+	uint16_t published_rows[NUM_PAGES];	/* Dirty rows of the last published view. */
+	uint32_t published_on_cycles[POV_PAGES][PAGE_SIZE][4];	/* Lit pixels of the last published view. */
+	uint64_t published_pov_cycles;
+
+	/* Last complete frame of the program, see vm_view.frame_mem. */
+	memory_word_t frame_mem[NUM_PAGES * PAGE_SIZE];
+	uint64_t frame_count;
+	uint64_t frame_sync_reads;	/* vm_state.user_sync_reads when the frame was captured. */
+
+	int event_fd;	/* Signaled by runner_post() and runner_stop(). */
+	int view_fd;	/* Signaled when a view is published. */
+	int timer_fd;	/* Wakes the runner up at its next deadline. */
+
+	pthread_t thread;
+};
+
+/*
+ * Starts running the VM on a new thread, optionally paused, recording cycles
+ * in a journal with the given capacity. The runner takes over the VM until
+ * runner_stop(). Returns false on error.
+ */
+bool runner_start(struct runner *runner, struct vm_state *vm, bool paused, size_t journal_capacity);
+
+/* Stops the runner thread, returning the VM to the caller. */
+void runner_stop(struct runner *runner);
+
+/* Posts an event from the UI. Returns false if the queue is full, dropping it. */
+bool runner_post(struct runner *runner, uint8_t type, uint16_t arg);
+
+/* Returns the latest view if a new one was published since the last call, or NULL. It stays valid until the next call. */
+const struct vm_view *runner_get_view(struct runner *runner);
+
+/* Returns a file descriptor to poll() for a new view, see runner_get_view(). */
+int runner_get_view_fd(const struct runner *runner);
+
+#endif /* _RUNNER_H */
@@ -0,0 +1,185 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+
+#include "exec.h"
+#include "pov.h"
+#include "program.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Identifies snapshot files, followed by SNAPSHOT_VERSION. */
+const uint8_t SNAPSHOT_MAGIC[4] = {'N', 'B', 'S', 'N'};
+
+/*
+ * Layout of a snapshot, as byte offsets:
+ *
+ *   0  magic             4
+ *   4  version           1
+ *   5  program hash      8  FNV-1a of program memory.
+ *  13  user memory     128  Two nibbles per byte.
+ * 141  PC                2
+ * 143  SP                1
+ * 144  flags             1
+ * 145  fault             1
+ * 146  PRNG seed         4
+ * 150  cycle count       8
+ * 158  time              8  VM time in nanoseconds, see vm_get_time().
+ * 166  since UserSync    8  Nanoseconds since UserSync last fired.
+ */
+enum {
+	OFFSET_VERSION = 4,
+	OFFSET_PROGRAM_HASH = 5,
+	OFFSET_USER_MEM = 13,
+	OFFSET_PC = 141,
+	OFFSET_SP = 143,
+	OFFSET_FLAGS = 144,
+	OFFSET_FAULT = 145,
+	OFFSET_RNG_SEED = 146,
+	OFFSET_CYCLE_COUNT = 150,
+	OFFSET_TIME = 158,
+	OFFSET_SINCE_USER_SYNC = 166,
+};
+
+_Static_assert(OFFSET_SINCE_USER_SYNC + 8 == SNAPSHOT_SIZE, "SNAPSHOT_SIZE does not match the layout");
+
+void put_le(uint8_t *buf, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		buf[i] = value >> (8 * i);
+	}
+}
+
+uint64_t get_le(const uint8_t *buf, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value |= (uint64_t) buf[i] << (8 * i);
+	}
+	return value;
+}
+
+uint64_t hash_program(const struct program *prg)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < PROGRAM_MEMORY_SIZE; i++) {
+		hash = (hash ^ (prg->instructions[i] & 0xff)) * 0x100000001b3ULL;
+		hash = (hash ^ (prg->instructions[i] >> 8)) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+void vm_snapshot(const struct vm_state *vm, uint8_t *buf)
+{
+	memset(buf, 0, SNAPSHOT_SIZE);
+	memcpy(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	buf[OFFSET_VERSION] = SNAPSHOT_VERSION;
+	put_le(&buf[OFFSET_PROGRAM_HASH], hash_program(vm->prg), 8);
+	for (int i = 0; i < NUM_PAGES * PAGE_SIZE; i += 2) {
+		buf[OFFSET_USER_MEM + i / 2] = (vm->user_mem[i] & 0xf) | (vm->user_mem[i + 1] << 4);
+	}
+	put_le(&buf[OFFSET_PC], vm->reg_pc, 2);
+	buf[OFFSET_SP] = vm->reg_sp;
+	buf[OFFSET_FLAGS] = vm->reg_flags;
+	buf[OFFSET_FAULT] = vm->fault;
+	put_le(&buf[OFFSET_RNG_SEED], vm->rng.seed, 4);
+	put_le(&buf[OFFSET_CYCLE_COUNT], vm->cycle_count, 8);
+	vm_clock_t now = vm_get_time(vm);
+	put_le(&buf[OFFSET_TIME], now, 8);
+	put_le(&buf[OFFSET_SINCE_USER_SYNC], now - vm->t_last_user_sync, 8);
+}
+
+bool vm_restore(struct vm_state *vm, const uint8_t *buf, size_t size)
+{
+	if (size != SNAPSHOT_SIZE || memcmp(buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))) {
+		fprintf(stderr, "Not a snapshot.\n");
+		return false;
+	}
+	if (buf[OFFSET_VERSION] != SNAPSHOT_VERSION) {
+		fprintf(stderr, "Unsupported snapshot version %d.\n", buf[OFFSET_VERSION]);
+		return false;
+	}
+	if (get_le(&buf[OFFSET_PROGRAM_HASH], 8) != hash_program(vm->prg)) {
+		fprintf(stderr, "Snapshot was taken of a different program.\n");
+		return false;
+	}
+	program_addr_t pc = get_le(&buf[OFFSET_PC], 2);
+	if (pc >= PROGRAM_MEMORY_SIZE || buf[OFFSET_SP] > MAX_STACK_DEPTH || buf[OFFSET_FLAGS] > 0xf) {
+		fprintf(stderr, "Snapshot is corrupt.\n");
+		return false;
+	}
+
+	for (int i = 0; i < NUM_PAGES * PAGE_SIZE; i += 2) {
+		vm->user_mem[i] = buf[OFFSET_USER_MEM + i / 2] & 0xf;
+		vm->user_mem[i + 1] = buf[OFFSET_USER_MEM + i / 2] >> 4;
+	}
+	vm->reg_pc = pc;
+	vm->reg_sp = buf[OFFSET_SP];
+	vm->reg_flags = buf[OFFSET_FLAGS];
+	vm->fault = buf[OFFSET_FAULT];
+	vm->rng.seed = get_le(&buf[OFFSET_RNG_SEED], 4);
+	vm->cycle_count = get_le(&buf[OFFSET_CYCLE_COUNT], 8);
+
+	/* Virtual time continues where it was, wall time continues from now. */
+	if (vm->time_mode == VM_TIME_VIRTUAL) {
+		vm->t_virtual = get_le(&buf[OFFSET_TIME], 8);
+	}
+	vm_clock_t now = vm_get_time(vm);
+	vm->t_cycle_start = now;
+	vm->t_cycle_end = now;
+	vm->t_next_cycle = now;
+	vm_mark_all_dirty(vm);
+	pov_reset(vm);
+	vm->t_last_user_sync = now - (vm_clock_t) get_le(&buf[OFFSET_SINCE_USER_SYNC], 8);
+	vm->poll_snapshot.valid = false;
+	return true;
+}
+
+bool vm_save_snapshot(const struct vm_state *vm, const char *path)
+{
+	uint8_t buf[SNAPSHOT_SIZE];
+	vm_snapshot(vm, buf);
+
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	bool success = fwrite(buf, 1, sizeof(buf), f) == sizeof(buf);
+	success = !fclose(f) && success;
+	if (!success) {
+		fprintf(stderr, "Could not write snapshot to %s\n", path);
+	}
+	return success;
+}
+
+bool vm_load_snapshot(struct vm_state *vm, const char *path)
+{
+	size_t size;
+	uint8_t *buf = read_file(path, &size);
+	if (!buf) {
+		return false;
+	}
+	bool success = vm_restore(vm, buf, size);
+	free(buf);
+	return success;
+}
@@ -0,0 +1,64 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Snapshots of the architectural VM state, for checkpointing long running
+ * programs and resuming them later.
+ *
+ * Snapshots have a fixed size and are stored little endian, versioned by
+ * their header. User memory is packed two nibbles per byte, the lower address
+ * in the low nibble. Time is stored relative to the snapshot, so that it can
+ * be restored into VMs using either time mode.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_VERSION 1
+
+/* Size of a serialized snapshot in bytes. */
+#define SNAPSHOT_SIZE 174
+
+/* Serializes the VM state into buf, which must hold SNAPSHOT_SIZE bytes. */
+void vm_snapshot(const struct vm_state *vm, uint8_t *buf);
+
+/*
+ * Restores a VM state serialized by vm_snapshot(). The VM must have been
+ * initialized with the program the snapshot was taken of. Returns false on
+ * error, leaving the VM unchanged.
+ */
+bool vm_restore(struct vm_state *vm, const uint8_t *buf, size_t size);
+
+/* Writes a snapshot of the VM state to a file. Returns false on error. */
+bool vm_save_snapshot(const struct vm_state *vm, const char *path);
+
+/* Restores the VM state from a file written by vm_save_snapshot(). Returns false on error. */
+bool vm_load_snapshot(struct vm_state *vm, const char *path);
+
+/* Stores and loads little endian integers of the given size in bytes. */
+void put_le(uint8_t *buf, uint64_t value, int bytes);
+uint64_t get_le(const uint8_t *buf, int bytes);
+
+#endif /* _SNAPSHOT_H */
@@ -0,0 +1,142 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Batch tests, built and run with "make check".
+ *
+ * Runs programs on their own and as lanes of a batch, and checks that every
+ * lane ends with the same cycles, program counter, exit reason and memory.
+ * Skipped on CPUs that cannot run batches.
+ */
+
+#include "batch.h"
+#include "headless.h"
+#include "program.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_CHECK_LANES 4
+#define BATCH_CHECK_CYCLES 100000
+
+struct batch_check {
+	const char *name;
+	const program_word_t *words;
+	int num_words;
+};
+
+/* Reaches JR -1 from a cycle that needs attention from the batch, so the lane halts on its own. */
+const program_word_t HALT_PROGRAM[] = {
+	0xdf4,	/* MOV R0,[RdFlags] */
+	0x0f9,	/* SKIP Z,1 */
+	0x010,	/* ADD R1,R0 */
+	0x021,	/* INC R1 */
+	0x032,	/* DEC R2 */
+	0x043,	/* DSZ R3 */
+	0x054,	/* OR R0,4 */
+	0xcf2,	/* MOV [Sync],R0 */
+	0xfff,	/* JR -1 */
+};
+
+const struct batch_check BATCH_CHECKS[] = {
+	{"halt", HALT_PROGRAM, sizeof(HALT_PROGRAM) / sizeof(HALT_PROGRAM[0])},
+};
+
+/* Creates a VM running the check's program with a fixed seed, like farm instances. Returns NULL on error. */
+struct vm_state *create_vm(const struct batch_check *check, uint32_t seed)
+{
+	struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+	struct program *prg = calloc(1, sizeof(struct program));
+	if (!vm || !prg) {
+		free(vm);
+		free(prg);
+		fprintf(stderr, "Failed to allocate VM state.\n");
+		return NULL;
+	}
+	prg->length = check->num_words;
+	memcpy(prg->instructions, check->words, check->num_words * sizeof(program_word_t));
+	vm_init(vm, prg); /* vm takes ownership of prg. */
+	struct headless_options opts = {.has_seed = true, .seed = seed};
+	headless_setup_vm(&opts, vm);
+	return vm;
+}
+
+void destroy_vm(struct vm_state *vm)
+{
+	if (vm) {
+		vm_destroy(vm);
+		free(vm);
+	}
+}
+
+/* Runs the check's program alone and batched, comparing each lane. Returns false on a mismatch. */
+bool check_batch(const struct batch_check *check)
+{
+	struct vm_state *alone[BATCH_CHECK_LANES] = {};
+	struct vm_state *lanes[BATCH_CHECK_LANES] = {};
+	bool success = true;
+	for (int i = 0; i < BATCH_CHECK_LANES; i++) {
+		alone[i] = create_vm(check, i);
+		lanes[i] = create_vm(check, i);
+		success = success && alone[i] && lanes[i];
+	}
+	struct vm_batch *batch = success ? batch_create(lanes, BATCH_CHECK_LANES) : NULL;
+	if (!batch) {
+		success = false;
+		goto out;
+	}
+
+	batch_run(batch, BATCH_CHECK_CYCLES);
+	batch_sync(batch);
+	for (int i = 0; i < BATCH_CHECK_LANES; i++) {
+		vm_run(alone[i], BATCH_CHECK_CYCLES);
+		if (alone[i]->cycle_count != lanes[i]->cycle_count || alone[i]->reg_pc != lanes[i]->reg_pc ||
+				alone[i]->halted != lanes[i]->halted || alone[i]->fault != lanes[i]->fault ||
+				memcmp(alone[i]->user_mem, lanes[i]->user_mem, sizeof(alone[i]->user_mem))) {
+			fprintf(stderr, "Batch check failed: %s lane %d ran %llu cycles to %03hx, not %llu cycles to %03hx.\n",
+					check->name, i, (unsigned long long) lanes[i]->cycle_count, lanes[i]->reg_pc,
+					(unsigned long long) alone[i]->cycle_count, alone[i]->reg_pc);
+			success = false;
+		}
+	}
+
+out:
+	batch_destroy(batch);
+	for (int i = 0; i < BATCH_CHECK_LANES; i++) {
+		destroy_vm(alone[i]);
+		destroy_vm(lanes[i]);
+	}
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!batch_supported()) {
+		fprintf(stderr, "Batches are not supported on this CPU, skipping.\n");
+		return EXIT_SUCCESS;
+	}
+	bool success = true;
+	for (size_t i = 0; i < sizeof(BATCH_CHECKS) / sizeof(BATCH_CHECKS[0]); i++) {
+		success = check_batch(&BATCH_CHECKS[i]) && success;
+	}
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,138 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fast-forward tests, built and run with "make check".
+ *
+ * Runs programs with fast-forwarding, interpreted and compiled, and checks
+ * that they end in the same state as when stepped one cycle at a time, for
+ * budgets that end in the middle of skipped loops.
+ */
+
+#include "headless.h"
+#include "program.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct fastfwd_check {
+	const char *name;
+	const program_word_t *words;
+	int num_words;
+};
+
+/* Waits for UserSync with In changed by the loop, which skipped iterations leave as the last one did. */
+const program_word_t IN_WAIT_PROGRAM[] = {
+	0x03b,	/* DEC IN */
+	0xdf4,	/* MOV R0,[RdFlags] */
+	0xffd,	/* JR -3 */
+};
+
+/* The same loop with a slow clock and a long UserSync period. */
+const program_word_t SLOW_IN_WAIT_PROGRAM[] = {
+	0x909,	/* MOV R0,9 */
+	0xcf2,	/* MOV [Sync],R0 */
+	0x902,	/* MOV R0,2 */
+	0xcf1,	/* MOV [Clock],R0 */
+	0x03b,	/* DEC IN */
+	0xdf4,	/* MOV R0,[RdFlags] */
+	0xffd,	/* JR -3 */
+};
+
+const struct fastfwd_check FASTFWD_CHECKS[] = {
+	{"in wait", IN_WAIT_PROGRAM, sizeof(IN_WAIT_PROGRAM) / sizeof(IN_WAIT_PROGRAM[0])},
+	{"slow in wait", SLOW_IN_WAIT_PROGRAM, sizeof(SLOW_IN_WAIT_PROGRAM) / sizeof(SLOW_IN_WAIT_PROGRAM[0])},
+};
+
+const uint64_t FASTFWD_CHECK_CYCLES[] = {1000, 5003, 100000, 114357};
+
+/* Creates a VM running the check's program with a fixed seed in virtual time. Returns NULL on error. */
+struct vm_state *create_vm(const struct fastfwd_check *check)
+{
+	struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+	struct program *prg = calloc(1, sizeof(struct program));
+	if (!vm || !prg) {
+		free(vm);
+		free(prg);
+		fprintf(stderr, "Failed to allocate VM state.\n");
+		return NULL;
+	}
+	prg->length = check->num_words;
+	memcpy(prg->instructions, check->words, check->num_words * sizeof(program_word_t));
+	vm_init(vm, prg); /* vm takes ownership of prg. */
+	struct headless_options opts = {.has_seed = true, .seed = 1};
+	headless_setup_vm(&opts, vm);
+	return vm;
+}
+
+void destroy_vm(struct vm_state *vm)
+{
+	if (vm) {
+		vm_destroy(vm);
+		free(vm);
+	}
+}
+
+/* Runs the check's program for the given cycles, fast-forwarding and stepped, and compares snapshots. */
+bool check_fastfwd(const struct fastfwd_check *check, uint64_t cycles, bool jit)
+{
+	struct vm_state *run = create_vm(check);
+	struct vm_state *stepped = create_vm(check);
+	bool success = run && stepped;
+	if (success) {
+		if (jit) {
+			vm_enable_jit(run);
+		}
+		vm_run(run, cycles);
+		for (uint64_t i = 0; i < cycles; i++) {
+			vm_execute_cycle(stepped);
+		}
+		uint8_t run_snapshot[SNAPSHOT_SIZE];
+		uint8_t stepped_snapshot[SNAPSHOT_SIZE];
+		vm_snapshot(run, run_snapshot);
+		vm_snapshot(stepped, stepped_snapshot);
+		for (int i = 0; i < SNAPSHOT_SIZE; i++) {
+			if (run_snapshot[i] != stepped_snapshot[i]) {
+				fprintf(stderr, "Fast-forward check failed: %s%s after %llu cycles differs at snapshot byte %d.\n",
+						check->name, jit ? " compiled" : "", (unsigned long long) cycles, i);
+				success = false;
+				break;
+			}
+		}
+	}
+	destroy_vm(run);
+	destroy_vm(stepped);
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	bool success = true;
+	for (size_t i = 0; i < sizeof(FASTFWD_CHECKS) / sizeof(FASTFWD_CHECKS[0]); i++) {
+		for (size_t j = 0; j < sizeof(FASTFWD_CHECK_CYCLES) / sizeof(FASTFWD_CHECK_CYCLES[0]); j++) {
+			success = check_fastfwd(&FASTFWD_CHECKS[i], FASTFWD_CHECK_CYCLES[j], false) && success;
+			success = check_fastfwd(&FASTFWD_CHECKS[i], FASTFWD_CHECK_CYCLES[j], true) && success;
+		}
+	}
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
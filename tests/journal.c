@@ -0,0 +1,100 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Journal tests, built and run with "make check".
+ *
+ * Steps instructions with unusual side effects with the journal, undoes
+ * them and checks that memory and registers are restored exactly.
+ */
+
+#include "journal.h"
+#include "program.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Instructions stepped and undone with the journal, run at JOURNAL_CHECK_PC with the given nibbles. */
+struct journal_check {
+	const char *name;
+	program_word_t word;
+	memory_word_t jump_reg;	/* Value of JSR or PCL, whichever the instruction changes. */
+	memory_word_t pcm;
+	memory_word_t pch;
+};
+
+#define JOURNAL_CHECK_PC 0x010
+
+const struct journal_check JOURNAL_CHECKS[] = {
+	{"INC JSR with carry", 0x02c, 0xf, 0x2, 0x1},	/* INC R12 */
+	{"INC PCL with carry", 0x02d, 0xf, 0x2, 0x1},	/* INC R13 */
+	{"INC PCL with carry to PCH", 0x02d, 0xf, 0xf, 0x1},
+	{"DEC JSR with borrow", 0x03c, 0x0, 0x2, 0x1},	/* DEC R12 */
+	{"DEC PCL with borrow", 0x03d, 0x0, 0x2, 0x1},	/* DEC R13 */
+	{"DEC PCL with borrow from PCH", 0x03d, 0x0, 0x0, 0x1},
+};
+
+/* Steps each check with the journal and undoes it, comparing memory and registers. Returns false on a mismatch. */
+bool check_journal(void)
+{
+	bool success = true;
+	for (size_t i = 0; i < sizeof(JOURNAL_CHECKS) / sizeof(JOURNAL_CHECKS[0]); i++) {
+		const struct journal_check *check = &JOURNAL_CHECKS[i];
+		struct vm_state *vm = calloc(1, sizeof(struct vm_state));
+		struct vm_state *before = malloc(sizeof(struct vm_state));
+		struct program *prg = calloc(1, sizeof(struct program));
+		struct journal journal;
+		if (!vm || !before || !prg || !journal_init(&journal, 1)) {
+			free(vm);
+			free(before);
+			free(prg);
+			fprintf(stderr, "Failed to allocate VM state.\n");
+			return false;
+		}
+		prg->length = PROGRAM_MEMORY_SIZE;
+		prg->instructions[JOURNAL_CHECK_PC] = check->word;
+		vm_init(vm, prg); /* vm takes ownership of prg. */
+		vm->reg_pc = JOURNAL_CHECK_PC;
+		vm->user_mem[check->word & 0xf] = check->jump_reg;
+		vm->reg_pcm = check->pcm;
+		vm->reg_pch = check->pch;
+		memcpy(before, vm, sizeof(struct vm_state));
+
+		journal_step(&journal, vm);
+		journal_undo(&journal, vm);
+		if (memcmp(before->user_mem, vm->user_mem, sizeof(vm->user_mem)) || before->reg_pc != vm->reg_pc ||
+				before->reg_sp != vm->reg_sp || before->reg_flags != vm->reg_flags) {
+			fprintf(stderr, "Journal check failed: %s is not undone.\n", check->name);
+			success = false;
+		}
+		journal_destroy(&journal);
+		vm_destroy(vm);
+		free(vm);
+		free(before);
+	}
+	return success;
+}
+
+int main(int argc, char *argv[])
+{
+	return check_journal() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
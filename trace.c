@@ -0,0 +1,560 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Identifies trace files, followed by TRACE_VERSION and TRACE_FILE_* flags. */
+const uint8_t TRACE_MAGIC[4] = {'N', 'B', 'T', 'R'};
+
+enum {
+	TRACE_FILE_COMPRESSED = 0x1,
+};
+
+#define FILE_HEADER_SIZE 8
+
+/*
+ * Layout of a chunk header, as byte offsets:
+ *
+ *   0  payload size      4  Bytes stored after the header.
+ *   4  raw size          4  Bytes of records after decompression.
+ *   8  first cycle       8
+ *  16  number of cycles  4
+ *  20  PC                2  Before the first cycle.
+ *  22  flags             1
+ *  23  SP                1
+ *  24  user memory     128  Two nibbles per byte, as in snapshots.
+ */
+#define CHUNK_HEADER_SIZE 152
+
+/* Tag, PC, registers, writes and events with their arguments. */
+#define MAX_RECORD_SIZE (1 + 2 + 1 + 2 * TRACE_MAX_WRITES + 3)
+
+#define MAX_CHUNK_SIZE (TRACE_CHUNK_CYCLES * MAX_RECORD_SIZE)
+
+struct trace_writer {
+	FILE *f;
+	bool compress;
+	bool failed;
+	struct journal journal;	/* Records the cycle being traced. */
+	uint8_t header[CHUNK_HEADER_SIZE];	/* Of the chunk being recorded. */
+	uint8_t *raw;
+	size_t raw_size;
+	uint8_t *packed;	/* Compressed payload. */
+	uint32_t num_cycles;	/* In the chunk being recorded. */
+	program_addr_t prev_pc;
+	uint8_t prev_regs;
+};
+
+struct trace_chunk {
+	size_t offset;
+	uint64_t first_cycle;
+	uint32_t num_cycles;
+};
+
+struct trace_reader {
+	const uint8_t *data;	/* Mapped file. */
+	size_t size;
+	bool compressed;
+	struct trace_chunk *chunks;
+	size_t num_chunks;
+	size_t chunk;		/* Index of the loaded chunk. */
+	const uint8_t *raw;	/* Records of the loaded chunk. */
+	size_t raw_size;
+	size_t pos;		/* Offset of the next record in raw. */
+	uint8_t *buffer;	/* Decompressed records. */
+	uint64_t cycle;		/* Cycle of the next record. */
+	uint32_t left;		/* Records left in the loaded chunk. */
+	program_addr_t prev_pc;
+	uint8_t flags;
+	uint8_t sp;
+	memory_word_t mem[NUM_PAGES * PAGE_SIZE];
+};
+
+static inline program_addr_t wrap_pc(int pc)
+{
+	return pc & (PROGRAM_MEMORY_SIZE - 1);
+}
+
+void begin_chunk(struct trace_writer *trace, const struct vm_state *vm)
+{
+	uint8_t *header = trace->header;
+	memset(header, 0, CHUNK_HEADER_SIZE);
+	put_le(&header[8], vm->cycle_count, 8);
+	put_le(&header[20], vm->reg_pc, 2);
+	header[22] = vm->reg_flags;
+	header[23] = vm->reg_sp;
+	for (int i = 0; i < NUM_PAGES * PAGE_SIZE; i += 2) {
+		header[24 + i / 2] = vm->user_mem[i] | (vm->user_mem[i + 1] << 4);
+	}
+	trace->raw_size = 0;
+	trace->prev_pc = wrap_pc(vm->reg_pc - 1);
+	trace->prev_regs = vm->reg_flags | (vm->reg_sp << 4);
+}
+
+void flush_chunk(struct trace_writer *trace)
+{
+	if (!trace->num_cycles) {
+		return;
+	}
+	const uint8_t *payload = trace->raw;
+	uLongf size = trace->raw_size;
+	if (trace->compress) {
+		size = compressBound(MAX_CHUNK_SIZE);
+		if (compress2(trace->packed, &size, trace->raw, trace->raw_size, Z_BEST_SPEED) != Z_OK) {
+			trace->failed = true;
+			return;
+		}
+		payload = trace->packed;
+	}
+	put_le(&trace->header[0], size, 4);
+	put_le(&trace->header[4], trace->raw_size, 4);
+	put_le(&trace->header[16], trace->num_cycles, 4);
+	if (fwrite(trace->header, 1, CHUNK_HEADER_SIZE, trace->f) != CHUNK_HEADER_SIZE ||
+			fwrite(payload, 1, size, trace->f) != size) {
+		trace->failed = true;
+	}
+	trace->num_cycles = 0;
+}
+
+struct trace_writer *trace_create(const char *path, bool compress)
+{
+	struct trace_writer *trace = calloc(1, sizeof(struct trace_writer));
+	if (!trace) {
+		fprintf(stderr, "Failed to allocate trace writer.\n");
+		return NULL;
+	}
+	trace->compress = compress;
+	trace->raw = malloc(MAX_CHUNK_SIZE);
+	trace->packed = compress ? malloc(compressBound(MAX_CHUNK_SIZE)) : NULL;
+	if (!trace->raw || (compress && !trace->packed) || !journal_init(&trace->journal, 1)) {
+		fprintf(stderr, "Failed to allocate trace buffers.\n");
+		free(trace->raw);
+		free(trace->packed);
+		free(trace);
+		return NULL;
+	}
+	trace->f = fopen(path, "wb");
+	if (!trace->f) {
+		perror(path);
+		trace->failed = true;
+		trace_close(trace);
+		return NULL;
+	}
+
+	uint8_t header[FILE_HEADER_SIZE] = {};
+	memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	header[4] = TRACE_VERSION;
+	header[5] = compress ? TRACE_FILE_COMPRESSED : 0;
+	if (fwrite(header, 1, sizeof(header), trace->f) != sizeof(header)) {
+		trace->failed = true;
+	}
+	return trace;
+}
+
+/* Executes one cycle and appends its record to the chunk. */
+void trace_step(struct trace_writer *trace, struct vm_state *vm)
+{
+	if (!trace->num_cycles) {
+		begin_chunk(trace, vm);
+	}
+	program_addr_t pc = vm->reg_pc;
+	vm_clock_t t_last_user_sync = vm->t_last_user_sync;
+	uint8_t fault = vm->fault;
+	journal_step(&trace->journal, vm);
+	const struct journal_entry *entry = &trace->journal.entries[0];
+
+	uint8_t *record = &trace->raw[trace->raw_size];
+	uint8_t *p = record + 1;
+	uint8_t tag;
+	int delta = pc - trace->prev_pc;
+	if (pc == wrap_pc(trace->prev_pc + 1)) {
+		tag = TRACE_PC_NEXT;
+	} else if (delta >= INT8_MIN && delta <= INT8_MAX) {
+		tag = TRACE_PC_REL;
+		*p++ = delta;
+	} else {
+		tag = TRACE_PC_ABS;
+		put_le(p, pc, 2);
+		p += 2;
+	}
+	trace->prev_pc = pc;
+
+	uint8_t regs = vm->reg_flags | (vm->reg_sp << 4);
+	if (regs != trace->prev_regs) {
+		tag |= TRACE_TAG_REGS;
+		*p++ = regs;
+		trace->prev_regs = regs;
+	}
+
+	/* Writes are replayed before EXR, so report the values registers had before the exchange. */
+	int num_writes = 0;
+	for (int i = 0; i < entry->num_writes; i++) {
+		memory_addr_t addr = entry->writes[i].addr;
+		bool seen = false;
+		for (int j = 0; j < i; j++) {
+			seen = seen || entry->writes[j].addr == addr;
+		}
+		memory_word_t value = addr < entry->exr_count ? vm->alt_regs_page[addr] : vm->user_mem[addr];
+		if (!seen && value != entry->writes[i].value) {
+			*p++ = addr;
+			*p++ = value;
+			num_writes++;
+		}
+	}
+	tag |= num_writes << 3;
+
+	uint8_t events = 0;
+	events |= vm->t_last_user_sync != t_last_user_sync ? TRACE_EVENT_USER_SYNC : 0;
+	events |= entry->exr_count ? TRACE_EVENT_EXR : 0;
+	events |= vm->fault != fault ? TRACE_EVENT_FAULT : 0;
+	if (events) {
+		tag |= TRACE_TAG_EVENTS;
+		*p++ = events;
+		if (events & TRACE_EVENT_EXR) {
+			*p++ = entry->exr_count;
+		}
+		if (events & TRACE_EVENT_FAULT) {
+			*p++ = vm->fault;
+		}
+	}
+	*record = tag;
+	trace->raw_size = p - trace->raw;
+	if (++trace->num_cycles == TRACE_CHUNK_CYCLES) {
+		flush_chunk(trace);
+	}
+}
+
+uint64_t trace_run(struct trace_writer *trace, struct vm_state *vm, uint64_t max_cycles)
+{
+	uint64_t start = vm->cycle_count;
+	while (!vm->fault && vm->cycle_count - start < max_cycles) {
+		trace_step(trace, vm);
+	}
+	return vm->cycle_count - start;
+}
+
+bool trace_close(struct trace_writer *trace)
+{
+	if (trace->f) {
+		flush_chunk(trace);
+		if (fclose(trace->f)) {
+			trace->failed = true;
+		}
+	}
+	bool success = !trace->failed;
+	if (!success) {
+		fprintf(stderr, "Failed to write trace.\n");
+	}
+	journal_destroy(&trace->journal);
+	free(trace->raw);
+	free(trace->packed);
+	free(trace);
+	return success;
+}
+
+bool load_chunk(struct trace_reader *reader, size_t index)
+{
+	const struct trace_chunk *chunk = &reader->chunks[index];
+	const uint8_t *header = &reader->data[chunk->offset];
+	size_t size = get_le(&header[0], 4);
+	uLongf raw_size = get_le(&header[4], 4);
+	if (raw_size > MAX_CHUNK_SIZE) {
+		fprintf(stderr, "Trace is corrupt.\n");
+		return false;
+	}
+	if (reader->compressed) {
+		if (uncompress(reader->buffer, &raw_size, header + CHUNK_HEADER_SIZE, size) != Z_OK) {
+			fprintf(stderr, "Trace is corrupt.\n");
+			return false;
+		}
+		reader->raw = reader->buffer;
+	} else {
+		reader->raw = header + CHUNK_HEADER_SIZE;
+	}
+	reader->raw_size = raw_size;
+	reader->pos = 0;
+	reader->chunk = index;
+	reader->cycle = chunk->first_cycle;
+	reader->left = chunk->num_cycles;
+	reader->prev_pc = wrap_pc(get_le(&header[20], 2) - 1);
+	reader->flags = header[22];
+	reader->sp = header[23];
+	for (int i = 0; i < NUM_PAGES * PAGE_SIZE; i += 2) {
+		reader->mem[i] = header[24 + i / 2] & 0xf;
+		reader->mem[i + 1] = header[24 + i / 2] >> 4;
+	}
+	return true;
+}
+
+struct trace_reader *trace_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	struct stat st;
+	struct trace_reader *reader = calloc(1, sizeof(struct trace_reader));
+	if (!reader || fstat(fd, &st)) {
+		fprintf(stderr, "Failed to open trace.\n");
+		free(reader);
+		close(fd);
+		return NULL;
+	}
+	reader->size = st.st_size;
+	reader->data = reader->size ? mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (reader->data == MAP_FAILED) {
+		reader->data = NULL;
+		fprintf(stderr, "Failed to map trace.\n");
+		trace_reader_close(reader);
+		return NULL;
+	}
+	if (reader->size < FILE_HEADER_SIZE || memcmp(reader->data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) || reader->data[4] != TRACE_VERSION) {
+		fprintf(stderr, "Not a trace, or an unsupported version.\n");
+		trace_reader_close(reader);
+		return NULL;
+	}
+	reader->compressed = reader->data[5] & TRACE_FILE_COMPRESSED;
+
+	/* Index chunks by hopping from header to header. */
+	size_t capacity = 0;
+	for (size_t offset = FILE_HEADER_SIZE; offset < reader->size;) {
+		const uint8_t *header = &reader->data[offset];
+		if (reader->size - offset < CHUNK_HEADER_SIZE || reader->size - offset - CHUNK_HEADER_SIZE < get_le(&header[0], 4)) {
+			fprintf(stderr, "Trace is truncated.\n");
+			trace_reader_close(reader);
+			return NULL;
+		}
+		if (reader->num_chunks == capacity) {
+			capacity = capacity ? 2 * capacity : 64;
+			struct trace_chunk *chunks = realloc(reader->chunks, capacity * sizeof(struct trace_chunk));
+			if (!chunks) {
+				fprintf(stderr, "Failed to allocate trace index.\n");
+				trace_reader_close(reader);
+				return NULL;
+			}
+			reader->chunks = chunks;
+		}
+		struct trace_chunk *chunk = &reader->chunks[reader->num_chunks++];
+		chunk->offset = offset;
+		chunk->first_cycle = get_le(&header[8], 8);
+		chunk->num_cycles = get_le(&header[16], 4);
+		offset += CHUNK_HEADER_SIZE + get_le(&header[0], 4);
+	}
+
+	reader->buffer = reader->compressed ? malloc(MAX_CHUNK_SIZE) : NULL;
+	if (reader->compressed && !reader->buffer) {
+		fprintf(stderr, "Failed to allocate trace buffer.\n");
+		trace_reader_close(reader);
+		return NULL;
+	}
+	if (reader->num_chunks && !load_chunk(reader, 0)) {
+		trace_reader_close(reader);
+		return NULL;
+	}
+	return reader;
+}
+
+void trace_reader_close(struct trace_reader *reader)
+{
+	if (reader->data) {
+		munmap((void *) reader->data, reader->size);
+	}
+	free(reader->chunks);
+	free(reader->buffer);
+	free(reader);
+}
+
+/* Returns the next n bytes of the loaded chunk, or NULL if it is too short. */
+static inline const uint8_t *take(struct trace_reader *reader, size_t n)
+{
+	if (reader->raw_size - reader->pos < n) {
+		return NULL;
+	}
+	const uint8_t *p = &reader->raw[reader->pos];
+	reader->pos += n;
+	return p;
+}
+
+bool trace_next(struct trace_reader *reader, struct trace_record *record)
+{
+	while (!reader->left) {
+		if (reader->chunk + 1 >= reader->num_chunks || !load_chunk(reader, reader->chunk + 1)) {
+			return false;
+		}
+	}
+
+	const uint8_t *p = take(reader, 1);
+	if (!p) {
+		goto corrupt;
+	}
+	uint8_t tag = *p;
+	switch (tag & TRACE_TAG_PC) {
+	case TRACE_PC_NEXT:
+		record->pc = wrap_pc(reader->prev_pc + 1);
+		break;
+	case TRACE_PC_REL:
+		if (!(p = take(reader, 1))) {
+			goto corrupt;
+		}
+		record->pc = wrap_pc(reader->prev_pc + (int8_t) *p);
+		break;
+	case TRACE_PC_ABS:
+		if (!(p = take(reader, 2))) {
+			goto corrupt;
+		}
+		record->pc = wrap_pc(get_le(p, 2));
+		break;
+	default:
+		goto corrupt;
+	}
+	reader->prev_pc = record->pc;
+
+	if (tag & TRACE_TAG_REGS) {
+		if (!(p = take(reader, 1))) {
+			goto corrupt;
+		}
+		reader->flags = *p & 0xf;
+		reader->sp = *p >> 4;
+	}
+
+	record->num_writes = (tag & TRACE_TAG_WRITES) >> 3;
+	if (!(p = take(reader, 2 * record->num_writes))) {
+		goto corrupt;
+	}
+	for (int i = 0; i < record->num_writes; i++) {
+		record->writes[i].addr = p[2 * i];
+		record->writes[i].value = p[2 * i + 1] & 0xf;
+		reader->mem[record->writes[i].addr] = record->writes[i].value;
+	}
+
+	record->events = 0;
+	record->exr_count = 0;
+	record->fault = 0;
+	if (tag & TRACE_TAG_EVENTS) {
+		if (!(p = take(reader, 1))) {
+			goto corrupt;
+		}
+		record->events = *p;
+		if (record->events & TRACE_EVENT_EXR) {
+			if (!(p = take(reader, 1)) || *p > PAGE_SIZE) {
+				goto corrupt;
+			}
+			record->exr_count = *p;
+			for (int i = 0; i < record->exr_count; i++) {
+				memory_word_t main = reader->mem[i];
+				reader->mem[i] = reader->mem[(NUM_PAGES - 2) * PAGE_SIZE + i];
+				reader->mem[(NUM_PAGES - 2) * PAGE_SIZE + i] = main;
+			}
+		}
+		if (record->events & TRACE_EVENT_FAULT) {
+			if (!(p = take(reader, 1))) {
+				goto corrupt;
+			}
+			record->fault = *p;
+		}
+	}
+
+	record->cycle = reader->cycle++;
+	record->flags = reader->flags;
+	record->sp = reader->sp;
+	reader->left--;
+	return true;
+
+corrupt:
+	fprintf(stderr, "Trace is corrupt at cycle %llu.\n", (unsigned long long) reader->cycle);
+	reader->left = 0;
+	reader->chunk = reader->num_chunks;
+	return false;
+}
+
+bool trace_seek(struct trace_reader *reader, uint64_t cycle)
+{
+	/* Find the last chunk starting at or before the cycle. */
+	size_t lo = 0, hi = reader->num_chunks;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (reader->chunks[mid].first_cycle <= cycle) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	if (!reader->num_chunks || cycle < reader->chunks[lo].first_cycle ||
+			cycle - reader->chunks[lo].first_cycle >= reader->chunks[lo].num_cycles ||
+			!load_chunk(reader, lo)) {
+		return false;
+	}
+	struct trace_record record;
+	while (reader->cycle < cycle) {
+		if (!trace_next(reader, &record)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+const memory_word_t *trace_memory(const struct trace_reader *reader)
+{
+	return reader->mem;
+}
+
+bool trace_dump(const char *path, uint64_t from, uint64_t count)
+{
+	struct trace_reader *reader = trace_open(path);
+	if (!reader) {
+		return false;
+	}
+	if (!trace_seek(reader, from)) {
+		fprintf(stderr, "Cycle %llu is not in the trace.\n", (unsigned long long) from);
+		trace_reader_close(reader);
+		return false;
+	}
+	struct trace_record record;
+	for (uint64_t i = 0; (!count || i < count) && trace_next(reader, &record); i++) {
+		printf("%llu %03hx F=%hhx SP=%hhx", (unsigned long long) record.cycle, record.pc, record.flags, record.sp);
+		for (int j = 0; j < record.num_writes; j++) {
+			printf(" [%02hhx]=%hhx", record.writes[j].addr, record.writes[j].value);
+		}
+		if (record.events & TRACE_EVENT_USER_SYNC) {
+			printf(" UserSync");
+		}
+		if (record.events & TRACE_EVENT_EXR) {
+			printf(" EXR %d", record.exr_count);
+		}
+		if (record.events & TRACE_EVENT_FAULT) {
+			printf(" %s", vm_fault_message(record.fault));
+		}
+		printf("\n");
+	}
+	trace_reader_close(reader);
+	return true;
+}
@@ -0,0 +1,129 @@
+/*
+ * Nibbler - Emulator for Voja's 4-bit processor.
+ *
+ * Copyright (c) 2022 Octavian Voicu
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compact binary traces of every executed cycle.
+ *
+ * A trace file starts with a header, followed by chunks of up to
+ * TRACE_CHUNK_CYCLES cycles. Each chunk header holds the full VM state before
+ * its first cycle, so readers can seek to a chunk without decoding the ones
+ * before it. Chunk payloads are optionally compressed with zlib.
+ *
+ * A payload is a sequence of records, one per cycle, each starting with a tag
+ * byte:
+ *
+ *   bits 0-1  PC of the executed instruction: TRACE_PC_NEXT if it follows the
+ *             previous one, TRACE_PC_REL with a signed delta byte, or
+ *             TRACE_PC_ABS with two bytes
+ *   bit 2     followed by a byte with the flags after the cycle in the low
+ *             nibble and SP in the high nibble, if either changed
+ *   bits 3-5  number of memory writes that follow, two bytes each: address
+ *             and new value
+ *   bit 6     followed by a byte of TRACE_EVENT_* bits and their arguments
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "journal.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_VERSION 1
+
+/* Cycles per chunk, i.e. seek granularity. */
+#define TRACE_CHUNK_CYCLES 0x10000
+
+enum {
+	TRACE_PC_NEXT = 0,
+	TRACE_PC_REL,
+	TRACE_PC_ABS,
+};
+
+enum {
+	TRACE_TAG_PC = 0x03,
+	TRACE_TAG_REGS = 0x04,
+	TRACE_TAG_WRITES = 0x38,
+	TRACE_TAG_EVENTS = 0x40,
+};
+
+/* Events in a record. EXR and FAULT are followed by a byte with the register count and fault, in this order. */
+enum {
+	TRACE_EVENT_USER_SYNC = 0x1,	/* UserSync fired at the start of the cycle. */
+	TRACE_EVENT_EXR = 0x2,	/* Registers were exchanged with the alternate page. */
+	TRACE_EVENT_FAULT = 0x4,	/* The VM faulted. */
+};
+
+/* Memory writes a record can hold; more than JOURNAL_MAX_WRITES since the tag has room for them. */
+#define TRACE_MAX_WRITES 7
+
+/* A decoded record. */
+struct trace_record {
+	uint64_t cycle;		/* Value of cycle_count before the cycle. */
+	program_addr_t pc;	/* Address of the executed instruction. */
+	uint8_t flags;		/* Flags after the cycle. */
+	uint8_t sp;		/* Stack pointer after the cycle. */
+	uint8_t events;		/* TRACE_EVENT_* bits. */
+	uint8_t exr_count;
+	uint8_t fault;
+	uint8_t num_writes;
+	struct journal_write writes[TRACE_MAX_WRITES];	/* New values. */
+};
+
+struct trace_writer;
+
+/* Creates a trace file, compressing it if requested. Returns NULL on error. */
+struct trace_writer *trace_create(const char *path, bool compress);
+
+/*
+ * Executes up to max_cycles cycles with the interpreter, recording each,
+ * stopping early if the VM faults. Returns the number of cycles executed.
+ * Like vm_run() without fast-forwarding or native code.
+ */
+uint64_t trace_run(struct trace_writer *trace, struct vm_state *vm, uint64_t max_cycles);
+
+/* Writes out buffered cycles and closes the file. Returns false if writing failed. */
+bool trace_close(struct trace_writer *trace);
+
+struct trace_reader;
+
+/* Maps a trace file for reading. Returns NULL on error. */
+struct trace_reader *trace_open(const char *path);
+
+void trace_reader_close(struct trace_reader *reader);
+
+/*
+ * Positions the reader so that trace_next() returns the record of the given
+ * cycle. Returns false if the trace does not contain it.
+ */
+bool trace_seek(struct trace_reader *reader, uint64_t cycle);
+
+/* Decodes the next record. Returns false at the end of the trace or on error. */
+bool trace_next(struct trace_reader *reader, struct trace_record *record);
+
+/* Returns user memory as of the position of the reader. */
+const memory_word_t *trace_memory(const struct trace_reader *reader);
+
+/* Prints count records starting at a cycle, one per line; 0 prints all. */
+bool trace_dump(const char *path, uint64_t from, uint64_t count);
+
+#endif /* _TRACE_H */
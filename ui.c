@@ -19,37 +19,35 @@
 
 #include "ui.h"
 
-#include "ops.h"
+#include "aot.h"
 #include "program.h"
+#include "snapshot.h"
 #include "vm.h"
 
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-const int STATUS_WIDTH = 0x40;
-const int STATUS_HEIGHT = 0x24;
 const int DISPLAY_WIDTH = 0x10;
 const int DISPLAY_HEIGHT = 0x10;
 
 const int DIMMER_LEVELS = 0x10;
 
-const int KEY_UP_DELAY_USEC = 200000;	/* Delay after which a key press will generate a corresponding key release. */
 const int DISPLAY_UPDATE_USEC = 33333;	/* Minimum period between redrawing display during execution (30 Hz). */
 const int STATUS_UPDATE_USEC = 100000;	/* Minimum period between redrawing status during execution. */
 
-/*
- * MAX_UI_SLEEP_USEC should be greater than UI_UPDATE_PERIOD_USEC by a margin of
- * at least the time it takes to do one update to ensure proper VM cycle timing.
- */
-const int UI_UPDATE_PERIOD_USEC = 1000;	/* Minimum period between UI updates. */
-const int MAX_UI_SLEEP_USEC = 5000;	/* Maximum time to sleep when waiting to synchronize to the next cycle. */
+const size_t JOURNAL_ENTRIES = 0x40000;	/* Cycles that can be stepped back, about 10 MB. */
 
 const int DISASSEMBLE_CONTEXT_SIZE = 5;	/* Number of disassembled instructions to show before and after the current one. */
-const int DISASSEMBLE_MAX_LEN = 20;	/* Maximum length of a disassembled line. */
+const int LISTING_VIEW_ROWS = STATUS_HEIGHT - 2;	/* Addresses shown in the full listing, below its header. */
+const char LISTING_HEADER[] = "     ADDR:  OPC  INSTRUCTION         TARGET";
+const char LISTING_RULE[] = "--------------------------------------------";
 
 char *CLOCK_FREQUENCIES[] = {
 	"MAX",
@@ -81,7 +79,15 @@ enum {
 	P_PIXEL_DIM0 = 2,
 };
 
+/* 256-color palette indices used with ANSI_MODE. */
+enum {
+	A_BLACK = 16,
+	A_RED0 = 16,	/* Start of the 6x6x6 color cube, red steps by 36. */
+	A_GRAY0 = 232,	/* Gray ramp of 24 levels, from 8 to 238 in steps of 10. */
+};
+
 bool need_cleanup; /* True iff ncurses is initialized and needs cleanup. */
+struct ansi_term *active_term; /* Terminal to restore with ANSI_MODE; NULL if none. */
 
 void cleanup()
 {
@@ -89,29 +95,59 @@ void cleanup()
 		endwin();
 		need_cleanup = false;
 	}
+	if (active_term) {
+		ansi_stop(active_term);
+		active_term = NULL;
+	}
 }
 
 void handle_signal(int sig)
 {
 	cleanup();
-	/* Don't exit on SIGUSR1 so error can be printed after UI cleanup. */
-	if (sig != SIGUSR1) {
-		exit(EXIT_SUCCESS);
-	}
+	exit(EXIT_SUCCESS);
 }
 
 void ui_init(struct ui *ui, int ui_options)
 {
 	memset(ui, 0, sizeof(struct ui));
 	ui->ui_options = ui_options;
+	ui->display_invalid = true;
+}
+
+/* Returns the palette index of a lit pixel, approximating the colors set up with ncurses. */
+int get_ansi_pixel_color(bool red_mode, memory_word_t dimmer)
+{
+	if (red_mode) {
+		return A_RED0 + 36 * (1 + dimmer * 5 / DIMMER_LEVELS);
+	}
+	int level = 255 * (dimmer + 1) / (DIMMER_LEVELS + 1);
+	int gray = (level - 3) / 10;
+	return A_GRAY0 + (gray < 0 ? 0 : gray > 23 ? 23 : gray);
 }
 
-void ui_start(struct ui *ui)
+/* Sets up the terminal for direct output and draws the window borders. */
+bool ansi_ui_start(struct ui *ui)
+{
+	if (!ansi_start(&ui->term)) {
+		return false;
+	}
+	active_term = &ui->term;
+	memset(ui->status_lines, ' ', sizeof(ui->status_lines));
+	memset(ui->shown_status_lines, ' ', sizeof(ui->shown_status_lines));
+	ansi_box(&ui->term, 0, 0, DISPLAY_HEIGHT + 2, DISPLAY_WIDTH + 2);
+	ansi_box(&ui->term, 0, DISPLAY_WIDTH + 3, STATUS_HEIGHT + 2, STATUS_WIDTH + 2);
+	return ansi_flush(&ui->term);
+}
+
+bool ui_start(struct ui *ui)
 {
 	atexit(cleanup);
 	signal(SIGINT, handle_signal);
 	signal(SIGTERM, handle_signal);
-	signal(SIGUSR1, handle_signal); /* Custom signal to cleanup UI on error. */
+
+	if (ui->ui_options & ANSI_MODE) {
+		return ansi_ui_start(ui);
+	}
 
 	need_cleanup = true;
 
@@ -166,6 +202,7 @@ void ui_start(struct ui *ui)
 	wrefresh(ui->status);
 	wtimeout(ui->status, 0);
 	keypad(ui->status, true);
+	return true;
 }
 
 void ui_destroy(struct ui *ui)
@@ -173,191 +210,390 @@ void ui_destroy(struct ui *ui)
 	cleanup();
 }
 
-void maybe_update_display(const struct vm_state *vm, struct ui *ui)
+/*
+ * Returns the brightness of a pixel as 0 for off, or 1 + the dimmer level it
+ * is shown at: the Dimmer register scaled by the fraction of the frame the
+ * pixel was lit, so that multiplexed or PWM'd pixels look as they would.
+ */
+int get_pixel_level(const struct ui *ui, uint32_t on_cycles, bool on, memory_word_t dimmer)
 {
-	vm_clock_t start = get_vm_clock(&vm->t_start);
+	uint64_t cycles = ui->pending_pov_cycles;
+	if (!cycles) {
+		return on ? dimmer + 1 : 0; /* Nothing ran since the last frame, e.g. when paused. */
+	}
+	return (2 * on_cycles * (dimmer + 1) + cycles) / (2 * cycles);
+}
+
+/* Starts accumulating the time pixels are lit for the next frame. */
+void end_pov_frame(struct ui *ui)
+{
+	memset(ui->pending_on_cycles, 0, sizeof(ui->pending_on_cycles));
+	ui->pending_pov_cycles = 0;
+}
+
+void maybe_update_display(struct ui *ui)
+{
+	const struct vm_view *view = ui->view;
+	vm_clock_t start = get_vm_clock(&ui->t_start);
 
 	if (vm_clock_as_usec(start - ui->t_last_display_update) < DISPLAY_UPDATE_USEC) {
 		return; /* Rate limit display updates to simulate screen refresh rate. */
 	}
 
 	ui->t_last_display_update = start;
+	ui->display_dirty = false;
+
+	/* Show the last complete frame when syncing to the program, unless it has none or is paused for debugging. */
+	bool sync_frame = (ui->ui_options & SYNC_FRAMES) && view->frame_count && !view->paused;
+	const memory_word_t *mem = view->user_mem;
+	if (sync_frame) {
+		mem = view->frame_mem;
+		if (view->frame_count != ui->last_frame_count) {
+			ui->frames_shown++;
+			ui->frames_skipped += view->frame_count - ui->last_frame_count - 1;
+			ui->last_frame_count = view->frame_count;
+		}
+		end_pov_frame(ui); /* Frames are snapshots, so they are shown as is. */
+	}
 
-	/* Detect if nothing changed and skip update. */
-	memory_word_t page = vm->reg_page;
+	/* Redraw everything when the shown pages or their color change, else only rows written since the last update. */
+	memory_word_t page = mem[SFR_PAGE];
 	memory_word_t next_page = (page + 1) % NUM_PAGES;
-	memory_word_t dimmer = vm->reg_dimmer;
-	bool matrix_off = vm->reg_wr_flags & WR_FLAG_MATRIX_OFF;
-	if (ui->last_dimmer == dimmer && matrix_off == ui->last_matrix_off &&
-			!memcmp(&ui->last_pages[0][0], &vm->pages[page][0], PAGE_SIZE * sizeof(memory_word_t)) &&
-			!memcmp(&ui->last_pages[1][0], &vm->pages[next_page][0], PAGE_SIZE * sizeof(memory_word_t))) {
-		vm_clock_t end = get_vm_clock(&vm->t_start);
+	memory_word_t dimmer = mem[SFR_DIMMER];
+	bool matrix_off = mem[SFR_WR_FLAGS] & WR_FLAG_MATRIX_OFF;
+	bool full = ui->display_invalid || ui->last_page != page || ui->last_dimmer != dimmer ||
+		ui->last_matrix_off != matrix_off;
+	/* The next page is shown on the left. */
+	const memory_word_t shown[DISPLAY_PAGES] = {next_page, page};
+	/* Rows not written can still change brightness when they were lit for part of the last frame. */
+	uint16_t rows[DISPLAY_PAGES] = {
+		ui->pending_rows[next_page] | ui->partial_rows[0],
+		ui->pending_rows[page] | ui->partial_rows[1],
+	};
+	memset(ui->pending_rows, 0, sizeof(ui->pending_rows));
+	if (full || sync_frame) {
+		rows[0] = rows[1] = 0xffff;
+	} else if (!rows[0] && !rows[1]) {
+		end_pov_frame(ui);
+		vm_clock_t end = get_vm_clock(&ui->t_start);
 		ui->dt_last_display_update = end - start;
 		return;
 	}
 
+	ui->display_invalid = false;
+	ui->last_page = page;
 	ui->last_dimmer = dimmer;
 	ui->last_matrix_off = matrix_off;
-	/* TODO(octav): Improve speed for updates to a small number of pixels. */
-	memcpy(&ui->last_pages[0][0], &vm->pages[page][0], PAGE_SIZE * sizeof(memory_word_t));
-	memcpy(&ui->last_pages[1][0], &vm->pages[next_page][0], PAGE_SIZE * sizeof(memory_word_t));
 
-	int pixel_on_attr, pixel_off_attr;
-	if (has_colors()) {
-		pixel_on_attr = COLOR_PAIR(P_PIXEL_DIM0 + dimmer);
-		pixel_off_attr = COLOR_PAIR(P_PIXEL_OFF);
-	} else {
-		pixel_on_attr = 0;
-		pixel_off_attr = 0;
-	}
+	bool ansi = ui->ui_options & ANSI_MODE;
+	bool red_mode = ui->ui_options & RED_MODE;
+	bool colors = !ansi && has_colors();
 
-	for (int i = 0; i < 0x10; i++) {
-		wmove(ui->display, i + 1, 1);
-		for (int j = page + 1; j >= page; j--) {
+	/* Draw only the pixels that differ from what is on screen, most significant bits first. */
+	memset(ui->partial_rows, 0, sizeof(ui->partial_rows));
+	for (int i = 0; i < PAGE_SIZE; i++) {
+		for (int j = 0; j < DISPLAY_PAGES; j++) {
+			if (!(rows[j] & (1 << i))) {
+				continue;
+			}
+			memory_word_t pixels = mem[shown[j] * PAGE_SIZE + i];
 			for (int k = 3; k >= 0; k--) {
-				if (vm->pages[j][i] & (1 << k)) {
-					wattrset(ui->display, pixel_on_attr);
-					wprintw(ui->display, "▐▌");
+				uint32_t on_cycles = ui->pending_on_cycles[j][i][k];
+				if (on_cycles && on_cycles < ui->pending_pov_cycles) {
+					ui->partial_rows[j] |= 1 << i;
+				}
+				int level = get_pixel_level(ui, on_cycles, pixels & (1 << k), dimmer);
+				if (!full && level == ui->last_levels[j][i][k]) {
+					continue;
+				}
+				ui->last_levels[j][i][k] = level;
+				bool on = level > 0;
+				int x = 1 + 2 * (4 * j + 3 - k);
+				if (ansi) {
+					/* The display window is at the top left of the screen. */
+					ansi_move(&ui->term, i + 1, x);
+					ansi_set_color(&ui->term, on ? get_ansi_pixel_color(red_mode, level - 1) : A_BLACK, A_BLACK);
+					ansi_put(&ui->term, on ? "▐▌" : "  ", on ? strlen("▐▌") : 2, 2);
 				} else {
-					wattrset(ui->display, pixel_off_attr);
-					wprintw(ui->display, "  ");
+					if (colors) {
+						wattrset(ui->display, COLOR_PAIR(on ? P_PIXEL_DIM0 + level - 1 : P_PIXEL_OFF));
+					}
+					mvwaddstr(ui->display, i + 1, x, on ? "▐▌" : "  ");
 				}
 			}
 		}
 	}
-	wrefresh(ui->display);
+	end_pov_frame(ui);
+	if (ansi) {
+		ansi_flush(&ui->term);
+	} else {
+		wrefresh(ui->display);
+	}
 
-	vm_clock_t end = get_vm_clock(&vm->t_start);
-	ui->dt_last_full_display_update = end - start;
+	vm_clock_t end = get_vm_clock(&ui->t_start);
+	if (full) {
+		ui->dt_last_full_display_update = end - start;
+	} else {
+		ui->dt_last_display_update = end - start;
+	}
 }
 
-void maybe_update_status(const struct vm_state *vm, struct ui *ui)
+/* Outputs len characters to the status window at a position inside its border. */
+void status_put(struct ui *ui, int row, int col, const char *s, int len)
 {
-	vm_clock_t start = get_vm_clock(&vm->t_start);
+	if (ui->ui_options & ANSI_MODE) {
+		/* Only updates the status text, present_status() outputs what changed. */
+		if (len > STATUS_WIDTH - (col - 1)) {
+			len = STATUS_WIDTH - (col - 1);
+		}
+		if (len > 0) {
+			memcpy(&ui->status_lines[row - 1][col - 1], s, len);
+		}
+	} else {
+		mvwaddnstr(ui->status, row, col, s, len);
+	}
+}
 
-	if (!ui->paused && vm_clock_as_usec(start - ui->t_last_status_update) < STATUS_UPDATE_USEC) {
-		return; /* Rate limit status updates when running to avoid execution slowdowns. */
+/* Prints to the status window at a position inside its border. */
+__attribute__((format(printf, 4, 5)))
+void status_printf(struct ui *ui, int row, int col, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	if (ui->ui_options & ANSI_MODE) {
+		char buf[STATUS_WIDTH + 1];
+		int len = vsnprintf(buf, sizeof(buf), fmt, args);
+		status_put(ui, row, col, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+	} else {
+		wmove(ui->status, row, col);
+		vw_printw(ui->status, fmt, args);
+	}
+	va_end(args);
+}
+
+/* Outputs the status window, with ANSI_MODE only the span of each line that changed since last shown. */
+void present_status(struct ui *ui)
+{
+	if (!(ui->ui_options & ANSI_MODE)) {
+		wrefresh(ui->status);
+		return;
+	}
+	for (int i = 0; i < STATUS_HEIGHT; i++) {
+		const char *line = ui->status_lines[i];
+		char *shown = ui->shown_status_lines[i];
+		int first = 0;
+		int last = STATUS_WIDTH;
+		while (first < last && line[first] == shown[first]) {
+			first++;
+		}
+		if (first == last) {
+			continue;
+		}
+		while (line[last - 1] == shown[last - 1]) {
+			last--;
+		}
+		/* The status window is right of the display window. */
+		ansi_move(&ui->term, i + 1, DISPLAY_WIDTH + 4 + first);
+		ansi_set_color(&ui->term, ANSI_DEFAULT_COLOR, ANSI_DEFAULT_COLOR);
+		ansi_put(&ui->term, line + first, last - first, last - first);
+		memcpy(shown + first, line + first, last - first);
+	}
+	ansi_flush(&ui->term);
+}
+
+/* Blanks the inside of the status window. */
+void clear_status(struct ui *ui)
+{
+	if (ui->ui_options & ANSI_MODE) {
+		memset(ui->status_lines, ' ', sizeof(ui->status_lines));
+	} else {
+		werase(ui->status);
+		box(ui->status, 0, 0);
+	}
+	ui->status_invalid = false;
+}
+
+/* Draws the cached disassembly of an address, marking the current instruction and breakpoints. */
+void draw_listing_line(struct ui *ui, int row, program_addr_t pc)
+{
+	char line[LISTING_WIDTH];
+	memcpy(line, listing_get_line(&ui->listing, pc), LISTING_WIDTH);
+	if (pc == ui->view->reg_pc) {
+		line[LISTING_PC_MARKER] = '>';
+	}
+	if (ui->breakpoints[pc]) {
+		line[LISTING_BREAKPOINT_MARKER] = '*';
 	}
+	status_put(ui, row, 1, line, LISTING_WIDTH);
+}
+
+/* Scrolls the full listing so it starts as close as possible to an address. */
+void scroll_listing(struct ui *ui, int top)
+{
+	int max_top = PROGRAM_MEMORY_SIZE - LISTING_VIEW_ROWS;
+	ui->listing_top = top < 0 ? 0 : top > max_top ? max_top : top;
+	ui->status_dirty = true;
+}
+
+/* Draws the full listing in the status window, scrolling to the PC when it moves out of view. */
+void draw_full_listing(struct ui *ui)
+{
+	program_addr_t pc = ui->view->reg_pc;
+	if (pc != ui->listing_pc && (pc < ui->listing_top || pc >= ui->listing_top + LISTING_VIEW_ROWS)) {
+		scroll_listing(ui, pc - LISTING_VIEW_ROWS / 2);
+	}
+	ui->listing_pc = pc;
+
+	status_put(ui, 1, 1, LISTING_HEADER, sizeof(LISTING_HEADER) - 1);
+	status_put(ui, 2, 1, LISTING_RULE, sizeof(LISTING_RULE) - 1);
+	for (int i = 0; i < LISTING_VIEW_ROWS; i++) {
+		draw_listing_line(ui, 3 + i, ui->listing_top + i);
+	}
+}
 
-	bool io_pos = vm->reg_wr_flags & WR_FLAG_IN_OUT_POS;
+/* Draws registers, timings and the disassembly around the PC in the status window. */
+void draw_vm_status(struct ui *ui)
+{
+	const struct vm_view *view = ui->view;
+	const memory_word_t *mem = view->user_mem;
+	bool io_pos = mem[SFR_WR_FLAGS] & WR_FLAG_IN_OUT_POS;
 	int row = 1;
 	int col = 1;
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Last cycle (ns):               %-10lld", vm->dt_last_cycle);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Last cycle period (ns):        %-10lld", vm->dt_last_cycle_period);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Last user sync period (ns):    %-10lld", vm->dt_last_user_sync_period);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Last full display update (ns): %-10lld", ui->dt_last_full_display_update);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Last display update (ns):      %-10lld", ui->dt_last_display_update);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Last status update (ns):       %-10lld", ui->dt_last_status_update);
+	status_printf(ui, row++, col, "Last cycle (ns):               %-10lld", view->dt_last_cycle);
+	status_printf(ui, row++, col, "Last cycle period (ns):        %-10lld", view->dt_last_cycle_period);
+	status_printf(ui, row++, col, "Last user sync period (ns):    %-10lld", view->dt_last_user_sync_period);
+	status_printf(ui, row++, col, "Clock rate (Hz):               %-10.0f of %-10.0f", view->clock_rate, view->requested_clock_rate);
+	status_printf(ui, row++, col, "Last full display update (ns): %-10lld", ui->dt_last_full_display_update);
+	status_printf(ui, row++, col, "Last display update (ns):      %-10lld", ui->dt_last_display_update);
+	status_printf(ui, row++, col, "Last status update (ns):       %-10lld", ui->dt_last_status_update);
+	status_printf(ui, row++, col, "Frames shown, skipped:         %-10llu %-10llu",
+		(unsigned long long) ui->frames_shown, (unsigned long long) ui->frames_skipped);
 	row++;
 
 	int regs_row = row;
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "PC:     %03hx", vm->reg_pc);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "SP:     %hhx", vm->reg_sp);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Flags:  %hhx", vm->reg_flags);
+	status_printf(ui, row++, col, "PC:     %03hx", view->reg_pc);
+	status_printf(ui, row++, col, "SP:     %hhx", view->reg_sp);
+	status_printf(ui, row++, col, "Flags:  %hhx", view->reg_flags);
 	row++;
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Page:   %hhx", vm->reg_page);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Clock:  %hhx", vm->reg_clock);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Sync:   %hhx", vm->reg_sync);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Out:    %hhx", io_pos ? vm->reg_out_b : vm->reg_out);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "In:     %hhx", io_pos ? vm->reg_in_b : vm->reg_in);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "KeySts: %hhx", vm->reg_key_status);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "KeyReg: %hhx", vm->reg_key_reg);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "WrFlgs: %hhx", vm->reg_wr_flags);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "RdFlgs: %hhx", vm->reg_rd_flags);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "Dimmer: %hhx", vm->reg_dimmer);
+	status_printf(ui, row++, col, "Page:   %hhx", mem[SFR_PAGE]);
+	status_printf(ui, row++, col, "Clock:  %hhx", mem[SFR_CLOCK]);
+	status_printf(ui, row++, col, "Sync:   %hhx", mem[SFR_SYNC]);
+	status_printf(ui, row++, col, "Out:    %hhx", io_pos ? mem[SFR_OUT_B] : mem[SFR_OUT]);
+	status_printf(ui, row++, col, "In:     %hhx", io_pos ? mem[SFR_IN_B] : mem[SFR_IN]);
+	status_printf(ui, row++, col, "KeySts: %hhx", mem[SFR_KEY_STATUS]);
+	status_printf(ui, row++, col, "KeyReg: %hhx", mem[SFR_KEY_REG]);
+	status_printf(ui, row++, col, "WrFlgs: %hhx", mem[SFR_WR_FLAGS]);
+	status_printf(ui, row++, col, "RdFlgs: %hhx", mem[SFR_RD_FLAGS]);
+	status_printf(ui, row++, col, "Dimmer: %hhx", mem[SFR_DIMMER]);
 	row++;
 
 	int asm_row = row;
 	row = regs_row;
 	col = 14;
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "R0 R1 R2 R3 R4 R5 R6 R7");
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, " %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx",
-		vm->reg_r0, vm->reg_r1, vm->reg_r2, vm->reg_r3,
-		vm->reg_r4, vm->reg_r5, vm->reg_r6, vm->reg_r7);
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "R8 R9 10 11 12 13 14 15");
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, " %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx",
-		vm->reg_r8, vm->reg_r9, vm->reg_r10, vm->reg_r11,
-		vm->reg_r12, vm->reg_r13, vm->reg_r14, vm->reg_r15);
+	status_printf(ui, row++, col, "R0 R1 R2 R3 R4 R5 R6 R7");
+	status_printf(ui, row++, col, " %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx",
+		mem[0x0], mem[0x1], mem[0x2], mem[0x3], mem[0x4], mem[0x5], mem[0x6], mem[0x7]);
+	status_printf(ui, row++, col, "R8 R9 10 11 12 13 14 15");
+	status_printf(ui, row++, col, " %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx  %hhx",
+		mem[0x8], mem[0x9], mem[0xa], mem[0xb], mem[0xc], mem[0xd], mem[0xe], mem[0xf]);
+	row++;
+	status_printf(ui, row++, col, "Undo:   %-10zu", view->undo_count);
 
 	/* Disassemble current instruction with a context around it. */
 	row = asm_row;
 	col = 1;
-	int first_pc = vm->reg_pc - DISASSEMBLE_CONTEXT_SIZE;
+	int first_pc = view->reg_pc - DISASSEMBLE_CONTEXT_SIZE;
 	if (first_pc < 0) {
 		first_pc = 0;
 	}
-	int last_pc = vm->reg_pc + DISASSEMBLE_CONTEXT_SIZE;
+	int last_pc = view->reg_pc + DISASSEMBLE_CONTEXT_SIZE;
 	if (last_pc >= PROGRAM_MEMORY_SIZE) {
 		last_pc = PROGRAM_MEMORY_SIZE - 1;
 	}
-	char buf[DISASSEMBLE_MAX_LEN];
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "ADDR:  OPC  INSTRUCTION");
-	wmove(ui->status, row++, col);
-	wprintw(ui->status, "-----------------------");
+	status_put(ui, row++, col, LISTING_HEADER, sizeof(LISTING_HEADER) - 1);
+	status_put(ui, row++, col, LISTING_RULE, sizeof(LISTING_RULE) - 1);
 	for (int pc = first_pc; pc <= last_pc; pc++) {
-		struct vm_instruction vmi;
-		decode_instruction(vm->prg->instructions[pc], &vmi);
-		const struct instruction_descriptor *descr = get_instruction_descriptor(&vmi);
-		disassemble_instruction(&vmi, descr, buf, sizeof(buf));
-		wmove(ui->status, row++, 1);
-		wprintw(ui->status, "%c%03hx:  %hhx%hhx%hhx  %-*s",
-			pc == vm->reg_pc ? '>' : ' ', pc, vmi.nibble1, vmi.nibble2, vmi.nibble3, (int)sizeof(buf), buf);
+		draw_listing_line(ui, row++, pc);
 	}
+}
 
-	wrefresh(ui->status);
+void maybe_update_status(struct ui *ui)
+{
+	vm_clock_t start = get_vm_clock(&ui->t_start);
+
+	if (!ui->view->paused && vm_clock_as_usec(start - ui->t_last_status_update) < STATUS_UPDATE_USEC) {
+		return; /* Rate limit status updates when running to avoid execution slowdowns. */
+	}
 
-	vm_clock_t end = get_vm_clock(&vm->t_start);
+	ui->status_dirty = false;
+
+	if (ui->status_invalid) {
+		clear_status(ui);
+	}
+	if (ui->listing_open) {
+		draw_full_listing(ui);
+	} else {
+		draw_vm_status(ui);
+	}
+	present_status(ui);
+
+	vm_clock_t end = get_vm_clock(&ui->t_start);
 	ui->dt_last_status_update = end - start;
 	ui->t_last_status_update = end;
 }
 
-void handle_keys(struct vm_state *vm, struct ui *ui)
+/* Passes a key press on to the runner. */
+void handle_key(struct ui *ui, int ch)
 {
+	struct runner *runner = &ui->runner;
+	program_addr_t pc = ui->view->reg_pc;
 	int key = -1;
-	int ch = wgetch(ui->status);
 	switch (ch) {
 	case 'q':
 		ui->quit = true;
 		break;
 	case '\n':
-		ui->single_step = false;
-		ui->paused = false;
+		runner_post(runner, RUNNER_EVENT_RUN, 0);
 		break;
 	case ' ':
-		ui->single_step = true;
-		ui->paused = false;
+		runner_post(runner, RUNNER_EVENT_STEP, 0);
+		break;
+	case KEY_BACKSPACE:
+	case '\b':
+	case 0x7f:
+		runner_post(runner, RUNNER_EVENT_UNDO, 0);
+		break;
+	case 'r':
+		runner_post(runner, RUNNER_EVENT_RUN_BACKWARDS, 0);
+		break;
+	case 'b':
+		ui->breakpoints[pc] = !ui->breakpoints[pc];
+		runner_post(runner, ui->breakpoints[pc] ? RUNNER_EVENT_SET_BREAKPOINT : RUNNER_EVENT_CLEAR_BREAKPOINT, pc);
+		ui->status_dirty = true;
+		break;
+	case 'l':
+		ui->listing_open = !ui->listing_open;
+		ui->listing_pc = pc;
+		scroll_listing(ui, pc - LISTING_VIEW_ROWS / 2);
+		ui->status_invalid = true;
+		break;
+	case KEY_UP:
+		scroll_listing(ui, ui->listing_top - 1);
+		break;
+	case KEY_DOWN:
+		scroll_listing(ui, ui->listing_top + 1);
+		break;
+	case KEY_PPAGE:
+		scroll_listing(ui, ui->listing_top - LISTING_VIEW_ROWS);
+		break;
+	case KEY_NPAGE:
+		scroll_listing(ui, ui->listing_top + LISTING_VIEW_ROWS);
 		break;
 	case KEY_LEFT:
-		vm->reg_page = (vm->reg_page - 1) & 0xf;
-		ui->vm_dirty = true;
+		runner_post(runner, RUNNER_EVENT_PAGE, 0xf);
 		break;
 	case KEY_RIGHT:
-		vm->reg_page = (vm->reg_page + 1) & 0xf;
-		ui->vm_dirty = true;
+		runner_post(runner, RUNNER_EVENT_PAGE, 0x1);
 		break;
 	case '\t':
 		key = 0;
@@ -405,49 +641,86 @@ void handle_keys(struct vm_state *vm, struct ui *ui)
 		break;
 	}
 	if (key >= 0) {
-		vm->reg_key_status = KEY_STATUS_JUST_PRESS | KEY_STATUS_LAST_PRESS | KEY_STATUS_ANY_PRESS;
-		vm->reg_key_reg = key;
-		ui->vm_dirty = true;
-		ui->t_last_key_press = get_vm_clock(&vm->t_start);
-	} else if (vm->reg_key_status & KEY_STATUS_LAST_PRESS) {
-		/*
-		 * There's no easy/portable way to get key release events, so assume keys are released
-		 * after a preset amount of time.
-		 */
-		long elapsed_usec = vm_clock_as_usec(get_vm_clock(&vm->t_start) - ui->t_last_key_press);
-		if (elapsed_usec >= KEY_UP_DELAY_USEC) {
-			/* Generate an artificial key release event, assume all keys have been released. */
-			vm->reg_key_status &= ~(KEY_STATUS_LAST_PRESS | KEY_STATUS_ANY_PRESS);
-		}
+		runner_post(runner, RUNNER_EVENT_KEY, key);
 	}
 }
 
-void ui_update(struct ui *ui, struct vm_state *vm)
+/* Returns how long to wait in msec until a pending update is no longer rate limited, or -1 if none is pending. */
+int get_update_timeout_msec(const struct ui *ui)
 {
-	handle_keys(vm, ui);
-	if (ui->quit) {
+	if (!ui->display_dirty && !ui->status_dirty) {
+		return -1;
+	}
+	vm_clock_t now = get_vm_clock(&ui->t_start);
+	vm_clock_t t = LLONG_MAX;
+	if (ui->display_dirty) {
+		t = ui->t_last_display_update + DISPLAY_UPDATE_USEC * 1000LL;
+	}
+	if (ui->status_dirty) {
+		vm_clock_t t_status = ui->view->paused ? now : ui->t_last_status_update + STATUS_UPDATE_USEC * 1000LL;
+		t = t_status < t ? t_status : t;
+	}
+	return t > now ? (t - now + 999999) / 1000000 : 0;
+}
+
+/* Sleeps until there is input, a new view or a pending update to draw, then handles all pending key presses. */
+void handle_keys(struct ui *ui)
+{
+	struct pollfd fds[] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = runner_get_view_fd(&ui->runner), .events = POLLIN},
+	};
+	if (poll(fds, 2, get_update_timeout_msec(ui)) <= 0 || !(fds[0].revents & POLLIN)) {
 		return;
 	}
-	if (!ui->vm_dirty) {
+	int ch;
+	bool ansi = ui->ui_options & ANSI_MODE;
+	while (!ui->quit && (ch = ansi ? ansi_getch(&ui->term) : wgetch(ui->status)) != ERR) {
+		handle_key(ui, ch);
+	}
+}
+
+void ui_update(struct ui *ui)
+{
+	handle_keys(ui);
+	if (ui->quit) {
 		return;
 	}
 
-	maybe_update_display(vm, ui);
-	maybe_update_status(vm, ui);
+	const struct vm_view *view = runner_get_view(&ui->runner);
+	if (view) {
+		ui->view = view;
+		for (int i = 0; i < NUM_PAGES; i++) {
+			ui->pending_rows[i] |= view->dirty_rows[i];
+		}
+		if ((ui->ui_options & SYNC_FRAMES) && view->frame_count && !view->paused) {
+			/* Only new frames of the program need drawing, see maybe_update_display(). */
+			ui->display_dirty |= view->frame_count != ui->last_frame_count;
+		} else {
+			for (int i = 0; i < DISPLAY_PAGES; i++) {
+				for (int j = 0; j < PAGE_SIZE; j++) {
+					for (int k = 0; k < 4; k++) {
+						ui->pending_on_cycles[i][j][k] += view->on_cycles[i][j][k];
+					}
+				}
+			}
+			ui->pending_pov_cycles += view->pov_cycles;
+			ui->display_dirty = true;
+		}
+		ui->status_dirty = true;
+	}
 
-	ui->vm_dirty = false;
+	if (ui->display_dirty) {
+		maybe_update_display(ui);
+	}
+	if (ui->status_dirty) {
+		maybe_update_status(ui);
+	}
 }
 
 bool ui_run(struct ui *ui, const char *binary_path)
 {
-	size_t size;
-	void *buf = read_file(binary_path, &size);
-	if (!buf) {
-		return false;
-	}
-	struct program *prg = load_program(buf, size);
-	free(buf);
-	buf = NULL;
+	struct program *prg = aot_load_program(binary_path);
 	if (!prg) {
 		return false;
 	}
@@ -458,49 +731,51 @@ bool ui_run(struct ui *ui, const char *binary_path)
 		return false;
 	}
 	vm_init(vm, prg); /* vm takes ownership of prg. */
+	ui->prg = prg;
 	prg = NULL;
+	listing_init(&ui->listing, vm->decoded);
+	if (ui->resume_path && !vm_load_snapshot(vm, ui->resume_path)) {
+		vm_destroy(vm);
+		free(vm);
+		return false;
+	}
 
-	ui_start(ui);
-
-	ui->paused = ui->ui_options & START_PAUSED;
-	ui->vm_dirty = true;
-	vm_clock_t t_last_update = 0;
+	get_time(&ui->t_start);
+	if (!ui_start(ui)) {
+		cleanup();
+		vm_destroy(vm);
+		free(vm);
+		return false;
+	}
 
-	while (!ui->quit) {
-		/* Rate limit updates if nothing interesting happened since the last one. */
-		long elapsed_usec = vm_clock_as_usec(get_vm_clock(&vm->t_start) - t_last_update);
-		if (UI_UPDATE_PERIOD_USEC > elapsed_usec) {
-			usleep(UI_UPDATE_PERIOD_USEC - elapsed_usec);
-		}
+	/* From here on the VM belongs to the runner thread until it is stopped. */
+	if (!runner_start(&ui->runner, vm, ui->ui_options & START_PAUSED, JOURNAL_ENTRIES)) {
+		cleanup();
+		vm_destroy(vm);
+		free(vm);
+		return false;
+	}
+	ui->view = runner_get_view(&ui->runner);
 
-		/* Process input and optionally update the screen. */
-		ui_update(ui, vm);
-		if (ui->paused) {
-			continue; /* The cycle clock is paused. */
-		}
+	while (!ui->quit && !ui->view->fault) {
+		ui_update(ui);
+	}
 
-		/* Check how much time is left until the next cycle. */
-		long cycle_delay_usec = vm_get_cycle_wait_usec(vm);
-		if (cycle_delay_usec && cycle_delay_usec <= MAX_UI_SLEEP_USEC) {
-			/* Not too much, wait now so cycle execution happens below. */
-			usleep(cycle_delay_usec);
-			cycle_delay_usec = 0;
-		}
-		if (cycle_delay_usec) {
-			continue; /* The next cycle is not here yet.*/
-		}
+	runner_stop(&ui->runner);
 
-		/* Execute the next cycle. */
-		vm_execute_cycle(vm);
-		ui->vm_dirty = true; /* VM state probably changed. */
-		if (ui->single_step) {
-			ui->paused = true; /* Single step mode pauses after each instruction. */
-		}
-		t_last_update = 0; /* Execute the next update immediately. */
+	bool success = true;
+	if (vm->fault) {
+		cleanup(); /* Restore the terminal so the error is visible. */
+		fprintf(stderr, "%s\n", vm_fault_message(vm->fault));
+		success = false;
+	}
+	if (ui->save_path) {
+		cleanup(); /* Restore the terminal so errors are visible. */
+		success = vm_save_snapshot(vm, ui->save_path) && success;
 	}
 
 	vm_destroy(vm);
 	free(vm);
 
-	return true;
+	return success;
 }
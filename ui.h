@@ -20,27 +20,53 @@
 #ifndef _UI_H
 #define _UI_H
 
+#include "ansi.h"
 #include "clock.h"
+#include "listing.h"
+#include "runner.h"
 #include "vm.h"
 
 #include <stdbool.h>
 #include <ncurses.h>
 
-#define DISPLAY_PAGES 2
+#define DISPLAY_PAGES POV_PAGES
+#define STATUS_WIDTH 0x40
+#define STATUS_HEIGHT 0x24
 
 struct ui {
 	int ui_options; /* Options as bit flags. */
+	const char *resume_path;	/* Restore the VM from this snapshot at startup; NULL for none. */
+	const char *save_path;	/* Save a snapshot of the VM here on exit; NULL for none. */
 
-	/* True iff the VM state may have changed since the last update. */
-	bool vm_dirty;
-	memory_word_t last_pages[DISPLAY_PAGES][PAGE_SIZE];
+	struct runner runner;	/* Runs the VM on its own thread. */
+	const struct program *prg;	/* Owned by the VM. */
+	const struct vm_view *view;	/* Latest view of the VM state. */
+	struct timespec t_start;	/* Reference for UI timestamps. */
+
+	/* True iff the view changed since the display or status was last drawn. */
+	bool display_dirty;
+	bool status_dirty;
+	bool status_invalid;	/* The status window must be cleared before drawing. */
+	uint16_t pending_rows[NUM_PAGES];	/* Rows changed since the display was last drawn, see vm_state.dirty_rows. */
+	bool display_invalid;	/* The display must be redrawn in full. */
+	/* Cycles each pixel was lit and cycles executed since the display was last drawn, left to right, see pov.h. */
+	uint32_t pending_on_cycles[DISPLAY_PAGES][PAGE_SIZE][4];
+	uint64_t pending_pov_cycles;
+	uint16_t partial_rows[DISPLAY_PAGES];	/* Rows with pixels lit for only part of the last frame drawn. */
+	uint8_t last_levels[DISPLAY_PAGES][PAGE_SIZE][4];	/* Brightness of the pixels on screen, see get_pixel_level(). */
+	memory_word_t last_page;
 	memory_word_t last_dimmer;
 	bool last_matrix_off;
+	uint64_t last_frame_count;	/* Frame of the program last drawn, see vm_view.frame_count. */
 
 	WINDOW *status;
 	WINDOW *display;
 
-	vm_clock_t t_last_key_press;	/* Timestamp of the last key press. */
+	/* Direct output used instead of ncurses with ANSI_MODE. */
+	struct ansi_term term;
+	char status_lines[STATUS_HEIGHT][STATUS_WIDTH];	/* Status text being drawn, inside the border. */
+	char shown_status_lines[STATUS_HEIGHT][STATUS_WIDTH];	/* Status text on screen. */
+
 	vm_clock_t t_last_display_update;	/* Timestamp of the last display update. */
 	vm_clock_t t_last_status_update;	/* Timestamp of the last status update. */
 
@@ -48,15 +74,24 @@ struct ui {
 	vm_clock_t dt_last_full_display_update;	/* Elapsed time for the last full display update. */
 	vm_clock_t dt_last_display_update;	/* Elapsed time for the last display update. */
 	vm_clock_t dt_last_status_update;	/* Elapsed time for the last status update. */
+	uint64_t frames_shown;	/* Frames of the program drawn with SYNC_FRAMES. */
+	uint64_t frames_skipped;	/* Frames of the program replaced by a newer one before they could be drawn. */
+
+	struct listing listing;	/* Cached disassembly. */
+	bool listing_open;	/* The status window shows the full listing instead of the VM state. */
+	int listing_top;	/* First address shown in the full listing. */
+	program_addr_t listing_pc;	/* PC when the full listing was last drawn. */
+
+	bool breakpoints[PROGRAM_MEMORY_SIZE];	/* Addresses where execution pauses, as set in the runner. */
 
 	bool quit;
-	bool single_step;
-	bool paused;
 };
 
 enum {
 	START_PAUSED = 0x1,
 	RED_MODE = 0x2,
+	ANSI_MODE = 0x4,
+	SYNC_FRAMES = 0x8,
 };
 
 void ui_init(struct ui *ui, int ui_options);
@@ -19,8 +19,13 @@
 
 #include "vm.h"
 
-#include "program.h"
+#include "aot.h"
+#include "exec.h"
+#include "fastfwd.h"
+#include "jit.h"
 #include "ops.h"
+#include "pov.h"
+#include "program.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -28,6 +33,9 @@
 #include <string.h>
 #include <unistd.h>
 
+/* Cycles in VM_TIME_WALL mode running later than this are not caught up with, e.g. after pausing. */
+const vm_clock_t MAX_CYCLE_LAG = 10000000;
+
 /* Clock periods in microseconds indexed by the value of the Clock register. */
 long CLOCK_PERIODS_USEC[] = {
 	1,
@@ -73,48 +81,76 @@ void vm_init(struct vm_state *vm, struct program *prg)
 	free(vm->prg);
 	vm->prg = prg;
 
+	for (int i = 0; i < PROGRAM_MEMORY_SIZE; i++) {
+		predecode_instruction(prg->instructions[i], &vm->decoded[i]);
+	}
+	vm->aot = aot_find_image(prg);
+	fastfwd_init(vm);
+
 	vm->reg_ser_ctrl = SERIAL_BAUD_9600;
 	vm->reg_auto_off = 0x2;
 	vm->reg_dimmer = 0xf;
 	vm->reg_random = init_rng(&vm->rng);
+	vm_mark_all_dirty(vm);
+	pov_reset(vm);
 
 	get_time(&vm->t_start);
 }
 
 void vm_destroy(struct vm_state *vm)
 {
+	jit_destroy(vm->jit);
+	vm->jit = NULL;
 	free(vm->prg);
 	vm->prg = NULL;
 }
 
-void vm_decode_next(struct vm_state *vm, struct vm_instruction *vmi)
+const struct decoded_instruction *vm_fetch_next(struct vm_state *vm)
 {
 	/* Should not happen as the program counter cannot exceed the size of program memory. */
 	assert(vm->reg_pc < PROGRAM_MEMORY_SIZE);
-	program_word_t pi = vm->prg->instructions[vm->reg_pc];
+	const struct decoded_instruction *di = &vm->decoded[vm->reg_pc];
 	vm->reg_pc++;
 	if (vm->reg_pc == PROGRAM_MEMORY_SIZE) {
 		vm->reg_pc = 0; /* Loop back to the first instruction. */
 	}
-	decode_instruction(pi, vmi);
+	return di;
 }
 
-long vm_get_cycle_wait_usec(struct vm_state *vm)
+bool vm_enable_jit(struct vm_state *vm)
 {
-	vm_clock_t now = get_vm_clock(&vm->t_start);
-	long elapsed_usec = vm_clock_as_usec(now - vm->t_cycle_start);
-	long period_usec = CLOCK_PERIODS_USEC[vm->reg_clock];
-	if (period_usec >= elapsed_usec) {
-		return period_usec - elapsed_usec;
-	} else {
-		return 0;
+	if (!vm->jit) {
+		vm->jit = jit_create(vm);
+	}
+	return vm->jit != NULL;
+}
+
+vm_clock_t vm_get_time(const struct vm_state *vm)
+{
+	if (vm->time_mode == VM_TIME_VIRTUAL) {
+		return vm->t_virtual;
 	}
+	return get_vm_clock(&vm->t_start);
+}
+
+void vm_mark_all_dirty(struct vm_state *vm)
+{
+	memset(vm->dirty_rows, 0xff, sizeof(vm->dirty_rows));
+}
+
+vm_clock_t vm_get_next_cycle_time(const struct vm_state *vm)
+{
+	return vm->t_next_cycle;
+}
+
+double vm_get_clock_frequency(const struct vm_state *vm)
+{
+	return 1e6 / CLOCK_PERIODS_USEC[vm->reg_clock];
 }
 
 /* Updates UserSync flag. */
-void vm_update_user_sync(struct vm_state *vm)
+void vm_update_user_sync(struct vm_state *vm, vm_clock_t now)
 {
-	vm_clock_t now = get_vm_clock(&vm->t_start);
 	vm_clock_t dt = now - vm->t_last_user_sync;
 	long elapsed_usec = vm_clock_as_usec(dt);
 	long period_usec = SYNC_PERIODS_USEC[vm->reg_sync];
@@ -133,20 +169,129 @@ void vm_update_in_reg(struct vm_state *vm) {
 	}
 }
 
-void vm_execute_cycle(struct vm_state *vm)
+void vm_begin_cycle(struct vm_state *vm)
 {
-	vm_clock_t now = get_vm_clock(&vm->t_start);
+	vm_clock_t now = vm_get_time(vm);
 	vm->dt_last_cycle_period = now - vm->t_cycle_start;
 	vm->t_cycle_start = now;
+	vm->dt_virtual_cycle = CLOCK_PERIODS_USEC[vm->reg_clock] * 1000LL;
+	if (vm->time_mode == VM_TIME_WALL) {
+		if (now - vm->t_next_cycle > MAX_CYCLE_LAG) {
+			vm->t_next_cycle = now; /* Too far behind, restart the timeline. */
+		}
+		vm->t_next_cycle += vm->dt_virtual_cycle;
+	}
 
-	vm_update_user_sync(vm);
+	vm_update_user_sync(vm, now);
 	vm_update_in_reg(vm);
+}
 
-	struct vm_instruction vmi;
-	vm_decode_next(vm, &vmi);
-	const struct instruction_descriptor *descr = get_instruction_descriptor(&vmi);
-	descr->op->op_fn(&vmi, descr, vm);
+void vm_end_cycles(struct vm_state *vm, uint64_t cycles)
+{
+	vm->cycle_count += cycles;
 
-	vm->t_cycle_end = get_vm_clock(&vm->t_start);
-	vm->dt_last_cycle = vm->t_cycle_end - vm->t_cycle_start;
+	if (vm->time_mode == VM_TIME_VIRTUAL) {
+		vm->t_virtual += cycles * vm->dt_virtual_cycle;
+		vm->t_cycle_end = vm->t_virtual;
+	} else {
+		vm->t_cycle_end = get_vm_clock(&vm->t_start);
+	}
+	vm->dt_last_cycle = (vm->t_cycle_end - vm->t_cycle_start) / cycles;
+}
+
+uint64_t vm_get_batch_cycles(const struct vm_state *vm)
+{
+	if (vm->time_mode != VM_TIME_VIRTUAL) {
+		return UINT64_MAX;
+	}
+	/* UserSync fires at the start of the first cycle k with t + k * period - t_sync >= sync_period. */
+	vm_clock_t elapsed = vm->t_cycle_start - vm->t_last_user_sync;
+	vm_clock_t left = SYNC_PERIODS_USEC[vm->reg_sync] * 1000LL - elapsed;
+	if (left <= vm->dt_virtual_cycle) {
+		return 1;
+	}
+	return (left + vm->dt_virtual_cycle - 1) / vm->dt_virtual_cycle;
+}
+
+uint64_t vm_get_sync_cycles(const struct vm_state *vm)
+{
+	vm_clock_t cycle_period = CLOCK_PERIODS_USEC[vm->reg_clock] * 1000LL;
+	vm_clock_t sync_period = SYNC_PERIODS_USEC[vm->reg_sync] * 1000LL;
+	return (sync_period + cycle_period - 1) / cycle_period;
+}
+
+void vm_init_sync(const struct vm_state *vm, struct vm_sync *sync)
+{
+	/* UserSync only fires within a run in virtual time; vm_begin_cycle() samples it otherwise. */
+	*sync = (struct vm_sync) {.next = UINT64_MAX, .period = 1};
+	if (vm->time_mode == VM_TIME_VIRTUAL) {
+		sync->next = vm_get_batch_cycles(vm);
+		sync->period = vm_get_sync_cycles(vm);
+	}
+}
+
+void vm_advance_sync(struct vm_sync *sync, uint64_t fired)
+{
+	sync->last = sync->next + (fired - 1) * sync->period;
+	sync->next = sync->last + sync->period;
+	sync->count += fired;
+}
+
+/* See load_lane() in batch.c, which does the same for lanes of a batch. */
+void vm_end_synced_cycles(struct vm_state *vm, uint64_t cycles, const struct vm_sync *sync)
+{
+	vm_clock_t dt = vm->dt_virtual_cycle;
+	if (sync->count) {
+		vm_clock_t t_sync = vm->t_cycle_start + sync->last * dt;
+		vm->dt_last_user_sync_period = sync->count > 1 ? sync->period * dt : t_sync - vm->t_last_user_sync;
+		vm->t_last_user_sync = t_sync;
+	}
+	vm_end_cycles(vm, cycles);
+	if (cycles > 1 && vm->time_mode == VM_TIME_VIRTUAL) {
+		vm->dt_last_cycle_period = dt;
+		vm->t_cycle_start = vm->t_virtual - dt;
+	}
+}
+
+void vm_execute_cycle(struct vm_state *vm)
+{
+	vm_begin_cycle(vm);
+
+	const struct decoded_instruction *di = vm_fetch_next(vm);
+	exec_decoded(di, vm);
+
+	vm_end_cycles(vm, 1);
+}
+
+uint64_t vm_run(struct vm_state *vm, uint64_t max_cycles)
+{
+	if (vm->aot) {
+		return aot_run(vm->aot, vm, max_cycles);
+	}
+	if (vm->jit) {
+		return jit_run(vm->jit, vm, max_cycles);
+	}
+	uint64_t start = vm->cycle_count;
+	while (!vm->fault && vm->cycle_count - start < max_cycles && !fastfwd_halt(vm)) {
+		if (fastfwd_begin_cycle(vm, max_cycles - (vm->cycle_count - start))) {
+			continue;
+		}
+		exec_decoded(vm_fetch_next(vm), vm);
+		vm_end_cycles(vm, 1);
+	}
+	return vm->cycle_count - start;
+}
+
+const char *vm_fault_message(uint8_t fault)
+{
+	switch (fault) {
+	case VM_FAULT_NONE:
+		return "No fault.";
+	case VM_FAULT_STACK_OVERFLOW:
+		return "Stack overflow.";
+	case VM_FAULT_STACK_UNDERFLOW:
+		return "Stack underflow.";
+	default:
+		return "Unknown fault.";
+	}
 }
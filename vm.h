@@ -24,6 +24,7 @@
 #include "program.h"
 #include "rng.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define PAGE_SIZE 0x10
@@ -139,12 +140,74 @@ enum {
 	KEY_STATUS_ALT_PRESS	= 0x8,
 };
 
+/* Reasons for the VM to stop executing. */
+enum {
+	VM_FAULT_NONE = 0,
+	VM_FAULT_STACK_OVERFLOW,
+	VM_FAULT_STACK_UNDERFLOW,
+};
+
+/* Sources of time for the VM, see vm_state.time_mode. */
+enum {
+	VM_TIME_WALL = 0,	/* Time is read from the host clock. */
+	VM_TIME_VIRTUAL,	/* Time advances by the Clock register period with every cycle. */
+};
+
 /* Type of a memory word. This is a nibble on the actual hardware. */
 typedef uint8_t memory_word_t;
 
 /* Address of a word in data memory as offset in words from the beginning. */
 typedef uint16_t memory_addr_t;
 
+struct vm_instruction {
+	uint8_t nibble1;
+	uint8_t nibble2;
+	uint8_t nibble3;
+};
+
+/* An instruction decoded ahead of time, ready to be dispatched. */
+struct decoded_instruction {
+	uint8_t variant;	/* Specialized handler, one of VARIANT_*. */
+	struct vm_instruction vmi;
+};
+
+/* VM state at the last UserSync poll, see fastfwd.h. */
+struct poll_snapshot {
+	bool valid;
+	program_addr_t pc;
+	uint64_t cycle_count;
+	vm_clock_t t_last_user_sync;
+	uint8_t reg_sp;
+	uint8_t reg_flags;
+	struct rng_state rng;
+	memory_word_t user_mem[NUM_PAGES * PAGE_SIZE];
+	bool partial;	/* Only SFRs and the addresses in the footprint were kept in user_mem. */
+
+	/*
+	 * Memory besides SFRs an iteration of footprint_period cycles from the poll
+	 * at footprint_pc can touch; all of it if num_addrs is 0.
+	 */
+	bool has_footprint;
+	program_addr_t footprint_pc;
+	uint64_t footprint_period;
+	uint16_t num_addrs;
+	uint8_t addrs[NUM_PAGES * PAGE_SIZE];
+};
+
+#define POV_PAGES 2	/* Pages shown on the LED matrix: the one after Page on the left, Page on the right. */
+
+/* Time each pixel of the LED matrix was lit, see pov.h. */
+struct pov_state {
+	memory_word_t page;	/* Page register the pixels are accounted for. */
+	uint64_t frame_start;	/* Cycle count when accumulation started. */
+	uint64_t row_start[POV_PAGES][PAGE_SIZE];	/* Cycle count up to which each row is accounted. */
+	uint32_t on_cycles[POV_PAGES][PAGE_SIZE][4];	/* Cycles each pixel was lit, indexed by bit. */
+};
+
+struct aot_image;
+struct call_graph;
+struct jit;
+
 /* The state of a running virtual machine. */
 struct vm_state {
 	struct program *prg; /* Owned by vm_state. */
@@ -227,19 +290,43 @@ struct vm_state {
 
 	struct rng_state rng;   /* Random number generator state. */
 
+	uint64_t cycle_count;	/* Number of instructions retired. */
+	uint8_t fault;		/* Set when execution cannot continue; one of VM_FAULT_*. */
+
+	uint8_t time_mode;	/* One of VM_TIME_*. */
+	vm_clock_t t_virtual;	/* Current time in VM_TIME_VIRTUAL mode. */
+	vm_clock_t dt_virtual_cycle;	/* Duration of cycles started with vm_begin_cycle() in VM_TIME_VIRTUAL mode. */
+
 	struct timespec t_start;	/* Timestamp of VM startup. */
 	vm_clock_t t_cycle_start;	/* Timestamp of cycle start. */
 	vm_clock_t t_cycle_end;		/* Timestamp of cycle end. */
+	vm_clock_t t_next_cycle;	/* Deadline for the start of the next cycle in VM_TIME_WALL mode. */
 	vm_clock_t t_last_user_sync;	/* Timestamp of last user sync. */
 	vm_clock_t dt_last_cycle;	/* Elapsed time for the last cycle. */
 	vm_clock_t dt_last_cycle_period;	/* Elapsed time between the start of the last two cycles. */
 	vm_clock_t dt_last_user_sync_period;	/* Elapsed time between the start of the last two user syncs. */
-};
 
-struct vm_instruction {
-	uint8_t nibble1;
-	uint8_t nibble2;
-	uint8_t nibble3;
+	const struct aot_image *aot;	/* Translated program linked in, see aot.h; NULL if none. */
+	struct jit *jit;	/* Owned by vm_state; NULL when interpreting. */
+	struct call_graph *call_graph;	/* Notified of calls and returns, see callgraph.h; NULL if none. */
+
+	/* Program memory decoded once at init, since it never changes. */
+	struct decoded_instruction decoded[PROGRAM_MEMORY_SIZE];
+
+	uint8_t fastfwd_kind[PROGRAM_MEMORY_SIZE];	/* One of FASTFWD_* for each address. */
+	struct poll_snapshot poll_snapshot;
+	uint64_t cycles_fast_forwarded;	/* Cycles accounted for without executing them. */
+	bool halted;	/* Set when fast-forwarding reached JR -1, which the program never leaves. */
+	/* Reads of RdFlags that consumed UserSync, the frame boundaries of sync driven programs. Interpreter only. */
+	uint64_t user_sync_reads;
+
+	/*
+	 * Rows of user memory changed since the owner last cleared them, one bit per
+	 * nibble of each page. Only journal_step() and journal_undo() maintain it,
+	 * so that other engines do not pay for it.
+	 */
+	uint16_t dirty_rows[NUM_PAGES];
+	struct pov_state pov;	/* Maintained along with dirty_rows. */
 };
 
 /* Initializes the VM with the given program. vm takes ownership of prg. */
@@ -248,10 +335,108 @@ void vm_init(struct vm_state *vm, struct program *prg);
 /* Cleans up the VM state. */
 void vm_destroy(struct vm_state *vm);
 
-/* Returns the time to wait until the start of the next cycle in usec. */
-long vm_get_cycle_wait_usec(struct vm_state *vm);
+/*
+ * Switches execution in vm_run() to the JIT compiler. Returns false if native
+ * code generation is not supported, in which case the interpreter is used.
+ */
+bool vm_enable_jit(struct vm_state *vm);
+
+/* Returns the current VM time, measured from VM startup. */
+vm_clock_t vm_get_time(const struct vm_state *vm);
+
+/*
+ * Returns the VM time at which the next cycle is due in VM_TIME_WALL mode.
+ * Cycles are due on an absolute timeline set by the Clock register, so a
+ * cycle started late is made up for by starting the following ones early.
+ */
+vm_clock_t vm_get_next_cycle_time(const struct vm_state *vm);
+
+/* Returns the clock frequency in Hz set by the Clock register. */
+double vm_get_clock_frequency(const struct vm_state *vm);
+
+/* Marks a nibble of user memory as changed in vm_state.dirty_rows. */
+static inline void vm_mark_dirty(struct vm_state *vm, memory_addr_t addr)
+{
+	vm->dirty_rows[addr / PAGE_SIZE] |= 1 << (addr % PAGE_SIZE);
+}
+
+/* Marks all of user memory as changed, e.g. after loading it. */
+void vm_mark_all_dirty(struct vm_state *vm);
+
+/* Returns the instruction at the program counter and advances it. */
+const struct decoded_instruction *vm_fetch_next(struct vm_state *vm);
+
+/* Sets the active In register to its idle value, done at the start of every cycle. */
+void vm_update_in_reg(struct vm_state *vm);
 
 /* Executes one cycle of the VM. */
 void vm_execute_cycle(struct vm_state *vm);
 
+/*
+ * Bookkeeping shared by execution engines: vm_begin_cycle() runs before an
+ * instruction executes, and vm_end_cycles() after one or more cycles ran.
+ * Engines running several cycles in between must stop before any SFR write
+ * that changes Clock or Sync, and run at most vm_get_batch_cycles() cycles
+ * unless they fire UserSync themselves, see struct vm_sync.
+ */
+void vm_begin_cycle(struct vm_state *vm);
+void vm_end_cycles(struct vm_state *vm, uint64_t cycles);
+
+/*
+ * Returns how many cycles, including the one just begun, can run before
+ * UserSync would fire. Unlimited in VM_TIME_WALL mode, where UserSync is
+ * sampled at vm_begin_cycle() only.
+ */
+uint64_t vm_get_batch_cycles(const struct vm_state *vm);
+
+/*
+ * Returns how many cycles pass between UserSync firing in VM_TIME_VIRTUAL
+ * mode, as long as Clock and Sync stay the same.
+ */
+uint64_t vm_get_sync_cycles(const struct vm_state *vm);
+
+/*
+ * When UserSync fires during cycles run without vm_begin_cycle(), counted in
+ * cycles from the first one, which was begun with it. Lets engines run past
+ * vm_get_batch_cycles(), setting UserSync only before accesses to RdFlags.
+ */
+struct vm_sync {
+	uint64_t next;		/* Next cycle UserSync fires at, not yet applied to RdFlags. */
+	uint64_t period;	/* Cycles between UserSync firing. */
+	uint64_t last;		/* Last cycle UserSync fired at, if count is non-zero. */
+	uint64_t count;		/* Times UserSync fired. */
+};
+
+/* Starts tracking UserSync for cycles run from the one just begun. */
+void vm_init_sync(const struct vm_state *vm, struct vm_sync *sync);
+
+/* Records UserSync firing the given number of times from the next cycle it was due at. */
+void vm_advance_sync(struct vm_sync *sync, uint64_t fired);
+
+/* Sets UserSync in RdFlags if it fired by the given cycle, as vm_begin_cycle() would have. */
+static inline void vm_apply_sync(struct vm_sync *sync, struct vm_state *vm, uint64_t cycle)
+{
+	if (cycle < sync->next) {
+		return;
+	}
+	vm_advance_sync(sync, (cycle - sync->next) / sync->period + 1);
+	vm->reg_rd_flags |= RD_FLAG_USER_SYNC;
+}
+
+/*
+ * Ends cycles run with UserSync tracked in sync like vm_end_cycles(), updating
+ * timing as if each had begun with vm_begin_cycle(). UserSync must have been
+ * applied up to the last cycle.
+ */
+void vm_end_synced_cycles(struct vm_state *vm, uint64_t cycles, const struct vm_sync *sync);
+
+/*
+ * Executes up to max_cycles cycles as fast as possible, stopping early if the
+ * VM faults or halts. Returns the number of cycles executed.
+ */
+uint64_t vm_run(struct vm_state *vm, uint64_t max_cycles);
+
+/* Returns a human readable description of a VM fault. */
+const char *vm_fault_message(uint8_t fault);
+
 #endif /* _VM_H */